@@ -1,5 +1,7 @@
 ﻿#include "SlimReaderWriterLock.h"
 
+#ifdef WIN32
+
 namespace kvs
 {
 
@@ -43,4 +45,6 @@ bool SlimReaderWriterLock::try_lock_shared()
    return TryAcquireSRWLockShared( &mSrwlock ) != 0;
 }
 
-} // namespace kvs
\ No newline at end of file
+} // namespace kvs
+
+#endif
@@ -1,5 +1,7 @@
 ﻿#pragma once
 
+#ifdef WIN32
+
 #include <WinSock2.h>
 
 namespace kvs
@@ -28,4 +30,22 @@ private:
    SRWLOCK mSrwlock;
 };
 
-} // namespace kvs
\ No newline at end of file
+} // namespace kvs
+
+#else
+
+#include "LockPolicies.h"
+
+namespace kvs
+{
+
+// вне Windows SRWLOCK нет, его место занимает блокировка того же устройства на futex
+#if defined( __linux__ )
+typedef FutexSharedMutex SlimReaderWriterLock;
+#else
+typedef PthreadSharedMutex SlimReaderWriterLock;
+#endif
+
+} // namespace kvs
+
+#endif
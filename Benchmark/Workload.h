@@ -0,0 +1,1018 @@
+﻿#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <chrono>
+#include <cmath>
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <algorithm>
+
+#include "SlimReaderWriterLock.h"
+#include "LockPolicies.h"
+#include "ThreadsafeHashTable.h"
+#include "SplitOrderedHashTable.h"
+
+// нагрузка в духе YCSB, которая задаётся из командной строки: смесь операций,
+// распределение ключей, размер значений, число потоков и конфигурации таблицы.
+// Для каждой конфигурации и числа потоков таблица заново заполняется records ключами,
+// затем потоки выполняют operations операций. По каждой операции выводятся
+// пропускная способность и перцентили задержки
+namespace workload
+{
+
+enum class Operation
+{
+   Read,
+   Update,
+   Insert,
+   Erase,
+   ReadModifyWrite,
+   Count
+};
+
+enum class KeyDistribution
+{
+   Uniform,
+   Zipfian,
+   Latest,
+   Sequential
+};
+
+enum class OutputFormat
+{
+   Text,
+   Csv,
+   Json
+};
+
+inline char const* OperationName( Operation const op )
+{
+   static char const* const names[] = { "read", "update", "insert", "erase", "rmw" };
+   return names[static_cast<size_t>( op )];
+}
+
+inline char const* DistributionName( KeyDistribution const distribution )
+{
+   static char const* const names[] = { "uniform", "zipfian", "latest", "sequential" };
+   return names[static_cast<size_t>( distribution )];
+}
+
+size_t const cOperationCount = static_cast<size_t>( Operation::Count );
+
+// одна конфигурация таблицы из перечисленных в параметрах
+struct Configuration
+{
+   std::string table;
+   std::string lock;
+   std::string layout;
+   std::string readMode;
+   std::string rehashMode;
+   size_t lockCount;
+   size_t maxLockCount;
+};
+
+struct Options
+{
+   Options()
+      : workload( "b" )
+      , distribution( KeyDistribution::Zipfian )
+      , zipfianTheta( 0.99 )
+      , records( 100000 )
+      , operations( 1000000 )
+      , valueSize( 8 )
+      , reserve( true )
+      , format( OutputFormat::Text )
+   {
+      mix.fill( 0 );
+   }
+
+   // доли операций в процентах, в сумме 100
+   std::array<size_t, cOperationCount> mix;
+
+   std::string workload;
+
+   KeyDistribution distribution;
+
+   double zipfianTheta;
+
+   // ключей в таблице перед измерением
+   size_t records;
+
+   // операций на одно измерение, они делятся между потоками
+   size_t operations;
+
+   // до 8 байт значение - число, больше - строка такой длины
+   size_t valueSize;
+
+   // резервировать ли ячейки под все ключи заранее
+   bool reserve;
+
+   std::vector<size_t> threadCounts;
+
+   std::vector<Configuration> configurations;
+
+   OutputFormat format;
+};
+
+// ключ записи - её номер, перемешанный FNV-1a, как в YCSB, чтобы соседние номера
+// не попадали в соседние ячейки
+inline uint64_t KeyOf( uint64_t ordinal )
+{
+   uint64_t hash = 0xcbf29ce484222325ull;
+   for ( int i = 0; i < 8; ++i )
+   {
+      hash ^= ordinal & 0xff;
+      hash *= 0x100000001b3ull;
+      ordinal >>= 8;
+   }
+   return hash;
+}
+
+// распределение Ципфа на [0, n) по Грею и др. ("Quickly generating billion-record
+// synthetic databases"), как ZipfianGenerator в YCSB: номер 0 самый частый
+class ZipfianGenerator
+{
+public:
+   ZipfianGenerator( uint64_t const n, double const theta )
+      : mCount( n )
+      , mTheta( theta )
+      , mAlpha( 1.0 / ( 1.0 - theta ) )
+      , mZetaN( Zeta( n, theta ) )
+   {
+      mEta = ( 1.0 - std::pow( 2.0 / n, 1.0 - theta ) ) / ( 1.0 - Zeta( 2, theta ) / mZetaN );
+   }
+
+   template<typename TEngine>
+   uint64_t Next( TEngine& engine ) const
+   {
+      auto const u = std::uniform_real_distribution<double>( 0.0, 1.0 )( engine );
+      auto const uz = u * mZetaN;
+      if ( uz < 1.0 )
+         return 0;
+
+      if ( uz < 1.0 + std::pow( 0.5, mTheta ) )
+         return 1;
+
+      auto const value = static_cast<uint64_t>( mCount * std::pow( mEta * u - mEta + 1.0, mAlpha ) );
+      return std::min( value, mCount - 1 );
+   }
+
+private:
+   static double Zeta( uint64_t const n, double const theta )
+   {
+      double sum = 0;
+      for ( uint64_t i = 1; i <= n; ++i )
+      {
+         sum += 1.0 / std::pow( static_cast<double>( i ), theta );
+      }
+      return sum;
+   }
+
+   uint64_t mCount;
+   double mTheta;
+   double mAlpha;
+   double mZetaN;
+   double mEta;
+};
+
+// номера существующих записей для одного потока. Вставленные во время измерения
+// записи получают номера от records и дальше, общий счётчик - inserted.
+// Ципф строится по начальным records записям, latest отсчитывает его от последней вставленной
+class KeyChooser
+{
+public:
+   KeyChooser( Options const& options, ZipfianGenerator const& zipfian, std::atomic<uint64_t> const& inserted, size_t const thread, size_t const threadCount )
+      : mDistribution( options.distribution )
+      , mRecords( options.records )
+      , mZipfian( zipfian )
+      , mInserted( inserted )
+      , mNext( options.records * thread / threadCount )
+   {
+
+   }
+
+   template<typename TEngine>
+   uint64_t Next( TEngine& engine )
+   {
+      auto const total = mRecords + mInserted.load( std::memory_order_relaxed );
+      switch ( mDistribution )
+      {
+      case KeyDistribution::Uniform:
+         return std::uniform_int_distribution<uint64_t>( 0, total - 1 )( engine );
+      case KeyDistribution::Zipfian:
+         return mZipfian.Next( engine );
+      case KeyDistribution::Latest:
+      {
+         auto const back = mZipfian.Next( engine );
+         return back < total ? total - 1 - back : 0;
+      }
+      default:
+         return mNext++ % total;
+      }
+   }
+
+private:
+   KeyDistribution mDistribution;
+   uint64_t mRecords;
+   ZipfianGenerator const& mZipfian;
+   std::atomic<uint64_t> const& mInserted;
+   uint64_t mNext;
+};
+
+// гистограмма задержек в наносекундах: до 32 нс точно, дальше 16 интервалов на каждую
+// степень двойки, т.е. погрешность перцентилей не больше 1/16
+class LatencyHistogram
+{
+public:
+   LatencyHistogram()
+      : mCount( 0 )
+      , mMax( 0 )
+   {
+      mBuckets.fill( 0 );
+   }
+
+   void Add( uint64_t const ns )
+   {
+      ++mBuckets[BucketOf( ns )];
+      ++mCount;
+      mMax = std::max( mMax, ns );
+   }
+
+   void Merge( LatencyHistogram const& other )
+   {
+      for ( size_t i = 0; i < cBucketCount; ++i )
+      {
+         mBuckets[i] += other.mBuckets[i];
+      }
+      mCount += other.mCount;
+      mMax = std::max( mMax, other.mMax );
+   }
+
+   uint64_t Count() const
+   {
+      return mCount;
+   }
+
+   uint64_t Max() const
+   {
+      return mMax;
+   }
+
+   // верхняя граница интервала, в который попал перцентиль q из [0, 1]
+   uint64_t Percentile( double const q ) const
+   {
+      if ( mCount == 0 )
+         return 0;
+
+      auto const rank = std::max<uint64_t>( 1, static_cast<uint64_t>( std::ceil( q * mCount ) ) );
+      uint64_t seen = 0;
+      for ( size_t i = 0; i < cBucketCount; ++i )
+      {
+         seen += mBuckets[i];
+         if ( seen >= rank )
+            return std::min( UpperBound( i ), mMax );
+      }
+      return mMax;
+   }
+
+private:
+   static int const cSubBits = 4;
+   static size_t const cSubCount = size_t( 1 ) << cSubBits;
+   static size_t const cBucketCount = ( 64 - cSubBits + 1 ) * cSubCount;
+
+   static size_t BucketOf( uint64_t const ns )
+   {
+      if ( ns < 2 * cSubCount )
+         return static_cast<size_t>( ns );
+
+      auto const exponent = HighestBit( ns );
+      return ( exponent - cSubBits ) * cSubCount + static_cast<size_t>( ns >> ( exponent - cSubBits ) );
+   }
+
+   static uint64_t UpperBound( size_t const bucket )
+   {
+      if ( bucket < 2 * cSubCount )
+         return bucket;
+
+      auto const exponent = bucket / cSubCount + cSubBits - 1;
+      auto const mantissa = bucket % cSubCount + cSubCount;
+      return ( ( mantissa + 1 ) << ( exponent - cSubBits ) ) - 1;
+   }
+
+   static size_t HighestBit( uint64_t const value )
+   {
+#if defined( __GNUC__ )
+      return 63 - __builtin_clzll( value );
+#else
+      size_t bit = 0;
+      for ( auto rest = value >> 1; rest != 0; rest >>= 1 )
+      {
+         ++bit;
+      }
+      return bit;
+#endif
+   }
+
+   std::array<uint64_t, cBucketCount> mBuckets;
+   uint64_t mCount;
+   uint64_t mMax;
+};
+
+typedef std::array<LatencyHistogram, cOperationCount> TOperationHistograms;
+
+// строки результатов в выбранном формате: текст, CSV с заголовком или массив JSON
+class Reporter
+{
+public:
+   Reporter( OutputFormat const format, std::ostream& out )
+      : mFormat( format )
+      , mOut( out )
+      , mRows( 0 )
+   {
+      if ( mFormat == OutputFormat::Csv )
+         mOut << "table,lock,locks,layout,read_mode,rehash,workload,distribution,records,value_size,threads,operation,count,duration_s,ops_per_s,p50_ns,p99_ns,p999_ns,max_ns\n";
+      else if ( mFormat == OutputFormat::Json )
+         mOut << "[";
+   }
+
+   ~Reporter()
+   {
+      if ( mFormat == OutputFormat::Json )
+         mOut << ( mRows == 0 ? "]\n" : "\n]\n" );
+   }
+
+   void Report( Configuration const& config, Options const& options, size_t const threads, double const duration, char const* operation, LatencyHistogram const& histogram )
+   {
+      auto const opsPerSecond = histogram.Count() / duration;
+      if ( mFormat == OutputFormat::Csv )
+      {
+         mOut
+            << config.table << ',' << config.lock << ',' << config.lockCount << ',' << config.layout << ','
+            << config.readMode << ',' << config.rehashMode << ',' << options.workload << ','
+            << DistributionName( options.distribution ) << ',' << options.records << ',' << options.valueSize << ','
+            << threads << ',' << operation << ',' << histogram.Count() << ',' << duration << ','
+            << opsPerSecond << ',' << histogram.Percentile( 0.5 ) << ',' << histogram.Percentile( 0.99 ) << ','
+            << histogram.Percentile( 0.999 ) << ',' << histogram.Max() << "\n";
+      }
+      else if ( mFormat == OutputFormat::Json )
+      {
+         mOut
+            << ( mRows == 0 ? "\n" : ",\n" )
+            << "{\"table\":\"" << config.table << "\",\"lock\":\"" << config.lock << "\",\"locks\":" << config.lockCount
+            << ",\"layout\":\"" << config.layout << "\",\"read_mode\":\"" << config.readMode
+            << "\",\"rehash\":\"" << config.rehashMode << "\",\"workload\":\"" << options.workload
+            << "\",\"distribution\":\"" << DistributionName( options.distribution ) << "\",\"records\":" << options.records
+            << ",\"value_size\":" << options.valueSize << ",\"threads\":" << threads
+            << ",\"operation\":\"" << operation << "\",\"count\":" << histogram.Count()
+            << ",\"duration_s\":" << duration << ",\"ops_per_s\":" << opsPerSecond
+            << ",\"p50_ns\":" << histogram.Percentile( 0.5 ) << ",\"p99_ns\":" << histogram.Percentile( 0.99 )
+            << ",\"p999_ns\":" << histogram.Percentile( 0.999 ) << ",\"max_ns\":" << histogram.Max() << "}";
+      }
+      else
+      {
+         mOut
+            << "Container: " << config.table << "<" << config.lock << "> Locks: " << config.lockCount
+            << " Layout: " << config.layout << " Read mode: " << config.readMode << " Rehash: " << config.rehashMode
+            << " Workload: " << options.workload << " Distribution: " << DistributionName( options.distribution )
+            << " Threads: " << threads << " Operation: " << operation << " Count: " << histogram.Count()
+            << " Mops/s: " << ( float ) ( opsPerSecond / 1000000 )
+            << " p50: " << histogram.Percentile( 0.5 ) << " ns p99: " << histogram.Percentile( 0.99 )
+            << " ns p999: " << histogram.Percentile( 0.999 ) << " ns max: " << histogram.Max() << " ns\n";
+      }
+      ++mRows;
+   }
+
+private:
+   Reporter( Reporter const& );
+
+   Reporter& operator=( Reporter const& );
+
+   OutputFormat mFormat;
+   std::ostream& mOut;
+   size_t mRows;
+};
+
+inline void MakeValue( size_t const /*size*/, uint64_t const seed, uint64_t& value )
+{
+   value = seed;
+}
+
+inline void MakeValue( size_t const size, uint64_t const seed, std::string& value )
+{
+   value.assign( size, static_cast<char>( 'a' + seed % 26 ) );
+}
+
+template <typename TKey, typename TValue, size_t pLockCount, typename TLock, typename THash, typename TStorage, kvs::StripeLayout pStripeLayout, typename TStats, typename TIndexing>
+kvs::ThreadsafeHashTable<TKey, TValue, pLockCount, TLock, THash, TStorage, pStripeLayout, TStats, TIndexing>* CreateMap( Configuration const& config, kvs::ThreadsafeHashTable<TKey, TValue, pLockCount, TLock, THash, TStorage, pStripeLayout, TStats, TIndexing>* )
+{
+   std::unique_ptr<kvs::ThreadsafeHashTable<TKey, TValue, pLockCount, TLock, THash, TStorage, pStripeLayout, TStats, TIndexing>> map( new kvs::ThreadsafeHashTable<TKey, TValue, pLockCount, TLock, THash, TStorage, pStripeLayout, TStats, TIndexing>( config.lockCount ) );
+   if ( config.maxLockCount != 0 )
+      map->SetMaxLockCount( config.maxLockCount );
+
+   if ( config.readMode == "locked" )
+      map->SetReadMode( kvs::ReadMode::Locked );
+   else if ( config.readMode == "optimistic" )
+      map->SetReadMode( kvs::ReadMode::Optimistic );
+   else if ( config.readMode == "lock-free" )
+      map->SetReadMode( kvs::ReadMode::LockFree );
+   else
+      throw std::invalid_argument( "unknown read mode: " + config.readMode );
+
+   if ( config.rehashMode == "stop-the-world" )
+      map->SetRehashMode( kvs::RehashMode::StopTheWorld );
+   else if ( config.rehashMode == "incremental" )
+      map->SetRehashMode( kvs::RehashMode::Incremental );
+   else
+      throw std::invalid_argument( "unknown rehash mode: " + config.rehashMode );
+
+   return map.release();
+}
+
+// таблица без блокировок не настраивается
+template <typename TMap>
+TMap* CreateMap( Configuration const& /*config*/, TMap* )
+{
+   return new TMap();
+}
+
+template <typename TKey, typename TValue, size_t pLockCount, typename TLock, typename THash, typename TStorage, kvs::StripeLayout pStripeLayout, typename TStats, typename TIndexing>
+void ReadModifyWrite( kvs::ThreadsafeHashTable<TKey, TValue, pLockCount, TLock, THash, TStorage, pStripeLayout, TStats, TIndexing>& map, TKey const& key, TValue const& value )
+{
+   map.Modify( key, [&value]( TValue& current )
+   {
+      current = value;
+   } );
+}
+
+// без Modify - чтение и запись двумя операциями
+template <typename TMap, typename TKey, typename TValue>
+void ReadModifyWrite( TMap& map, TKey const& key, TValue const& value )
+{
+   TValue current;
+   if ( map.Find( key, current ) )
+      map.Update( typename TMap::TKeyValue( key, value ) );
+}
+
+template <typename TMap>
+void Load( TMap& map, Options const& options )
+{
+   typedef typename TMap::TKeyValue::second_type TValue;
+
+   size_t const loaderCount = std::max<size_t>( std::thread::hardware_concurrency(), 1 );
+   std::vector<std::thread> loaders;
+   for ( size_t t = 0; t < loaderCount; ++t )
+   {
+      loaders.push_back( std::thread( [&map, &options, t, loaderCount]()
+      {
+         for ( uint64_t ordinal = t; ordinal < options.records; ordinal += loaderCount )
+         {
+            TValue value;
+            MakeValue( options.valueSize, ordinal, value );
+            map.Insert( typename TMap::TKeyValue( KeyOf( ordinal ), std::move( value ) ) );
+         }
+      } ) );
+   }
+
+   for ( auto it = loaders.begin(); it != loaders.end(); ++it )
+   {
+      it->join();
+   }
+}
+
+// одно измерение: threadCount потоков выполняют смесь операций над заполненной таблицей
+template <typename TMap>
+void RunThreads( TMap& map, Configuration const& config, Options const& options, size_t const threadCount, Reporter& reporter )
+{
+   typedef typename TMap::TKeyValue TKeyValue;
+   typedef typename TKeyValue::second_type TValue;
+
+   ZipfianGenerator const zipfian( std::max<size_t>( options.records, 2 ), options.zipfianTheta );
+   std::atomic<uint64_t> inserted( 0 );
+   std::atomic<size_t> ready( 0 );
+   std::atomic<bool> start( false );
+
+   std::vector<std::unique_ptr<TOperationHistograms>> histograms;
+   std::vector<std::thread> threads;
+   for ( size_t t = 0; t < threadCount; ++t )
+   {
+      histograms.push_back( std::unique_ptr<TOperationHistograms>( new TOperationHistograms() ) );
+      auto& threadHistograms = *histograms.back();
+      threads.push_back( std::thread( [&, t]()
+      {
+         std::default_random_engine engine( std::random_device{}() );
+         std::uniform_int_distribution<size_t> percent( 0, 99 );
+         KeyChooser chooser( options, zipfian, inserted, t, threadCount );
+
+         TValue value;
+         MakeValue( options.valueSize, t, value );
+         size_t const operations = options.operations / threadCount + ( t < options.operations % threadCount ? 1 : 0 );
+
+         ++ready;
+         while ( !start.load( std::memory_order_acquire ) )
+         {
+            std::this_thread::yield();
+         }
+
+         for ( size_t n = 0; n < operations; ++n )
+         {
+            auto roll = percent( engine );
+            size_t op = 0;
+            while ( roll >= options.mix[op] )
+            {
+               roll -= options.mix[op];
+               ++op;
+            }
+
+            auto const operation = static_cast<Operation>( op );
+            auto const key = KeyOf( operation == Operation::Insert ? options.records + inserted.fetch_add( 1, std::memory_order_relaxed ) : chooser.Next( engine ) );
+
+            auto const tic = std::chrono::steady_clock::now();
+            switch ( operation )
+            {
+            case Operation::Read:
+            {
+               TValue current;
+               map.Find( key, current );
+               break;
+            }
+            case Operation::Update:
+               map.Update( TKeyValue( key, value ) );
+               break;
+            case Operation::Insert:
+               map.Insert( TKeyValue( key, value ) );
+               break;
+            case Operation::Erase:
+               map.Erase( key );
+               break;
+            default:
+               ReadModifyWrite( map, key, value );
+               break;
+            }
+            auto const toc = std::chrono::steady_clock::now();
+
+            threadHistograms[op].Add( static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>( toc - tic ).count() ) );
+         }
+      } ) );
+   }
+
+   while ( ready.load() != threadCount )
+   {
+      std::this_thread::yield();
+   }
+
+   auto const tic_start = std::chrono::steady_clock::now();
+   start.store( true, std::memory_order_release );
+   for ( auto it = threads.begin(); it != threads.end(); ++it )
+   {
+      it->join();
+   }
+   auto const duration = std::chrono::duration<double>( std::chrono::steady_clock::now() - tic_start ).count();
+
+   LatencyHistogram total;
+   for ( size_t op = 0; op < cOperationCount; ++op )
+   {
+      LatencyHistogram merged;
+      for ( auto it = histograms.begin(); it != histograms.end(); ++it )
+      {
+         merged.Merge( ( **it )[op] );
+      }
+
+      if ( merged.Count() == 0 )
+         continue;
+
+      reporter.Report( config, options, threadCount, duration, OperationName( static_cast<Operation>( op ) ), merged );
+      total.Merge( merged );
+   }
+   reporter.Report( config, options, threadCount, duration, "total", total );
+}
+
+// для каждого числа потоков таблица создаётся и заполняется заново
+template <typename TMap>
+void RunConfiguration( Configuration const& config, Options const& options, Reporter& reporter )
+{
+   for ( auto count_it = options.threadCounts.begin(); count_it != options.threadCounts.end(); ++count_it )
+   {
+      std::unique_ptr<TMap> map( CreateMap( config, static_cast<TMap*>( nullptr ) ) );
+      if ( options.reserve )
+         map->Reserve( options.records + options.operations * options.mix[static_cast<size_t>( Operation::Insert )] / 100 );
+
+      Load( *map, options );
+      RunThreads( *map, config, options, *count_it, reporter );
+   }
+}
+
+template <typename TValue, typename TLock, typename TStorage>
+void DispatchLayout( Configuration const& config, Options const& options, Reporter& reporter )
+{
+   if ( config.layout == "padded" )
+      RunConfiguration<kvs::ThreadsafeHashTable<uint64_t, TValue, 256, TLock, std::hash<uint64_t>, TStorage, kvs::StripeLayout::Padded>>( config, options, reporter );
+   else if ( config.layout == "packed" )
+      RunConfiguration<kvs::ThreadsafeHashTable<uint64_t, TValue, 256, TLock, std::hash<uint64_t>, TStorage, kvs::StripeLayout::Packed>>( config, options, reporter );
+   else
+      throw std::invalid_argument( "unknown layout: " + config.layout );
+}
+
+template <typename TValue, typename TLock>
+void DispatchStorage( Configuration const& config, Options const& options, Reporter& reporter )
+{
+   if ( config.table == "list" )
+      DispatchLayout<TValue, TLock, kvs::ListStorage>( config, options, reporter );
+   else if ( config.table == "flat-linear" )
+      DispatchLayout<TValue, TLock, kvs::FlatStorage<kvs::Probing::Linear>>( config, options, reporter );
+   else if ( config.table == "flat-robinhood" )
+      DispatchLayout<TValue, TLock, kvs::FlatStorage<kvs::Probing::RobinHood>>( config, options, reporter );
+   else if ( config.table == "pooled" )
+      DispatchLayout<TValue, TLock, kvs::PooledListStorage>( config, options, reporter );
+   else if ( config.table == "epoch" )
+      DispatchLayout<TValue, TLock, kvs::EpochListStorage>( config, options, reporter );
+   else if ( config.table == "hashed" )
+      DispatchLayout<TValue, TLock, kvs::HashedListStorage>( config, options, reporter );
+   else if ( config.table == "swiss" )
+      DispatchLayout<TValue, TLock, kvs::SwissStorage>( config, options, reporter );
+   else
+      throw std::invalid_argument( "unknown table: " + config.table );
+}
+
+template <typename TValue>
+void DispatchLock( Configuration const& config, Options const& options, Reporter& reporter )
+{
+   if ( config.table == "split-ordered" )
+      RunConfiguration<kvs::SplitOrderedHashTable<uint64_t, TValue>>( config, options, reporter );
+   else if ( config.lock == "srw" )
+      DispatchStorage<TValue, kvs::SlimReaderWriterLock>( config, options, reporter );
+   else if ( config.lock == "boost" )
+      DispatchStorage<TValue, boost::shared_mutex>( config, options, reporter );
+   else if ( config.lock == "std" )
+      DispatchStorage<TValue, std::shared_mutex>( config, options, reporter );
+#ifndef WIN32
+   else if ( config.lock == "pthread" )
+      DispatchStorage<TValue, kvs::PthreadSharedMutex>( config, options, reporter );
+#endif
+#if defined( __linux__ )
+   else if ( config.lock == "futex" )
+      DispatchStorage<TValue, kvs::FutexSharedMutex>( config, options, reporter );
+#endif
+   else if ( config.lock == "spin" )
+      DispatchStorage<TValue, kvs::SpinSharedMutex>( config, options, reporter );
+   else if ( config.lock == "ticket" )
+      DispatchStorage<TValue, kvs::TicketMutex>( config, options, reporter );
+   else if ( config.lock == "bravo" )
+      DispatchStorage<TValue, kvs::BravoSharedMutex<kvs::SlimReaderWriterLock>>( config, options, reporter );
+   else
+      throw std::invalid_argument( "unknown lock: " + config.lock );
+}
+
+// значения до 8 байт - числа, их могут читать и оптимистичные чтения FlatStorage
+inline void Run( Options const& options )
+{
+   Reporter reporter( options.format, std::cout );
+   for ( auto config_it = options.configurations.begin(); config_it != options.configurations.end(); ++config_it )
+   {
+      if ( options.valueSize <= sizeof( uint64_t ) )
+         DispatchLock<uint64_t>( *config_it, options, reporter );
+      else
+         DispatchLock<std::string>( *config_it, options, reporter );
+   }
+}
+
+inline std::vector<std::string> SplitList( std::string const& value )
+{
+   std::vector<std::string> items;
+   std::stringstream stream( value );
+   std::string item;
+   while ( std::getline( stream, item, ',' ) )
+   {
+      if ( !item.empty() )
+         items.push_back( item );
+   }
+   return items;
+}
+
+inline size_t ParseSize( std::string const& name, std::string const& value )
+{
+   size_t pos = 0;
+   unsigned long long result = 0;
+   try
+   {
+      result = std::stoull( value, &pos );
+   }
+   catch( std::exception const& )
+   {
+      pos = 0;
+   }
+
+   if ( pos == 0 || pos != value.size() )
+      throw std::invalid_argument( "--" + name + " expects a number, got '" + value + "'" );
+   return static_cast<size_t>( result );
+}
+
+inline std::vector<size_t> ParseSizeList( std::string const& name, std::string const& value )
+{
+   std::vector<size_t> result;
+   auto const items = SplitList( value );
+   for ( auto it = items.begin(); it != items.end(); ++it )
+   {
+      result.push_back( ParseSize( name, *it ) );
+   }
+   return result;
+}
+
+// смеси YCSB. Workload E (короткие диапазоны) не поддерживается: у таблицы нет порядка ключей
+inline void ApplyPreset( std::string const& name, Options& options )
+{
+   options.mix.fill( 0 );
+   options.distribution = KeyDistribution::Zipfian;
+   auto& mix = options.mix;
+   if ( name == "a" )
+   {
+      mix[static_cast<size_t>( Operation::Read )] = 50;
+      mix[static_cast<size_t>( Operation::Update )] = 50;
+   }
+   else if ( name == "b" )
+   {
+      mix[static_cast<size_t>( Operation::Read )] = 95;
+      mix[static_cast<size_t>( Operation::Update )] = 5;
+   }
+   else if ( name == "c" )
+   {
+      mix[static_cast<size_t>( Operation::Read )] = 100;
+   }
+   else if ( name == "d" )
+   {
+      mix[static_cast<size_t>( Operation::Read )] = 95;
+      mix[static_cast<size_t>( Operation::Insert )] = 5;
+      options.distribution = KeyDistribution::Latest;
+   }
+   else if ( name == "f" )
+   {
+      mix[static_cast<size_t>( Operation::Read )] = 50;
+      mix[static_cast<size_t>( Operation::ReadModifyWrite )] = 50;
+   }
+   // смесь прежнего бенчмарка: 2 читателя, 2 обновляющих и 4 вставляющих потока
+   else if ( name == "legacy" )
+   {
+      mix[static_cast<size_t>( Operation::Read )] = 25;
+      mix[static_cast<size_t>( Operation::Update )] = 25;
+      mix[static_cast<size_t>( Operation::Insert )] = 50;
+      options.distribution = KeyDistribution::Uniform;
+   }
+   else
+   {
+      throw std::invalid_argument( "unknown workload: " + name );
+   }
+   options.workload = name;
+}
+
+char const* const cTables = "list,flat-linear,flat-robinhood,pooled,epoch,hashed,swiss,split-ordered";
+
+// блокировки, доступные на этой платформе. В "all" нет futex: вне Windows srw - это она и есть
+#if defined( __linux__ )
+char const* const cLocks = "srw,boost,std,pthread,futex,spin,ticket,bravo";
+char const* const cAllLocks = "srw,boost,std,pthread,spin,ticket,bravo";
+#elif !defined( WIN32 )
+char const* const cLocks = "srw,boost,std,pthread,spin,ticket,bravo";
+char const* const cAllLocks = "srw,boost,std,spin,ticket,bravo";
+#else
+char const* const cLocks = "srw,boost,std,spin,ticket,bravo";
+char const* const cAllLocks = "srw,boost,std,spin,ticket,bravo";
+#endif
+
+// список значений параметра, каждое из которых есть среди known
+inline std::vector<std::string> CheckNames( std::string const& name, std::string const& value, std::string const& known )
+{
+   auto const items = SplitList( value );
+   auto const knownItems = SplitList( known );
+   if ( items.empty() )
+      throw std::invalid_argument( "--" + name + " is empty" );
+
+   for ( auto it = items.begin(); it != items.end(); ++it )
+   {
+      if ( std::find( knownItems.begin(), knownItems.end(), *it ) == knownItems.end() )
+         throw std::invalid_argument( "unknown --" + name + " value '" + *it + "', expected one of " + known );
+   }
+   return items;
+}
+
+inline void PrintUsage( std::ostream& out )
+{
+   out
+      << "usage: Benchmark workload [--option=value ...]\n"
+      << "  --workload=a|b|c|d|f|legacy     YCSB mix (default b: 95% read, 5% update)\n"
+      << "  --read= --update= --insert= --erase= --rmw=\n"
+      << "                                  custom mix in percent, overrides --workload, sums to 100\n"
+      << "  --distribution=uniform|zipfian|latest|sequential\n"
+      << "  --theta=0.99                    zipfian constant\n"
+      << "  --records=100000                keys loaded before each measurement\n"
+      << "  --operations=1000000            operations per measurement, split between threads\n"
+      << "  --value-size=8                  bytes; up to 8 the value is an integer\n"
+      << "  --threads=1,2,4,8               thread counts to sweep\n"
+      << "  --table=" << cTables << "|all\n"
+      << "  --lock=" << cLocks << "|all\n"
+      << "  --locks=256                     lock counts, e.g. 11,256\n"
+      << "  --layout=padded,packed\n"
+      << "  --read-mode=locked|optimistic|lock-free\n"
+      << "  --rehash=stop-the-world|incremental\n"
+      << "  --max-locks=0                   let the lock count grow up to this value on rehash\n"
+      << "  --no-reserve                    let the table grow during the measurement\n"
+      << "  --format=text|csv|json\n";
+}
+
+inline Options ParseOptions( int const argc, char* argv[] )
+{
+   Options options;
+   std::vector<std::string> tables( 1, "list" );
+   std::vector<std::string> locks( 1, "srw" );
+   std::vector<std::string> layouts( 1, "padded" );
+   std::vector<size_t> lockCounts( 1, 256 );
+   std::string readMode = "locked";
+   std::string rehashMode = "stop-the-world";
+   size_t maxLockCount = 0;
+   bool customMix = false;
+   bool customDistribution = false;
+   KeyDistribution distribution = KeyDistribution::Zipfian;
+   std::array<size_t, cOperationCount> mix;
+   mix.fill( 0 );
+   ApplyPreset( "b", options );
+   options.threadCounts = { 1, 2, 4, 8 };
+
+   for ( int i = 0; i < argc; ++i )
+   {
+      std::string const arg = argv[i];
+      if ( arg == "--no-reserve" )
+      {
+         options.reserve = false;
+         continue;
+      }
+
+      auto const eq = arg.find( '=' );
+      if ( arg.compare( 0, 2, "--" ) != 0 || eq == std::string::npos )
+         throw std::invalid_argument( "unexpected argument: " + arg );
+
+      auto const name = arg.substr( 2, eq - 2 );
+      auto const value = arg.substr( eq + 1 );
+      if ( name == "workload" )
+         ApplyPreset( value, options );
+      else if ( name == "read" || name == "update" || name == "insert" || name == "erase" || name == "rmw" )
+      {
+         for ( size_t op = 0; op < cOperationCount; ++op )
+         {
+            if ( name == OperationName( static_cast<Operation>( op ) ) )
+               mix[op] = ParseSize( name, value );
+         }
+         customMix = true;
+      }
+      else if ( name == "distribution" )
+      {
+         bool known = false;
+         for ( int d = 0; d <= static_cast<int>( KeyDistribution::Sequential ); ++d )
+         {
+            if ( value == DistributionName( static_cast<KeyDistribution>( d ) ) )
+            {
+               distribution = static_cast<KeyDistribution>( d );
+               known = true;
+            }
+         }
+         if ( !known )
+            throw std::invalid_argument( "unknown distribution: " + value );
+         customDistribution = true;
+      }
+      else if ( name == "theta" )
+         options.zipfianTheta = std::stod( value );
+      else if ( name == "records" )
+         options.records = ParseSize( name, value );
+      else if ( name == "operations" )
+         options.operations = ParseSize( name, value );
+      else if ( name == "value-size" )
+         options.valueSize = ParseSize( name, value );
+      else if ( name == "threads" )
+         options.threadCounts = ParseSizeList( name, value );
+      else if ( name == "table" )
+         tables = CheckNames( name, value == "all" ? cTables : value, cTables );
+      else if ( name == "lock" )
+         locks = CheckNames( name, value == "all" ? cAllLocks : value, cLocks );
+      else if ( name == "locks" )
+         lockCounts = ParseSizeList( name, value );
+      else if ( name == "layout" )
+         layouts = CheckNames( name, value, "padded,packed" );
+      else if ( name == "read-mode" )
+         readMode = CheckNames( name, value, "locked,optimistic,lock-free" ).front();
+      else if ( name == "rehash" )
+         rehashMode = CheckNames( name, value, "stop-the-world,incremental" ).front();
+      else if ( name == "max-locks" )
+         maxLockCount = ParseSize( name, value );
+      else if ( name == "format" )
+      {
+         if ( value == "text" )
+            options.format = OutputFormat::Text;
+         else if ( value == "csv" )
+            options.format = OutputFormat::Csv;
+         else if ( value == "json" )
+            options.format = OutputFormat::Json;
+         else
+            throw std::invalid_argument( "unknown format: " + value );
+      }
+      else
+         throw std::invalid_argument( "unknown option: --" + name );
+   }
+
+   // распределение из командной строки важнее распределения смеси
+   if ( customDistribution )
+      options.distribution = distribution;
+
+   if ( customMix )
+   {
+      options.mix = mix;
+      options.workload = "custom";
+   }
+
+   size_t total = 0;
+   for ( size_t op = 0; op < cOperationCount; ++op )
+   {
+      total += options.mix[op];
+   }
+   if ( total != 100 )
+      throw std::invalid_argument( "operation mix must sum to 100" );
+
+   if ( options.records == 0 )
+      throw std::invalid_argument( "--records must be positive" );
+
+   if ( options.threadCounts.empty() || std::find( options.threadCounts.begin(), options.threadCounts.end(), size_t( 0 ) ) != options.threadCounts.end() )
+      throw std::invalid_argument( "--threads must list positive thread counts" );
+
+   // таблица без блокировок не зависит от блокировки и её раскладки, она выводится один раз
+   bool splitOrdered = false;
+   for ( auto table_it = tables.begin(); table_it != tables.end(); ++table_it )
+   {
+      if ( *table_it == "split-ordered" )
+      {
+         splitOrdered = true;
+         continue;
+      }
+
+      for ( auto lock_it = locks.begin(); lock_it != locks.end(); ++lock_it )
+      {
+         for ( auto count_it = lockCounts.begin(); count_it != lockCounts.end(); ++count_it )
+         {
+            for ( auto layout_it = layouts.begin(); layout_it != layouts.end(); ++layout_it )
+            {
+               Configuration const config = { *table_it, *lock_it, *layout_it, readMode, rehashMode, *count_it, maxLockCount };
+               options.configurations.push_back( config );
+            }
+         }
+      }
+   }
+
+   if ( splitOrdered )
+   {
+      Configuration const config = { "split-ordered", "none", "none", "lock-free", "incremental", 0, 0 };
+      options.configurations.push_back( config );
+   }
+
+   return options;
+}
+
+// argv - аргументы после имени сценария
+inline int Main( int const argc, char* argv[] )
+{
+   for ( int i = 0; i < argc; ++i )
+   {
+      if ( std::string( argv[i] ) == "--help" )
+      {
+         PrintUsage( std::cout );
+         return 0;
+      }
+   }
+
+   Options options;
+   try
+   {
+      options = ParseOptions( argc, argv );
+   }
+   catch( std::exception const& e )
+   {
+      std::cerr << e.what() << "\n";
+      PrintUsage( std::cerr );
+      return 1;
+   }
+
+   try
+   {
+      Run( options );
+   }
+   catch( std::exception const& e )
+   {
+      std::cerr << e.what() << "\n";
+      return 1;
+   }
+
+   return 0;
+}
+
+} // namespace workload
@@ -6,14 +6,29 @@
 #include <time.h>
 #include <condition_variable>
 #include <random>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 
 #include "SlimReaderWriterLock.h"
+#include "LockPolicies.h"
 #include "ThreadsafeHashTable.h"
+#include "SplitOrderedHashTable.h"
+#include "SharedMemoryHashTable.h"
+#include "CacheHashTable.h"
+#include "Workload.h"
 
 #ifndef WIN32
 #include <sys/time.h>
 #else
 #include <WinSock2.h>
+#include <psapi.h>
+
+#pragma comment( lib, "psapi.lib" )
 
 int gettimeofday( struct timeval* tv, void* tz )
 {
@@ -62,24 +77,40 @@ typedef std::pair<TKey, TValue> TKeyValue;
 //typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, std::mutex> TConcurrentMap;
 //typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, boost::shared_mutex> TConcurrentMap;
 typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock> TConcurrentMap;
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, boost::shared_mutex> TSharedMutexMap;
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock, std::hash<TKey>, kvs::FlatStorage<kvs::Probing::Linear>> TLinearFlatMap;
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock, std::hash<TKey>, kvs::FlatStorage<kvs::Probing::RobinHood>> TRobinHoodFlatMap;
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock, std::hash<TKey>, kvs::ListStorage, kvs::StripeLayout::Packed> TPackedMap;
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock, std::hash<TKey>, kvs::FlatStorage<kvs::Probing::RobinHood>, kvs::StripeLayout::Packed> TPackedFlatMap;
+// таблица без блокировок с тем же интерфейсом
+typedef kvs::SplitOrderedHashTable<TKey, TValue> TLockFreeMap;
 typedef std::map<TKey, TValue> TSerialMap;
 
 #pragma region concurrent_func
 
-void ReadFunc( TConcurrentMap& concurrent_map, long const count )
+// результат чтений, чтобы компилятор не выбросил поиск
+std::atomic<size_t> read_hits( 0 );
+
+template <typename TMap>
+void ReadFunc( TMap& concurrent_map, long const count )
 {
    std::random_device rd;
    std::default_random_engine generator( rd() );
    std::uniform_int_distribution<int> distribution( distrib_min, distrib_max );
 
+   size_t hits = 0;
    for ( long i = 0; i < count; ++i )
    {
       TValue current;
-      concurrent_map.Find( distribution( generator ), current );
+      if ( concurrent_map.Find( distribution( generator ), current ) )
+         ++hits;
    }
+
+   read_hits += hits;
 };
 
-void UpdateFunc( TConcurrentMap& concurrent_map, long const count )
+template <typename TMap>
+void UpdateFunc( TMap& concurrent_map, long const count )
 {
    std::random_device rd;
    std::default_random_engine generator( rd() );
@@ -94,7 +125,8 @@ void UpdateFunc( TConcurrentMap& concurrent_map, long const count )
    }
 };
 
-void InsertFunc( TConcurrentMap& concurrent_map, long const count )
+template <typename TMap>
+void InsertFunc( TMap& concurrent_map, long const count )
 {
    std::random_device rd;
    std::default_random_engine generator( rd() );
@@ -163,12 +195,15 @@ void InsertSerial( TSerialMap& serial_map, long const count )
 
 #pragma endregion serial_func
 
-int main()
+#pragma region concurrent_map_test
+
+template <typename TMap>
+void ConcurrentMapTest( char const* name )
 {
    // количество потоков
    int num_threads = reader_count + updater_count + inserter_count;
 
-   TConcurrentMap concurrent_map;
+   TMap concurrent_map;
    // заранее резервируем ячейки, чтобы не тратить время на рехэш
    concurrent_map.Reserve( iter_count * inserter_count * 2 );
 
@@ -185,24 +220,22 @@ int main()
       concurrent_map.Insert( kv );
    }
 
-#pragma region concurrent_map_test
-
    auto tic_start = TRI_microtime();
 
    std::vector<std::thread> threads;
    for ( int i = 0; i < reader_count; ++i )
    {
-      threads.push_back( std::thread( ReadFunc, std::ref( concurrent_map ), iter_count ) );
+      threads.push_back( std::thread( ReadFunc<TMap>, std::ref( concurrent_map ), iter_count ) );
    }
 
    for ( int i = 0; i < updater_count; ++i )
    {
-      threads.push_back( std::thread( UpdateFunc, std::ref( concurrent_map ), iter_count ) );
+      threads.push_back( std::thread( UpdateFunc<TMap>, std::ref( concurrent_map ), iter_count ) );
    }
 
    for ( int i = 0; i < inserter_count; ++i )
    {
-      threads.push_back( std::thread( InsertFunc, std::ref( concurrent_map ), iter_count ) );
+      threads.push_back( std::thread( InsertFunc<TMap>, std::ref( concurrent_map ), iter_count ) );
    }
 
    for ( int i = 0; i < num_threads; ++i )
@@ -211,7 +244,8 @@ int main()
    }
 
    std::cout
-      << "Container: ThreadsafeHashTable"
+      << "Container: "
+      << name
       << " Threads: "
       << num_threads
       <<" Iterations: "
@@ -228,22 +262,2087 @@ int main()
       << concurrent_map.Size()
       << "\n"
       << "\n";
+}
 
 #pragma endregion concurrent_map_test
 
-#pragma region serial_map_test
+#pragma region rehash_latency_test
 
-   TSerialMap serial_map;
-   for ( size_t i = 0; i < initial_size; ++i )
+// перцентиль по отсортированным замерам
+double Percentile( std::vector<double> const& sorted, double const p )
+{
+   if ( sorted.empty() )
+      return 0;
+
+   auto idx = static_cast<size_t>( p * ( sorted.size() - 1 ) );
+   return sorted[idx];
+}
+
+void PrintLatency( char const* operation, std::vector<double>& latencies )
+{
+   std::sort( latencies.begin(), latencies.end() );
+
+   std::cout
+      << "  " << operation
+      << " p50: " << Percentile( latencies, 0.5 )
+      << " p99: " << Percentile( latencies, 0.99 )
+      << " p999: " << Percentile( latencies, 0.999 )
+      << " max: " << ( latencies.empty() ? 0 : latencies.back() )
+      << " us\n";
+}
+
+// время одной операции в микросекундах
+template <typename Function>
+double Measure( Function f )
+{
+   auto const start = std::chrono::high_resolution_clock::now();
+   f();
+   auto const stop = std::chrono::high_resolution_clock::now();
+   return std::chrono::duration<double, std::micro>( stop - start ).count();
+}
+
+// таблица растёт с нуля без Reserve, поэтому рехэш идёт всё время теста
+template <typename TMap>
+void RehashLatencyTest( kvs::RehashMode const mode, bool const helper, char const* name )
+{
+   TMap concurrent_map;
+   concurrent_map.SetRehashMode( mode );
+
+   std::vector<std::vector<double>> insert_latencies( inserter_count );
+   std::vector<std::vector<double>> read_latencies( reader_count );
+   std::atomic<bool> done( false );
+
+   auto tic_start = TRI_microtime();
+
+   std::vector<std::thread> threads;
+   for ( size_t i = 0; i < inserter_count; ++i )
    {
-      TKeyValue kv;
-      kv.first = distribution( generator );
-      kv.second = distribution( generator );
+      threads.push_back( std::thread( [&, i]()
+      {
+         std::default_random_engine generator( static_cast<unsigned>( i ) );
+         std::uniform_int_distribution<int> distribution( distrib_min, distrib_max * 4 );
+         auto& latencies = insert_latencies[i];
+         latencies.reserve( iter_count );
 
-      serial_map.insert( kv );
+         for ( size_t j = 0; j < iter_count; ++j )
+         {
+            TKeyValue kv( distribution( generator ), 0 );
+            latencies.push_back( Measure( [&](){ concurrent_map.Insert( kv ); } ) );
+         }
+      } ) );
+   }
+
+   for ( size_t i = 0; i < reader_count; ++i )
+   {
+      threads.push_back( std::thread( [&, i]()
+      {
+         std::default_random_engine generator( static_cast<unsigned>( i + inserter_count ) );
+         std::uniform_int_distribution<int> distribution( distrib_min, distrib_max * 4 );
+         auto& latencies = read_latencies[i];
+         latencies.reserve( iter_count );
+
+         for ( size_t j = 0; j < iter_count; ++j )
+         {
+            TValue value;
+            auto const key = distribution( generator );
+            latencies.push_back( Measure( [&](){ concurrent_map.Find( key, value ); } ) );
+         }
+      } ) );
+   }
+
+   std::thread helper_thread;
+   if ( helper )
+   {
+      helper_thread = std::thread( [&]()
+      {
+         while ( !done )
+         {
+            if ( !concurrent_map.RehashStep( 64 ) )
+               std::this_thread::yield();
+         }
+      } );
+   }
+
+   for ( auto it = threads.begin(); it != threads.end(); ++it )
+   {
+      it->join();
+   }
+
+   done = true;
+   if ( helper_thread.joinable() )
+      helper_thread.join();
+
+   std::cout
+      << "Container: "
+      << name
+      << " Inserters: "
+      << inserter_count
+      << " Readers: "
+      << reader_count
+      << " Iterations: "
+      << iter_count
+      << " Duration: "
+      << ( float ) ( TRI_microtime() - tic_start )
+      << " Container size: "
+      << concurrent_map.Size()
+      << "\n";
+
+   std::vector<double> inserts;
+   for ( auto it = insert_latencies.begin(); it != insert_latencies.end(); ++it )
+      inserts.insert( inserts.end(), it->begin(), it->end() );
+   PrintLatency( "Insert", inserts );
+
+   std::vector<double> reads;
+   for ( auto it = read_latencies.begin(); it != read_latencies.end(); ++it )
+      reads.insert( reads.end(), it->begin(), it->end() );
+   PrintLatency( "Find", reads );
+
+   std::cout << "\n";
+}
+
+#pragma endregion rehash_latency_test
+
+#pragma region read_scaling_test
+
+size_t const max_reader_count = 32;
+
+// только чтение из заполненной таблицы, число потоков от 1 до max_reader_count
+template <typename TMap>
+void ReadScaling( TMap& concurrent_map, char const* name )
+{
+   for ( long i = distrib_min; i <= distrib_max; i += 2 )
+   {
+      concurrent_map.Insert( TKeyValue( i, i ) );
+   }
+
+   for ( size_t thread_count = 1; thread_count <= max_reader_count; thread_count *= 2 )
+   {
+      auto tic_start = TRI_microtime();
+
+      std::vector<std::thread> threads;
+      for ( size_t i = 0; i < thread_count; ++i )
+      {
+         threads.push_back( std::thread( ReadFunc<TMap>, std::ref( concurrent_map ), iter_count ) );
+      }
+
+      for ( auto it = threads.begin(); it != threads.end(); ++it )
+      {
+         it->join();
+      }
+
+      auto const duration = TRI_microtime() - tic_start;
+
+      std::cout
+         << "Container: "
+         << name
+         << " Readers: "
+         << thread_count
+         << " Iterations: "
+         << iter_count
+         << " Duration: "
+         << ( float ) duration
+         << " Mops/s: "
+         << ( float ) ( thread_count * iter_count / duration / 1000000 )
+         << "\n";
+   }
+
+   std::cout << "\n";
+}
+
+template <typename TMap>
+void ReadScalingTest( kvs::ReadMode const mode, char const* name )
+{
+   TMap concurrent_map;
+   concurrent_map.SetReadMode( mode );
+
+   ReadScaling( concurrent_map, name );
+}
+
+#pragma endregion read_scaling_test
+
+#pragma region write_scaling_test
+
+size_t const max_writer_count = 32;
+
+template <typename TFunction>
+void PrintWriteScaling( char const* name, size_t const thread_count, TFunction f )
+{
+   auto tic_start = TRI_microtime();
+
+   std::vector<std::thread> threads;
+   for ( size_t i = 0; i < thread_count; ++i )
+   {
+      threads.push_back( std::thread( f, i ) );
+   }
+
+   for ( auto it = threads.begin(); it != threads.end(); ++it )
+   {
+      it->join();
+   }
+
+   auto const duration = TRI_microtime() - tic_start;
+
+   std::cout
+      << "Container: "
+      << name
+      << " Writers: "
+      << thread_count
+      << " Iterations: "
+      << iter_count
+      << " Duration: "
+      << ( float ) duration
+      << " Mops/s: "
+      << ( float ) ( thread_count * iter_count / duration / 1000000 )
+      << "\n";
+}
+
+// сам счётчик: один общий атомик против слота на поток
+void CounterScalingTest()
+{
+   for ( size_t thread_count = 1; thread_count <= max_writer_count; thread_count *= 2 )
+   {
+      std::atomic<size_t> shared_counter( 0 );
+      PrintWriteScaling( "std::atomic<size_t>", thread_count, [&]( size_t )
+      {
+         for ( size_t i = 0; i < iter_count; ++i )
+         {
+            ++shared_counter;
+         }
+      } );
+   }
+   std::cout << "\n";
+
+   for ( size_t thread_count = 1; thread_count <= max_writer_count; thread_count *= 2 )
+   {
+      kvs::ShardedCounter sharded_counter( thread_count );
+      PrintWriteScaling( "kvs::ShardedCounter", thread_count, [&]( size_t slot )
+      {
+         for ( size_t i = 0; i < iter_count; ++i )
+         {
+            sharded_counter.Add( slot, 1, 1024 );
+         }
+      } );
+   }
+   std::cout << "\n";
+}
+
+// вставка и удаление непересекающихся ключей, число потоков от 1 до max_writer_count
+template <typename TMap>
+void WriteScalingTest( char const* name )
+{
+   for ( size_t thread_count = 1; thread_count <= max_writer_count; thread_count *= 2 )
+   {
+      TMap concurrent_map;
+      concurrent_map.Reserve( thread_count * iter_count / 2 );
+
+      PrintWriteScaling( name, thread_count, [&]( size_t thread_idx )
+      {
+         TKey const base = static_cast<TKey>( thread_idx * iter_count );
+         for ( size_t i = 0; i < iter_count; ++i )
+         {
+            TKey const key = base + static_cast<TKey>( i / 2 );
+            if ( i % 2 == 0 )
+               concurrent_map.Insert( TKeyValue( key, key ) );
+            else
+               concurrent_map.Erase( key );
+         }
+      } );
+   }
+
+   std::cout << "\n";
+}
+
+#pragma endregion write_scaling_test
+
+#pragma region lock_growth_test
+
+// таблица растёт с нуля без резервирования, блокировок либо фиксированное число,
+// либо оно растёт вместе с ячейками до max_lock_count
+template <typename TMap>
+void LockGrowthTest( size_t const lock_count, size_t const max_lock_count, char const* name )
+{
+   TMap concurrent_map( lock_count );
+   concurrent_map.SetMaxLockCount( max_lock_count );
+
+   auto tic_start = TRI_microtime();
+
+   std::vector<std::thread> threads;
+   for ( size_t i = 0; i < reader_count; ++i )
+   {
+      threads.push_back( std::thread( ReadFunc<TMap>, std::ref( concurrent_map ), iter_count ) );
+   }
+
+   for ( size_t i = 0; i < inserter_count; ++i )
+   {
+      threads.push_back( std::thread( InsertFunc<TMap>, std::ref( concurrent_map ), iter_count ) );
+   }
+
+   for ( auto it = threads.begin(); it != threads.end(); ++it )
+   {
+      it->join();
+   }
+
+   std::cout
+      << "Container: "
+      << name
+      << " Readers: "
+      << reader_count
+      << " Inserters: "
+      << inserter_count
+      << " Duration: "
+      << ( float ) ( TRI_microtime() - tic_start )
+      << " Container size: "
+      << concurrent_map.Size()
+      << " Locks: "
+      << concurrent_map.LockCount()
+      << "\n";
+}
+
+#pragma endregion lock_growth_test
+
+#pragma region stripe_layout_test
+
+// каждый поток обновляет свой ключ, а значит свою соседнюю блокировку:
+// при плотной раскладке соседние блокировки делят кэш-линию
+template <typename TMap>
+void StripeLayoutTest( char const* name )
+{
+   for ( size_t thread_count = 1; thread_count <= max_writer_count; thread_count *= 2 )
+   {
+      TMap concurrent_map;
+      for ( size_t i = 0; i < thread_count; ++i )
+      {
+         concurrent_map.Insert( TKeyValue( static_cast<TKey>( i ), 0 ) );
+      }
+
+      PrintWriteScaling( name, thread_count, [&]( size_t thread_idx )
+      {
+         TKey const key = static_cast<TKey>( thread_idx );
+         for ( size_t i = 0; i < iter_count; ++i )
+         {
+            concurrent_map.Update( TKeyValue( key, static_cast<TValue>( i ) ) );
+         }
+      } );
+   }
+
+   std::cout << "\n";
+}
+
+#pragma endregion stripe_layout_test
+
+#pragma region batch_test
+
+size_t const batch_sizes[] = { 16, 256, 4096 };
+
+void PrintBatch( char const* name, char const* operation, size_t const batch_size, double const duration )
+{
+   std::cout
+      << "Container: "
+      << name
+      << " Operation: "
+      << operation
+      << " Batch: "
+      << batch_size
+      << " Threads: "
+      << inserter_count
+      << " Iterations: "
+      << iter_count
+      << " Duration: "
+      << ( float ) duration
+      << " Mops/s: "
+      << ( float ) ( inserter_count * iter_count / duration / 1000000 )
+      << "\n";
+}
+
+// пакет 0 - вставка и поиск по одному ключу
+template <typename TMap>
+void BatchTest( size_t const batch_size, char const* name )
+{
+   TMap concurrent_map;
+   concurrent_map.Reserve( iter_count * inserter_count * 2 );
+
+   auto run = [&]( bool const insert )
+   {
+      auto tic_start = TRI_microtime();
+
+      std::vector<std::thread> threads;
+      for ( size_t t = 0; t < inserter_count; ++t )
+      {
+         threads.push_back( std::thread( [&, t]()
+         {
+            std::default_random_engine generator( static_cast<unsigned>( t ) );
+            std::uniform_int_distribution<int> distribution( distrib_min, distrib_max );
+
+            std::vector<TKeyValue> kvs;
+            std::vector<TKey> keys;
+            std::vector<TValue> values;
+            std::vector<char> flags;
+            size_t hits = 0;
+            for ( size_t i = 0; i < iter_count; ++i )
+            {
+               TKeyValue const kv( distribution( generator ), distribution( generator ) );
+               if ( batch_size == 0 )
+               {
+                  TValue value;
+                  if ( insert )
+                     concurrent_map.Insert( kv );
+                  else if ( concurrent_map.Find( kv.first, value ) )
+                     ++hits;
+                  continue;
+               }
+
+               kvs.push_back( kv );
+               keys.push_back( kv.first );
+               if ( kvs.size() < batch_size && i + 1 < iter_count )
+                  continue;
+
+               if ( insert )
+                  concurrent_map.MultiInsert( kvs, flags );
+               else
+                  hits += concurrent_map.MultiFind( keys, values, flags );
+               kvs.clear();
+               keys.clear();
+            }
+
+            read_hits += hits;
+         } ) );
+      }
+
+      for ( auto it = threads.begin(); it != threads.end(); ++it )
+      {
+         it->join();
+      }
+
+      PrintBatch( name, insert ? "insert" : "find", batch_size, TRI_microtime() - tic_start );
+   };
+
+   run( true );
+   run( false );
+}
+
+#pragma endregion batch_test
+
+#pragma region string_test
+
+size_t const string_count = 200000;
+size_t const string_value_size = 1024;
+
+typedef kvs::ThreadsafeHashTable<std::string, std::string, lock_count, kvs::SlimReaderWriterLock, kvs::StringHash> TStringMap;
+
+// строковые ключи и большие значения: копирование против перемещения и поиска по std::string_view
+void StringTest( bool const move )
+{
+   std::vector<std::string> keys;
+   for ( size_t i = 0; i < string_count; ++i )
+   {
+      keys.push_back( "user:" + std::to_string( i ) + ":profile" );
+   }
+
+   TStringMap concurrent_map;
+   std::string const value( string_value_size, 'x' );
+
+   auto tic_start = TRI_microtime();
+   for ( size_t i = 0; i < string_count; ++i )
+   {
+      if ( move )
+      {
+         concurrent_map.Emplace( std::move( keys[i] ), std::string( value ) );
+         keys[i] = "user:" + std::to_string( i ) + ":profile";
+      }
+      else
+      {
+         std::pair<std::string, std::string> const kv( keys[i], value );
+         concurrent_map.Insert( kv );
+      }
+   }
+   auto const insert_duration = TRI_microtime() - tic_start;
+
+   // ключи для поиска - куски одного большого буфера, как после разбора запроса
+   std::string buffer;
+   std::vector<std::pair<size_t, size_t>> spans;
+   for ( size_t i = 0; i < string_count; ++i )
+   {
+      spans.push_back( std::make_pair( buffer.size(), keys[i].size() ) );
+      buffer += keys[i];
    }
 
    tic_start = TRI_microtime();
+   size_t hits = 0;
+   for ( size_t i = 0; i < string_count; ++i )
+   {
+      std::string_view const key( buffer.data() + spans[i].first, spans[i].second );
+      if ( move )
+      {
+         if ( concurrent_map.Visit( key, [&hits]( std::string const& v ){ hits += v.size(); } ) )
+            ++hits;
+      }
+      else
+      {
+         std::string found;
+         if ( concurrent_map.Find( std::string( key ), found ) )
+            hits += found.size() + 1;
+      }
+   }
+   auto const find_duration = TRI_microtime() - tic_start;
+   read_hits += hits;
+
+   std::cout
+      << "Container: ThreadsafeHashTable<std::string, std::string>"
+      << ( move ? " (Emplace + Visit by std::string_view)" : " (Insert + Find by std::string)" )
+      << " Count: "
+      << string_count
+      << " Value size: "
+      << string_value_size
+      << " Insert duration: "
+      << ( float ) insert_duration
+      << " Find duration: "
+      << ( float ) find_duration
+      << "\n";
+}
+
+#pragma endregion string_test
+
+#pragma region counting_test
+
+size_t const counting_key_count = 100000;
+double const counting_skew = 0.99;
+
+// распределение Ципфа на [0, n): ключ k выпадает с вероятностью ~ 1 / ( k + 1 )^s
+class ZipfDistribution
+{
+public:
+   ZipfDistribution( size_t const n, double const s )
+      : mCdf( n )
+   {
+      double sum = 0;
+      for ( size_t k = 0; k < n; ++k )
+      {
+         sum += 1.0 / std::pow( static_cast<double>( k + 1 ), s );
+         mCdf[k] = sum;
+      }
+
+      for ( auto cdf_it = mCdf.begin(); cdf_it != mCdf.end(); ++cdf_it )
+      {
+         *cdf_it /= sum;
+      }
+   }
+
+   template <typename TGenerator>
+   size_t operator()( TGenerator& generator ) const
+   {
+      auto const u = std::uniform_real_distribution<double>( 0.0, 1.0 )( generator );
+      auto const it = std::lower_bound( mCdf.begin(), mCdf.end(), u );
+      return it == mCdf.end() ? mCdf.size() - 1 : static_cast<size_t>( it - mCdf.begin() );
+   }
+
+private:
+   std::vector<double> mCdf;
+};
+
+enum class CountingMode
+{
+   FindUpdate,
+   Upsert,
+   Compute
+};
+
+// подсчёт частот ключей с перекосом: Find + Update/Insert против Upsert и Compute.
+// Find + Update не атомарен, поэтому часть приращений теряется
+template <typename TMap>
+void CountingTest( CountingMode const mode, char const* name )
+{
+   ZipfDistribution const zipf( counting_key_count, counting_skew );
+   size_t const thread_count = inserter_count;
+
+   TMap concurrent_map;
+   concurrent_map.Reserve( counting_key_count * 2 );
+
+   auto tic_start = TRI_microtime();
+
+   std::vector<std::thread> threads;
+   for ( size_t t = 0; t < thread_count; ++t )
+   {
+      threads.push_back( std::thread( [&, t]()
+      {
+         std::default_random_engine generator( static_cast<unsigned>( t ) );
+         for ( size_t i = 0; i < iter_count; ++i )
+         {
+            auto const key = static_cast<TKey>( zipf( generator ) );
+            switch ( mode )
+            {
+            case CountingMode::FindUpdate:
+               {
+                  TValue value;
+                  if ( concurrent_map.Find( key, value ) )
+                     concurrent_map.Update( TKeyValue( key, value + 1 ) );
+                  else if ( !concurrent_map.Insert( TKeyValue( key, 1 ) ) )
+                     concurrent_map.Update( TKeyValue( key, concurrent_map[key] + 1 ) );
+               }
+               break;
+            case CountingMode::Upsert:
+               concurrent_map.Upsert( key, 1, []( TValue& v ){ ++v; } );
+               break;
+            case CountingMode::Compute:
+               concurrent_map.Compute( key, []( TValue& v, bool ){ ++v; return true; } );
+               break;
+            }
+         }
+      } ) );
+   }
+
+   for ( auto it = threads.begin(); it != threads.end(); ++it )
+   {
+      it->join();
+   }
+
+   auto const duration = TRI_microtime() - tic_start;
+
+   size_t total = 0;
+   concurrent_map.ForEach( [&total]( TKeyValue const& kv ){ total += kv.second; } );
+
+   std::cout
+      << "Container: "
+      << name
+      << " Threads: "
+      << thread_count
+      << " Iterations: "
+      << iter_count
+      << " Duration: "
+      << ( float ) duration
+      << " Mops/s: "
+      << ( float ) ( thread_count * iter_count / duration / 1000000 )
+      << " Lost increments: "
+      << thread_count * iter_count - total
+      << "\n";
+}
+
+#pragma endregion counting_test
+
+#pragma region node_pool_test
+
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock, std::hash<TKey>, kvs::PooledListStorage> TPooledMap;
+
+// занятая процессом физическая память в мегабайтах
+double ResidentMegabytes()
+{
+#ifdef WIN32
+   PROCESS_MEMORY_COUNTERS counters;
+   if ( !GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+      return 0;
+   return counters.WorkingSetSize / ( 1024.0 * 1024.0 );
+#else
+   long pages = 0;
+   long resident = 0;
+   FILE* statm = fopen( "/proc/self/statm", "r" );
+   if ( statm == nullptr )
+      return 0;
+   if ( fscanf( statm, "%ld %ld", &pages, &resident ) != 2 )
+      resident = 0;
+   fclose( statm );
+   return resident * 4096.0 / ( 1024.0 * 1024.0 );
+#endif
+}
+
+// вставка без резервирования, затем удаление половины ключей и повторная вставка:
+// освобождённые узлы должны переиспользоваться. Память после Clear() показывает,
+// вернулись ли узлы. Свободную память аллокатор процессу обычно не отдаёт,
+// поэтому для честного сравнения каждую таблицу лучше мерить отдельным запуском
+template <typename TMap>
+void NodePoolTest( char const* name )
+{
+   auto const rss_start = ResidentMegabytes();
+
+   TMap concurrent_map;
+   auto const insert = [&]( size_t thread_idx )
+   {
+      TKey const first = static_cast<TKey>( thread_idx * iter_count );
+      for ( size_t i = 0; i < iter_count; ++i )
+      {
+         concurrent_map.Insert( TKeyValue( first + static_cast<TKey>( i ), static_cast<TValue>( i ) ) );
+      }
+   };
+
+   PrintWriteScaling( name, inserter_count, insert );
+   auto const rss_filled = ResidentMegabytes();
+
+   PrintWriteScaling( name, inserter_count, [&]( size_t thread_idx )
+   {
+      TKey const first = static_cast<TKey>( thread_idx * iter_count );
+      for ( size_t i = 0; i < iter_count; i += 2 )
+      {
+         concurrent_map.Erase( first + static_cast<TKey>( i ) );
+      }
+   } );
+
+   PrintWriteScaling( name, inserter_count, insert );
+   auto const rss_churned = ResidentMegabytes();
+
+   auto const size = concurrent_map.Size();
+   concurrent_map.Clear();
+
+   std::cout
+      << "Container: "
+      << name
+      << " Container size: "
+      << size
+      << " RSS MB (filled / after erase + reinsert / after Clear): "
+      << ( float ) ( rss_filled - rss_start )
+      << " / "
+      << ( float ) ( rss_churned - rss_start )
+      << " / "
+      << ( float ) ( ResidentMegabytes() - rss_start )
+      << "\n\n";
+}
+
+#pragma endregion node_pool_test
+
+#pragma region scan_test
+
+size_t const scan_size = 4000000;
+size_t const scan_count = 5;
+
+// подсчёт элементов полным обходом: ForEach под всеми блокировками против
+// ParallelCountIf на пуле из 1..max_scan_threads потоков. Во время обходов
+// один писатель обновляет ключи, сколько он успел - видно по Updates
+template <typename TMap>
+void ScanTest( size_t const max_scan_threads, char const* name )
+{
+   TMap concurrent_map( lock_count );
+   concurrent_map.Reserve( scan_size );
+   for ( size_t i = 0; i < scan_size; ++i )
+   {
+      concurrent_map.Insert( TKeyValue( static_cast<TKey>( i ), static_cast<TValue>( i ) ) );
+   }
+
+   auto const odd = []( TKeyValue const& kv )
+   {
+      return kv.second % 2 == 1;
+   };
+
+   auto const run = [&]( size_t const thread_count, std::function<size_t()> const& scan )
+   {
+      std::atomic<bool> stop( false );
+      std::atomic<size_t> updates( 0 );
+      std::thread writer( [&]()
+      {
+         std::default_random_engine generator( 42 );
+         std::uniform_int_distribution<size_t> distribution( 0, scan_size - 1 );
+         while ( !stop )
+         {
+            auto const key = static_cast<TKey>( distribution( generator ) );
+            concurrent_map.Update( TKeyValue( key, static_cast<TValue>( key ) ) );
+            ++updates;
+         }
+      } );
+
+      auto tic_start = TRI_microtime();
+      size_t found = 0;
+      for ( size_t i = 0; i < scan_count; ++i )
+      {
+         found += scan();
+      }
+      auto const duration = TRI_microtime() - tic_start;
+
+      stop = true;
+      writer.join();
+
+      std::cout
+         << "Container: "
+         << name
+         << " Scan threads: "
+         << thread_count
+         << " Container size: "
+         << concurrent_map.Size()
+         << " Duration per scan: "
+         << ( float ) ( duration / scan_count )
+         << " Found: "
+         << found / scan_count
+         << " Updates: "
+         << updates
+         << "\n";
+   };
+
+   run( 0, [&]() -> size_t
+   {
+      size_t count = 0;
+      concurrent_map.ForEach( [&]( TKeyValue const& kv )
+      {
+         if ( odd( kv ) )
+            ++count;
+      } );
+      return count;
+   } );
+
+   for ( size_t thread_count = 1; thread_count <= max_scan_threads; thread_count *= 2 )
+   {
+      // вызывающий поток тоже работает, поэтому в пуле на один поток меньше
+      kvs::ThreadPool pool( thread_count - 1 );
+      run( thread_count, [&]() -> size_t
+      {
+         return concurrent_map.ParallelCountIf( pool, odd );
+      } );
+   }
+
+   std::cout << "\n";
+}
+
+#pragma endregion scan_test
+
+#pragma region scan_latency_test
+
+enum class ScanMode
+{
+   ForEach,
+   Cursor
+};
+
+// задержки писателей, пока другой поток без остановки обходит таблицу:
+// ForEach держит все блокировки весь обход, Scan - одну блокировку на шаг
+template <typename TMap>
+void ScanLatencyTest( ScanMode const mode, char const* name )
+{
+   size_t const size = scan_size / 4;
+   TMap concurrent_map( lock_count );
+   for ( size_t i = 0; i < size; ++i )
+   {
+      concurrent_map.Insert( TKeyValue( static_cast<TKey>( i ), static_cast<TValue>( i ) ) );
+   }
+
+   std::atomic<bool> done( false );
+   std::atomic<size_t> scans( 0 );
+   std::thread scanner( [&]()
+   {
+      while ( !done )
+      {
+         size_t count = 0;
+         if ( mode == ScanMode::ForEach )
+         {
+            concurrent_map.ForEach( [&count]( TKeyValue const& ){ ++count; } );
+         }
+         else
+         {
+            typename TMap::ScanCursor cursor;
+            while ( !done && concurrent_map.Scan( cursor, [&count]( TKeyValue const& ){ ++count; } ) )
+            {
+            }
+         }
+         ++scans;
+      }
+   } );
+
+   std::vector<std::vector<double>> update_latencies( updater_count );
+   std::vector<std::thread> threads;
+   for ( size_t i = 0; i < updater_count; ++i )
+   {
+      threads.push_back( std::thread( [&, i]()
+      {
+         std::default_random_engine generator( static_cast<unsigned>( i ) );
+         std::uniform_int_distribution<size_t> distribution( 0, size - 1 );
+         auto& latencies = update_latencies[i];
+         latencies.reserve( iter_count );
+
+         for ( size_t j = 0; j < iter_count; ++j )
+         {
+            TKeyValue kv( static_cast<TKey>( distribution( generator ) ), static_cast<TValue>( j ) );
+            latencies.push_back( Measure( [&](){ concurrent_map.Update( kv ); } ) );
+         }
+      } ) );
+   }
+
+   for ( auto it = threads.begin(); it != threads.end(); ++it )
+   {
+      it->join();
+   }
+
+   done = true;
+   scanner.join();
+
+   std::cout
+      << "Container: "
+      << name
+      << " Updaters: "
+      << updater_count
+      << " Iterations: "
+      << iter_count
+      << " Container size: "
+      << concurrent_map.Size()
+      << " Scans: "
+      << scans
+      << "\n";
+
+   std::vector<double> updates;
+   for ( auto it = update_latencies.begin(); it != update_latencies.end(); ++it )
+      updates.insert( updates.end(), it->begin(), it->end() );
+   PrintLatency( "Update", updates );
+
+   std::cout << "\n";
+}
+
+#pragma endregion scan_latency_test
+
+#pragma region lock_free_read_test
+
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock, std::hash<TKey>, kvs::EpochListStorage> TEpochListMap;
+
+// читатели без блокировки вместе с писателями, которые заменяют и удаляют узлы:
+// скорость чтения и сколько памяти ждёт освобождения по эпохам
+template <typename TMap>
+void LockFreeReadTest( kvs::ReadMode const mode, size_t const writer_count, char const* name )
+{
+   TMap concurrent_map;
+   concurrent_map.SetReadMode( mode );
+   for ( long i = distrib_min; i <= distrib_max; i += 2 )
+   {
+      concurrent_map.Insert( TKeyValue( i, i ) );
+   }
+
+   size_t const reader_count = std::max<size_t>( std::thread::hardware_concurrency(), 2 );
+   std::atomic<bool> stop( false );
+
+   std::vector<std::thread> writers;
+   for ( size_t i = 0; i < writer_count; ++i )
+   {
+      writers.push_back( std::thread( [&concurrent_map, &stop]()
+      {
+         std::default_random_engine generator( std::random_device{}() );
+         std::uniform_int_distribution<int> distribution( distrib_min, distrib_max );
+         while ( !stop )
+         {
+            auto const key = distribution( generator );
+            if ( key % 4 == 0 )
+            {
+               concurrent_map.Erase( key );
+               concurrent_map.Insert( TKeyValue( key, key ) );
+            }
+            else
+            {
+               concurrent_map.Update( TKeyValue( key, key ) );
+            }
+         }
+      } ) );
+   }
+
+   auto tic_start = TRI_microtime();
+
+   std::vector<std::thread> readers;
+   for ( size_t i = 0; i < reader_count; ++i )
+   {
+      readers.push_back( std::thread( ReadFunc<TMap>, std::ref( concurrent_map ), iter_count ) );
+   }
+
+   for ( auto it = readers.begin(); it != readers.end(); ++it )
+   {
+      it->join();
+   }
+
+   auto const duration = TRI_microtime() - tic_start;
+
+   stop = true;
+   for ( auto it = writers.begin(); it != writers.end(); ++it )
+   {
+      it->join();
+   }
+
+   auto const retired = concurrent_map.GetRetiredMemory();
+   std::cout
+      << "Container: "
+      << name
+      << " Readers: "
+      << reader_count
+      << " Writers: "
+      << writer_count
+      << " Read Mops/s: "
+      << ( float ) ( reader_count * iter_count / duration / 1000000 )
+      << " Retired now: "
+      << retired.count
+      << " (" << retired.bytes / 1024 << " KB)"
+      << " Retired peak: "
+      << retired.peakCount
+      << " (" << retired.peakBytes / 1024 << " KB)"
+      << "\n";
+}
+
+#pragma endregion lock_free_read_test
+
+#pragma region lock_policy_test
+
+template <size_t pLockCount, typename TLock>
+void LockPolicyTest( char const* lock_name )
+{
+   std::string const name = std::string( "ThreadsafeHashTable<" ) + lock_name + "> Locks: " + std::to_string( pLockCount );
+   ConcurrentMapTest<kvs::ThreadsafeHashTable<TKey, TValue, pLockCount, TLock>>( name.c_str() );
+}
+
+// все блокировки, доступные на этой платформе. Вне Windows SlimReaderWriterLock -
+// это FutexSharedMutex (Linux) или PthreadSharedMutex, поэтому они не повторяются
+template <size_t pLockCount>
+void LockPolicyTests()
+{
+   LockPolicyTest<pLockCount, kvs::SlimReaderWriterLock>( "SlimReaderWriterLock" );
+   LockPolicyTest<pLockCount, boost::shared_mutex>( "boost::shared_mutex" );
+   LockPolicyTest<pLockCount, std::shared_mutex>( "std::shared_mutex" );
+#if defined( __linux__ )
+   LockPolicyTest<pLockCount, kvs::PthreadSharedMutex>( "PthreadSharedMutex" );
+#endif
+   LockPolicyTest<pLockCount, kvs::SpinSharedMutex>( "SpinSharedMutex" );
+   LockPolicyTest<pLockCount, kvs::TicketMutex>( "TicketMutex" );
+}
+
+#pragma endregion lock_policy_test
+
+#pragma region read_mostly_test
+
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, std::shared_mutex> TStdSharedMutexMap;
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::BravoSharedMutex<kvs::SlimReaderWriterLock>> TBravoMap;
+
+// доля записей в смешанной нагрузке, в процентах
+size_t const read_mostly_write_percent = 5;
+
+// 95% Find и 5% Update из заполненной таблицы, число потоков от 1 до max_reader_count
+template <typename TMap>
+void ReadMostlyTest( size_t const locks, char const* name )
+{
+   TMap concurrent_map( locks );
+   for ( long i = distrib_min; i <= distrib_max; i += 2 )
+   {
+      concurrent_map.Insert( TKeyValue( i, i ) );
+   }
+
+   for ( size_t thread_count = 1; thread_count <= max_reader_count; thread_count *= 2 )
+   {
+      auto tic_start = TRI_microtime();
+
+      std::vector<std::thread> threads;
+      for ( size_t i = 0; i < thread_count; ++i )
+      {
+         threads.push_back( std::thread( [&concurrent_map]()
+         {
+            std::default_random_engine generator( std::random_device{}() );
+            std::uniform_int_distribution<int> distribution( distrib_min, distrib_max );
+            for ( size_t n = 0; n < iter_count; ++n )
+            {
+               auto const key = distribution( generator );
+               if ( n % 100 < read_mostly_write_percent )
+               {
+                  concurrent_map.Update( TKeyValue( key, key ) );
+               }
+               else
+               {
+                  TValue current;
+                  concurrent_map.Find( key, current );
+               }
+            }
+         } ) );
+      }
+
+      for ( auto it = threads.begin(); it != threads.end(); ++it )
+      {
+         it->join();
+      }
+
+      auto const duration = TRI_microtime() - tic_start;
+
+      std::cout
+         << "Container: "
+         << name
+         << " Locks: "
+         << locks
+         << " Threads: "
+         << thread_count
+         << " Iterations: "
+         << iter_count
+         << " Duration: "
+         << ( float ) duration
+         << " Mops/s: "
+         << ( float ) ( thread_count * iter_count / duration / 1000000 )
+         << "\n";
+   }
+
+   std::cout << "\n";
+}
+
+#pragma endregion read_mostly_test
+
+#pragma region indexing_test
+
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock, std::hash<TKey>, kvs::ListStorage, kvs::StripeLayout::Padded, kvs::NoStats, kvs::PowerOfTwoIndexing> TPowerOfTwoMap;
+
+enum class KeyPattern
+{
+   Sequential,
+   // у ключей с шагом indexing_stride совпадают младшие биты тождественного std::hash<int>
+   Strided,
+   Random
+};
+
+int const indexing_stride = 1024;
+
+std::vector<TKey> MakeIndexingKeys( KeyPattern const pattern )
+{
+   std::vector<TKey> keys( iter_count );
+   std::mt19937 generator( 12345 );
+   std::uniform_int_distribution<TKey> distribution;
+   for ( size_t i = 0; i < keys.size(); ++i )
+   {
+      if ( pattern == KeyPattern::Sequential )
+         keys[i] = static_cast<TKey>( i );
+      else if ( pattern == KeyPattern::Strided )
+         keys[i] = static_cast<TKey>( i * indexing_stride );
+      else
+         keys[i] = distribution( generator );
+   }
+   return keys;
+}
+
+// inserter_count потоков вставляют свои части ключей, затем ищут их же.
+// Длина цепочек - из GetStats() после вставки
+template <typename TMap>
+void IndexingTest( std::vector<TKey> const& keys, char const* pattern_name, char const* name )
+{
+   TMap concurrent_map;
+
+   auto const run = [&keys]( std::function<void( size_t, size_t )> const& f )
+   {
+      auto const tic_start = TRI_microtime();
+
+      std::vector<std::thread> threads;
+      auto const part = keys.size() / inserter_count;
+      for ( size_t i = 0; i < inserter_count; ++i )
+      {
+         threads.push_back( std::thread( f, i * part, i + 1 == inserter_count ? keys.size() : ( i + 1 ) * part ) );
+      }
+
+      for ( auto it = threads.begin(); it != threads.end(); ++it )
+      {
+         it->join();
+      }
+
+      return TRI_microtime() - tic_start;
+   };
+
+   auto const insert_duration = run( [&]( size_t const first, size_t const last )
+   {
+      for ( auto idx = first; idx < last; ++idx )
+      {
+         concurrent_map.Insert( TKeyValue( keys[idx], keys[idx] ) );
+      }
+   } );
+
+   auto const find_duration = run( [&]( size_t const first, size_t const last )
+   {
+      size_t hits = 0;
+      for ( auto idx = first; idx < last; ++idx )
+      {
+         TValue current;
+         if ( concurrent_map.Find( keys[idx], current ) )
+            ++hits;
+      }
+      read_hits += hits;
+   } );
+
+   auto const stats = concurrent_map.GetStats();
+
+   std::cout
+      << "Container: "
+      << name
+      << " Keys: "
+      << pattern_name
+      << " Threads: "
+      << inserter_count
+      << " Insert Mops/s: "
+      << ( float ) ( keys.size() / insert_duration / 1000000 )
+      << " Find Mops/s: "
+      << ( float ) ( keys.size() / find_duration / 1000000 )
+      << " Buckets: "
+      << stats.bucketCount
+      << " Max chain: "
+      << stats.maxChainLength
+      << "\n";
+}
+
+#pragma endregion indexing_test
+
+#pragma region hashed_strings_test
+
+// длинные ключи с общим префиксом, как пути объектов
+size_t const hashed_key_size = 128;
+
+typedef kvs::ThreadsafeHashTable<std::string, TValue, lock_count, kvs::SlimReaderWriterLock, kvs::StringHash> TStringKeyMap;
+typedef kvs::ThreadsafeHashTable<std::string, TValue, lock_count, kvs::SlimReaderWriterLock, kvs::StringHash, kvs::HashedListStorage> THashedStringKeyMap;
+
+std::string MakeLongKey( size_t const i )
+{
+   auto const suffix = std::to_string( i );
+   std::string key( hashed_key_size - suffix.size(), '/' );
+   key.replace( 0, 16, "tenant/objects//" );
+   return key + suffix;
+}
+
+// вставка с рехэшами, отдельный рехэш всей таблицы, поиск имеющихся и отсутствующих ключей
+template <typename TMap>
+void HashedStringsTest( char const* name )
+{
+   std::vector<std::string> keys;
+   std::vector<std::string> missing;
+   for ( size_t i = 0; i < string_count; ++i )
+   {
+      keys.push_back( MakeLongKey( i ) );
+      missing.push_back( MakeLongKey( i + string_count ) );
+   }
+
+   TMap concurrent_map;
+
+   auto tic_start = TRI_microtime();
+   for ( size_t i = 0; i < string_count; ++i )
+   {
+      concurrent_map.TryEmplace( keys[i], static_cast<TValue>( i ) );
+   }
+   auto const insert_duration = TRI_microtime() - tic_start;
+
+   // рехэш под всеми блокировками: вчетверо больше ячеек
+   tic_start = TRI_microtime();
+   concurrent_map.Reserve( concurrent_map.GetStats().bucketCount * 4 );
+   auto const rehash_duration = TRI_microtime() - tic_start;
+
+   size_t hits = 0;
+   tic_start = TRI_microtime();
+   for ( size_t i = 0; i < string_count; ++i )
+   {
+      TValue current;
+      if ( concurrent_map.Find( keys[i], current ) )
+         ++hits;
+   }
+   auto const find_duration = TRI_microtime() - tic_start;
+
+   tic_start = TRI_microtime();
+   for ( size_t i = 0; i < string_count; ++i )
+   {
+      TValue current;
+      if ( concurrent_map.Find( missing[i], current ) )
+         ++hits;
+   }
+   auto const miss_duration = TRI_microtime() - tic_start;
+   read_hits += hits;
+
+   std::cout
+      << "Container: "
+      << name
+      << " Count: "
+      << string_count
+      << " Key size: "
+      << hashed_key_size
+      << " Insert duration: "
+      << ( float ) insert_duration
+      << " Rehash duration: "
+      << ( float ) rehash_duration
+      << " Find duration: "
+      << ( float ) find_duration
+      << " Miss duration: "
+      << ( float ) miss_duration
+      << "\n";
+}
+
+#pragma endregion hashed_strings_test
+
+#pragma region swiss_lookup_test
+
+typedef kvs::ThreadsafeHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock, std::hash<TKey>, kvs::SwissStorage> TSwissMap;
+
+// потоки поиска: 1, 4 и 16
+size_t const swiss_thread_counts[] = { 1, 4, 16 };
+
+// поиск имеющихся (чётных) и отсутствующих (нечётных) ключей в таблице из iter_count элементов
+template <typename TMap>
+void SwissLookupTest( kvs::ReadMode const mode, char const* name )
+{
+   TMap concurrent_map;
+   concurrent_map.SetReadMode( mode );
+   for ( size_t i = 0; i < iter_count; ++i )
+   {
+      concurrent_map.Insert( TKeyValue( static_cast<TKey>( i * 2 ), static_cast<TValue>( i ) ) );
+   }
+
+   for ( auto count_it = std::begin( swiss_thread_counts ); count_it != std::end( swiss_thread_counts ); ++count_it )
+   {
+      auto const thread_count = *count_it;
+      double durations[2];
+      for ( int miss = 0; miss < 2; ++miss )
+      {
+         auto const tic_start = TRI_microtime();
+
+         std::vector<std::thread> threads;
+         for ( size_t t = 0; t < thread_count; ++t )
+         {
+            threads.push_back( std::thread( [&concurrent_map, miss, t]()
+            {
+               std::mt19937 generator( static_cast<unsigned>( t ) );
+               std::uniform_int_distribution<size_t> distribution( 0, iter_count - 1 );
+               size_t hits = 0;
+               for ( size_t n = 0; n < iter_count; ++n )
+               {
+                  TValue current;
+                  if ( concurrent_map.Find( static_cast<TKey>( distribution( generator ) * 2 + miss ), current ) )
+                     ++hits;
+               }
+               read_hits += hits;
+            } ) );
+         }
+
+         for ( auto it = threads.begin(); it != threads.end(); ++it )
+         {
+            it->join();
+         }
+
+         durations[miss] = TRI_microtime() - tic_start;
+      }
+
+      std::cout
+         << "Container: "
+         << name
+         << " Threads: "
+         << thread_count
+         << " Hit Mops/s: "
+         << ( float ) ( thread_count * iter_count / durations[0] / 1000000 )
+         << " Miss Mops/s: "
+         << ( float ) ( thread_count * iter_count / durations[1] / 1000000 )
+         << "\n";
+   }
+
+   std::cout << "\n";
+}
+
+#pragma endregion swiss_lookup_test
+
+#pragma region shrink_test
+
+size_t const shrink_size = 4000000;
+size_t const shrink_scan_count = 10;
+
+enum class ShrinkMode
+{
+   // политика по умолчанию: массив ячеек остаётся максимальным
+   None,
+   // minLoadFactor: таблица сжимается сама по ходу удалений
+   Auto,
+   // ShrinkToFit() после удалений
+   Explicit
+};
+
+// заполнение, удаление 99% ключей по одному (спад нагрузки), затем полные обходы ForEach и Clear.
+// Память массива ячеек - количество ячеек * размер ячейки, RSS - вся память процесса
+template <typename TMap>
+void ShrinkTest( ShrinkMode const mode, char const* name )
+{
+   auto const rss_start = ResidentMegabytes();
+
+   TMap concurrent_map;
+   if ( mode == ShrinkMode::Auto )
+   {
+      kvs::GrowthPolicy policy;
+      policy.minLoadFactor = 0.1f;
+      concurrent_map.SetGrowthPolicy( policy );
+   }
+
+   for ( size_t i = 0; i < shrink_size; ++i )
+   {
+      concurrent_map.Insert( TKeyValue( static_cast<TKey>( i ), static_cast<TValue>( i ) ) );
+   }
+   auto const peak_buckets = concurrent_map.GetStats().bucketCount;
+
+   auto tic_start = TRI_microtime();
+   for ( size_t i = 0; i < shrink_size; ++i )
+   {
+      if ( i % 100 != 0 )
+         concurrent_map.Erase( static_cast<TKey>( i ) );
+   }
+   if ( mode == ShrinkMode::Explicit )
+      concurrent_map.ShrinkToFit();
+   auto const erase_duration = TRI_microtime() - tic_start;
+
+   auto const stats = concurrent_map.GetStats();
+   auto const rss_erased = ResidentMegabytes();
+
+   size_t visited = 0;
+   tic_start = TRI_microtime();
+   for ( size_t i = 0; i < shrink_scan_count; ++i )
+   {
+      concurrent_map.ForEach( [&visited]( TKeyValue const& ){ ++visited; } );
+   }
+   auto const scan_duration = TRI_microtime() - tic_start;
+
+   tic_start = TRI_microtime();
+   concurrent_map.Clear();
+   auto const clear_duration = TRI_microtime() - tic_start;
+
+   std::cout
+      << "Container: "
+      << name
+      << " Size: "
+      << stats.size
+      << " Buckets (peak / after erase): "
+      << peak_buckets
+      << " / "
+      << stats.bucketCount
+      << " Bucket array MB (peak / after erase): "
+      << ( float ) ( peak_buckets * sizeof( typename TMap::TBucketSlot ) / ( 1024.0 * 1024.0 ) )
+      << " / "
+      << ( float ) ( stats.bucketCount * sizeof( typename TMap::TBucketSlot ) / ( 1024.0 * 1024.0 ) )
+      << " RSS MB after erase: "
+      << ( float ) ( rss_erased - rss_start )
+      << " Erase duration: "
+      << ( float ) erase_duration
+      << " ForEach duration: "
+      << ( float ) ( scan_duration / shrink_scan_count )
+      << " Clear duration: "
+      << ( float ) clear_duration
+      << " Visited: "
+      << visited / shrink_scan_count
+      << "\n";
+}
+
+#pragma endregion shrink_test
+
+#pragma region snapshot_test
+
+size_t const snapshot_size = 4000000;
+char const* const snapshot_path = "ThreadsafeHashTable.snapshot";
+
+double FileGigabytes( char const* path )
+{
+   std::ifstream file( path, std::ios::binary | std::ios::ate );
+   return static_cast<double>( file.tellg() ) / ( 1024.0 * 1024.0 * 1024.0 );
+}
+
+// запись снимка вместе с писателем: сколько обновлений он успел и самая долгая пауза обновления.
+// Затем загрузка снимка в новую таблицу против вставки тех же пар по одной
+template <typename TMap>
+void SnapshotTest( char const* name )
+{
+   TMap source;
+   for ( size_t i = 0; i < snapshot_size; ++i )
+   {
+      source.Insert( TKeyValue( static_cast<TKey>( i ), static_cast<TValue>( i ) ) );
+   }
+
+   std::atomic<bool> stop( false );
+   std::atomic<size_t> updates( 0 );
+   double max_pause = 0;
+   std::thread writer( [&]()
+   {
+      std::default_random_engine generator( 42 );
+      std::uniform_int_distribution<size_t> distribution( 0, snapshot_size - 1 );
+      while ( !stop )
+      {
+         auto const key = static_cast<TKey>( distribution( generator ) );
+         auto const tic = TRI_microtime();
+         source.Update( TKeyValue( key, static_cast<TValue>( key + 1 ) ) );
+         max_pause = std::max( max_pause, TRI_microtime() - tic );
+         ++updates;
+      }
+   } );
+
+   auto tic_start = TRI_microtime();
+   auto const saved = source.SaveSnapshot( snapshot_path );
+   auto const save_duration = TRI_microtime() - tic_start;
+   stop = true;
+   writer.join();
+
+   auto const gigabytes = FileGigabytes( snapshot_path );
+
+   TMap loaded;
+   tic_start = TRI_microtime();
+   auto const complete = loaded.LoadSnapshot( snapshot_path );
+   auto const load_duration = TRI_microtime() - tic_start;
+
+   // прогрев по-старому: те же пары из снимка вставляются по одной
+   TMap inserted;
+   kvs::SnapshotReader<TKey, TValue> reader( snapshot_path );
+   tic_start = TRI_microtime();
+   while ( reader.NextBlock() )
+   {
+      for ( size_t pos = 0; pos < reader.BlockSize(); ++pos )
+      {
+         TKeyValue kv;
+         reader.Record( pos, kv.first, kv.second );
+         inserted.Insert( kv );
+      }
+   }
+   auto const insert_duration = TRI_microtime() - tic_start;
+
+   std::remove( snapshot_path );
+
+   std::cout
+      << "Container: "
+      << name
+      << " Size: "
+      << loaded.Size()
+      << ( saved && complete ? "" : " (snapshot failed)" )
+      << " Snapshot MB: "
+      << ( float ) ( gigabytes * 1024 )
+      << " Save duration: "
+      << ( float ) save_duration
+      << " Updates during save: "
+      << updates
+      << " Max update pause: "
+      << ( float ) max_pause
+      << " Load GB/s: "
+      << ( float ) ( gigabytes / load_duration )
+      << " Insert-by-one GB/s: "
+      << ( float ) ( gigabytes / insert_duration )
+      << "\n";
+}
+
+#pragma endregion snapshot_test
+
+#pragma region shared_memory_test
+
+size_t const shared_size = 4000000;
+size_t const shared_lookups = 10000000;
+char const* const shared_name = "ThreadsafeHashTableBenchmark";
+
+typedef kvs::SharedMemoryHashTable<TKey, TValue, lock_count, kvs::SpinSharedMutex> TSharedMemoryMap;
+typedef kvs::SharedMemoryHashTable<TKey, TValue, lock_count, kvs::InterprocessSharedMutex> TInterprocessMemoryMap;
+
+// процесс-читатель: подключается к региону, который заполнил родитель, и ищет случайные ключи
+template <typename TMap>
+int SharedReaderMain( int reader_id )
+{
+   TMap map( kvs::SharedMode::Open, shared_name );
+
+   std::default_random_engine generator( reader_id );
+   std::uniform_int_distribution<size_t> distribution( 0, shared_size - 1 );
+   size_t hits = 0;
+
+   auto const tic_start = TRI_microtime();
+   for ( size_t i = 0; i < shared_lookups; ++i )
+   {
+      TValue value;
+      if ( map.Find( static_cast<TKey>( distribution( generator ) ), value ) )
+         ++hits;
+   }
+   auto const duration = TRI_microtime() - tic_start;
+
+   std::cout
+      << "   Reader process: "
+      << reader_id
+      << " Hits: "
+      << hits
+      << " Mops/s: "
+      << ( float ) ( shared_lookups / duration / 1e6 )
+      << "\n";
+   return hits == shared_lookups ? 0 : 1;
+}
+
+// память обычной таблицы с теми же данными, которую без общего региона держал бы каждый процесс
+double PrivateCopyMegabytes()
+{
+   auto const rss_start = ResidentMegabytes();
+   TConcurrentMap copy;
+   for ( size_t i = 0; i < shared_size; ++i )
+   {
+      copy.Insert( TKeyValue( static_cast<TKey>( i ), static_cast<TValue>( i ) ) );
+   }
+   return ResidentMegabytes() - rss_start;
+}
+
+// родитель заполняет регион и обновляет его, пока process_count процессов-читателей ищут в нём.
+// lock_name передаётся читателям, чтобы они открыли регион с той же блокировкой
+template <typename TMap>
+void SharedMemoryTest( std::string const& self, size_t process_count, std::string const& lock_name, double private_megabytes )
+{
+   TMap map( kvs::SharedMode::Create, shared_name, shared_size );
+   auto tic_start = TRI_microtime();
+   for ( size_t i = 0; i < shared_size; ++i )
+   {
+      map.Insert( TKeyValue( static_cast<TKey>( i ), static_cast<TValue>( i ) ) );
+   }
+   auto const fill_duration = TRI_microtime() - tic_start;
+   auto const shared_megabytes = map.RegionSize() / ( 1024.0 * 1024.0 );
+
+   std::atomic<bool> stop( false );
+   std::atomic<size_t> updates( 0 );
+   std::thread writer( [&]()
+   {
+      std::default_random_engine generator( 42 );
+      std::uniform_int_distribution<size_t> distribution( 0, shared_size - 1 );
+      while ( !stop )
+      {
+         auto const key = static_cast<TKey>( distribution( generator ) );
+         map.Update( TKeyValue( key, static_cast<TValue>( key + 1 ) ) );
+         ++updates;
+      }
+   } );
+
+
+   std::atomic<size_t> failed( 0 );
+   std::vector<std::thread> launchers;
+   tic_start = TRI_microtime();
+   for ( size_t idx = 0; idx < process_count; ++idx )
+   {
+      launchers.emplace_back( [&self, &lock_name, &failed, idx]()
+      {
+         auto const command = "\"" + self + "\" shared-reader " + lock_name + " " + std::to_string( idx );
+         if ( std::system( command.c_str() ) != 0 )
+            ++failed;
+      } );
+   }
+   for ( auto it = launchers.begin(); it != launchers.end(); ++it )
+   {
+      it->join();
+   }
+   auto const duration = TRI_microtime() - tic_start;
+
+   stop = true;
+   writer.join();
+   TMap::Remove( shared_name );
+
+   std::cout
+      << "Container: SharedMemoryHashTable<"
+      << lock_name
+      << "> Processes: "
+      << process_count
+      << " Size: "
+      << map.Size()
+      << ( failed == 0 ? "" : " (reader failed)" )
+      << " Fill duration: "
+      << ( float ) fill_duration
+      << " Total Mops/s (incl. process start): "
+      << ( float ) ( process_count * shared_lookups / duration / 1e6 )
+      << " Updates: "
+      << updates
+      << " Region MB: "
+      << ( float ) shared_megabytes
+      << " Per-process copies MB: "
+      << ( float ) ( private_megabytes * ( process_count + 1 ) )
+      << "\n";
+}
+
+#pragma endregion shared_memory_test
+
+#pragma region cache_test
+
+size_t const cache_key_count = 1000000;
+size_t const cache_thread_count = 4;
+size_t const cache_ops = 2000000;
+
+typedef kvs::CacheHashTable<TKey, TValue, lock_count, kvs::SlimReaderWriterLock> TCacheMap;
+// значение - номер вставки, по нему уборщик удаляет самые старые элементы
+typedef kvs::ThreadsafeHashTable<TKey, uint64_t, lock_count, kvs::SlimReaderWriterLock> TSweptMap;
+
+// запросы потоков по закону Ципфа: номер записи 0 самый частый
+std::vector<std::vector<TKey>> MakeCacheTrace()
+{
+   workload::ZipfianGenerator const zipfian( cache_key_count, 0.99 );
+   std::vector<std::vector<TKey>> trace( cache_thread_count );
+   for ( size_t t = 0; t < cache_thread_count; ++t )
+   {
+      std::default_random_engine generator( static_cast<unsigned>( t ) );
+      trace[t].reserve( cache_ops );
+      for ( size_t i = 0; i < cache_ops; ++i )
+      {
+         trace[t].push_back( static_cast<TKey>( workload::KeyOf( zipfian.Next( generator ) ) ) );
+      }
+   }
+   return trace;
+}
+
+void PrintCacheResult( char const* name, size_t const capacity, size_t const hits, double const duration, size_t const peak_size )
+{
+   auto const ops = cache_thread_count * cache_ops;
+   std::cout
+      << "Container: "
+      << name
+      << " Capacity: "
+      << capacity
+      << " Hit rate: "
+      << ( float ) ( 100.0 * hits / ops )
+      << "% Mops/s: "
+      << ( float ) ( ops / duration / 1e6 )
+      << " Peak size: "
+      << peak_size
+      << "\n";
+}
+
+// промах - чтение из медленного хранилища, здесь мгновенное, и вставка в кэш,
+// который сам вытесняет элементы своей полосы
+void CacheTest( std::vector<std::vector<TKey>> const& trace, size_t const capacity )
+{
+   TCacheMap cache( capacity );
+   std::atomic<size_t> hits( 0 );
+   std::vector<std::thread> threads;
+
+   auto const tic_start = TRI_microtime();
+   for ( size_t t = 0; t < cache_thread_count; ++t )
+   {
+      threads.emplace_back( [&cache, &hits, &trace, t]()
+      {
+         size_t local_hits = 0;
+         for ( auto key_it = trace[t].begin(); key_it != trace[t].end(); ++key_it )
+         {
+            TValue value;
+            if ( cache.Find( *key_it, value ) )
+               ++local_hits;
+            else
+               cache.Insert( TKeyValue( *key_it, *key_it ) );
+         }
+         hits += local_hits;
+      } );
+   }
+   for ( auto it = threads.begin(); it != threads.end(); ++it )
+   {
+      it->join();
+   }
+   auto const duration = TRI_microtime() - tic_start;
+
+   PrintCacheResult( "CacheHashTable (CLOCK)", capacity, hits, duration, cache.Size() );
+}
+
+// таблица без предела и внешний уборщик: когда размер превысил предел, он собирает
+// самые старые вставки обходом под всеми блокировками и удаляет их, оставляя 90% предела.
+// EraseIf таблицы удаляет только первый подходящий элемент, поэтому удаление - MultiErase
+void SweeperTest( std::vector<std::vector<TKey>> const& trace, size_t const capacity )
+{
+   TSweptMap map;
+   std::atomic<size_t> hits( 0 );
+   std::atomic<uint64_t> inserted( 0 );
+   std::atomic<bool> stop( false );
+   size_t peak_size = 0;
+
+   std::thread sweeper( [&]()
+   {
+      std::vector<TKey> stale;
+      std::vector<char> erased;
+      while ( !stop )
+      {
+         auto const size = map.Size();
+         peak_size = std::max( peak_size, size );
+         if ( size > capacity )
+         {
+            auto const cutoff = inserted.load() - capacity * 9 / 10;
+            stale.clear();
+            map.ForEach( [&stale, cutoff]( std::pair<TKey, uint64_t> const& kv )
+            {
+               if ( kv.second < cutoff )
+                  stale.push_back( kv.first );
+            } );
+            map.MultiErase( stale, erased );
+         }
+         std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+      }
+   } );
+
+   std::vector<std::thread> threads;
+   auto const tic_start = TRI_microtime();
+   for ( size_t t = 0; t < cache_thread_count; ++t )
+   {
+      threads.emplace_back( [&map, &hits, &inserted, &trace, t]()
+      {
+         size_t local_hits = 0;
+         for ( auto key_it = trace[t].begin(); key_it != trace[t].end(); ++key_it )
+         {
+            uint64_t value;
+            if ( map.Find( *key_it, value ) )
+               ++local_hits;
+            else
+               map.Insert( std::make_pair( *key_it, inserted++ ) );
+         }
+         hits += local_hits;
+      } );
+   }
+   for ( auto it = threads.begin(); it != threads.end(); ++it )
+   {
+      it->join();
+   }
+   auto const duration = TRI_microtime() - tic_start;
+
+   stop = true;
+   sweeper.join();
+   peak_size = std::max( peak_size, map.Size() );
+
+   PrintCacheResult( "ThreadsafeHashTable + sweeper", capacity, hits, duration, peak_size );
+}
+
+#pragma endregion cache_test
+
+int main( int argc, char* argv[] )
+{
+   std::string const scenario = argc > 1 ? argv[1] : "";
+
+   // настраиваемая нагрузка, см. Workload.h и "workload --help"
+   if ( scenario == "workload" )
+      return workload::Main( argc - 2, argv + 2 );
+
+   if ( scenario == "storage" )
+   {
+      // одна и та же нагрузка на разных способах хранения коллизий
+      ConcurrentMapTest<TConcurrentMap>( "ThreadsafeHashTable<ListStorage>" );
+      ConcurrentMapTest<TLinearFlatMap>( "ThreadsafeHashTable<FlatStorage<Linear>>" );
+      ConcurrentMapTest<TRobinHoodFlatMap>( "ThreadsafeHashTable<FlatStorage<RobinHood>>" );
+      return 0;
+   }
+
+   if ( scenario == "rehash" )
+   {
+      // задержки операций, пока таблица растёт
+      RehashLatencyTest<TConcurrentMap>( kvs::RehashMode::StopTheWorld, false, "ThreadsafeHashTable (stop-the-world rehash)" );
+      RehashLatencyTest<TConcurrentMap>( kvs::RehashMode::Incremental, false, "ThreadsafeHashTable (incremental rehash)" );
+      RehashLatencyTest<TConcurrentMap>( kvs::RehashMode::Incremental, true, "ThreadsafeHashTable (incremental rehash + helper thread)" );
+      return 0;
+   }
+
+   if ( scenario == "read-scaling" )
+   {
+      ReadScalingTest<TSharedMutexMap>( kvs::ReadMode::Locked, "ThreadsafeHashTable<boost::shared_mutex>" );
+      ReadScalingTest<TConcurrentMap>( kvs::ReadMode::Locked, "ThreadsafeHashTable<SlimReaderWriterLock>" );
+      ReadScalingTest<TRobinHoodFlatMap>( kvs::ReadMode::Locked, "ThreadsafeHashTable<SlimReaderWriterLock, FlatStorage>" );
+      ReadScalingTest<TRobinHoodFlatMap>( kvs::ReadMode::Optimistic, "ThreadsafeHashTable<SlimReaderWriterLock, FlatStorage> (optimistic reads)" );
+      return 0;
+   }
+
+   if ( scenario == "write-scaling" )
+   {
+      // каждая вставка и удаление меняют счётчик размера
+      CounterScalingTest();
+      WriteScalingTest<TConcurrentMap>( "ThreadsafeHashTable<SlimReaderWriterLock>" );
+      WriteScalingTest<TRobinHoodFlatMap>( "ThreadsafeHashTable<SlimReaderWriterLock, FlatStorage>" );
+      return 0;
+   }
+
+   if ( scenario == "lock-growth" )
+   {
+      LockGrowthTest<TConcurrentMap>( 11, 11, "ThreadsafeHashTable (11 locks)" );
+      LockGrowthTest<TConcurrentMap>( 256, 256, "ThreadsafeHashTable (256 locks)" );
+      LockGrowthTest<TConcurrentMap>( 11, 11 * 1024, "ThreadsafeHashTable (11 locks growing with the table)" );
+      return 0;
+   }
+
+   if ( scenario == "stripe-layout" )
+   {
+      StripeLayoutTest<TPackedMap>( "ThreadsafeHashTable<SlimReaderWriterLock> (packed stripes)" );
+      StripeLayoutTest<TConcurrentMap>( "ThreadsafeHashTable<SlimReaderWriterLock> (padded stripes)" );
+      StripeLayoutTest<TPackedFlatMap>( "ThreadsafeHashTable<SlimReaderWriterLock, FlatStorage> (packed stripes)" );
+      StripeLayoutTest<TRobinHoodFlatMap>( "ThreadsafeHashTable<SlimReaderWriterLock, FlatStorage> (padded stripes)" );
+      return 0;
+   }
+
+   if ( scenario == "batch" )
+   {
+      // пакетные MultiInsert/MultiFind против вставки и поиска по одному ключу
+      BatchTest<TConcurrentMap>( 0, "ThreadsafeHashTable<SlimReaderWriterLock>" );
+      for ( auto size_it = std::begin( batch_sizes ); size_it != std::end( batch_sizes ); ++size_it )
+      {
+         BatchTest<TConcurrentMap>( *size_it, "ThreadsafeHashTable<SlimReaderWriterLock>" );
+      }
+
+      BatchTest<TRobinHoodFlatMap>( 0, "ThreadsafeHashTable<SlimReaderWriterLock, FlatStorage>" );
+      for ( auto size_it = std::begin( batch_sizes ); size_it != std::end( batch_sizes ); ++size_it )
+      {
+         BatchTest<TRobinHoodFlatMap>( *size_it, "ThreadsafeHashTable<SlimReaderWriterLock, FlatStorage>" );
+      }
+      return 0;
+   }
+
+   if ( scenario == "strings" )
+   {
+      StringTest( false );
+      StringTest( true );
+      return 0;
+   }
+
+   if ( scenario == "counting" )
+   {
+      CountingTest<TConcurrentMap>( CountingMode::FindUpdate, "ThreadsafeHashTable (Find + Update)" );
+      CountingTest<TConcurrentMap>( CountingMode::Upsert, "ThreadsafeHashTable (Upsert)" );
+      CountingTest<TConcurrentMap>( CountingMode::Compute, "ThreadsafeHashTable (Compute)" );
+      CountingTest<TRobinHoodFlatMap>( CountingMode::FindUpdate, "ThreadsafeHashTable<FlatStorage> (Find + Update)" );
+      CountingTest<TRobinHoodFlatMap>( CountingMode::Upsert, "ThreadsafeHashTable<FlatStorage> (Upsert)" );
+      return 0;
+   }
+
+   if ( scenario == "pool" )
+   {
+      // вставки: три строки на таблицу - вставка, удаление половины, повторная вставка.
+      // "pool list" или "pool pooled" запускает одну таблицу, чтобы RSS не смешивался
+      std::string const storage = argc > 2 ? argv[2] : "";
+      if ( storage != "pooled" )
+         NodePoolTest<TConcurrentMap>( "ThreadsafeHashTable<ListStorage>" );
+      if ( storage != "list" )
+         NodePoolTest<TPooledMap>( "ThreadsafeHashTable<PooledListStorage>" );
+      return 0;
+   }
+
+   if ( scenario == "scan" )
+   {
+      // Scan threads 0 - ForEach под всеми блокировками в одном потоке
+      size_t const max_scan_threads = std::max<size_t>( std::thread::hardware_concurrency(), 1 );
+      ScanTest<TConcurrentMap>( max_scan_threads, "ThreadsafeHashTable<SlimReaderWriterLock>" );
+      ScanTest<TRobinHoodFlatMap>( max_scan_threads, "ThreadsafeHashTable<SlimReaderWriterLock, FlatStorage>" );
+      return 0;
+   }
+
+   if ( scenario == "scan-latency" )
+   {
+      ScanLatencyTest<TConcurrentMap>( ScanMode::ForEach, "ThreadsafeHashTable (ForEach)" );
+      ScanLatencyTest<TConcurrentMap>( ScanMode::Cursor, "ThreadsafeHashTable (Scan cursor)" );
+      return 0;
+   }
+
+   if ( scenario == "lock-free" )
+   {
+      // striped-таблица против split-ordered таблицы без блокировок на одних и тех же нагрузках
+      ConcurrentMapTest<TConcurrentMap>( "ThreadsafeHashTable<SlimReaderWriterLock>" );
+      ConcurrentMapTest<TLockFreeMap>( "SplitOrderedHashTable" );
+
+      TConcurrentMap locked_map;
+      ReadScaling( locked_map, "ThreadsafeHashTable<SlimReaderWriterLock>" );
+      TLockFreeMap lock_free_map;
+      ReadScaling( lock_free_map, "SplitOrderedHashTable" );
+
+      WriteScalingTest<TConcurrentMap>( "ThreadsafeHashTable<SlimReaderWriterLock>" );
+      WriteScalingTest<TLockFreeMap>( "SplitOrderedHashTable" );
+      return 0;
+   }
+
+   if ( scenario == "lock-free-reads" )
+   {
+      // EpochListStorage под блокировкой и без неё, ListStorage - для сравнения
+      for ( size_t writer_count = 0; writer_count <= 2; ++writer_count )
+      {
+         LockFreeReadTest<TConcurrentMap>( kvs::ReadMode::Locked, writer_count, "ThreadsafeHashTable<ListStorage>" );
+         LockFreeReadTest<TEpochListMap>( kvs::ReadMode::Locked, writer_count, "ThreadsafeHashTable<EpochListStorage>" );
+         LockFreeReadTest<TEpochListMap>( kvs::ReadMode::LockFree, writer_count, "ThreadsafeHashTable<EpochListStorage> (lock-free reads)" );
+         std::cout << "\n";
+      }
+      return 0;
+   }
+
+   if ( scenario == "locks" )
+   {
+      // конфигурации из README: 11 и 256 блокировок
+      LockPolicyTests<11>();
+      LockPolicyTests<256>();
+      return 0;
+   }
+
+   if ( scenario == "read-mostly" )
+   {
+      // BravoSharedMutex против обычных блокировок чтения-записи на нагрузке из 95% чтений
+      size_t const lock_counts[] = { 11, lock_count };
+      for ( auto count_it = std::begin( lock_counts ); count_it != std::end( lock_counts ); ++count_it )
+      {
+         ReadMostlyTest<TStdSharedMutexMap>( *count_it, "ThreadsafeHashTable<std::shared_mutex>" );
+         ReadMostlyTest<TConcurrentMap>( *count_it, "ThreadsafeHashTable<SlimReaderWriterLock>" );
+         ReadMostlyTest<TBravoMap>( *count_it, "ThreadsafeHashTable<BravoSharedMutex<SlimReaderWriterLock>>" );
+      }
+      return 0;
+   }
+
+   if ( scenario == "indexing" )
+   {
+      // остаток от деления против степени двойки с перемешанным хэшем
+      struct
+      {
+         KeyPattern pattern;
+         char const* name;
+      } const patterns[] = { { KeyPattern::Sequential, "sequential" }, { KeyPattern::Strided, "strided" }, { KeyPattern::Random, "random" } };
+      for ( auto pattern_it = std::begin( patterns ); pattern_it != std::end( patterns ); ++pattern_it )
+      {
+         auto const keys = MakeIndexingKeys( pattern_it->pattern );
+         IndexingTest<TConcurrentMap>( keys, pattern_it->name, "ThreadsafeHashTable<ModuloIndexing>" );
+         IndexingTest<TPowerOfTwoMap>( keys, pattern_it->name, "ThreadsafeHashTable<PowerOfTwoIndexing>" );
+      }
+      return 0;
+   }
+
+   if ( scenario == "hashed-strings" )
+   {
+      // хэши, сохранённые в узлах, против пересчёта хэша при рехэше
+      HashedStringsTest<TStringKeyMap>( "ThreadsafeHashTable<ListStorage>" );
+      HashedStringsTest<THashedStringKeyMap>( "ThreadsafeHashTable<HashedListStorage>" );
+      return 0;
+   }
+
+   if ( scenario == "swiss" )
+   {
+      // группы с управляющими байтами против списков и робин гуда
+      SwissLookupTest<TConcurrentMap>( kvs::ReadMode::Locked, "ThreadsafeHashTable<ListStorage>" );
+      SwissLookupTest<TRobinHoodFlatMap>( kvs::ReadMode::Locked, "ThreadsafeHashTable<FlatStorage<RobinHood>>" );
+      SwissLookupTest<TSwissMap>( kvs::ReadMode::Locked, "ThreadsafeHashTable<SwissStorage>" );
+      SwissLookupTest<TSwissMap>( kvs::ReadMode::Optimistic, "ThreadsafeHashTable<SwissStorage> (Optimistic)" );
+      return 0;
+   }
+
+   if ( scenario == "shrink" )
+   {
+      // "shrink none", "shrink auto" или "shrink explicit" запускает одну таблицу, чтобы RSS не смешивался
+      std::string const which = argc > 2 ? argv[2] : "";
+      if ( which.empty() || which == "none" )
+         ShrinkTest<TConcurrentMap>( ShrinkMode::None, "ThreadsafeHashTable (no shrink)" );
+      if ( which.empty() || which == "auto" )
+         ShrinkTest<TConcurrentMap>( ShrinkMode::Auto, "ThreadsafeHashTable (minLoadFactor 0.1)" );
+      if ( which.empty() || which == "explicit" )
+         ShrinkTest<TConcurrentMap>( ShrinkMode::Explicit, "ThreadsafeHashTable (ShrinkToFit)" );
+      return 0;
+   }
+
+   if ( scenario == "snapshot" )
+   {
+      // запись снимка без остановки писателей и загрузка без блокировки на каждый элемент
+      SnapshotTest<TConcurrentMap>( "ThreadsafeHashTable<ListStorage>" );
+      SnapshotTest<TRobinHoodFlatMap>( "ThreadsafeHashTable<FlatStorage<RobinHood>>" );
+      SnapshotTest<TSwissMap>( "ThreadsafeHashTable<SwissStorage>" );
+      return 0;
+   }
+
+   if ( scenario == "shared" )
+   {
+      // "shared [processes]": один регион общей памяти на все процессы против своей таблицы в каждом
+      size_t const process_count = argc > 2 ? std::stoul( argv[2] ) : 4;
+      auto const private_megabytes = PrivateCopyMegabytes();
+      SharedMemoryTest<TSharedMemoryMap>( argv[0], process_count, "spin", private_megabytes );
+      SharedMemoryTest<TInterprocessMemoryMap>( argv[0], process_count, "interprocess", private_megabytes );
+      return 0;
+   }
+
+   if ( scenario == "shared-reader" && argc > 3 )
+   {
+      // процесс-читатель, которого запускает "shared"
+      auto const reader_id = std::stoi( argv[3] );
+      return std::string( argv[2] ) == "spin" ? SharedReaderMain<TSharedMemoryMap>( reader_id ) : SharedReaderMain<TInterprocessMemoryMap>( reader_id );
+   }
+
+   if ( scenario == "cache" )
+   {
+      // вытеснение CLOCK при вставке против уборщика на EraseIf, запросы по закону Ципфа
+      auto const trace = MakeCacheTrace();
+      size_t const capacities[] = { cache_key_count / 100, cache_key_count / 20, cache_key_count / 5 };
+      for ( auto capacity_it = std::begin( capacities ); capacity_it != std::end( capacities ); ++capacity_it )
+      {
+         CacheTest( trace, *capacity_it );
+         SweeperTest( trace, *capacity_it );
+      }
+      return 0;
+   }
+
+   ConcurrentMapTest<TConcurrentMap>( "ThreadsafeHashTable" );
+
+#pragma region serial_map_test
+
+   std::random_device rd;
+   std::default_random_engine generator( rd() );
+   std::uniform_int_distribution<int> distribution( distrib_min, distrib_max );
+
+   TSerialMap serial_map;
+   for ( size_t i = 0; i < initial_size; ++i )
+   {
+      TKeyValue kv;
+      kv.first = distribution( generator );
+      kv.second = distribution( generator );
+
+      serial_map.insert( kv );
+   }
+
+   auto tic_start = TRI_microtime();
 
    for ( size_t i = 0; i < inserter_count; ++i )
    {
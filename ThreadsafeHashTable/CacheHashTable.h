@@ -0,0 +1,459 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+
+#include <unordered_map>
+
+namespace kvs
+{
+
+// счётчики кэша (GetCacheStats)
+struct CacheStats
+{
+   CacheStats()
+      : evictions( 0 )
+      , expirations( 0 )
+   {
+
+   }
+
+   // элементы, вытесненные вставкой в заполненную полосу
+   uint64_t evictions;
+
+   // элементы, удалённые из-за истёкшего срока жизни
+   uint64_t expirations;
+};
+
+// таблица-кэш ограниченного размера: полосы, как в ThreadsafeHashTable, но у каждой полосы
+// свой предел элементов (maxEntries / pLockCount). Вставка в заполненную полосу вытесняет
+// элемент этой же полосы по алгоритму CLOCK под той же эксклюзивной блокировкой - внешний
+// уборщик на EraseIf, который берёт все блокировки, не нужен. CLOCK приближает LRU: Find
+// отмечает элемент, стрелка полосы идёт по её слотам, снимает отметки и вытесняет первый
+// неотмеченный или просроченный элемент.
+// У элемента может быть срок жизни (ttl при вставке). Просроченный элемент не находится
+// Find и удаляется им же при встрече, а стрелка вытесняет его, даже если он отмечен.
+// Время читается только для элементов со сроком жизни.
+// Интерфейс повторяет ThreadsafeHashTable, чтобы их можно было подставлять друг вместо друга
+template <typename TKey, typename TValue, size_t pLockCount = 11, typename TLock = boost::shared_mutex, typename THash = std::hash<TKey>>
+class CacheHashTable
+{
+public:
+   typedef std::pair<TKey, TValue> TKeyValue;
+
+   typedef std::chrono::steady_clock TClock;
+
+   // maxEntries - наибольшее количество элементов, делится между полосами поровну
+   explicit CacheHashTable( size_t const maxEntries )
+      : mStripeCapacity( std::max<size_t>( ( maxEntries + pLockCount - 1 ) / pLockCount, 1 ) )
+   {
+      if ( mStripeCapacity >= cNoSlot )
+         throw std::invalid_argument( "maxEntries out of range" );
+
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         auto& stripe = mStripes[idx];
+         stripe.slots.assign( mStripeCapacity, nullptr );
+         stripe.index.reserve( mStripeCapacity );
+      }
+   }
+
+   // предел элементов для бюджета памяти: слот и узел индекса на элемент,
+   // без памяти, которую ключ или значение выделяют сами
+   static size_t EntriesForMemory( size_t const bytes )
+   {
+      return bytes / cEntryBytes;
+   }
+
+   // false - ключа нет или его срок жизни истёк
+   bool Find( TKey const& key, TValue& value )
+   {
+      auto const hash = mHasher( key );
+      auto& stripe = GetStripe( hash );
+
+      auto expired = false;
+      {
+         boost::shared_lock_guard<TLock> lock( stripe.lock );
+
+         auto const it = stripe.index.find( key );
+         if ( it == stripe.index.end() )
+            return false;
+
+         auto& entry = it->second;
+         expired = Expired( entry, Now( entry ) );
+         if ( !expired )
+         {
+            Touch( entry );
+            value = entry.value;
+            return true;
+         }
+      }
+
+      // просроченный элемент удаляется под эксклюзивной блокировкой, если его не успели заменить
+      std::lock_guard<TLock> lock( stripe.lock );
+      auto const it = stripe.index.find( key );
+      if ( it != stripe.index.end() && Expired( it->second, TClock::now() ) )
+      {
+         Remove( stripe, it );
+         ++stripe.expirations;
+      }
+      return false;
+   }
+
+   size_t Size() const
+   {
+      size_t size = 0;
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         size += mStripes[idx].size.load( std::memory_order_relaxed );
+      }
+      return size;
+   }
+
+   size_t Capacity() const
+   {
+      return mStripeCapacity * pLockCount;
+   }
+
+   // ttl - срок жизни элемента, нулевой - без срока. Заполненная полоса вытесняет элемент.
+   // false - ключ уже есть и его срок не истёк
+   bool Insert( TKeyValue const& kv, TClock::duration const ttl = TClock::duration::zero() )
+   {
+      return Put( kv.first, kv.second, ttl, false );
+   }
+
+   // вставляет или заменяет значение и срок жизни. true - ключ вставлен
+   bool InsertOrAssign( TKey const& key, TValue const& value, TClock::duration const ttl = TClock::duration::zero() )
+   {
+      return Put( key, value, ttl, true );
+   }
+
+   // меняет значение, срок жизни остаётся прежним
+   bool Update( TKeyValue const& kv )
+   {
+      auto const hash = mHasher( kv.first );
+      auto& stripe = GetStripe( hash );
+      std::lock_guard<TLock> lock( stripe.lock );
+
+      auto const it = stripe.index.find( kv.first );
+      if ( it == stripe.index.end() )
+         return false;
+
+      auto& entry = it->second;
+      if ( Expired( entry, Now( entry ) ) )
+      {
+         Remove( stripe, it );
+         ++stripe.expirations;
+         return false;
+      }
+
+      entry.value = kv.second;
+      Touch( entry );
+      return true;
+   }
+
+   void Erase( TKey const& key )
+   {
+      auto const hash = mHasher( key );
+      auto& stripe = GetStripe( hash );
+      std::lock_guard<TLock> lock( stripe.lock );
+
+      auto const it = stripe.index.find( key );
+      if ( it != stripe.index.end() )
+         Remove( stripe, it );
+   }
+
+   void Clear()
+   {
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         auto& stripe = mStripes[idx];
+         std::lock_guard<TLock> lock( stripe.lock );
+
+         stripe.index.clear();
+         std::fill( stripe.slots.begin(), stripe.slots.end(), nullptr );
+         stripe.free.clear();
+         stripe.used = 0;
+         stripe.hand = 0;
+         stripe.size.store( 0, std::memory_order_relaxed );
+      }
+   }
+
+   // f( TKeyValue const& ) для элементов, срок которых не истёк, по одной полосе за раз
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      auto const now = TClock::now();
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         auto& stripe = mStripes[idx];
+         boost::shared_lock_guard<TLock> lock( stripe.lock );
+
+         for ( auto it = stripe.index.begin(); it != stripe.index.end(); ++it )
+         {
+            if ( !Expired( it->second, now ) )
+               f( TKeyValue( it->first, it->second.value ) );
+         }
+      }
+   }
+
+   // в отличие от EraseIf у ThreadsafeHashTable удаляет все подходящие элементы, а заодно
+   // просроченные, держа по одной блокировке за раз. Возвращает количество подходящих
+   template<typename Predicate>
+   size_t EraseAllIf( Predicate p )
+   {
+      auto const now = TClock::now();
+      size_t erased = 0;
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         auto& stripe = mStripes[idx];
+         std::lock_guard<TLock> lock( stripe.lock );
+
+         for ( auto it = stripe.index.begin(); it != stripe.index.end(); )
+         {
+            if ( Expired( it->second, now ) )
+            {
+               it = Remove( stripe, it );
+               ++stripe.expirations;
+            }
+            else if ( p( TKeyValue( it->first, it->second.value ) ) )
+            {
+               it = Remove( stripe, it );
+               ++erased;
+            }
+            else
+            {
+               ++it;
+            }
+         }
+      }
+      return erased;
+   }
+
+   CacheStats GetCacheStats() const
+   {
+      CacheStats stats;
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         stats.evictions += mStripes[idx].evictions.load( std::memory_order_relaxed );
+         stats.expirations += mStripes[idx].expirations.load( std::memory_order_relaxed );
+      }
+      return stats;
+   }
+
+private:
+   CacheHashTable( CacheHashTable const& );
+
+   CacheHashTable& operator=( CacheHashTable const& );
+
+   static uint32_t const cNoSlot = 0xffffffffu;
+
+   // срок жизни без ограничения
+   static int64_t const cNoExpiry = 0;
+
+   // лежит в узле индекса рядом с ключом, поэтому поиск доходит до значения без лишнего перехода
+   struct Entry
+   {
+      Entry()
+         : value()
+         , expiry( cNoExpiry )
+         , referenced( false )
+         , slot( cNoSlot )
+      {
+
+      }
+
+      TValue value;
+
+      // момент истечения в тиках TClock или cNoExpiry
+      int64_t expiry;
+
+      // отметка CLOCK: Find ставит её под разделяемой блокировкой, стрелка снимает
+      std::atomic<bool> referenced;
+
+      // место элемента на круге стрелки
+      uint32_t slot;
+   };
+
+   typedef std::unordered_map<TKey, Entry, THash> TIndex;
+
+   typedef typename TIndex::value_type TNode;
+
+   // узел индекса с указателями списка и ячейки и слот круга
+   static size_t const cEntryBytes = sizeof( TNode ) + 4 * sizeof( void* );
+
+   // круг стрелки - слоты с указателями на узлы индекса (узлы unordered_map не переезжают).
+   // Слоты бывают заняты, свободны после удаления или ещё не выданы (от used до конца)
+   struct alignas( cCacheLineSize ) Stripe
+   {
+      Stripe()
+         : used( 0 )
+         , hand( 0 )
+         , size( 0 )
+         , evictions( 0 )
+         , expirations( 0 )
+      {
+
+      }
+
+      TLock lock;
+
+      TIndex index;
+
+      std::vector<TNode*> slots;
+
+      std::vector<uint32_t> free;
+
+      size_t used;
+
+      // стрелка CLOCK
+      size_t hand;
+
+      std::atomic<size_t> size;
+
+      std::atomic<uint64_t> evictions;
+
+      std::atomic<uint64_t> expirations;
+   };
+
+   Stripe& GetStripe( size_t const hash )
+   {
+      return mStripes[hash % pLockCount];
+   }
+
+   static int64_t Ticks( TClock::time_point const time )
+   {
+      return time.time_since_epoch().count();
+   }
+
+   // время нужно только элементам со сроком жизни
+   static TClock::time_point Now( Entry const& entry )
+   {
+      return entry.expiry == cNoExpiry ? TClock::time_point() : TClock::now();
+   }
+
+   static bool Expired( Entry const& entry, TClock::time_point const now )
+   {
+      return entry.expiry != cNoExpiry && entry.expiry <= Ticks( now );
+   }
+
+   // отметка пишется, только если её нет, чтобы повторные попадания не гоняли кэш-линию
+   static void Touch( Entry& entry )
+   {
+      if ( !entry.referenced.load( std::memory_order_relaxed ) )
+         entry.referenced.store( true, std::memory_order_relaxed );
+   }
+
+   static int64_t ExpiryFor( TClock::duration const ttl )
+   {
+      if ( ttl <= TClock::duration::zero() )
+         return cNoExpiry;
+
+      return std::max<int64_t>( Ticks( TClock::now() + ttl ), cNoExpiry + 1 );
+   }
+
+   bool Put( TKey const& key, TValue const& value, TClock::duration const ttl, bool const assign )
+   {
+      auto const hash = mHasher( key );
+      auto& stripe = GetStripe( hash );
+      auto const expiry = ExpiryFor( ttl );
+      std::lock_guard<TLock> lock( stripe.lock );
+
+      auto const it = stripe.index.find( key );
+      if ( it != stripe.index.end() )
+      {
+         auto& entry = it->second;
+         auto const expired = Expired( entry, Now( entry ) );
+         if ( !assign && !expired )
+            return false;
+
+         if ( expired )
+            ++stripe.expirations;
+
+         entry.value = value;
+         entry.expiry = expiry;
+         Touch( entry );
+         return expired;
+      }
+
+      auto referenced = false;
+      auto const slot = AllocateSlot( stripe, referenced );
+      auto& node = *stripe.index.emplace( std::piecewise_construct, std::forward_as_tuple( key ), std::forward_as_tuple() ).first;
+      node.second.value = value;
+      node.second.expiry = expiry;
+      node.second.referenced.store( referenced, std::memory_order_relaxed );
+      node.second.slot = slot;
+      stripe.slots[slot] = &node;
+      stripe.size.store( stripe.size.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+      return true;
+   }
+
+   // свободный слот полосы, в заполненной полосе - слот вытесненного элемента.
+   // Слот, освобождённый удалением, может оказаться прямо перед стрелкой, поэтому новый
+   // элемент в нём получает отметку (referenced), чтобы пережить хотя бы один её проход.
+   // Слоты, выданные по порядку или стрелкой, стрелка встретит только через круг
+   uint32_t AllocateSlot( Stripe& stripe, bool& referenced )
+   {
+      if ( !stripe.free.empty() )
+      {
+         auto const slot = stripe.free.back();
+         stripe.free.pop_back();
+         referenced = true;
+         return slot;
+      }
+
+      if ( stripe.used < mStripeCapacity )
+         return static_cast<uint32_t>( stripe.used++ );
+
+      auto const slot = Evict( stripe );
+      stripe.free.pop_back();
+      return slot;
+   }
+
+   // CLOCK: за два оборота стрелки найдётся элемент без отметки. Заполненная полоса
+   // занимает все слоты круга
+   uint32_t Evict( Stripe& stripe )
+   {
+      auto now = TClock::time_point();
+      for ( ;; )
+      {
+         auto const slot = static_cast<uint32_t>( stripe.hand );
+         stripe.hand = stripe.hand + 1 < mStripeCapacity ? stripe.hand + 1 : 0;
+
+         auto& node = *stripe.slots[slot];
+         if ( node.second.expiry != cNoExpiry && now == TClock::time_point() )
+            now = TClock::now();
+
+         auto const expired = Expired( node.second, now );
+         if ( !expired && node.second.referenced.load( std::memory_order_relaxed ) )
+         {
+            node.second.referenced.store( false, std::memory_order_relaxed );
+            continue;
+         }
+
+         Remove( stripe, stripe.index.find( node.first ) );
+         if ( expired )
+            ++stripe.expirations;
+         else
+            ++stripe.evictions;
+         return slot;
+      }
+   }
+
+   typename TIndex::iterator Remove( Stripe& stripe, typename TIndex::iterator const it )
+   {
+      auto const slot = it->second.slot;
+      stripe.slots[slot] = nullptr;
+      stripe.free.push_back( slot );
+      stripe.size.store( stripe.size.load( std::memory_order_relaxed ) - 1, std::memory_order_relaxed );
+      return stripe.index.erase( it );
+   }
+
+   THash mHasher;
+
+   size_t const mStripeCapacity;
+
+   std::array<Stripe, pLockCount> mStripes;
+};
+
+} // namespace kvs
@@ -0,0 +1,33 @@
+﻿#pragma once
+
+#include "precomp.h"
+
+#if defined( _MSC_VER )
+#include <xmmintrin.h>
+#endif
+
+namespace kvs
+{
+
+// размер блока, который не должны делить потоки, пишущие в разные данные.
+// std::hardware_destructive_interference_size есть не во всех компиляторах
+size_t const cCacheLineSize = 64;
+
+// обёртка, которая кладёт объект в свою кэш-линию
+template <typename T>
+struct alignas( cCacheLineSize ) CacheAligned : T
+{
+
+};
+
+// подсказка процессору заранее загрузить кэш-линию
+inline void Prefetch( void const* p )
+{
+#if defined( _MSC_VER )
+   _mm_prefetch( static_cast<char const*>( p ), _MM_HINT_T0 );
+#else
+   __builtin_prefetch( p );
+#endif
+}
+
+} // namespace kvs
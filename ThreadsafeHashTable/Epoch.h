@@ -0,0 +1,415 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+
+namespace kvs
+{
+
+// память, ожидающая освобождения по эпохам
+struct RetiredMemory
+{
+   RetiredMemory()
+      : bytes( 0 )
+      , count( 0 )
+      , peakBytes( 0 )
+      , peakCount( 0 )
+   {
+
+   }
+
+   size_t bytes;
+
+   size_t count;
+
+   // наибольшие значения с создания домена, они обновляются при каждой сборке
+   // списков, т.е. не реже чем раз в несколько десятков отложенных объектов
+   size_t peakBytes;
+
+   size_t peakCount;
+};
+
+// освобождение памяти по эпохам. Поток, который читает разделяемые узлы без блокировки,
+// держит Guard: на это время он занимает слот и публикует в нём глобальную эпоху.
+// Отцепленные узлы не удаляются сразу, а откладываются (Retire) с текущей эпохой.
+// Эпоха продвигается, когда все занятые слоты видели текущую, поэтому через две
+// эпохи после Retire ни один читатель уже не может держать узел, и его можно удалить
+class EpochDomain
+{
+   // отложенных объектов в списке, после которых пробуем продвинуть эпоху и освободить память
+   static size_t const cCollectThreshold = 64;
+
+   struct Retired
+   {
+      void* pointer;
+      void ( *deleter )( void* );
+      uint64_t epoch;
+      size_t bytes;
+   };
+
+   // список отложенных объектов одного владельца. Изменения размера копятся в pending
+   // и попадают в общие счётчики домена при сборке
+   struct RetiredList
+   {
+      RetiredList()
+         : collectAt( cCollectThreshold )
+         , pendingBytes( 0 )
+         , pendingCount( 0 )
+      {
+
+      }
+
+      std::vector<Retired> items;
+
+      // размер списка, при котором пробуем освободить память в следующий раз
+      size_t collectAt;
+
+      ptrdiff_t pendingBytes;
+
+      ptrdiff_t pendingCount;
+   };
+
+   // слот читателя. Занят, пока state != 0, в state - эпоха входа, сдвинутая на бит.
+   // Отложенные узлы лежат в слоте того потока, который их отложил, и разбираются
+   // любым следующим владельцем слота
+   struct SlotData
+   {
+      SlotData()
+         : state( 0 )
+      {
+
+      }
+
+      std::atomic<uint64_t> state;
+
+      RetiredList retired;
+   };
+
+   typedef CacheAligned<SlotData> Slot;
+
+public:
+   // slotCount - сколько потоков могут одновременно находиться внутри Guard,
+   // лишние потоки ждут свободного слота
+   explicit EpochDomain( size_t const slotCount = DefaultSlotCount() )
+      : mSlots( slotCount )
+      , mEpoch( 1 )
+      , mRetiredBytes( 0 )
+      , mRetiredCount( 0 )
+      , mPeakBytes( 0 )
+      , mPeakCount( 0 )
+   {
+
+   }
+
+   // к этому моменту ни один поток не должен находиться внутри Guard,
+   // а все списки RetireList этого домена должны быть разрушены
+   ~EpochDomain()
+   {
+      for ( auto slot_it = mSlots.begin(); slot_it != mSlots.end(); ++slot_it )
+      {
+         FreeRetired( slot_it->retired, std::numeric_limits<uint64_t>::max() );
+      }
+      FreeRetired( mOrphans, std::numeric_limits<uint64_t>::max() );
+   }
+
+   // критическая секция читателя: пока Guard жив, узлы, которые были достижимы
+   // при его создании, не будут удалены
+   class Guard
+   {
+   public:
+      explicit Guard( EpochDomain& domain )
+         : mDomain( domain )
+         , mSlot( domain.Enter() )
+      {
+
+      }
+
+      ~Guard()
+      {
+         mDomain.Leave( mSlot );
+      }
+
+      // узел уже недостижим для новых читателей, delete выполнится позже
+      template<typename T>
+      void Retire( T* const pointer )
+      {
+         mDomain.Push( mSlot.retired, pointer );
+      }
+
+   private:
+      Guard( Guard const& );
+
+      Guard& operator=( Guard const& );
+
+      EpochDomain& mDomain;
+      Slot& mSlot;
+   };
+
+   // отложенное освобождение для писателей, которые меняют данные под своей блокировкой
+   // и не входят в Guard. Список не синхронизирован и принадлежит одной блокировке.
+   // Без домена (Bind не вызывался) объекты удаляются сразу
+   class RetireList
+   {
+   public:
+      RetireList()
+         : mDomain( nullptr )
+      {
+
+      }
+
+      ~RetireList()
+      {
+         ReleaseAll();
+      }
+
+      void Bind( EpochDomain& domain )
+      {
+         ReleaseAll();
+         mDomain = &domain;
+      }
+
+      template<typename T>
+      void Retire( T* const pointer )
+      {
+         if ( mDomain == nullptr )
+            delete pointer;
+         else
+            mDomain->Push( mList, pointer );
+      }
+
+      // отдаёт ещё не освобождённые объекты домену, тот освободит их сам
+      void ReleaseAll()
+      {
+         if ( mDomain != nullptr )
+            mDomain->Adopt( mList );
+      }
+
+      // объекты списка ещё не освобождены, но память под ними занята
+      size_t ReservedBytes() const
+      {
+         size_t bytes = 0;
+         for ( auto retired_it = mList.items.begin(); retired_it != mList.items.end(); ++retired_it )
+         {
+            bytes += retired_it->bytes;
+         }
+         return bytes;
+      }
+
+   private:
+      RetireList( RetireList const& );
+
+      RetireList& operator=( RetireList const& );
+
+      EpochDomain* mDomain;
+
+      RetiredList mList;
+   };
+
+   // отложенное освобождение вне Guard и без своего списка, например для массивов,
+   // которые меняются редко. Берёт мьютекс домена
+   template<typename T>
+   void Retire( T* const pointer )
+   {
+      std::lock_guard<std::mutex> lock( mOrphanMutex );
+      mOrphans.items.push_back( MakeRetired( pointer ) );
+      Account( static_cast<ptrdiff_t>( sizeof( T ) ), 1 );
+   }
+
+   RetiredMemory GetRetiredMemory() const
+   {
+      RetiredMemory memory;
+      memory.bytes = Clamp( mRetiredBytes.load( std::memory_order_relaxed ) );
+      memory.count = Clamp( mRetiredCount.load( std::memory_order_relaxed ) );
+      memory.peakBytes = Clamp( mPeakBytes.load( std::memory_order_relaxed ) );
+      memory.peakCount = Clamp( mPeakCount.load( std::memory_order_relaxed ) );
+      return memory;
+   }
+
+   static size_t DefaultSlotCount()
+   {
+      auto const count = std::thread::hardware_concurrency() * 4;
+      return count < 64 ? 64 : count;
+   }
+
+private:
+   EpochDomain( EpochDomain const& );
+
+   EpochDomain& operator=( EpochDomain const& );
+
+   Slot& Enter()
+   {
+      // поток начинает со своего слота, чтобы потоки не толкались на одном
+      auto idx = ThreadSlot() % mSlots.size();
+      for ( ;; )
+      {
+         auto& slot = mSlots[idx];
+         uint64_t expected = 0;
+         auto const epoch = mEpoch.load();
+         if ( slot.state.load( std::memory_order_relaxed ) == 0 && slot.state.compare_exchange_strong( expected, epoch << 1 | 1 ) )
+         {
+            // эпоха могла смениться до публикации, тогда публикуем новую
+            for ( auto current = mEpoch.load(); current != ( slot.state.load( std::memory_order_relaxed ) >> 1 ); current = mEpoch.load() )
+            {
+               slot.state.store( current << 1 | 1 );
+            }
+            return slot;
+         }
+
+         idx = ( idx + 1 ) % mSlots.size();
+         if ( idx == 0 )
+            std::this_thread::yield();
+      }
+   }
+
+   void Leave( Slot& slot )
+   {
+      slot.state.store( 0, std::memory_order_release );
+   }
+
+   template<typename T>
+   Retired MakeRetired( T* const pointer ) const
+   {
+      Retired const retired = { pointer, []( void* p )
+      {
+         delete static_cast<T*>( p );
+      }, mEpoch.load(), sizeof( T ) };
+      return retired;
+   }
+
+   template<typename T>
+   void Push( RetiredList& list, T* const pointer )
+   {
+      list.items.push_back( MakeRetired( pointer ) );
+      list.pendingBytes += sizeof( T );
+      ++list.pendingCount;
+
+      // если читатель надолго задержал эпоху, список не пересматривается на каждом Retire
+      if ( list.items.size() >= list.collectAt )
+         Collect( list );
+   }
+
+   void Collect( RetiredList& list )
+   {
+      Flush( list );
+      TryAdvance();
+
+      auto const epoch = mEpoch.load();
+      FreeRetired( list, epoch );
+      list.collectAt = list.items.size() * 2 + cCollectThreshold;
+
+      // список домена разбирает тот, кто первым застал его свободным
+      if ( mOrphanMutex.try_lock() )
+      {
+         std::lock_guard<std::mutex> lock( mOrphanMutex, std::adopt_lock );
+         FreeRetired( mOrphans, epoch );
+      }
+   }
+
+   // чужой список переходит в список домена
+   void Adopt( RetiredList& list )
+   {
+      Flush( list );
+      if ( list.items.empty() )
+         return;
+
+      std::lock_guard<std::mutex> lock( mOrphanMutex );
+      mOrphans.items.insert( mOrphans.items.end(), list.items.begin(), list.items.end() );
+      list.items.clear();
+      list.collectAt = cCollectThreshold;
+   }
+
+   // эпоха продвигается, если все занятые слоты уже вошли в текущую
+   void TryAdvance()
+   {
+      auto epoch = mEpoch.load();
+      for ( auto slot_it = mSlots.begin(); slot_it != mSlots.end(); ++slot_it )
+      {
+         auto const state = slot_it->state.load();
+         if ( state != 0 && ( state >> 1 ) != epoch )
+            return;
+      }
+
+      mEpoch.compare_exchange_strong( epoch, epoch + 1 );
+   }
+
+   // удаляет объекты, отложенные не позже чем за две эпохи до current
+   void FreeRetired( RetiredList& list, uint64_t const current )
+   {
+      ptrdiff_t bytes = 0;
+      ptrdiff_t count = 0;
+      auto keep = list.items.begin();
+      for ( auto retired_it = list.items.begin(); retired_it != list.items.end(); ++retired_it )
+      {
+         if ( current == std::numeric_limits<uint64_t>::max() || retired_it->epoch + 2 <= current )
+         {
+            bytes += retired_it->bytes;
+            ++count;
+            retired_it->deleter( retired_it->pointer );
+         }
+         else
+         {
+            *keep++ = *retired_it;
+         }
+      }
+      list.items.erase( keep, list.items.end() );
+
+      Account( -bytes, -count );
+   }
+
+   void Flush( RetiredList& list )
+   {
+      Account( list.pendingBytes, list.pendingCount );
+      list.pendingBytes = 0;
+      list.pendingCount = 0;
+   }
+
+   void Account( ptrdiff_t const bytes, ptrdiff_t const count )
+   {
+      if ( bytes == 0 && count == 0 )
+         return;
+
+      UpdatePeak( mPeakBytes, mRetiredBytes.fetch_add( bytes, std::memory_order_relaxed ) + bytes );
+      UpdatePeak( mPeakCount, mRetiredCount.fetch_add( count, std::memory_order_relaxed ) + count );
+   }
+
+   static void UpdatePeak( std::atomic<ptrdiff_t>& peak, ptrdiff_t const value )
+   {
+      auto current = peak.load( std::memory_order_relaxed );
+      while ( current < value && !peak.compare_exchange_weak( current, value, std::memory_order_relaxed ) )
+      {
+
+      }
+   }
+
+   static size_t Clamp( ptrdiff_t const value )
+   {
+      return value < 0 ? 0 : static_cast<size_t>( value );
+   }
+
+   static size_t ThreadSlot()
+   {
+      static std::atomic<size_t> next( 0 );
+      thread_local size_t const slot = next.fetch_add( 1, std::memory_order_relaxed );
+      return slot;
+   }
+
+   std::vector<Slot> mSlots;
+
+   alignas( cCacheLineSize ) std::atomic<uint64_t> mEpoch;
+
+   // счётчики отложенной памяти меняются пачками, при сборке списков
+   alignas( cCacheLineSize ) std::atomic<ptrdiff_t> mRetiredBytes;
+
+   std::atomic<ptrdiff_t> mRetiredCount;
+
+   std::atomic<ptrdiff_t> mPeakBytes;
+
+   std::atomic<ptrdiff_t> mPeakCount;
+
+   // объекты, отложенные без своего списка или оставшиеся от разрушенных списков
+   std::mutex mOrphanMutex;
+
+   RetiredList mOrphans;
+};
+
+} // namespace kvs
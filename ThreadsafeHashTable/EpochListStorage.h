@@ -0,0 +1,431 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+#include "Epoch.h"
+
+namespace kvs
+{
+
+// ячейка таблицы - отсортированный по ключу односвязный список коллизий, который можно
+// читать без блокировки. Узел не меняется после публикации: новое значение ключа - новый узел
+// на месте старого. Удалённые и заменённые узлы откладываются в список своей блокировки
+// и освобождаются, когда их уже не может читать ни один поток (EpochDomain)
+template <typename TKey, typename TValue>
+class EpochListBucket
+{
+   struct Node;
+
+public:
+   typedef std::pair<TKey, TValue> TKeyValue;
+   typedef EpochDomain::RetireList TPool;
+
+   // размер ячеек меняет таблица при рехэше
+   static bool const cSelfResizing = false;
+
+   // массив ячеек меняется при рехэше, искать ячейку без блокировки может только таблица
+   static bool const cOptimisticReads = false;
+
+   // узлы освобождаются по эпохам, ссылки на них атомарны
+   static bool const cLockFreeReads = true;
+
+   EpochListBucket()
+      : mHead( nullptr )
+      , mSize( 0 )
+      , mPool( nullptr )
+   {
+
+   }
+
+   EpochListBucket( EpochListBucket&& b ) noexcept
+      : mHead( b.mHead.load( std::memory_order_relaxed ) )
+      , mSize( b.mSize )
+      , mPool( b.mPool )
+   {
+      b.mHead.store( nullptr, std::memory_order_relaxed );
+      b.mSize = 0;
+   }
+
+   ~EpochListBucket()
+   {
+      Clear();
+   }
+
+   EpochListBucket& operator=( EpochListBucket&& b ) noexcept
+   {
+      if ( this == &b )
+         return *this;
+
+      Clear();
+      mHead.store( b.mHead.load( std::memory_order_relaxed ), std::memory_order_release );
+      mSize = b.mSize;
+      mPool = b.mPool;
+      b.mHead.store( nullptr, std::memory_order_relaxed );
+      b.mSize = 0;
+      return *this;
+   }
+
+   // узлы берутся из общего аллокатора, в пул блокировки откладываются только удалённые
+   void Attach( TPool& pool )
+   {
+      mPool = &pool;
+   }
+
+   void Clear()
+   {
+      auto node = mHead.load( std::memory_order_relaxed );
+      mHead.store( nullptr, std::memory_order_release );
+      while ( node != nullptr )
+      {
+         auto const next = node->next.load( std::memory_order_relaxed );
+         Retire( node );
+         node = next;
+      }
+
+      mSize = 0;
+   }
+
+   void Reserve( size_t const /*size*/ )
+   {
+
+   }
+
+   // значение создаётся из args, только если ключа ещё нет
+   template<typename K, typename... Args>
+   bool Emplace( size_t const /*hash*/, K&& key, Args&&... args )
+   {
+      auto const link = LowerBound( key );
+      auto const cur = link->load( std::memory_order_relaxed );
+      if ( cur != nullptr && cur->kv.first == key )
+         return false;
+
+      Link( link, new Node( TKeyValue( std::piecewise_construct, std::forward_as_tuple( std::forward<K>( key ) ), std::forward_as_tuple( std::forward<Args>( args )... ) ) ) );
+      return true;
+   }
+
+   // возвращает true, если ключ вставлен, и false, если присвоено значение
+   template<typename K, typename V>
+   bool InsertOrAssign( size_t const /*hash*/, K&& key, V&& value )
+   {
+      auto const link = LowerBound( key );
+      auto const cur = link->load( std::memory_order_relaxed );
+      if ( cur != nullptr && cur->kv.first == key )
+      {
+         Replace( link, TKeyValue( cur->kv.first, std::forward<V>( value ) ) );
+         return false;
+      }
+
+      Link( link, new Node( TKeyValue( std::forward<K>( key ), std::forward<V>( value ) ) ) );
+      return true;
+   }
+
+   template<typename K, typename V>
+   bool Update( size_t const /*hash*/, K const& key, V&& value )
+   {
+      auto const link = Locate( key );
+      if ( link == nullptr )
+         return false;
+
+      Replace( link, TKeyValue( link->load( std::memory_order_relaxed )->kv.first, std::forward<V>( value ) ) );
+      return true;
+   }
+
+   template<typename K>
+   bool Read( size_t const /*hash*/, K const& key, TValue& value ) const
+   {
+      auto const link = Locate( key );
+      if ( link == nullptr )
+         return false;
+
+      value = link->load( std::memory_order_relaxed )->kv.second;
+      return true;
+   }
+
+   // вызывает f( значение ) без копирования значения
+   template<typename K, typename Function>
+   bool Visit( size_t const /*hash*/, K const& key, Function f ) const
+   {
+      auto const link = Locate( key );
+      if ( link == nullptr )
+         return false;
+
+      f( link->load( std::memory_order_relaxed )->kv.second );
+      return true;
+   }
+
+   // f меняет копию значения, которая затем заменяет узел
+   template<typename K, typename Function>
+   bool Modify( size_t const /*hash*/, K const& key, Function& f )
+   {
+      auto const link = Locate( key );
+      if ( link == nullptr )
+         return false;
+
+      auto const cur = link->load( std::memory_order_relaxed );
+      TValue value = cur->kv.second;
+      f( value );
+      Replace( link, TKeyValue( cur->kv.first, std::move( value ) ) );
+      return true;
+   }
+
+   // f( значение, есть ли ключ ) -> оставить ли ключ. present - есть ли ключ после вызова,
+   // возвращается изменение количества элементов
+   template<typename K, typename Function>
+   ptrdiff_t Compute( size_t const /*hash*/, K&& key, Function& f, bool& present )
+   {
+      auto const link = LowerBound( key );
+      auto const cur = link->load( std::memory_order_relaxed );
+      if ( cur != nullptr && cur->kv.first == key )
+      {
+         TValue value = cur->kv.second;
+         present = f( value, true );
+         if ( !present )
+         {
+            Unlink( link );
+            return -1;
+         }
+
+         Replace( link, TKeyValue( cur->kv.first, std::move( value ) ) );
+         return 0;
+      }
+
+      TValue value = TValue();
+      present = f( value, false );
+      if ( !present )
+         return 0;
+
+      Link( link, new Node( TKeyValue( std::forward<K>( key ), std::move( value ) ) ) );
+      return 1;
+   }
+
+   template<typename K>
+   bool OptimisticRead( size_t const /*hash*/, K const& /*key*/, TValue& /*value*/ ) const
+   {
+      return false;
+   }
+
+   // чтение без блокировки внутри EpochDomain::Guard. Пока идёт запись или рехэш,
+   // поиск может пройти мимо ключа, поэтому результат проверяет таблица по версии блокировки
+   template<typename K>
+   bool LockFreeRead( size_t const /*hash*/, K const& key, TValue& value ) const
+   {
+      for ( auto node = mHead.load( std::memory_order_acquire ); node != nullptr; node = node->next.load( std::memory_order_acquire ) )
+      {
+         if ( key < node->kv.first )
+            return false;
+
+         if ( node->kv.first == key )
+         {
+            value = node->kv.second;
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   // загрузка первого узла цепочки до того, как понадобится ключ
+   void Prefetch( size_t const /*hash*/ ) const
+   {
+      auto const head = mHead.load( std::memory_order_relaxed );
+      if ( head != nullptr )
+         kvs::Prefetch( head );
+   }
+
+   template<typename K>
+   bool Delete( size_t const /*hash*/, K const& key )
+   {
+      auto const link = Locate( key );
+      if ( link == nullptr )
+         return false;
+
+      Unlink( link );
+      return true;
+   }
+
+   size_t Size() const
+   {
+      return mSize;
+   }
+
+   // узлы не меняются на месте, поэтому элементы передаются только для чтения
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      for ( auto node = mHead.load( std::memory_order_relaxed ); node != nullptr; node = node->next.load( std::memory_order_relaxed ) )
+      {
+         f( node->kv );
+      }
+   }
+
+   template<typename Predicate>
+   bool FindFirstIf( Predicate p, TKeyValue& found )
+   {
+      for ( auto node = mHead.load( std::memory_order_relaxed ); node != nullptr; node = node->next.load( std::memory_order_relaxed ) )
+      {
+         if( p( node->kv ) )
+         {
+            found = node->kv;
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   template<typename Predicate>
+   bool EraseIf( Predicate p )
+   {
+      for ( auto link = &mHead; link->load( std::memory_order_relaxed ) != nullptr; link = &link->load( std::memory_order_relaxed )->next )
+      {
+         if( p( link->load( std::memory_order_relaxed )->kv ) )
+         {
+            Unlink( link );
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   // удаляет все подходящие элементы, возвращает их количество
+   template<typename Predicate>
+   size_t EraseAllIf( Predicate p )
+   {
+      size_t erased = 0;
+      for ( auto link = &mHead; link->load( std::memory_order_relaxed ) != nullptr; )
+      {
+         if( p( link->load( std::memory_order_relaxed )->kv ) )
+         {
+            Unlink( link );
+            ++erased;
+         }
+         else
+         {
+            link = &link->load( std::memory_order_relaxed )->next;
+         }
+      }
+
+      return erased;
+   }
+
+   // переносит все элементы в ячейки destination( хэш ), узлы перевешиваются.
+   // Читатель без блокировки может при этом перейти в чужую цепочку, но узлы остаются живыми,
+   // а промах отсекается проверкой версии
+   template<typename THashFunction, typename TDestination>
+   void MoveTo( THashFunction hashOf, TDestination destination )
+   {
+      for ( auto node = mHead.load( std::memory_order_relaxed ); node != nullptr; node = mHead.load( std::memory_order_relaxed ) )
+      {
+         mHead.store( node->next.load( std::memory_order_relaxed ), std::memory_order_release );
+         --mSize;
+
+         EpochListBucket& target = destination( hashOf( node->kv.first ) );
+         target.Link( target.LowerBound( node->kv.first ), node );
+      }
+   }
+
+private:
+   EpochListBucket( EpochListBucket const& );
+
+   EpochListBucket& operator=( EpochListBucket const& );
+
+   typedef std::atomic<Node*> TLink;
+
+   struct Node
+   {
+      explicit Node( TKeyValue&& value )
+         : next( nullptr )
+         , kv( std::move( value ) )
+      {
+
+      }
+
+      TLink next;
+      TKeyValue const kv;
+   };
+
+   // ссылка на первый узел, ключ которого не меньше key. Вызывается под эксклюзивной блокировкой
+   template<typename K>
+   TLink* LowerBound( K const& key )
+   {
+      auto link = &mHead;
+      for ( auto node = link->load( std::memory_order_relaxed ); node != nullptr && node->kv.first < key; node = link->load( std::memory_order_relaxed ) )
+      {
+         link = &node->next;
+      }
+      return link;
+   }
+
+   // ссылка на узел с ключом key или nullptr
+   template<typename K>
+   TLink* Locate( K const& key ) const
+   {
+      auto link = const_cast<TLink*>( &mHead );
+      for ( auto node = link->load( std::memory_order_relaxed ); node != nullptr; node = link->load( std::memory_order_relaxed ) )
+      {
+         if ( key < node->kv.first )
+            return nullptr;
+
+         if ( node->kv.first == key )
+            return link;
+
+         link = &node->next;
+      }
+
+      return nullptr;
+   }
+
+   // узел публикуется целиком: сначала заполняется, затем одна запись ссылки
+   void Link( TLink* const link, Node* const node )
+   {
+      node->next.store( link->load( std::memory_order_relaxed ), std::memory_order_relaxed );
+      link->store( node, std::memory_order_release );
+      ++mSize;
+   }
+
+   void Replace( TLink* const link, TKeyValue&& kv )
+   {
+      auto const old = link->load( std::memory_order_relaxed );
+      auto const node = new Node( std::move( kv ) );
+      node->next.store( old->next.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+      link->store( node, std::memory_order_release );
+      Retire( old );
+   }
+
+   // читатель, стоящий на удалённом узле, продолжает по его ссылке
+   void Unlink( TLink* const link )
+   {
+      auto const node = link->load( std::memory_order_relaxed );
+      link->store( node->next.load( std::memory_order_relaxed ), std::memory_order_release );
+      Retire( node );
+      --mSize;
+   }
+
+   void Retire( Node* const node )
+   {
+      if ( mPool != nullptr )
+         mPool->Retire( node );
+      else
+         delete node;
+   }
+
+   TLink mHead;
+
+   size_t mSize;
+
+   TPool* mPool;
+};
+
+// списки коллизий, которые таблица может читать без блокировки (ReadMode::LockFree).
+// Изменение значения заменяет узел, удалённые узлы освобождаются по эпохам
+struct EpochListStorage
+{
+   template <typename TKey, typename TValue>
+   struct Rebind
+   {
+      typedef EpochListBucket<TKey, TValue> TBucket;
+   };
+};
+
+} // namespace kvs
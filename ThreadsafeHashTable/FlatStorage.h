@@ -0,0 +1,603 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+#include "NodePool.h"
+#include "Indexing.h"
+
+namespace kvs
+{
+
+enum class Probing
+{
+   Linear,
+   RobinHood
+};
+
+// ячейка таблицы - самостоятельная хэш-таблица с открытой адресацией,
+// все записи лежат в одном непрерывном массиве
+template <typename TKey, typename TValue, Probing pProbing>
+class FlatBucket
+{
+public:
+   typedef std::pair<TKey, TValue> TKeyValue;
+
+   typedef NoNodePool TPool;
+
+   // ячейка сама меняет свой размер, рехэш всей таблицы не нужен
+   static bool const cSelfResizing = true;
+
+   // простые типы можно читать без блокировки с проверкой версии
+   static bool const cOptimisticReads = std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value;
+
+   static bool const cLockFreeReads = false;
+
+   FlatBucket()
+      : mArray( nullptr )
+      , mSize( 0 )
+   {
+
+   }
+
+   FlatBucket( FlatBucket const& b )
+      : mArray( nullptr )
+      , mSize( 0 )
+   {
+      CopyFrom( b );
+   }
+
+   FlatBucket( FlatBucket&& b ) noexcept
+      : mArray( b.mArray.exchange( nullptr ) )
+      , mRetired( std::move( b.mRetired ) )
+      , mSize( b.mSize )
+   {
+      b.mSize = 0;
+   }
+
+   ~FlatBucket()
+   {
+      delete mArray.load();
+   }
+
+   FlatBucket& operator=( FlatBucket const& b )
+   {
+      if ( this == &b )
+         return *this;
+
+      Clear();
+      CopyFrom( b );
+      return *this;
+   }
+
+   FlatBucket& operator=( FlatBucket&& b ) noexcept
+   {
+      if ( this == &b )
+         return *this;
+
+      delete mArray.exchange( b.mArray.exchange( nullptr ) );
+      mRetired = std::move( b.mRetired );
+      mSize = b.mSize;
+      b.mSize = 0;
+      return *this;
+   }
+
+   // узлы не из пула, привязывать нечего
+   void Attach( TPool& /*pool*/ )
+   {
+
+   }
+
+   void Clear()
+   {
+      auto array = mArray.load( std::memory_order_relaxed );
+      if ( array == nullptr )
+         return;
+
+      if ( cOptimisticReads )
+      {
+         // массив может читать поток без блокировки, поэтому не освобождаем, а чистим
+         for ( auto slot_it = array->slots.begin(); slot_it != array->slots.end(); ++slot_it )
+         {
+            *slot_it = Slot();
+         }
+      }
+      else
+      {
+         mArray.store( nullptr, std::memory_order_relaxed );
+         delete array;
+      }
+
+      mSize = 0;
+   }
+
+   void Reserve( size_t const size )
+   {
+      auto capacity = MinCapacity;
+      while ( !FitsLoad( size, capacity ) )
+      {
+         capacity *= 2;
+      }
+
+      if ( capacity > Capacity() )
+         Rehash( capacity );
+   }
+
+   // значение создаётся из args, только если ключа ещё нет
+   template<typename K, typename... Args>
+   bool Emplace( size_t const hash, K&& key, Args&&... args )
+   {
+      if ( Locate( hash, key ) != npos )
+         return false;
+
+      Add( hash, TKeyValue( std::piecewise_construct, std::forward_as_tuple( std::forward<K>( key ) ), std::forward_as_tuple( std::forward<Args>( args )... ) ) );
+      return true;
+   }
+
+   // возвращает true, если ключ вставлен, и false, если присвоено значение
+   template<typename K, typename V>
+   bool InsertOrAssign( size_t const hash, K&& key, V&& value )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx != npos )
+      {
+         Slots()[idx].kv.second = std::forward<V>( value );
+         return false;
+      }
+
+      Add( hash, TKeyValue( std::forward<K>( key ), std::forward<V>( value ) ) );
+      return true;
+   }
+
+   template<typename K, typename V>
+   bool Update( size_t const hash, K const& key, V&& value )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      Slots()[idx].kv.second = std::forward<V>( value );
+      return true;
+   }
+
+   template<typename K>
+   bool Read( size_t const hash, K const& key, TValue& value ) const
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      value = Slots()[idx].kv.second;
+      return true;
+   }
+
+   // вызывает f( значение ) без копирования значения
+   template<typename K, typename Function>
+   bool Visit( size_t const hash, K const& key, Function f ) const
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      TValue const& value = Slots()[idx].kv.second;
+      f( value );
+      return true;
+   }
+
+   // вызывает f( значение ) с возможностью изменить значение на месте
+   template<typename K, typename Function>
+   bool Modify( size_t const hash, K const& key, Function& f )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      f( Slots()[idx].kv.second );
+      return true;
+   }
+
+   // f( значение, есть ли ключ ) -> оставить ли ключ. present - есть ли ключ после вызова,
+   // возвращается изменение количества элементов
+   template<typename K, typename Function>
+   ptrdiff_t Compute( size_t const hash, K&& key, Function& f, bool& present )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx != npos )
+      {
+         present = f( Slots()[idx].kv.second, true );
+         if ( present )
+            return 0;
+
+         EraseAt( idx );
+         return -1;
+      }
+
+      TValue value = TValue();
+      present = f( value, false );
+      if ( !present )
+         return 0;
+
+      Add( hash, TKeyValue( std::forward<K>( key ), std::move( value ) ) );
+      return 1;
+   }
+
+   // чтение без блокировки. Результат имеет смысл, только если за время чтения
+   // не менялась версия блокировки ячейки - это проверяет таблица
+   template<typename K>
+   bool OptimisticRead( size_t const hash, K const& key, TValue& value ) const
+   {
+      auto const array = mArray.load( std::memory_order_acquire );
+      if ( array == nullptr )
+         return false;
+
+      auto const mask = array->mask;
+      auto idx = MixHash( hash ) & mask;
+      for ( uint32_t distance = 1; distance <= mask + 1; ++distance )
+      {
+         // копия слота: запись могла быть изменена писателем посреди чтения
+         Slot slot;
+         std::memcpy( static_cast<void*>( &slot ), &array->slots[idx], sizeof( Slot ) );
+
+         if ( slot.distance == 0 )
+            return false;
+
+         if ( pProbing == Probing::RobinHood && slot.distance < distance )
+            return false;
+
+         if ( slot.hash == hash && slot.kv.first == key )
+         {
+            value = slot.kv.second;
+            return true;
+         }
+
+         idx = ( idx + 1 ) & mask;
+      }
+
+      return false;
+   }
+
+   template<typename K>
+   bool LockFreeRead( size_t const /*hash*/, K const& /*key*/, TValue& /*value*/ ) const
+   {
+      return false;
+   }
+
+   // загрузка домашнего слота ключа до того, как понадобится ключ
+   void Prefetch( size_t const hash ) const
+   {
+      if ( Capacity() != 0 )
+         kvs::Prefetch( &Slots()[Home( hash )] );
+   }
+
+   template<typename K>
+   bool Delete( size_t const hash, K const& key )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      EraseAt( idx );
+      return true;
+   }
+
+   size_t Size() const
+   {
+      return mSize;
+   }
+
+   size_t Capacity() const
+   {
+      auto const array = mArray.load( std::memory_order_relaxed );
+      return array == nullptr ? 0 : array->slots.size();
+   }
+
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; ++idx )
+      {
+         auto& slot = Slots()[idx];
+         if ( slot.distance != 0 )
+            f( slot.kv );
+      }
+   }
+
+   template<typename Predicate>
+   bool FindFirstIf( Predicate p, TKeyValue& found )
+   {
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; ++idx )
+      {
+         auto const slot_it = &Slots()[idx];
+         if ( slot_it->distance != 0 && p( slot_it->kv ) )
+         {
+            found = slot_it->kv;
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   template<typename Predicate>
+   bool EraseIf( Predicate p )
+   {
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; ++idx )
+      {
+         if ( Slots()[idx].distance != 0 && p( Slots()[idx].kv ) )
+         {
+            EraseAt( idx );
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   // удаляет все подходящие элементы, возвращает их количество. После удаления
+   // на место idx сдвигается следующий элемент кластера, поэтому idx проверяется снова
+   template<typename Predicate>
+   size_t EraseAllIf( Predicate p )
+   {
+      size_t erased = 0;
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; )
+      {
+         if ( Slots()[idx].distance != 0 && p( Slots()[idx].kv ) )
+         {
+            EraseAt( idx );
+            ++erased;
+         }
+         else
+         {
+            ++idx;
+         }
+      }
+
+      return erased;
+   }
+
+   // переносит все элементы в ячейки destination( хэш ), хэш берётся из слота
+   template<typename THashFunction, typename TDestination>
+   void MoveTo( THashFunction /*hashOf*/, TDestination destination )
+   {
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; ++idx )
+      {
+         auto& slot = Slots()[idx];
+         if ( slot.distance != 0 )
+         {
+            FlatBucket& target = destination( slot.hash );
+            target.Add( slot.hash, std::move( slot.kv ) );
+         }
+      }
+
+      Clear();
+   }
+
+private:
+   struct Slot
+   {
+      Slot()
+         : hash( 0 )
+         , distance( 0 )
+      {
+
+      }
+
+      size_t hash;
+      // 0 - слот пуст, иначе расстояние от домашней позиции + 1
+      uint32_t distance;
+      TKeyValue kv;
+   };
+
+   // массив слотов публикуется одним указателем вместе с маской,
+   // чтобы читатель без блокировки не увидел их несогласованными
+   struct SlotArray
+   {
+      explicit SlotArray( size_t const capacity )
+         : mask( capacity - 1 )
+         , slots( capacity )
+      {
+
+      }
+
+      size_t const mask;
+      std::vector<Slot> slots;
+   };
+
+   static size_t const npos = static_cast<size_t>( -1 );
+   static size_t const MinCapacity = 8;
+
+   static bool FitsLoad( size_t const size, size_t const capacity )
+   {
+      // робин гуд держит большую загрузку, линейному пробированию нужен запас
+      if ( pProbing == Probing::RobinHood )
+         return size * 8 <= capacity * 7;
+      return size * 4 <= capacity * 3;
+   }
+
+   Slot* Slots() const
+   {
+      return mArray.load( std::memory_order_relaxed )->slots.data();
+   }
+
+   size_t Mask() const
+   {
+      return mArray.load( std::memory_order_relaxed )->mask;
+   }
+
+   // хэш перемешивается, чтобы позиция в ячейке не зависела от индекса блокировки
+   size_t Home( size_t const hash ) const
+   {
+      return MixHash( hash ) & Mask();
+   }
+
+   void CopyFrom( FlatBucket const& b )
+   {
+      if ( b.Capacity() == 0 )
+         return;
+
+      Rehash( b.Capacity() );
+      auto const slots = b.Slots();
+      for ( size_t idx = 0, capacity = b.Capacity(); idx < capacity; ++idx )
+      {
+         if ( slots[idx].distance != 0 )
+            Place( slots[idx].hash, TKeyValue( slots[idx].kv ) );
+      }
+      mSize = b.mSize;
+   }
+
+   template<typename K>
+   size_t Locate( size_t const hash, K const& key ) const
+   {
+      if ( mSize == 0 )
+         return npos;
+
+      auto const slots = Slots();
+      auto const mask = Mask();
+      auto idx = Home( hash );
+      for ( uint32_t distance = 1; ; ++distance )
+      {
+         auto const& slot = slots[idx];
+         if ( slot.distance == 0 )
+            return npos;
+
+         // у робин гуда записи с нашим хэшем не могут лежать дальше более "бедных"
+         if ( pProbing == Probing::RobinHood && slot.distance < distance )
+            return npos;
+
+         if ( slot.hash == hash && slot.kv.first == key )
+            return idx;
+
+         idx = ( idx + 1 ) & mask;
+      }
+   }
+
+   // добавление ключа, которого точно нет в ячейке
+   void Add( size_t const hash, TKeyValue&& kv )
+   {
+      if ( !FitsLoad( mSize + 1, Capacity() ) )
+         Rehash( Capacity() == 0 ? MinCapacity : Capacity() * 2 );
+
+      Place( hash, std::move( kv ) );
+      ++mSize;
+   }
+
+   void Place( size_t const hash, TKeyValue&& kv )
+   {
+      PlaceInto( *mArray.load( std::memory_order_relaxed ), hash, std::move( kv ) );
+   }
+
+   static void PlaceInto( SlotArray& array, size_t const hash, TKeyValue&& kv )
+   {
+      Slot cur;
+      cur.hash = hash;
+      cur.distance = 1;
+      cur.kv = std::move( kv );
+
+      auto const slots = array.slots.data();
+      auto const mask = array.mask;
+      auto idx = MixHash( hash ) & mask;
+      for ( ;; )
+      {
+         auto& slot = slots[idx];
+         if ( slot.distance == 0 )
+         {
+            slot = std::move( cur );
+            return;
+         }
+
+         if ( pProbing == Probing::RobinHood && slot.distance < cur.distance )
+         {
+            std::swap( slot, cur );
+         }
+
+         idx = ( idx + 1 ) & mask;
+         ++cur.distance;
+      }
+   }
+
+   void EraseAt( size_t idx )
+   {
+      auto const slots = Slots();
+      auto const mask = Mask();
+
+      if ( pProbing == Probing::RobinHood )
+      {
+         // сдвигаем назад хвост кластера, пока записи не на своих местах
+         auto next = ( idx + 1 ) & mask;
+         while ( slots[next].distance > 1 )
+         {
+            slots[idx] = std::move( slots[next] );
+            --slots[idx].distance;
+            idx = next;
+            next = ( next + 1 ) & mask;
+         }
+      }
+      else
+      {
+         // алгоритм R Кнута: переносим в дыру всё, что иначе стало бы недостижимым
+         auto next = idx;
+         for ( ;; )
+         {
+            next = ( next + 1 ) & mask;
+            auto& slot = slots[next];
+            if ( slot.distance == 0 )
+               break;
+
+            auto const to_home = slot.distance - 1;
+            auto const to_hole = ( next - idx ) & mask;
+            if ( to_home < to_hole )
+               continue;
+
+            auto const home = ( next - to_home ) & mask;
+            slots[idx] = std::move( slot );
+            slots[idx].distance = static_cast<uint32_t>( ( ( idx - home ) & mask ) + 1 );
+            idx = next;
+         }
+      }
+
+      slots[idx] = Slot();
+      --mSize;
+   }
+
+   void Rehash( size_t const capacity )
+   {
+      auto const oldArray = mArray.load( std::memory_order_relaxed );
+      std::unique_ptr<SlotArray> newArray( new SlotArray( capacity ) );
+
+      if ( oldArray != nullptr )
+      {
+         for ( auto slot_it = oldArray->slots.begin(); slot_it != oldArray->slots.end(); ++slot_it )
+         {
+            if ( slot_it->distance != 0 )
+               PlaceInto( *newArray, slot_it->hash, std::move( slot_it->kv ) );
+         }
+      }
+
+      mArray.store( newArray.release(), std::memory_order_release );
+
+      // старый массив ещё могут читать без блокировки, он живёт до разрушения ячейки.
+      // Массивы растут вдвое, так что их суммарный размер не больше текущего
+      if ( cOptimisticReads )
+         mRetired.push_back( std::unique_ptr<SlotArray>( oldArray ) );
+      else
+         delete oldArray;
+   }
+
+   std::atomic<SlotArray*> mArray;
+
+   std::vector<std::unique_ptr<SlotArray>> mRetired;
+
+   size_t mSize;
+};
+
+// хранение в массивах с открытой адресацией, по одной таблице на блокировку
+template <Probing pProbing = Probing::RobinHood>
+struct FlatStorage
+{
+   template <typename TKey, typename TValue>
+   struct Rebind
+   {
+      typedef FlatBucket<TKey, TValue, pProbing> TBucket;
+   };
+};
+
+} // namespace kvs
@@ -0,0 +1,323 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+#include "NodePool.h"
+
+namespace kvs
+{
+
+// ячейка таблицы - список коллизий, в котором рядом с каждым элементом хранится его хэш.
+// Список отсортирован по хэшу, элементы с одинаковым хэшем - по ключу, поэтому поиск
+// проходит чужие элементы по сравнению хэшей и сравнивает ключи только при совпадении
+template <typename TKey, typename TValue>
+class HashedListBucket
+{
+public:
+   typedef std::pair<TKey, TValue> TKeyValue;
+
+   typedef NoNodePool TPool;
+
+   // размер ячеек меняет таблица при рехэше
+   static bool const cSelfResizing = false;
+
+   // узлы списка освобождаются сразу, читать без блокировки нельзя
+   static bool const cOptimisticReads = false;
+
+   static bool const cLockFreeReads = false;
+
+   HashedListBucket()
+   {
+
+   }
+
+   // перенос меняет только указатели списка, значения не трогаются
+   HashedListBucket( HashedListBucket&& b ) noexcept
+   {
+      mValues.swap( b.mValues );
+   }
+
+   HashedListBucket& operator=( HashedListBucket&& b ) noexcept
+   {
+      mValues.swap( b.mValues );
+      return *this;
+   }
+
+   // узлы не из пула, привязывать нечего
+   void Attach( TPool& /*pool*/ )
+   {
+
+   }
+
+   void Clear()
+   {
+      mValues.clear();
+   }
+
+   void Reserve( size_t const /*size*/ )
+   {
+
+   }
+
+   // значение создаётся из args, только если ключа ещё нет
+   template<typename K, typename... Args>
+   bool Emplace( size_t const hash, K&& key, Args&&... args )
+   {
+      auto const insert_position = LowerBound( mValues, hash, key );
+      if ( Matches( insert_position, hash, key ) )
+         return false;
+
+      mValues.emplace( insert_position, hash, std::piecewise_construct, std::forward_as_tuple( std::forward<K>( key ) ), std::forward_as_tuple( std::forward<Args>( args )... ) );
+      return true;
+   }
+
+   // возвращает true, если ключ вставлен, и false, если присвоено значение
+   template<typename K, typename V>
+   bool InsertOrAssign( size_t const hash, K&& key, V&& value )
+   {
+      auto const insert_position = LowerBound( mValues, hash, key );
+      if ( Matches( insert_position, hash, key ) )
+      {
+         insert_position->kv.second = std::forward<V>( value );
+         return false;
+      }
+
+      mValues.emplace( insert_position, hash, std::forward<K>( key ), std::forward<V>( value ) );
+      return true;
+   }
+
+   template<typename K, typename V>
+   bool Update( size_t const hash, K const& key, V&& value )
+   {
+      auto const val_it = LowerBound( mValues, hash, key );
+      if ( !Matches( val_it, hash, key ) )
+         return false;
+
+      val_it->kv.second = std::forward<V>( value );
+      return true;
+   }
+
+   template<typename K>
+   bool Read( size_t const hash, K const& key, TValue& value ) const
+   {
+      return Visit( hash, key, [&value]( TValue const& cur_value )
+      {
+         value = cur_value;
+      } );
+   }
+
+   // вызывает f( значение ) без копирования значения
+   template<typename K, typename Function>
+   bool Visit( size_t const hash, K const& key, Function f ) const
+   {
+      auto const val_it = LowerBound( mValues, hash, key );
+      if ( !Matches( val_it, hash, key ) )
+         return false;
+
+      f( val_it->kv.second );
+      return true;
+   }
+
+   // вызывает f( значение ) с возможностью изменить значение на месте
+   template<typename K, typename Function>
+   bool Modify( size_t const hash, K const& key, Function& f )
+   {
+      auto const val_it = LowerBound( mValues, hash, key );
+      if ( !Matches( val_it, hash, key ) )
+         return false;
+
+      f( val_it->kv.second );
+      return true;
+   }
+
+   // f( значение, есть ли ключ ) -> оставить ли ключ. present - есть ли ключ после вызова,
+   // возвращается изменение количества элементов
+   template<typename K, typename Function>
+   ptrdiff_t Compute( size_t const hash, K&& key, Function& f, bool& present )
+   {
+      auto const val_it = LowerBound( mValues, hash, key );
+      if ( Matches( val_it, hash, key ) )
+      {
+         present = f( val_it->kv.second, true );
+         if ( present )
+            return 0;
+
+         mValues.erase( val_it );
+         return -1;
+      }
+
+      TValue value = TValue();
+      present = f( value, false );
+      if ( !present )
+         return 0;
+
+      mValues.emplace( val_it, hash, std::forward<K>( key ), std::move( value ) );
+      return 1;
+   }
+
+   template<typename K>
+   bool OptimisticRead( size_t const /*hash*/, K const& /*key*/, TValue& /*value*/ ) const
+   {
+      return false;
+   }
+
+   template<typename K>
+   bool LockFreeRead( size_t const /*hash*/, K const& /*key*/, TValue& /*value*/ ) const
+   {
+      return false;
+   }
+
+   // загрузка первого узла цепочки до того, как понадобится хэш
+   void Prefetch( size_t const /*hash*/ ) const
+   {
+      if ( !mValues.empty() )
+         kvs::Prefetch( &mValues.front() );
+   }
+
+   template<typename K>
+   bool Delete( size_t const hash, K const& key )
+   {
+      auto const val_it = LowerBound( mValues, hash, key );
+      if ( !Matches( val_it, hash, key ) )
+         return false;
+
+      mValues.erase( val_it );
+      return true;
+   }
+
+   size_t Size() const
+   {
+      return mValues.size();
+   }
+
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      for ( auto val_it = mValues.begin(), end_it = mValues.end(); val_it != end_it; ++val_it )
+      {
+         f( val_it->kv );
+      }
+   }
+
+   template<typename Predicate>
+   bool FindFirstIf( Predicate p, TKeyValue& found )
+   {
+      for ( auto val_it = mValues.begin(), end_it = mValues.end(); val_it != end_it; ++val_it )
+      {
+         auto const& val = val_it->kv;
+
+         if( p( val ) )
+         {
+            found = val;
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   template<typename Predicate>
+   bool EraseIf( Predicate p )
+   {
+      for ( auto val_it = mValues.begin(), end_it = mValues.end(); val_it != end_it; ++val_it )
+      {
+         if( p( val_it->kv ) )
+         {
+            mValues.erase( val_it );
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   // удаляет все подходящие элементы, возвращает их количество
+   template<typename Predicate>
+   size_t EraseAllIf( Predicate p )
+   {
+      size_t erased = 0;
+      for ( auto val_it = mValues.begin(); val_it != mValues.end(); )
+      {
+         if( p( val_it->kv ) )
+         {
+            val_it = mValues.erase( val_it );
+            ++erased;
+         }
+         else
+         {
+            ++val_it;
+         }
+      }
+
+      return erased;
+   }
+
+   // переносит все элементы в ячейки destination( хэш ), перевешивая узлы списка.
+   // Хэш берётся из узла, хэш-функция не вызывается
+   template<typename THashFunction, typename TDestination>
+   void MoveTo( THashFunction /*hashOf*/, TDestination destination )
+   {
+      while ( !mValues.empty() )
+      {
+         auto const node = mValues.begin();
+         HashedListBucket& target = destination( node->hash );
+         target.mValues.splice( LowerBound( target.mValues, node->hash, node->kv.first ), mValues, node );
+      }
+   }
+
+private:
+   HashedListBucket( HashedListBucket const& );
+
+   HashedListBucket& operator=( HashedListBucket const& );
+
+   struct Entry
+   {
+      template<typename... Args>
+      explicit Entry( size_t const entryHash, Args&&... args )
+         : hash( entryHash )
+         , kv( std::forward<Args>( args )... )
+      {
+
+      }
+
+      size_t hash;
+      TKeyValue kv;
+   };
+
+   typedef std::list<Entry> TCollisionContainer;
+
+   // первый узел, который не меньше пары ( hash, key ). Ключи сравниваются
+   // только у узлов с тем же хэшем
+   template<typename TContainer, typename K>
+   static auto LowerBound( TContainer& values, size_t const hash, K const& key ) -> decltype( values.begin() )
+   {
+      auto val_it = values.begin();
+      while ( val_it != values.end() && ( val_it->hash < hash || ( val_it->hash == hash && val_it->kv.first < key ) ) )
+      {
+         ++val_it;
+      }
+      return val_it;
+   }
+
+   template<typename TIterator, typename K>
+   bool Matches( TIterator const val_it, size_t const hash, K const& key ) const
+   {
+      return val_it != mValues.end() && val_it->hash == hash && val_it->kv.first == key;
+   }
+
+   TCollisionContainer mValues;
+};
+
+// цепочки коллизий с сохранёнными хэшами: рехэш не пересчитывает хэши ключей
+// (для длинных строк это основная его работа под всеми блокировками),
+// а поиск отсекает чужие ключи сравнением хэшей. Узел больше на size_t
+struct HashedListStorage
+{
+   template <typename TKey, typename TValue>
+   struct Rebind
+   {
+      typedef HashedListBucket<TKey, TValue> TBucket;
+   };
+};
+
+} // namespace kvs
@@ -0,0 +1,70 @@
+﻿#pragma once
+
+#include "precomp.h"
+
+namespace kvs
+{
+
+// финализатор MurmurHash3: каждый бит результата зависит от всех битов хэша
+inline size_t MixHash( size_t hash )
+{
+   uint64_t h = hash;
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return static_cast<size_t>( h );
+}
+
+// параметр TIndexing таблицы: как хэш ключа превращается в номер ячейки и номер блокировки.
+// Hash() применяется к хэшу один раз за операцию, Index() по нему выбирает и блокировку,
+// и ячейку. Блокировка ячейки - её номер по модулю количества блокировок, поэтому
+// для количеств, которые выдаёт Count(), Index( hash, locks ) == Index( hash, buckets ) % locks
+
+// остаток от деления: количества ячеек и блокировок любые, хэш берётся как есть
+struct ModuloIndexing
+{
+   static size_t Hash( size_t const hash )
+   {
+      return hash;
+   }
+
+   static size_t Index( size_t const hash, size_t const count )
+   {
+      return hash % count;
+   }
+
+   static size_t Count( size_t const count )
+   {
+      return count;
+   }
+};
+
+// количества округляются вверх до степени двойки, номер - младшие биты хэша без деления.
+// std::hash для целых обычно тождественен, поэтому хэш сначала перемешивается,
+// иначе последовательные и идущие с шагом ключи делили бы одни ячейки
+struct PowerOfTwoIndexing
+{
+   static size_t Hash( size_t const hash )
+   {
+      return MixHash( hash );
+   }
+
+   static size_t Index( size_t const hash, size_t const count )
+   {
+      return hash & ( count - 1 );
+   }
+
+   static size_t Count( size_t const count )
+   {
+      size_t res = 1;
+      while ( res < count )
+      {
+         res *= 2;
+      }
+      return res;
+   }
+};
+
+} // namespace kvs
@@ -0,0 +1,369 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+#include "NodePool.h"
+
+namespace kvs
+{
+
+// ячейка таблицы - отсортированный по ключу список коллизий
+template <typename TKey, typename TValue>
+class ListBucket
+{
+public:
+   typedef std::pair<TKey, TValue> TKeyValue;
+   typedef std::list<TKeyValue> TCollisionContainer;
+   typedef typename TCollisionContainer::iterator TCollisionIterator;
+
+   typedef NoNodePool TPool;
+
+   // размер ячеек меняет таблица при рехэше
+   static bool const cSelfResizing = false;
+
+   // узлы списка освобождаются сразу, читать без блокировки нельзя
+   static bool const cOptimisticReads = false;
+
+   static bool const cLockFreeReads = false;
+
+   ListBucket()
+   {
+
+   }
+
+   ListBucket( ListBucket const& b )
+   {
+      mValues = b.mValues;
+   }
+
+   // перенос меняет только указатели списка, значения не трогаются
+   ListBucket( ListBucket&& b ) noexcept
+   {
+      mValues.swap( b.mValues );
+   }
+
+   ~ListBucket()
+   {
+
+   }
+
+   ListBucket& operator=( ListBucket const& b )
+   {
+      if ( this == &b )
+         return *this;
+
+      mValues = b.mValues;
+      return *this;
+   }
+
+   ListBucket& operator=( ListBucket&& b ) noexcept
+   {
+      mValues.swap( b.mValues );
+      return *this;
+   }
+
+   TCollisionContainer const& Values()
+   {
+      return mValues;
+   }
+
+   // узлы не из пула, привязывать нечего
+   void Attach( TPool& /*pool*/ )
+   {
+
+   }
+
+   void Clear()
+   {
+      mValues.clear();
+   }
+
+   void Reserve( size_t const /*size*/ )
+   {
+
+   }
+
+   // значение создаётся из args, только если ключа ещё нет
+   template<typename K, typename... Args>
+   bool Emplace( size_t const /*hash*/, K&& key, Args&&... args )
+   {
+      auto insert_position = LowerBound( key );
+      if ( insert_position != mValues.end() && insert_position->first == key )
+         return false;
+
+      mValues.emplace( insert_position, std::piecewise_construct, std::forward_as_tuple( std::forward<K>( key ) ), std::forward_as_tuple( std::forward<Args>( args )... ) );
+      return true;
+   }
+
+   // возвращает true, если ключ вставлен, и false, если присвоено значение
+   template<typename K, typename V>
+   bool InsertOrAssign( size_t const hash, K&& key, V&& value )
+   {
+      auto insert_position = LowerBound( key );
+      if ( insert_position != mValues.end() && insert_position->first == key )
+      {
+         insert_position->second = std::forward<V>( value );
+         return false;
+      }
+
+      return Emplace( hash, std::forward<K>( key ), std::forward<V>( value ) );
+   }
+
+   template<typename K, typename V>
+   bool Update( size_t const /*hash*/, K const& key, V&& value )
+   {
+      for ( auto bval_it = mValues.begin(); bval_it != mValues.end(); ++bval_it )
+      {
+         auto& cur_bval = *bval_it;
+         auto const& cur_key = cur_bval.first;
+
+         if ( cur_key == key )
+         {
+            cur_bval.second = std::forward<V>( value );
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   template<typename K>
+   bool Read( size_t const hash, K const& key, TValue& value ) const
+   {
+      return Visit( hash, key, [&value]( TValue const& cur_value )
+      {
+         value = cur_value;
+      } );
+   }
+
+   // вызывает f( значение ) без копирования значения
+   template<typename K, typename Function>
+   bool Visit( size_t const /*hash*/, K const& key, Function f ) const
+   {
+      for ( auto val_it = mValues.begin(); val_it != mValues.end(); ++val_it )
+      {
+         auto& cur_val = *val_it;
+         auto const& cur_key = cur_val.first;
+
+         if ( key < cur_key )
+         {
+            return false;
+         }
+         else if ( cur_key == key )
+         {
+            f( cur_val.second );
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   // вызывает f( значение ) с возможностью изменить значение на месте
+   template<typename K, typename Function>
+   bool Modify( size_t const /*hash*/, K const& key, Function& f )
+   {
+      auto const val_it = LowerBound( key );
+      if ( val_it == mValues.end() || !( val_it->first == key ) )
+         return false;
+
+      f( val_it->second );
+      return true;
+   }
+
+   // f( значение, есть ли ключ ) -> оставить ли ключ. present - есть ли ключ после вызова,
+   // возвращается изменение количества элементов
+   template<typename K, typename Function>
+   ptrdiff_t Compute( size_t const /*hash*/, K&& key, Function& f, bool& present )
+   {
+      auto const val_it = LowerBound( key );
+      if ( val_it != mValues.end() && val_it->first == key )
+      {
+         present = f( val_it->second, true );
+         if ( present )
+            return 0;
+
+         mValues.erase( val_it );
+         return -1;
+      }
+
+      TValue value = TValue();
+      present = f( value, false );
+      if ( !present )
+         return 0;
+
+      mValues.emplace( val_it, std::forward<K>( key ), std::move( value ) );
+      return 1;
+   }
+
+   template<typename K>
+   bool OptimisticRead( size_t const /*hash*/, K const& /*key*/, TValue& /*value*/ ) const
+   {
+      return false;
+   }
+
+   template<typename K>
+   bool LockFreeRead( size_t const /*hash*/, K const& /*key*/, TValue& /*value*/ ) const
+   {
+      return false;
+   }
+
+   // загрузка первого узла цепочки до того, как понадобится ключ
+   void Prefetch( size_t const /*hash*/ ) const
+   {
+      if ( !mValues.empty() )
+         kvs::Prefetch( &mValues.front() );
+   }
+
+   template<typename K>
+   TCollisionIterator Find( K const& key )
+   {
+      for ( auto val_it = mValues.begin(); val_it != mValues.end(); ++val_it )
+      {
+         auto& cur_val = *val_it;
+         auto const& cur_key = cur_val.first;
+
+         if ( key < cur_key )
+         {
+            return mValues.end();
+         }
+         else if ( cur_key == key )
+         {
+            return val_it;
+         }
+      }
+
+      return mValues.end();
+   }
+
+   template<typename K>
+   bool Delete( size_t const /*hash*/, K const& key )
+   {
+      for ( auto bval_it = mValues.begin(); bval_it != mValues.end(); ++bval_it )
+      {
+         auto& cur_bval = *bval_it;
+         auto const& cur_key = cur_bval.first;
+
+         if ( key < cur_key )
+         {
+            return false;
+         }
+         else if ( cur_key == key )
+         {
+            mValues.erase( bval_it );
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   size_t Size() const
+   {
+      return mValues.size();
+   }
+
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      for ( auto val_it = mValues.begin(), end_it = mValues.end(); val_it != end_it; ++val_it )
+      {
+         f( *val_it );
+      }
+   }
+
+   template<typename Predicate>
+   bool FindFirstIf( Predicate p, TKeyValue& found )
+   {
+      for ( auto val_it = mValues.begin(), end_it = mValues.end(); val_it != end_it; ++val_it )
+      {
+         auto const& val = *val_it;
+
+         if( p( val ) )
+         {
+            found = val;
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   template<typename Predicate>
+   bool EraseIf( Predicate p )
+   {
+      for ( auto val_it = mValues.begin(), end_it = mValues.end(); val_it != end_it; ++val_it )
+      {
+         auto const& val = *val_it;
+
+         if( p( val ) )
+         {
+            mValues.erase( val_it );
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   // удаляет все подходящие элементы, возвращает их количество
+   template<typename Predicate>
+   size_t EraseAllIf( Predicate p )
+   {
+      size_t erased = 0;
+      for ( auto val_it = mValues.begin(); val_it != mValues.end(); )
+      {
+         if( p( *val_it ) )
+         {
+            val_it = mValues.erase( val_it );
+            ++erased;
+         }
+         else
+         {
+            ++val_it;
+         }
+      }
+
+      return erased;
+   }
+
+   // переносит все элементы в ячейки destination( хэш ), перевешивая узлы списка
+   // без копирования и перемещения ключей и значений
+   template<typename THashFunction, typename TDestination>
+   void MoveTo( THashFunction hashOf, TDestination destination )
+   {
+      while ( !mValues.empty() )
+      {
+         auto const node = mValues.begin();
+         ListBucket& target = destination( hashOf( node->first ) );
+         target.mValues.splice( target.LowerBound( node->first ), mValues, node );
+      }
+   }
+
+private:
+   // первый узел, ключ которого не меньше key
+   template<typename K>
+   TCollisionIterator LowerBound( K const& key )
+   {
+      auto val_it = mValues.begin();
+      while ( val_it != mValues.end() && val_it->first < key )
+      {
+         ++val_it;
+      }
+      return val_it;
+   }
+
+   TCollisionContainer mValues;
+};
+
+// хранение по умолчанию: цепочки коллизий в std::list
+struct ListStorage
+{
+   template <typename TKey, typename TValue>
+   struct Rebind
+   {
+      typedef ListBucket<TKey, TValue> TBucket;
+   };
+};
+
+} // namespace kvs
@@ -0,0 +1,631 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+
+#if defined( __linux__ )
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+// блокировки для параметра TLock таблицы. Кроме них подходят boost::shared_mutex
+// и std::shared_mutex: нужны lock, unlock, try_lock (для рехэша), lock_shared и unlock_shared
+
+namespace kvs
+{
+
+// пауза в цикле ожидания, чтобы не мешать второму потоку ядра
+inline void CpuRelax()
+{
+#if defined( _MSC_VER )
+   _mm_pause();
+#elif defined( __i386__ ) || defined( __x86_64__ )
+   __builtin_ia32_pause();
+#else
+   std::this_thread::yield();
+#endif
+}
+
+// ожидание в цикле: сначала pause, затем поток отдаёт квант, чтобы не крутиться,
+// пока владелец блокировки вытеснен
+class SpinWait
+{
+public:
+   SpinWait()
+      : mCount( 0 )
+   {
+
+   }
+
+   void Pause()
+   {
+      if ( mCount < cSpinCount )
+      {
+         ++mCount;
+         CpuRelax();
+      }
+      else
+      {
+         std::this_thread::yield();
+      }
+   }
+
+private:
+   static int const cSpinCount = 64;
+
+   int mCount;
+};
+
+// блокировка чтения-записи на одном атомике без сна: для коротких критических секций,
+// когда потоков не больше, чем ядер. Писатель, который ждёт, не пускает новых читателей
+class SpinSharedMutex
+{
+public:
+   SpinSharedMutex()
+      : mState( 0 )
+   {
+
+   }
+
+   void lock()
+   {
+      // сначала занимаем право на запись, затем ждём, пока уйдут читатели
+      SpinWait wait;
+      for ( ;; )
+      {
+         auto state = mState.load( std::memory_order_relaxed );
+         if ( ( state & cWriter ) == 0 && mState.compare_exchange_weak( state, state | cWriter, std::memory_order_acquire ) )
+            break;
+         wait.Pause();
+      }
+
+      while ( ( mState.load( std::memory_order_acquire ) & cReaderMask ) != 0 )
+      {
+         wait.Pause();
+      }
+   }
+
+   bool try_lock()
+   {
+      uint32_t expected = 0;
+      return mState.compare_exchange_strong( expected, cWriter, std::memory_order_acquire );
+   }
+
+   void unlock()
+   {
+      mState.fetch_and( ~cWriter, std::memory_order_release );
+   }
+
+   void lock_shared()
+   {
+      SpinWait wait;
+      while ( !try_lock_shared() )
+      {
+         wait.Pause();
+      }
+   }
+
+   bool try_lock_shared()
+   {
+      auto state = mState.load( std::memory_order_relaxed );
+      while ( ( state & cWriter ) == 0 )
+      {
+         if ( mState.compare_exchange_weak( state, state + 1, std::memory_order_acquire ) )
+            return true;
+      }
+      return false;
+   }
+
+   void unlock_shared()
+   {
+      mState.fetch_sub( 1, std::memory_order_release );
+   }
+
+private:
+   SpinSharedMutex( SpinSharedMutex const& );
+
+   SpinSharedMutex& operator=( SpinSharedMutex const& );
+
+   static uint32_t const cWriter = 1u << 31;
+   static uint32_t const cReaderMask = cWriter - 1;
+
+   std::atomic<uint32_t> mState;
+};
+
+// исключительная блокировка с очередью по билетам: потоки входят в порядке прихода.
+// Читатели тоже берут её исключительно, как std::mutex
+class TicketMutex
+{
+public:
+   TicketMutex()
+      : mNext( 0 )
+      , mServing( 0 )
+   {
+
+   }
+
+   void lock()
+   {
+      auto const ticket = mNext.fetch_add( 1, std::memory_order_relaxed );
+      SpinWait wait;
+      while ( mServing.load( std::memory_order_acquire ) != ticket )
+      {
+         wait.Pause();
+      }
+   }
+
+   // билет берётся, только если очередь пуста
+   bool try_lock()
+   {
+      auto serving = mServing.load( std::memory_order_acquire );
+      return mNext.compare_exchange_strong( serving, serving + 1, std::memory_order_acquire );
+   }
+
+   void unlock()
+   {
+      mServing.store( mServing.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+   }
+
+   void lock_shared()
+   {
+      lock();
+   }
+
+   bool try_lock_shared()
+   {
+      return try_lock();
+   }
+
+   void unlock_shared()
+   {
+      unlock();
+   }
+
+private:
+   TicketMutex( TicketMutex const& );
+
+   TicketMutex& operator=( TicketMutex const& );
+
+   std::atomic<uint32_t> mNext;
+
+   std::atomic<uint32_t> mServing;
+};
+
+// блокировка для таблиц, которые почти только читают (BRAVO). Пока блокировка смещена
+// в сторону чтения, читатель не трогает её общее слово, а занимает ячейку в строке своего
+// потока в глобальной таблице индикаторов: строки потоков лежат в разных кэш-линиях,
+// поэтому читатели на разных ядрах не мешают друг другу. Писатель берёт TUnderlying,
+// снимает смещение и ждёт, пока быстрые читатели освободят свои ячейки. Снятие
+// смещения дорого, поэтому следующие N-кратное его время читатели идут через TUnderlying
+template <typename TUnderlying = std::shared_mutex>
+class BravoSharedMutex
+{
+public:
+   BravoSharedMutex()
+      : mReadBias( true )
+      , mInhibitUntil( 0 )
+   {
+
+   }
+
+   void lock()
+   {
+      mLock.lock();
+      RevokeReadBias();
+   }
+
+   bool try_lock()
+   {
+      if ( !mLock.try_lock() )
+         return false;
+
+      if ( TryRevokeReadBias() )
+         return true;
+
+      mLock.unlock();
+      return false;
+   }
+
+   void unlock()
+   {
+      mLock.unlock();
+   }
+
+   void lock_shared()
+   {
+      if ( TryFastLockShared() )
+         return;
+
+      mLock.lock_shared();
+      RestoreReadBias();
+   }
+
+   bool try_lock_shared()
+   {
+      if ( TryFastLockShared() )
+         return true;
+
+      if ( !mLock.try_lock_shared() )
+         return false;
+
+      RestoreReadBias();
+      return true;
+   }
+
+   void unlock_shared()
+   {
+      auto& thread = CurrentThread();
+      for ( size_t i = 0; i < thread.heldCount; ++i )
+      {
+         if ( thread.held[i] == this )
+         {
+            thread.held[i] = thread.held[--thread.heldCount];
+            IndicatorOf( thread.row ).store( nullptr, std::memory_order_release );
+            return;
+         }
+      }
+
+      mLock.unlock_shared();
+   }
+
+private:
+   BravoSharedMutex( BravoSharedMutex const& );
+
+   BravoSharedMutex& operator=( BravoSharedMutex const& );
+
+   // строк индикаторов, потоки с одинаковым номером по модулю делят строку
+   static size_t const cRowCount = 256;
+
+   // ячеек в строке - одна кэш-линия, ячейка выбирается по адресу блокировки
+   static size_t const cSlotsPerRow = cCacheLineSize / sizeof( void* );
+
+   // во сколько раз пауза в быстром чтении длиннее последнего снятия смещения
+   static int64_t const cInhibitMultiplier = 9;
+
+   // сколько быстрых разделяемых блокировок поток держит одновременно,
+   // остальные берутся через TUnderlying
+   static size_t const cMaxHeldFastLocks = 4;
+
+   typedef std::atomic<BravoSharedMutex const*> TIndicator;
+
+   struct IndicatorRowData
+   {
+      std::array<TIndicator, cSlotsPerRow> slots;
+   };
+
+   typedef CacheAligned<IndicatorRowData> IndicatorRow;
+
+   // строка индикаторов потока и его быстрые разделяемые блокировки: только по ним
+   // unlock_shared отличает свою ячейку от занятой другим потоком той же строки
+   struct ThreadState
+   {
+      size_t row;
+      BravoSharedMutex const* held[cMaxHeldFastLocks];
+      size_t heldCount;
+   };
+
+   bool TryFastLockShared()
+   {
+      if ( !mReadBias.load( std::memory_order_acquire ) )
+         return false;
+
+      auto& thread = CurrentThread();
+      if ( thread.heldCount == cMaxHeldFastLocks )
+         return false;
+
+      auto& indicator = IndicatorOf( thread.row );
+      BravoSharedMutex const* expected = nullptr;
+      if ( !indicator.compare_exchange_strong( expected, this ) )
+         return false;
+
+      // писатель снимает смещение до того, как смотрит индикаторы, поэтому он
+      // либо увидит ячейку, либо читатель увидит снятое смещение
+      if ( !mReadBias.load() )
+      {
+         indicator.store( nullptr, std::memory_order_relaxed );
+         return false;
+      }
+
+      thread.held[thread.heldCount++] = this;
+      return true;
+   }
+
+   // вызывается под эксклюзивной TUnderlying
+   void RevokeReadBias()
+   {
+      if ( !mReadBias.load( std::memory_order_relaxed ) )
+         return;
+
+      mReadBias.store( false );
+      auto const start = Now();
+      auto const rowCount = RowsInUse();
+      for ( size_t row = 0; row < rowCount; ++row )
+      {
+         SpinWait wait;
+         while ( IndicatorOf( row ).load() == this )
+         {
+            wait.Pause();
+         }
+      }
+
+      mInhibitUntil.store( Now() + ( Now() - start ) * cInhibitMultiplier, std::memory_order_relaxed );
+   }
+
+   // не ждёт быстрых читателей: если они есть, смещение возвращается. Читатели,
+   // которые успели увидеть его снятым, ждут на TUnderlying
+   bool TryRevokeReadBias()
+   {
+      if ( !mReadBias.load( std::memory_order_relaxed ) )
+         return true;
+
+      mReadBias.store( false );
+      auto const rowCount = RowsInUse();
+      for ( size_t row = 0; row < rowCount; ++row )
+      {
+         if ( IndicatorOf( row ).load() == this )
+         {
+            mReadBias.store( true, std::memory_order_release );
+            return false;
+         }
+      }
+
+      return true;
+   }
+
+   // вызывается под разделяемой TUnderlying, поэтому писатель в это время смещение не снимает
+   void RestoreReadBias()
+   {
+      if ( !mReadBias.load( std::memory_order_relaxed ) && Now() >= mInhibitUntil.load( std::memory_order_relaxed ) )
+         mReadBias.store( true, std::memory_order_release );
+   }
+
+   TIndicator& IndicatorOf( size_t const row ) const
+   {
+      return Indicators()[row].slots[( reinterpret_cast<uintptr_t>( this ) / cCacheLineSize ) % cSlotsPerRow];
+   }
+
+   static IndicatorRow* Indicators()
+   {
+      static IndicatorRow rows[cRowCount];
+      return rows;
+   }
+
+   // счётчик потоков, которые брали строку. Поток получает строку до того, как займёт
+   // ячейку, поэтому писатель, снявший смещение, видит все строки с быстрыми читателями
+   static std::atomic<size_t>& RowCounter()
+   {
+      static std::atomic<size_t> counter( 0 );
+      return counter;
+   }
+
+   static size_t RowsInUse()
+   {
+      return std::min( RowCounter().load(), cRowCount );
+   }
+
+   static ThreadState& CurrentThread()
+   {
+      thread_local ThreadState thread = { cRowCount, {}, 0 };
+      if ( thread.row == cRowCount )
+         thread.row = RowCounter().fetch_add( 1 ) % cRowCount;
+      return thread;
+   }
+
+   static int64_t Now()
+   {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+   }
+
+   TUnderlying mLock;
+
+   std::atomic<bool> mReadBias;
+
+   std::atomic<int64_t> mInhibitUntil;
+};
+
+#ifndef WIN32
+
+// pthread_rwlock_t с интерфейсом TLock
+class PthreadSharedMutex
+{
+public:
+   PthreadSharedMutex()
+   {
+      pthread_rwlock_init( &mLock, nullptr );
+   }
+
+   ~PthreadSharedMutex()
+   {
+      pthread_rwlock_destroy( &mLock );
+   }
+
+   void lock()
+   {
+      pthread_rwlock_wrlock( &mLock );
+   }
+
+   bool try_lock()
+   {
+      return pthread_rwlock_trywrlock( &mLock ) == 0;
+   }
+
+   void unlock()
+   {
+      pthread_rwlock_unlock( &mLock );
+   }
+
+   void lock_shared()
+   {
+      pthread_rwlock_rdlock( &mLock );
+   }
+
+   bool try_lock_shared()
+   {
+      return pthread_rwlock_tryrdlock( &mLock ) == 0;
+   }
+
+   void unlock_shared()
+   {
+      pthread_rwlock_unlock( &mLock );
+   }
+
+private:
+   PthreadSharedMutex( PthreadSharedMutex const& );
+
+   PthreadSharedMutex& operator=( PthreadSharedMutex const& );
+
+   pthread_rwlock_t mLock;
+};
+
+#endif
+
+#if defined( __linux__ )
+
+// тонкая блокировка чтения-записи на futex, по устройству близкая к SRWLOCK: одно 32-битное
+// слово, без ожидающих захват и освобождение - один CAS или одна атомарная операция.
+// Поток немного крутится и затем засыпает на слове. Писатель, который ждёт, не пускает
+// новых читателей, поэтому читатели не морят писателей голодом
+class FutexSharedMutex
+{
+public:
+   FutexSharedMutex()
+      : mState( 0 )
+   {
+
+   }
+
+   void lock()
+   {
+      int spins = 0;
+      for ( ;; )
+      {
+         auto state = mState.load( std::memory_order_relaxed );
+         if ( ( state & ( cWriter | cReaderMask ) ) == 0 )
+         {
+            if ( mState.compare_exchange_weak( state, state | cWriter, std::memory_order_acquire ) )
+               return;
+            continue;
+         }
+
+         if ( spins < cSpinCount )
+         {
+            ++spins;
+            CpuRelax();
+            continue;
+         }
+
+         // флаг ожидания ставится до сна, иначе освобождающий поток никого не разбудит
+         if ( ( state & cWriterWaiting ) == 0 && !mState.compare_exchange_weak( state, state | cWriterWaiting, std::memory_order_relaxed ) )
+            continue;
+
+         Wait( state | cWriterWaiting );
+      }
+   }
+
+   bool try_lock()
+   {
+      auto state = mState.load( std::memory_order_relaxed );
+      while ( ( state & ( cWriter | cReaderMask ) ) == 0 )
+      {
+         if ( mState.compare_exchange_weak( state, state | cWriter, std::memory_order_acquire ) )
+            return true;
+      }
+      return false;
+   }
+
+   void unlock()
+   {
+      auto const state = mState.fetch_and( ~( cWriter | cWriterWaiting | cReadersWaiting ), std::memory_order_release );
+      if ( ( state & ( cWriterWaiting | cReadersWaiting ) ) != 0 )
+         WakeAll();
+   }
+
+   void lock_shared()
+   {
+      int spins = 0;
+      for ( ;; )
+      {
+         auto state = mState.load( std::memory_order_relaxed );
+         if ( ( state & ( cWriter | cWriterWaiting ) ) == 0 )
+         {
+            if ( mState.compare_exchange_weak( state, state + 1, std::memory_order_acquire ) )
+               return;
+            continue;
+         }
+
+         if ( spins < cSpinCount )
+         {
+            ++spins;
+            CpuRelax();
+            continue;
+         }
+
+         if ( ( state & cReadersWaiting ) == 0 && !mState.compare_exchange_weak( state, state | cReadersWaiting, std::memory_order_relaxed ) )
+            continue;
+
+         Wait( state | cReadersWaiting );
+      }
+   }
+
+   bool try_lock_shared()
+   {
+      auto state = mState.load( std::memory_order_relaxed );
+      while ( ( state & ( cWriter | cWriterWaiting ) ) == 0 )
+      {
+         if ( mState.compare_exchange_weak( state, state + 1, std::memory_order_acquire ) )
+            return true;
+      }
+      return false;
+   }
+
+   // последний читатель будит ждущего писателя, а с ним и ждущих читателей
+   void unlock_shared()
+   {
+      auto const state = mState.fetch_sub( 1, std::memory_order_release ) - 1;
+      if ( ( state & cReaderMask ) == 0 && ( state & cWriterWaiting ) != 0 )
+      {
+         auto const waiting = mState.fetch_and( ~( cWriterWaiting | cReadersWaiting ), std::memory_order_relaxed );
+         if ( ( waiting & ( cWriterWaiting | cReadersWaiting ) ) != 0 )
+            WakeAll();
+      }
+   }
+
+private:
+   FutexSharedMutex( FutexSharedMutex const& );
+
+   FutexSharedMutex& operator=( FutexSharedMutex const& );
+
+   static uint32_t const cWriter = 1u << 31;
+   static uint32_t const cWriterWaiting = 1u << 30;
+   static uint32_t const cReadersWaiting = 1u << 29;
+   static uint32_t const cReaderMask = cReadersWaiting - 1;
+
+   // попыток перед сном: критические секции таблицы короткие
+   static int const cSpinCount = 100;
+
+   // спит, пока слово равно expected. Проснуться можно и без причины, вызывающий проверяет сам
+   void Wait( uint32_t const expected )
+   {
+      syscall( SYS_futex, reinterpret_cast<uint32_t*>( &mState ), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0 );
+   }
+
+   void WakeAll()
+   {
+      syscall( SYS_futex, reinterpret_cast<uint32_t*>( &mState ), FUTEX_WAKE_PRIVATE, std::numeric_limits<int>::max(), nullptr, nullptr, 0 );
+   }
+
+   std::atomic<uint32_t> mState;
+};
+
+#endif
+
+} // namespace kvs
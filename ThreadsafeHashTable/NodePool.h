@@ -0,0 +1,147 @@
+﻿#pragma once
+
+#include "precomp.h"
+
+namespace kvs
+{
+
+class EpochDomain;
+
+// пул для хранилищ без узлов: ничего не хранит
+struct NoNodePool
+{
+   // домен эпох нужен только хранилищам, которые читаются без блокировки
+   void Bind( EpochDomain& /*domain*/ )
+   {
+
+   }
+
+   void ReleaseAll()
+   {
+
+   }
+
+   size_t ReservedBytes() const
+   {
+      return 0;
+   }
+};
+
+// пул узлов одной блокировки. Узлы нарезаются из больших блоков (слабов), освобождённые
+// узлы переиспользуются, а все слабы освобождаются разом. Пул не синхронизирован:
+// им пользуются только под эксклюзивной блокировкой его полосы
+template <typename TNode>
+class NodePool
+{
+public:
+   NodePool()
+      : mFree( nullptr )
+      , mCursor( nullptr )
+      , mEnd( nullptr )
+      , mNextSlabNodes( cMinSlabNodes )
+      , mReservedBytes( 0 )
+   {
+
+   }
+
+   ~NodePool()
+   {
+      ReleaseAll();
+   }
+
+   void Bind( EpochDomain& /*domain*/ )
+   {
+
+   }
+
+   // память под узел, узел конструирует вызывающий
+   void* Allocate()
+   {
+      if ( mFree != nullptr )
+      {
+         auto const node = mFree;
+         mFree = mFree->next;
+         return node;
+      }
+
+      if ( mCursor == mEnd )
+         AddSlab();
+
+      return mCursor++;
+   }
+
+   // память уже разрушенного узла
+   void Deallocate( void* const p )
+   {
+      auto const node = static_cast<FreeNode*>( p );
+      node->next = mFree;
+      mFree = node;
+   }
+
+   // вызывается, когда в пуле не осталось живых узлов
+   void ReleaseAll()
+   {
+      for ( auto slab_it = mSlabs.begin(); slab_it != mSlabs.end(); ++slab_it )
+      {
+         ::operator delete( *slab_it );
+      }
+
+      std::vector<void*>().swap( mSlabs );
+      mFree = nullptr;
+      mCursor = nullptr;
+      mEnd = nullptr;
+      mNextSlabNodes = cMinSlabNodes;
+      mReservedBytes = 0;
+   }
+
+   size_t ReservedBytes() const
+   {
+      return mReservedBytes;
+   }
+
+private:
+   NodePool( NodePool const& );
+
+   NodePool& operator=( NodePool const& );
+
+   struct FreeNode
+   {
+      FreeNode* next;
+   };
+
+   typedef typename std::aligned_storage<sizeof( TNode ), alignof( TNode )>::type TNodeStorage;
+
+   static_assert( sizeof( TNode ) >= sizeof( FreeNode ), "node must fit a free list link" );
+
+   // слабы растут вдвое, чтобы маленькие полосы не держали много памяти
+   static size_t const cMinSlabNodes = 16;
+   static size_t const cMaxSlabNodes = 4096;
+
+   void AddSlab()
+   {
+      auto const bytes = mNextSlabNodes * sizeof( TNodeStorage );
+      auto const slab = static_cast<TNodeStorage*>( ::operator new( bytes ) );
+      mSlabs.push_back( slab );
+
+      mCursor = slab;
+      mEnd = slab + mNextSlabNodes;
+      mReservedBytes += bytes;
+
+      if ( mNextSlabNodes < cMaxSlabNodes )
+         mNextSlabNodes *= 2;
+   }
+
+   FreeNode* mFree;
+
+   TNodeStorage* mCursor;
+
+   TNodeStorage* mEnd;
+
+   size_t mNextSlabNodes;
+
+   size_t mReservedBytes;
+
+   std::vector<void*> mSlabs;
+};
+
+} // namespace kvs
@@ -0,0 +1,423 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+#include "NodePool.h"
+
+namespace kvs
+{
+
+// ячейка таблицы - отсортированный по ключу односвязный список коллизий,
+// узлы которого берутся из пула своей блокировки, а не из общего аллокатора
+template <typename TKey, typename TValue>
+class PooledListBucket
+{
+   struct Node;
+
+public:
+   typedef std::pair<TKey, TValue> TKeyValue;
+   typedef NodePool<Node> TPool;
+
+   // размер ячеек меняет таблица при рехэше
+   static bool const cSelfResizing = false;
+
+   // узлы переиспользуются сразу, читать без блокировки нельзя
+   static bool const cOptimisticReads = false;
+
+   static bool const cLockFreeReads = false;
+
+   PooledListBucket()
+      : mHead( nullptr )
+      , mSize( 0 )
+      , mPool( nullptr )
+   {
+
+   }
+
+   PooledListBucket( PooledListBucket&& b ) noexcept
+      : mHead( b.mHead )
+      , mSize( b.mSize )
+      , mPool( b.mPool )
+   {
+      b.mHead = nullptr;
+      b.mSize = 0;
+   }
+
+   ~PooledListBucket()
+   {
+      Clear();
+   }
+
+   PooledListBucket& operator=( PooledListBucket&& b ) noexcept
+   {
+      if ( this == &b )
+         return *this;
+
+      Clear();
+      mHead = b.mHead;
+      mSize = b.mSize;
+      mPool = b.mPool;
+      b.mHead = nullptr;
+      b.mSize = 0;
+      return *this;
+   }
+
+   // привязка к пулу блокировки, которой принадлежит ячейка.
+   // Если ячейка уже заполнена из другого пула, узлы переезжают в новый
+   void Attach( TPool& pool )
+   {
+      if ( mPool == &pool )
+         return;
+
+      auto node = mHead;
+      auto const oldPool = mPool;
+      mPool = &pool;
+      mHead = nullptr;
+
+      Node** tail = &mHead;
+      while ( node != nullptr )
+      {
+         auto const next = node->next;
+         auto const moved = CreateNode( std::move( node->kv ) );
+         DestroyNode( *oldPool, node );
+
+         *tail = moved;
+         tail = &moved->next;
+         node = next;
+      }
+   }
+
+   void Clear()
+   {
+      while ( mHead != nullptr )
+      {
+         auto const node = mHead;
+         mHead = node->next;
+         DestroyNode( *mPool, node );
+      }
+
+      mSize = 0;
+   }
+
+   void Reserve( size_t const /*size*/ )
+   {
+
+   }
+
+   // значение создаётся из args, только если ключа ещё нет
+   template<typename K, typename... Args>
+   bool Emplace( size_t const /*hash*/, K&& key, Args&&... args )
+   {
+      auto const link = LowerBound( key );
+      if ( *link != nullptr && ( *link )->kv.first == key )
+         return false;
+
+      Link( link, CreateNode( TKeyValue( std::piecewise_construct, std::forward_as_tuple( std::forward<K>( key ) ), std::forward_as_tuple( std::forward<Args>( args )... ) ) ) );
+      return true;
+   }
+
+   // возвращает true, если ключ вставлен, и false, если присвоено значение
+   template<typename K, typename V>
+   bool InsertOrAssign( size_t const /*hash*/, K&& key, V&& value )
+   {
+      auto const link = LowerBound( key );
+      if ( *link != nullptr && ( *link )->kv.first == key )
+      {
+         ( *link )->kv.second = std::forward<V>( value );
+         return false;
+      }
+
+      Link( link, CreateNode( TKeyValue( std::forward<K>( key ), std::forward<V>( value ) ) ) );
+      return true;
+   }
+
+   template<typename K, typename V>
+   bool Update( size_t const /*hash*/, K const& key, V&& value )
+   {
+      auto const node = Locate( key );
+      if ( node == nullptr )
+         return false;
+
+      node->kv.second = std::forward<V>( value );
+      return true;
+   }
+
+   template<typename K>
+   bool Read( size_t const /*hash*/, K const& key, TValue& value ) const
+   {
+      auto const node = Locate( key );
+      if ( node == nullptr )
+         return false;
+
+      value = node->kv.second;
+      return true;
+   }
+
+   // вызывает f( значение ) без копирования значения
+   template<typename K, typename Function>
+   bool Visit( size_t const /*hash*/, K const& key, Function f ) const
+   {
+      auto const node = Locate( key );
+      if ( node == nullptr )
+         return false;
+
+      TValue const& value = node->kv.second;
+      f( value );
+      return true;
+   }
+
+   // вызывает f( значение ) с возможностью изменить значение на месте
+   template<typename K, typename Function>
+   bool Modify( size_t const /*hash*/, K const& key, Function& f )
+   {
+      auto const node = Locate( key );
+      if ( node == nullptr )
+         return false;
+
+      f( node->kv.second );
+      return true;
+   }
+
+   // f( значение, есть ли ключ ) -> оставить ли ключ. present - есть ли ключ после вызова,
+   // возвращается изменение количества элементов
+   template<typename K, typename Function>
+   ptrdiff_t Compute( size_t const /*hash*/, K&& key, Function& f, bool& present )
+   {
+      auto const link = LowerBound( key );
+      if ( *link != nullptr && ( *link )->kv.first == key )
+      {
+         present = f( ( *link )->kv.second, true );
+         if ( present )
+            return 0;
+
+         Unlink( link );
+         return -1;
+      }
+
+      TValue value = TValue();
+      present = f( value, false );
+      if ( !present )
+         return 0;
+
+      Link( link, CreateNode( TKeyValue( std::forward<K>( key ), std::move( value ) ) ) );
+      return 1;
+   }
+
+   template<typename K>
+   bool OptimisticRead( size_t const /*hash*/, K const& /*key*/, TValue& /*value*/ ) const
+   {
+      return false;
+   }
+
+   template<typename K>
+   bool LockFreeRead( size_t const /*hash*/, K const& /*key*/, TValue& /*value*/ ) const
+   {
+      return false;
+   }
+
+   // загрузка первого узла цепочки до того, как понадобится ключ
+   void Prefetch( size_t const /*hash*/ ) const
+   {
+      if ( mHead != nullptr )
+         kvs::Prefetch( mHead );
+   }
+
+   template<typename K>
+   bool Delete( size_t const /*hash*/, K const& key )
+   {
+      auto const link = LowerBound( key );
+      if ( *link == nullptr || !( ( *link )->kv.first == key ) )
+         return false;
+
+      Unlink( link );
+      return true;
+   }
+
+   size_t Size() const
+   {
+      return mSize;
+   }
+
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      for ( auto node = mHead; node != nullptr; node = node->next )
+      {
+         f( node->kv );
+      }
+   }
+
+   template<typename Predicate>
+   bool FindFirstIf( Predicate p, TKeyValue& found )
+   {
+      for ( auto node = mHead; node != nullptr; node = node->next )
+      {
+         if( p( node->kv ) )
+         {
+            found = node->kv;
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   template<typename Predicate>
+   bool EraseIf( Predicate p )
+   {
+      for ( auto link = &mHead; *link != nullptr; link = &( *link )->next )
+      {
+         if( p( ( *link )->kv ) )
+         {
+            Unlink( link );
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   // удаляет все подходящие элементы, возвращает их количество
+   template<typename Predicate>
+   size_t EraseAllIf( Predicate p )
+   {
+      size_t erased = 0;
+      for ( auto link = &mHead; *link != nullptr; )
+      {
+         if( p( ( *link )->kv ) )
+         {
+            Unlink( link );
+            ++erased;
+         }
+         else
+         {
+            link = &( *link )->next;
+         }
+      }
+
+      return erased;
+   }
+
+   // переносит все элементы в ячейки destination( хэш ). Узлы из того же пула
+   // перевешиваются, в ячейку с другим пулом элемент перемещается в новый узел
+   template<typename THashFunction, typename TDestination>
+   void MoveTo( THashFunction hashOf, TDestination destination )
+   {
+      while ( mHead != nullptr )
+      {
+         auto const node = mHead;
+         mHead = node->next;
+         --mSize;
+
+         PooledListBucket& target = destination( hashOf( node->kv.first ) );
+         if ( target.mPool == mPool )
+         {
+            target.Link( target.LowerBound( node->kv.first ), node );
+         }
+         else
+         {
+            target.Link( target.LowerBound( node->kv.first ), target.CreateNode( std::move( node->kv ) ) );
+            DestroyNode( *mPool, node );
+         }
+      }
+   }
+
+private:
+   PooledListBucket( PooledListBucket const& );
+
+   PooledListBucket& operator=( PooledListBucket const& );
+
+   struct Node
+   {
+      explicit Node( TKeyValue&& value )
+         : next( nullptr )
+         , kv( std::move( value ) )
+      {
+
+      }
+
+      Node* next;
+      TKeyValue kv;
+   };
+
+   Node* CreateNode( TKeyValue&& kv )
+   {
+      auto const memory = mPool->Allocate();
+      try
+      {
+         return new ( memory ) Node( std::move( kv ) );
+      }
+      catch( ... )
+      {
+         mPool->Deallocate( memory );
+         throw;
+      }
+   }
+
+   static void DestroyNode( TPool& pool, Node* const node )
+   {
+      node->~Node();
+      pool.Deallocate( node );
+   }
+
+   // ссылка на первый узел, ключ которого не меньше key
+   template<typename K>
+   Node** LowerBound( K const& key )
+   {
+      auto link = &mHead;
+      while ( *link != nullptr && ( *link )->kv.first < key )
+      {
+         link = &( *link )->next;
+      }
+      return link;
+   }
+
+   template<typename K>
+   Node* Locate( K const& key ) const
+   {
+      for ( auto node = mHead; node != nullptr; node = node->next )
+      {
+         if ( key < node->kv.first )
+            return nullptr;
+
+         if ( node->kv.first == key )
+            return node;
+      }
+
+      return nullptr;
+   }
+
+   void Link( Node** const link, Node* const node )
+   {
+      node->next = *link;
+      *link = node;
+      ++mSize;
+   }
+
+   void Unlink( Node** const link )
+   {
+      auto const node = *link;
+      *link = node->next;
+      DestroyNode( *mPool, node );
+      --mSize;
+   }
+
+   Node* mHead;
+
+   size_t mSize;
+
+   TPool* mPool;
+};
+
+// цепочки коллизий с узлами из пула блокировки: вставка не ходит в общий аллокатор,
+// удалённые узлы переиспользуются, а Clear() освобождает память пулов целиком
+struct PooledListStorage
+{
+   template <typename TKey, typename TValue>
+   struct Rebind
+   {
+      typedef PooledListBucket<TKey, TValue> TBucket;
+   };
+};
+
+} // namespace kvs
@@ -0,0 +1,104 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+
+namespace kvs
+{
+
+// слот распределённого счётчика, меняется только под своей блокировкой
+struct CounterSlot
+{
+   CounterSlot()
+      : value( 0 )
+      , pending( 0 )
+   {
+
+   }
+
+   // накопленное изменение уходит в общий атомик, когда по модулю достигает порога,
+   // так что ошибка общего значения не больше количества слотов * threshold.
+   // Возвращает true, если общее значение изменилось
+   bool Add( ptrdiff_t const delta, ptrdiff_t const threshold, std::atomic<ptrdiff_t>& approximate )
+   {
+      value.store( value.load( std::memory_order_relaxed ) + delta, std::memory_order_relaxed );
+
+      pending += delta;
+      if ( pending >= threshold || -pending >= threshold )
+      {
+         approximate.fetch_add( pending, std::memory_order_relaxed );
+         pending = 0;
+         return true;
+      }
+      return false;
+   }
+
+   void Reset( ptrdiff_t const initial = 0 )
+   {
+      value.store( initial, std::memory_order_relaxed );
+      pending = 0;
+   }
+
+   std::atomic<ptrdiff_t> value;
+   ptrdiff_t pending;
+};
+
+// счётчик, разнесённый по слотам (по одному на блокировку).
+// Слот меняется только под своей блокировкой и лежит в своей кэш-линии, поэтому
+// писатели разных блокировок не делят одну линию. Точное значение - сумма слотов,
+// приблизительное собирается в общий атомик пачками
+class ShardedCounter
+{
+public:
+   explicit ShardedCounter( size_t const slotCount )
+      : mSlots( slotCount )
+      , mApproximate( 0 )
+   {
+
+   }
+
+   // вызывается под блокировкой слота
+   void Add( size_t const slot, ptrdiff_t const delta, ptrdiff_t const threshold = 1 )
+   {
+      mSlots[slot].Add( delta, threshold, mApproximate );
+   }
+
+   size_t Approximate() const
+   {
+      auto const value = mApproximate.load( std::memory_order_relaxed );
+      return value < 0 ? 0 : static_cast<size_t>( value );
+   }
+
+   size_t Exact() const
+   {
+      ptrdiff_t value = 0;
+      for ( auto slot_it = mSlots.begin(); slot_it != mSlots.end(); ++slot_it )
+      {
+         value += slot_it->value.load( std::memory_order_relaxed );
+      }
+      return value < 0 ? 0 : static_cast<size_t>( value );
+   }
+
+   // вызывается под всеми блокировками, значение целиком кладётся в первый слот
+   void Reset( size_t const value = 0 )
+   {
+      for ( auto slot_it = mSlots.begin(); slot_it != mSlots.end(); ++slot_it )
+      {
+         slot_it->Reset();
+      }
+      if ( !mSlots.empty() )
+         mSlots.front().Reset( static_cast<ptrdiff_t>( value ) );
+      mApproximate = static_cast<ptrdiff_t>( value );
+   }
+
+private:
+   ShardedCounter( ShardedCounter const& );
+
+   ShardedCounter& operator=( ShardedCounter const& );
+
+   std::vector<CacheAligned<CounterSlot>> mSlots;
+
+   alignas( cCacheLineSize ) std::atomic<ptrdiff_t> mApproximate;
+};
+
+} // namespace kvs
@@ -0,0 +1,474 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+#include "LockPolicies.h"
+
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
+
+namespace kvs
+{
+
+// interprocess_sharable_mutex из boost.interprocess с интерфейсом TLock: ждущий поток спит,
+// а не крутится, зато каждый захват и освобождение проходят через внутренний мьютекс
+class InterprocessSharedMutex
+{
+public:
+   InterprocessSharedMutex()
+   {
+
+   }
+
+   void lock()
+   {
+      mLock.lock();
+   }
+
+   bool try_lock()
+   {
+      return mLock.try_lock();
+   }
+
+   void unlock()
+   {
+      mLock.unlock();
+   }
+
+   void lock_shared()
+   {
+      mLock.lock_sharable();
+   }
+
+   bool try_lock_shared()
+   {
+      return mLock.try_lock_sharable();
+   }
+
+   void unlock_shared()
+   {
+      mLock.unlock_sharable();
+   }
+
+private:
+   InterprocessSharedMutex( InterprocessSharedMutex const& );
+
+   InterprocessSharedMutex& operator=( InterprocessSharedMutex const& );
+
+   boost::interprocess::interprocess_sharable_mutex mLock;
+};
+
+enum class SharedMode
+{
+   // создать регион заново, прежний регион с тем же именем удаляется
+   Create,
+   // подключиться к региону, который создал другой процесс
+   Open
+};
+
+// таблица, у которой ячейки, элементы и блокировки лежат в именованном регионе общей памяти
+// (shared_memory_object из boost.interprocess: shm_open в POSIX, файл, отображённый в память,
+// в Windows). Один процесс создаёт и заполняет таблицу, другие подключаются к тому же региону
+// и читают его одновременно с ним, без своих копий данных.
+// В регионе нет указателей: ячейка хранит номер первого узла, узел - номер следующего,
+// поэтому в каждом процессе регион может быть отображён по своему адресу.
+// Блокировки лежат в том же регионе, по одной на pLockCount-ю часть ячеек, как в ThreadsafeHashTable.
+// TLock должна работать между процессами: SpinSharedMutex (одно атомарное слово) или
+// InterprocessSharedMutex, но не блокировки, которые спят на адресе процесса.
+// Количество элементов ограничено capacity, заданным при создании, и ячейки не растут.
+// Узлы удалённых элементов переиспользуются вставками той же блокировки.
+// Ключи и значения - тривиально копируемые типы без указателей, а хэш должен давать одно и то же
+// во всех процессах. Процесс, упавший под блокировкой, оставляет её захваченной
+template <typename TKey, typename TValue, size_t pLockCount = 64, typename TLock = SpinSharedMutex, typename THash = std::hash<TKey>>
+class SharedMemoryHashTable
+{
+public:
+   typedef std::pair<TKey, TValue> TKeyValue;
+
+   static_assert( std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value, "shared memory needs trivially copyable keys and values" );
+   static_assert( std::atomic<uint64_t>::is_always_lock_free, "shared memory needs address-free atomics" );
+
+   // capacity - наибольшее количество элементов, нужно только при создании.
+   // Бросает boost::interprocess::interprocess_exception, если регион не создаётся или
+   // не найден, и std::runtime_error, если найденный регион не от такой же таблицы
+   SharedMemoryHashTable( SharedMode const mode, std::string const& name, size_t const capacity = 0 )
+   {
+      using namespace boost::interprocess;
+
+      if ( mode == SharedMode::Create )
+      {
+         if ( capacity == 0 || capacity >= cNil )
+            throw std::invalid_argument( "capacity out of range" );
+
+         shared_memory_object::remove( name.c_str() );
+         shared_memory_object shm( create_only, name.c_str(), read_write );
+         auto const bucketCount = BucketCountFor( capacity );
+         shm.truncate( static_cast<offset_t>( Layout( capacity, bucketCount ).size ) );
+         mRegion = mapped_region( shm, read_write );
+         Create( capacity, bucketCount );
+      }
+      else
+      {
+         shared_memory_object shm( open_only, name.c_str(), read_write );
+         mRegion = mapped_region( shm, read_write );
+         Attach();
+      }
+   }
+
+   // удаляет регион по имени. Процессы, которые его отобразили, продолжают с ним работать.
+   // Деструктор таблицы только снимает отображение, сам регион остаётся
+   static bool Remove( std::string const& name )
+   {
+      return boost::interprocess::shared_memory_object::remove( name.c_str() );
+   }
+
+   bool Find( TKey const& key, TValue& value )
+   {
+      auto const hash = mHasher( key );
+      auto& stripe = GetStripe( hash );
+      stripe.lock.lock_shared();
+
+      auto const idx = Locate( hash, key, nullptr );
+      if ( idx != cNil )
+         value = mNodes[idx].value;
+
+      stripe.lock.unlock_shared();
+      return idx != cNil;
+   }
+
+   // false - ключ уже есть или в регионе не осталось свободных узлов
+   bool Insert( TKeyValue const& kv )
+   {
+      auto const hash = mHasher( kv.first );
+      auto& stripe = GetStripe( hash );
+      stripe.lock.lock();
+
+      auto res = false;
+      if ( Locate( hash, kv.first, nullptr ) == cNil )
+      {
+         auto const idx = AllocateNode( stripe );
+         if ( idx != cNil )
+         {
+            auto& head = mHeads[BucketIndex( hash )];
+            auto& node = mNodes[idx];
+            node.key = kv.first;
+            node.value = kv.second;
+            node.next = head;
+            head = idx;
+
+            stripe.size.store( stripe.size.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+            res = true;
+         }
+      }
+
+      stripe.lock.unlock();
+      return res;
+   }
+
+   bool Update( TKeyValue const& kv )
+   {
+      auto const hash = mHasher( kv.first );
+      auto& stripe = GetStripe( hash );
+      stripe.lock.lock();
+
+      auto const idx = Locate( hash, kv.first, nullptr );
+      if ( idx != cNil )
+         mNodes[idx].value = kv.second;
+
+      stripe.lock.unlock();
+      return idx != cNil;
+   }
+
+   void Erase( TKey const& key )
+   {
+      auto const hash = mHasher( key );
+      auto& stripe = GetStripe( hash );
+      stripe.lock.lock();
+
+      uint32_t* link = nullptr;
+      auto const idx = Locate( hash, key, &link );
+      if ( idx != cNil )
+      {
+         *link = mNodes[idx].next;
+         mNodes[idx].next = stripe.freeHead;
+         stripe.freeHead = idx;
+
+         stripe.size.store( stripe.size.load( std::memory_order_relaxed ) - 1, std::memory_order_relaxed );
+      }
+
+      stripe.lock.unlock();
+   }
+
+   size_t Size() const
+   {
+      int64_t size = 0;
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         size += mStripes[idx].size.load( std::memory_order_relaxed );
+      }
+      return size < 0 ? 0 : static_cast<size_t>( size );
+   }
+
+   size_t Capacity() const
+   {
+      return static_cast<size_t>( mHeader->capacity );
+   }
+
+   // размер региона в байтах
+   size_t RegionSize() const
+   {
+      return mRegion.get_size();
+   }
+
+   // f( TKeyValue const& ) под разделяемыми блокировками всех полос
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         mStripes[idx].lock.lock_shared();
+      }
+
+      for ( size_t buc_idx = 0; buc_idx < mBucketCount; ++buc_idx )
+      {
+         for ( auto idx = mHeads[buc_idx]; idx != cNil; idx = mNodes[idx].next )
+         {
+            TKeyValue const kv( mNodes[idx].key, mNodes[idx].value );
+            f( kv );
+         }
+      }
+
+      for ( size_t idx = pLockCount; idx > 0; --idx )
+      {
+         mStripes[idx - 1].lock.unlock_shared();
+      }
+   }
+
+   void Clear()
+   {
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         mStripes[idx].lock.lock();
+      }
+
+      std::fill( mHeads, mHeads + mBucketCount, cNil );
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         mStripes[idx].freeHead = cNil;
+         mStripes[idx].size.store( 0, std::memory_order_relaxed );
+      }
+      mHeader->nextNode.store( 0, std::memory_order_relaxed );
+
+      for ( size_t idx = pLockCount; idx > 0; --idx )
+      {
+         mStripes[idx - 1].lock.unlock();
+      }
+   }
+
+private:
+   SharedMemoryHashTable( SharedMemoryHashTable const& );
+
+   SharedMemoryHashTable& operator=( SharedMemoryHashTable const& );
+
+   // пустая ссылка на узел
+   static uint32_t const cNil = 0xffffffffu;
+
+   static uint64_t const cMagic = 0x3150414d4853564bull; // "KVSHMAP1"
+
+   static size_t const cBucketsPerElement = 2;
+
+   // заголовок региона
+   struct Header
+   {
+      uint64_t magic;
+
+      uint32_t keySize;
+
+      uint32_t valueSize;
+
+      uint64_t lockCount;
+
+      uint64_t stripeSize;
+
+      uint64_t capacity;
+
+      uint64_t bucketCount;
+
+      // узлы, ещё ни разу не выданные, начинаются с этого номера
+      std::atomic<uint64_t> nextNode;
+
+      // регион заполнен создателем, выставляется последним
+      std::atomic<uint32_t> ready;
+   };
+
+   struct alignas( cCacheLineSize ) Stripe
+   {
+      TLock lock;
+
+      // меняется только под эксклюзивной блокировкой
+      std::atomic<int64_t> size;
+
+      // удалённые узлы ячеек этой блокировки
+      uint32_t freeHead;
+   };
+
+   struct Node
+   {
+      uint32_t next;
+
+      TKey key;
+
+      TValue value;
+   };
+
+   // смещения частей региона: заголовок, блокировки, ячейки (номера первых узлов), узлы
+   struct RegionLayout
+   {
+      size_t stripes;
+      size_t heads;
+      size_t nodes;
+      size_t size;
+   };
+
+   static size_t AlignUp( size_t const offset, size_t const alignment )
+   {
+      return ( offset + alignment - 1 ) / alignment * alignment;
+   }
+
+   static RegionLayout Layout( size_t const capacity, size_t const bucketCount )
+   {
+      RegionLayout layout;
+      layout.stripes = AlignUp( sizeof( Header ), alignof( Stripe ) );
+      layout.heads = AlignUp( layout.stripes + pLockCount * sizeof( Stripe ), cCacheLineSize );
+      layout.nodes = AlignUp( layout.heads + bucketCount * sizeof( uint32_t ), alignof( Node ) );
+      layout.size = layout.nodes + capacity * sizeof( Node );
+      return layout;
+   }
+
+   // ячеек вдвое больше, чем элементов, и количество блокировок делит количество ячеек
+   static size_t BucketCountFor( size_t const capacity )
+   {
+      auto const count = capacity * cBucketsPerElement;
+      return ( count + pLockCount - 1 ) / pLockCount * pLockCount;
+   }
+
+   void Map( size_t const capacity, size_t const bucketCount )
+   {
+      auto const base = static_cast<char*>( mRegion.get_address() );
+      auto const layout = Layout( capacity, bucketCount );
+      mStripes = reinterpret_cast<Stripe*>( base + layout.stripes );
+      mHeads = reinterpret_cast<uint32_t*>( base + layout.heads );
+      mNodes = reinterpret_cast<Node*>( base + layout.nodes );
+      mBucketCount = bucketCount;
+   }
+
+   void Create( size_t const capacity, size_t const bucketCount )
+   {
+      mHeader = new ( mRegion.get_address() ) Header();
+      mHeader->magic = cMagic;
+      mHeader->keySize = sizeof( TKey );
+      mHeader->valueSize = sizeof( TValue );
+      mHeader->lockCount = pLockCount;
+      mHeader->stripeSize = sizeof( Stripe );
+      mHeader->capacity = capacity;
+      mHeader->bucketCount = bucketCount;
+      mHeader->nextNode.store( 0, std::memory_order_relaxed );
+
+      Map( capacity, bucketCount );
+      for ( size_t idx = 0; idx < pLockCount; ++idx )
+      {
+         auto const stripe = new ( &mStripes[idx] ) Stripe();
+         stripe->size.store( 0, std::memory_order_relaxed );
+         stripe->freeHead = cNil;
+      }
+      std::fill( mHeads, mHeads + bucketCount, cNil );
+
+      mHeader->ready.store( 1, std::memory_order_release );
+   }
+
+   void Attach()
+   {
+      if ( mRegion.get_size() < sizeof( Header ) )
+         throw std::runtime_error( "shared region is too small" );
+
+      mHeader = static_cast<Header*>( mRegion.get_address() );
+      if ( mHeader->ready.load( std::memory_order_acquire ) != 1 || mHeader->magic != cMagic )
+         throw std::runtime_error( "shared region is not initialized" );
+
+      if ( mHeader->keySize != sizeof( TKey ) || mHeader->valueSize != sizeof( TValue ) || mHeader->lockCount != pLockCount || mHeader->stripeSize != sizeof( Stripe ) )
+         throw std::runtime_error( "shared region belongs to another table type" );
+
+      auto const capacity = static_cast<size_t>( mHeader->capacity );
+      auto const bucketCount = static_cast<size_t>( mHeader->bucketCount );
+      if ( mRegion.get_size() < Layout( capacity, bucketCount ).size )
+         throw std::runtime_error( "shared region is too small" );
+
+      Map( capacity, bucketCount );
+   }
+
+   Stripe& GetStripe( size_t const hash ) const
+   {
+      return mStripes[hash % pLockCount];
+   }
+
+   size_t BucketIndex( size_t const hash ) const
+   {
+      return hash % mBucketCount;
+   }
+
+   // номер узла с ключом или cNil. link - ссылка на найденный узел, для удаления.
+   // Вызывается под блокировкой ключа
+   uint32_t Locate( size_t const hash, TKey const& key, uint32_t** link ) const
+   {
+      auto prev = &mHeads[BucketIndex( hash )];
+      for ( auto idx = *prev; idx != cNil; idx = *prev )
+      {
+         if ( mNodes[idx].key == key )
+         {
+            if ( link != nullptr )
+               *link = prev;
+            return idx;
+         }
+         prev = &mNodes[idx].next;
+      }
+
+      return cNil;
+   }
+
+   // узел из списка удалённых своей блокировки, иначе ещё не выданный. Вызывается под блокировкой stripe
+   uint32_t AllocateNode( Stripe& stripe )
+   {
+      if ( stripe.freeHead != cNil )
+      {
+         auto const idx = stripe.freeHead;
+         stripe.freeHead = mNodes[idx].next;
+         return idx;
+      }
+
+      auto next = mHeader->nextNode.load( std::memory_order_relaxed );
+      do
+      {
+         if ( next >= mHeader->capacity )
+            return cNil;
+      } while ( !mHeader->nextNode.compare_exchange_weak( next, next + 1, std::memory_order_relaxed ) );
+
+      return static_cast<uint32_t>( next );
+   }
+
+   THash mHasher;
+
+   boost::interprocess::mapped_region mRegion;
+
+   Header* mHeader;
+
+   Stripe* mStripes;
+
+   uint32_t* mHeads;
+
+   Node* mNodes;
+
+   size_t mBucketCount;
+};
+
+} // namespace kvs
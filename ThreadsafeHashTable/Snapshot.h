@@ -0,0 +1,219 @@
+﻿#pragma once
+
+#include "precomp.h"
+
+namespace kvs
+{
+
+// снимок таблицы (SaveSnapshot, LoadSnapshot) для тривиально копируемых ключей и значений:
+// заголовок, затем блоки. Блок - количество записей uint64_t и сами записи подряд: байты ключа,
+// затем байты значения, без выравнивания. Блок с нулевым количеством - конец снимка.
+// Числа записаны в порядке байтов машины, поэтому снимок читается только там, где совпадают
+// порядок байтов и размеры типов. Файл читается от начала до конца, поэтому его можно
+// как передавать потоком, так и отображать в память
+struct SnapshotHeader
+{
+   static uint32_t const cVersion = 1;
+
+   SnapshotHeader()
+      : version( cVersion )
+      , keySize( 0 )
+      , valueSize( 0 )
+      , reserved( 0 )
+      , expectedCount( 0 )
+   {
+      std::memcpy( magic, "KVSSNAP", sizeof( magic ) );
+   }
+
+   bool Matches( SnapshotHeader const& other ) const
+   {
+      return std::memcmp( magic, other.magic, sizeof( magic ) ) == 0 && version == other.version && keySize == other.keySize && valueSize == other.valueSize;
+   }
+
+   char magic[8];
+
+   uint32_t version;
+
+   uint32_t keySize;
+
+   uint32_t valueSize;
+
+   uint32_t reserved;
+
+   // размер таблицы в начале записи, по нему загрузка заранее выделяет ячейки
+   uint64_t expectedCount;
+};
+
+// запись снимка. Записи копятся в буфере, а в файл уходят блоком, когда их набралось
+// cBlockRecords, - так запись в файл можно делать без блокировок таблицы
+template <typename TKey, typename TValue>
+class SnapshotWriter
+{
+public:
+   static size_t const cRecordSize = sizeof( TKey ) + sizeof( TValue );
+
+   static size_t const cBlockRecords = 64 * 1024;
+
+   SnapshotWriter( std::string const& path, uint64_t const expectedCount )
+      : mFile( path, std::ios::binary | std::ios::trunc )
+      , mRecords( 0 )
+   {
+      mBuffer.reserve( sizeof( uint64_t ) + cBlockRecords * cRecordSize );
+      mBuffer.resize( sizeof( uint64_t ) );
+
+      SnapshotHeader header;
+      header.keySize = sizeof( TKey );
+      header.valueSize = sizeof( TValue );
+      header.expectedCount = expectedCount;
+      mFile.write( reinterpret_cast<char const*>( &header ), sizeof( header ) );
+   }
+
+   void Add( std::pair<TKey, TValue> const& kv )
+   {
+      auto const offset = mBuffer.size();
+      mBuffer.resize( offset + cRecordSize );
+      std::memcpy( &mBuffer[offset], &kv.first, sizeof( TKey ) );
+      std::memcpy( &mBuffer[offset + sizeof( TKey )], &kv.second, sizeof( TValue ) );
+      ++mRecords;
+   }
+
+   bool BlockFull() const
+   {
+      return mRecords >= cBlockRecords;
+   }
+
+   // пишет накопленные записи одним блоком
+   bool Flush()
+   {
+      if ( mRecords == 0 )
+         return mFile.good();
+
+      uint64_t const count = mRecords;
+      std::memcpy( &mBuffer[0], &count, sizeof( count ) );
+      mFile.write( mBuffer.data(), mBuffer.size() );
+
+      mBuffer.resize( sizeof( uint64_t ) );
+      mRecords = 0;
+      return mFile.good();
+   }
+
+   // пишет оставшиеся записи и конец снимка
+   bool Finish()
+   {
+      if ( !Flush() )
+         return false;
+
+      uint64_t const end = 0;
+      mFile.write( reinterpret_cast<char const*>( &end ), sizeof( end ) );
+      mFile.flush();
+      return mFile.good();
+   }
+
+private:
+   SnapshotWriter( SnapshotWriter const& );
+
+   SnapshotWriter& operator=( SnapshotWriter const& );
+
+   std::ofstream mFile;
+
+   // количество записей блока, затем записи
+   std::vector<char> mBuffer;
+
+   size_t mRecords;
+};
+
+// чтение снимка по блокам
+template <typename TKey, typename TValue>
+class SnapshotReader
+{
+public:
+   static size_t const cRecordSize = sizeof( TKey ) + sizeof( TValue );
+
+   explicit SnapshotReader( std::string const& path )
+      : mFile( path, std::ios::binary )
+      , mRecords( 0 )
+      , mComplete( false )
+   {
+      SnapshotHeader expected;
+      expected.keySize = sizeof( TKey );
+      expected.valueSize = sizeof( TValue );
+
+      mFile.read( reinterpret_cast<char*>( &mHeader ), sizeof( mHeader ) );
+      mGood = mFile.good() && mHeader.Matches( expected );
+   }
+
+   // файл открылся, и это снимок таблицы с такими же размерами ключа и значения
+   bool Good() const
+   {
+      return mGood;
+   }
+
+   uint64_t ExpectedCount() const
+   {
+      return mHeader.expectedCount;
+   }
+
+   // читает следующий блок, false - конец снимка или ошибка чтения
+   bool NextBlock()
+   {
+      mRecords = 0;
+      if ( !mGood || mComplete )
+         return false;
+
+      uint64_t count = 0;
+      mFile.read( reinterpret_cast<char*>( &count ), sizeof( count ) );
+      if ( !mFile.good() )
+         return mGood = false;
+
+      if ( count == 0 )
+      {
+         mComplete = true;
+         return false;
+      }
+
+      mBuffer.resize( static_cast<size_t>( count ) * cRecordSize );
+      mFile.read( mBuffer.data(), mBuffer.size() );
+      if ( !mFile.good() )
+         return mGood = false;
+
+      mRecords = static_cast<size_t>( count );
+      return true;
+   }
+
+   size_t BlockSize() const
+   {
+      return mRecords;
+   }
+
+   void Record( size_t const idx, TKey& key, TValue& value ) const
+   {
+      auto const record = &mBuffer[idx * cRecordSize];
+      std::memcpy( &key, record, sizeof( TKey ) );
+      std::memcpy( &value, record + sizeof( TKey ), sizeof( TValue ) );
+   }
+
+   // прочитан конец снимка
+   bool Complete() const
+   {
+      return mComplete;
+   }
+
+private:
+   SnapshotReader( SnapshotReader const& );
+
+   SnapshotReader& operator=( SnapshotReader const& );
+
+   std::ifstream mFile;
+
+   SnapshotHeader mHeader;
+
+   std::vector<char> mBuffer;
+
+   size_t mRecords;
+
+   bool mGood;
+
+   bool mComplete;
+};
+
+} // namespace kvs
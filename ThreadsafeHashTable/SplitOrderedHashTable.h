@@ -0,0 +1,507 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+#include "Epoch.h"
+
+namespace kvs
+{
+
+// таблица без блокировок на split-ordered списке (Shalev, Shavit).
+// Все элементы лежат в одном отсортированном односвязном списке без блокировок (Harris, Michael),
+// упорядоченном по перевёрнутым битам хэша. Ячейка - указатель на фиктивный узел внутри
+// списка, после которого идут элементы ячейки. При удвоении ячеек элементы никуда не
+// переносятся: новая ячейка лишь вставляет свой фиктивный узел посреди родительской.
+// Удалённые узлы и старые значения освобождаются по эпохам, поэтому читатель может
+// идти по списку, пока другие потоки удаляют из него.
+// Интерфейс повторяет ThreadsafeHashTable, чтобы их можно было подставлять друг вместо друга
+template <typename TKey, typename TValue, typename THash = std::hash<TKey>>
+class SplitOrderedHashTable
+{
+public:
+   typedef std::pair<TKey, TValue> TKeyValue;
+
+   // bucketCount - начальное количество ячеек, округляется вверх до степени двойки
+   explicit SplitOrderedHashTable( size_t const bucketCount = cMinBucketCount )
+      : mBucketCount( RoundUpToPowerOfTwo( bucketCount ) )
+      , mSizes( SizeSlotCount() )
+   {
+      for ( size_t idx = 0; idx < cSegmentCount; ++idx )
+      {
+         mSegments[idx].store( nullptr, std::memory_order_relaxed );
+      }
+
+      // фиктивный узел ячейки 0 - голова всего списка
+      BucketSlot( 0 ).store( new Node( 0 ), std::memory_order_release );
+   }
+
+   // к этому моменту никто не должен обращаться к таблице
+   ~SplitOrderedHashTable()
+   {
+      auto node = BucketSlot( 0 ).load( std::memory_order_relaxed );
+      while ( node != nullptr )
+      {
+         auto const next = Pointer( node->next.load( std::memory_order_relaxed ) );
+         DeleteNode( node );
+         node = next;
+      }
+
+      for ( size_t idx = 0; idx < cSegmentCount; ++idx )
+      {
+         delete[] mSegments[idx].load( std::memory_order_relaxed );
+      }
+   }
+
+   bool Find( TKey const& key, TValue& value )
+   {
+      EpochDomain::Guard guard( mDomain );
+
+      auto const hash = HashOf( key );
+      Node* prev;
+      Node* cur;
+      if ( !Search( Bucket( hash, guard ), RegularOrder( hash ), &key, prev, cur, guard ) )
+         return false;
+
+      value = *static_cast<ValueNode*>( cur )->value.load( std::memory_order_acquire );
+      return true;
+   }
+
+   // размер - сумма счётчиков потоков, во время вставок и удалений он приблизительный
+   size_t Size() const
+   {
+      ptrdiff_t size = 0;
+      for ( auto size_it = mSizes.begin(); size_it != mSizes.end(); ++size_it )
+      {
+         size += size_it->value.load( std::memory_order_relaxed );
+      }
+      return size < 0 ? 0 : static_cast<size_t>( size );
+   }
+
+   TValue operator[]( TKey const& key )
+   {
+      TValue value;
+      if ( Find( key, value ) )
+         return value;
+      throw std::exception( "Key not found" );
+   }
+
+   bool Insert( TKeyValue const& kv )
+   {
+      return InsertImpl( TKey( kv.first ), std::unique_ptr<TValue>( new TValue( kv.second ) ) );
+   }
+
+   bool Insert( TKeyValue&& kv )
+   {
+      return InsertImpl( std::move( kv.first ), std::unique_ptr<TValue>( new TValue( std::move( kv.second ) ) ) );
+   }
+
+   // значение заменяется целиком: новое публикуется одной атомарной записью,
+   // старое освобождается, когда его не смогут читать
+   bool Update( TKeyValue const& kv )
+   {
+      EpochDomain::Guard guard( mDomain );
+
+      auto const hash = HashOf( kv.first );
+      Node* prev;
+      Node* cur;
+      if ( !Search( Bucket( hash, guard ), RegularOrder( hash ), &kv.first, prev, cur, guard ) )
+         return false;
+
+      std::unique_ptr<TValue> value( new TValue( kv.second ) );
+      auto const old = static_cast<ValueNode*>( cur )->value.exchange( value.release(), std::memory_order_acq_rel );
+      guard.Retire( old );
+      return true;
+   }
+
+   void Erase( TKey const& key )
+   {
+      EpochDomain::Guard guard( mDomain );
+
+      auto const hash = HashOf( key );
+      auto const head = Bucket( hash, guard );
+      auto const order = RegularOrder( hash );
+      for ( ;; )
+      {
+         Node* prev;
+         Node* cur;
+         if ( !Search( head, order, &key, prev, cur, guard ) )
+            return;
+
+         // удаление - это пометка узла, кто пометил, тот и удалил
+         auto next = cur->next.load( std::memory_order_acquire );
+         if ( IsMarked( next ) || !cur->next.compare_exchange_strong( next, next | cMark, std::memory_order_acq_rel ) )
+            continue;
+
+         AddSize( -1 );
+
+         // вырезать узел может и другой поток, который пройдёт мимо
+         auto expected = reinterpret_cast<uintptr_t>( cur );
+         if ( prev->next.compare_exchange_strong( expected, next, std::memory_order_acq_rel ) )
+            guard.Retire( static_cast<ValueNode*>( cur ) );
+         else
+            Search( head, order, &key, prev, cur, guard );
+         return;
+      }
+   }
+
+   // не атомарна относительно параллельных вставок
+   void Clear()
+   {
+      std::vector<TKey> keys;
+      ForEachNode( [&keys]( ValueNode& node )
+      {
+         keys.push_back( node.key );
+      } );
+
+      for ( auto key_it = keys.begin(); key_it != keys.end(); ++key_it )
+      {
+         Erase( *key_it );
+      }
+   }
+
+   // f( TKeyValue const& ) для копии каждого элемента. Обход не атомарен
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      ForEachNode( [&f]( ValueNode& node )
+      {
+         f( TKeyValue( node.key, *node.value.load( std::memory_order_acquire ) ) );
+      } );
+   }
+
+   // заранее удваивает ячейки, чтобы вставка size элементов не меняла их количество.
+   // Фиктивные узлы новых ячеек всё равно создаются при первом обращении
+   void Reserve( size_t const size )
+   {
+      GrowTo( RoundUpToPowerOfTwo( size / cMaxLoadFactor + 1 ) );
+   }
+
+   size_t BucketCount() const
+   {
+      return mBucketCount.load( std::memory_order_relaxed );
+   }
+
+   // удалённые узлы и заменённые значения, которые ещё могут читать другие потоки
+   RetiredMemory GetRetiredMemory() const
+   {
+      return mDomain.GetRetiredMemory();
+   }
+
+private:
+   SplitOrderedHashTable( SplitOrderedHashTable const& );
+
+   SplitOrderedHashTable& operator=( SplitOrderedHashTable const& );
+
+   static size_t const cMinBucketCount = 16;
+
+   // средняя длина ячейки, после которой ячейки удваиваются
+   static size_t const cMaxLoadFactor = 2;
+
+   // через сколько вставок потока проверяется, не пора ли удвоить ячейки (степень двойки)
+   static size_t const cGrowthCheckPeriod = 16;
+
+   // сегмент s хранит ячейки [2^s, 2^(s+1)), сегмент 0 - ячейки 0 и 1
+   static size_t const cSegmentCount = 64;
+
+   // младший бит ссылки на следующий узел помечает сам узел удалённым
+   static uintptr_t const cMark = 1;
+
+   // фиктивный узел ячейки. Фиктивные узлы никогда не удаляются
+   struct Node
+   {
+      explicit Node( uint64_t const nodeOrder )
+         : order( nodeOrder )
+         , next( 0 )
+      {
+
+      }
+
+      // перевёрнутый хэш: у элементов младший бит 1, у фиктивных узлов 0
+      uint64_t const order;
+
+      std::atomic<uintptr_t> next;
+   };
+
+   struct ValueNode : Node
+   {
+      ValueNode( uint64_t const nodeOrder, TKey&& nodeKey, TValue* const nodeValue )
+         : Node( nodeOrder )
+         , key( std::move( nodeKey ) )
+         , value( nodeValue )
+      {
+
+      }
+
+      ~ValueNode()
+      {
+         delete value.load( std::memory_order_relaxed );
+      }
+
+      TKey const key;
+
+      std::atomic<TValue*> value;
+   };
+
+   struct SizeData
+   {
+      SizeData()
+         : value( 0 )
+      {
+
+      }
+
+      std::atomic<ptrdiff_t> value;
+   };
+
+   typedef CacheAligned<SizeData> SizeSlot;
+
+   typedef std::atomic<Node*> TBucketHead;
+
+   bool InsertImpl( TKey&& key, std::unique_ptr<TValue> value )
+   {
+      auto const hash = HashOf( key );
+      std::unique_ptr<ValueNode> node( new ValueNode( RegularOrder( hash ), std::move( key ), value.get() ) );
+      value.release();
+
+      {
+         EpochDomain::Guard guard( mDomain );
+
+         auto const head = Bucket( hash, guard );
+         for ( ;; )
+         {
+            Node* prev;
+            Node* cur;
+            if ( Search( head, node->order, &node->key, prev, cur, guard ) )
+               return false;
+
+            auto expected = reinterpret_cast<uintptr_t>( cur );
+            node->next.store( expected, std::memory_order_relaxed );
+            if ( prev->next.compare_exchange_strong( expected, reinterpret_cast<uintptr_t>( node.get() ), std::memory_order_acq_rel ) )
+               break;
+         }
+      }
+
+      node.release();
+
+      // общий размер пересчитывается не на каждой вставке
+      if ( ( AddSize( 1 ) & ( cGrowthCheckPeriod - 1 ) ) == 0 )
+      {
+         auto const bucketCount = BucketCount();
+         if ( Size() > bucketCount * cMaxLoadFactor )
+            GrowTo( bucketCount * 2 );
+      }
+      return true;
+   }
+
+   // ищет в списке от head первый узел с порядком order и ключом key (для фиктивного узла key
+   // не задан) и возвращает true, если нашёл. Иначе cur - первый узел с большим порядком,
+   // а prev - предыдущий, между ними вставляется новый узел. Помеченные узлы по дороге вырезаются
+   bool Search( Node* const head, uint64_t const order, TKey const* const key, Node*& prev, Node*& cur, EpochDomain::Guard& guard )
+   {
+      for ( ;; )
+      {
+         prev = head;
+         cur = Pointer( prev->next.load( std::memory_order_acquire ) );
+
+         for ( ;; )
+         {
+            if ( cur == nullptr )
+               return false;
+
+            auto const next = cur->next.load( std::memory_order_acquire );
+            if ( IsMarked( next ) )
+            {
+               // кто вырезал узел, тот и откладывает его освобождение
+               auto expected = reinterpret_cast<uintptr_t>( cur );
+               if ( !prev->next.compare_exchange_strong( expected, next & ~cMark, std::memory_order_acq_rel ) )
+                  break;
+
+               guard.Retire( static_cast<ValueNode*>( cur ) );
+               cur = Pointer( next );
+               continue;
+            }
+
+            if ( order < cur->order )
+               return false;
+
+            if ( order == cur->order && ( key == nullptr || static_cast<ValueNode*>( cur )->key == *key ) )
+               return true;
+
+            prev = cur;
+            cur = Pointer( next );
+         }
+      }
+   }
+
+   // фиктивный узел ячейки хэша, создаётся при первом обращении к ячейке
+   Node* Bucket( uint64_t const hash, EpochDomain::Guard& guard )
+   {
+      return BucketHead( static_cast<size_t>( hash & ( BucketCount() - 1 ) ), guard );
+   }
+
+   Node* BucketHead( size_t const bucket, EpochDomain::Guard& guard )
+   {
+      auto& slot = BucketSlot( bucket );
+      auto const head = slot.load( std::memory_order_acquire );
+      if ( head != nullptr )
+         return head;
+
+      // фиктивный узел вставляется в список родительской ячейки - той же без старшего бита
+      auto const parent = BucketHead( bucket & ~( size_t( 1 ) << HighestBit( bucket ) ), guard );
+      std::unique_ptr<Node> dummy( new Node( Reverse( bucket ) ) );
+      for ( ;; )
+      {
+         Node* prev;
+         Node* cur;
+         if ( Search( parent, dummy->order, nullptr, prev, cur, guard ) )
+         {
+            // другой поток успел вставить фиктивный узел этой ячейки
+            slot.store( cur, std::memory_order_release );
+            return cur;
+         }
+
+         auto expected = reinterpret_cast<uintptr_t>( cur );
+         dummy->next.store( expected, std::memory_order_relaxed );
+         if ( prev->next.compare_exchange_strong( expected, reinterpret_cast<uintptr_t>( dummy.get() ), std::memory_order_acq_rel ) )
+            break;
+      }
+
+      slot.store( dummy.get(), std::memory_order_release );
+      return dummy.release();
+   }
+
+   // ссылка на ячейку в её сегменте, сегмент создаётся при первом обращении
+   TBucketHead& BucketSlot( size_t const bucket )
+   {
+      auto const segment = bucket < 2 ? 0 : HighestBit( bucket );
+      auto const offset = bucket < 2 ? bucket : bucket - ( size_t( 1 ) << segment );
+
+      auto heads = mSegments[segment].load( std::memory_order_acquire );
+      if ( heads == nullptr )
+      {
+         auto const created = new TBucketHead[segment == 0 ? 2 : size_t( 1 ) << segment]();
+         if ( mSegments[segment].compare_exchange_strong( heads, created, std::memory_order_acq_rel ) )
+            heads = created;
+         else
+            delete[] created;
+      }
+
+      return heads[offset];
+   }
+
+   template<typename Function>
+   void ForEachNode( Function f )
+   {
+      EpochDomain::Guard guard( mDomain );
+
+      auto node = BucketSlot( 0 ).load( std::memory_order_acquire );
+      while ( node != nullptr )
+      {
+         auto const next = node->next.load( std::memory_order_acquire );
+         if ( ( node->order & 1 ) != 0 && !IsMarked( next ) )
+            f( *static_cast<ValueNode*>( node ) );
+         node = Pointer( next );
+      }
+   }
+
+   void GrowTo( size_t const bucketCount )
+   {
+      auto current = BucketCount();
+      while ( current < bucketCount && !mBucketCount.compare_exchange_weak( current, bucketCount, std::memory_order_relaxed ) )
+      {
+
+      }
+   }
+
+   // возвращает новое значение счётчика своего потока
+   ptrdiff_t AddSize( ptrdiff_t const delta )
+   {
+      return mSizes[ThreadSlot() % mSizes.size()].value.fetch_add( delta, std::memory_order_relaxed ) + delta;
+   }
+
+   uint64_t HashOf( TKey const& key ) const
+   {
+      return static_cast<uint64_t>( mHash( key ) );
+   }
+
+   // у элемента старший бит хэша выставлен, чтобы после переворота порядок был нечётным
+   // и элемент шёл после фиктивного узла своей ячейки
+   static uint64_t RegularOrder( uint64_t const hash )
+   {
+      return Reverse( hash | ( uint64_t( 1 ) << 63 ) );
+   }
+
+   static uint64_t Reverse( uint64_t x )
+   {
+      x = ( ( x >> 1 ) & 0x5555555555555555ull ) | ( ( x & 0x5555555555555555ull ) << 1 );
+      x = ( ( x >> 2 ) & 0x3333333333333333ull ) | ( ( x & 0x3333333333333333ull ) << 2 );
+      x = ( ( x >> 4 ) & 0x0F0F0F0F0F0F0F0Full ) | ( ( x & 0x0F0F0F0F0F0F0F0Full ) << 4 );
+      x = ( ( x >> 8 ) & 0x00FF00FF00FF00FFull ) | ( ( x & 0x00FF00FF00FF00FFull ) << 8 );
+      x = ( ( x >> 16 ) & 0x0000FFFF0000FFFFull ) | ( ( x & 0x0000FFFF0000FFFFull ) << 16 );
+      return ( x >> 32 ) | ( x << 32 );
+   }
+
+   static size_t HighestBit( size_t x )
+   {
+      size_t bit = 0;
+      while ( x >>= 1 )
+      {
+         ++bit;
+      }
+      return bit;
+   }
+
+   static size_t RoundUpToPowerOfTwo( size_t const value )
+   {
+      size_t result = 2;
+      while ( result < value )
+      {
+         result *= 2;
+      }
+      return result;
+   }
+
+   static bool IsMarked( uintptr_t const link )
+   {
+      return ( link & cMark ) != 0;
+   }
+
+   static Node* Pointer( uintptr_t const link )
+   {
+      return reinterpret_cast<Node*>( link & ~cMark );
+   }
+
+   static void DeleteNode( Node* const node )
+   {
+      if ( ( node->order & 1 ) != 0 )
+         delete static_cast<ValueNode*>( node );
+      else
+         delete node;
+   }
+
+   // номер потока для счётчика размера
+   static size_t ThreadSlot()
+   {
+      static std::atomic<size_t> next( 0 );
+      thread_local size_t const slot = next.fetch_add( 1, std::memory_order_relaxed );
+      return slot;
+   }
+
+   static size_t SizeSlotCount()
+   {
+      auto const count = std::thread::hardware_concurrency() * 2;
+      return count < 16 ? 16 : count;
+   }
+
+   THash mHash;
+
+   EpochDomain mDomain;
+
+   std::atomic<TBucketHead*> mSegments[cSegmentCount];
+
+   alignas( cCacheLineSize ) std::atomic<size_t> mBucketCount;
+
+   std::vector<SizeSlot> mSizes;
+};
+
+} // namespace kvs
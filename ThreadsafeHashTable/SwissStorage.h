@@ -0,0 +1,691 @@
+﻿#pragma once
+
+#include "precomp.h"
+#include "CacheLine.h"
+#include "NodePool.h"
+#include "Indexing.h"
+#include "ListStorage.h"
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define KVS_SWISS_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+namespace kvs
+{
+
+// управляющий байт слота: пустой, удалённый или у занятого - младшие 7 бит хэша
+int8_t const cSwissEmpty = -128;
+int8_t const cSwissDeleted = -2;
+
+size_t const cSwissGroupSize = 16;
+
+// управляющие байты группы слотов, выровнены под одну загрузку SSE2
+struct alignas( 16 ) SwissControl
+{
+   int8_t bytes[cSwissGroupSize];
+};
+
+// сравнение всех управляющих байтов группы сразу. Результат - маска, бит i которой
+// отвечает байту i. Без SSE2 байты сравниваются по одному
+class SwissGroup
+{
+public:
+   explicit SwissGroup( SwissControl const& control )
+#ifdef KVS_SWISS_SSE2
+      : mControl( _mm_load_si128( reinterpret_cast<__m128i const*>( control.bytes ) ) )
+#else
+      : mControl( control )
+#endif
+   {
+
+   }
+
+   uint32_t Match( int8_t const h2 ) const
+   {
+#ifdef KVS_SWISS_SSE2
+      return static_cast<uint32_t>( _mm_movemask_epi8( _mm_cmpeq_epi8( mControl, _mm_set1_epi8( h2 ) ) ) );
+#else
+      return MatchIf( [h2]( int8_t const c ) { return c == h2; } );
+#endif
+   }
+
+   uint32_t MatchEmpty() const
+   {
+      return Match( cSwissEmpty );
+   }
+
+   // пустые и удалённые слоты - байты со старшим битом
+   uint32_t MatchFree() const
+   {
+#ifdef KVS_SWISS_SSE2
+      return static_cast<uint32_t>( _mm_movemask_epi8( mControl ) );
+#else
+      return MatchIf( []( int8_t const c ) { return c < 0; } );
+#endif
+   }
+
+   // номер младшего установленного бита непустой маски
+   static unsigned LowestBit( uint32_t const mask )
+   {
+#if defined( _MSC_VER )
+      unsigned long idx;
+      _BitScanForward( &idx, mask );
+      return idx;
+#else
+      return static_cast<unsigned>( __builtin_ctz( mask ) );
+#endif
+   }
+
+private:
+#ifdef KVS_SWISS_SSE2
+   __m128i mControl;
+#else
+   template<typename Predicate>
+   uint32_t MatchIf( Predicate p ) const
+   {
+      uint32_t mask = 0;
+      for ( size_t idx = 0; idx < cSwissGroupSize; ++idx )
+      {
+         if ( p( mControl.bytes[idx] ) )
+            mask |= 1u << idx;
+      }
+      return mask;
+   }
+
+   SwissControl mControl;
+#endif
+};
+
+// ячейка таблицы - хэш-таблица с открытой адресацией по группам из 16 слотов (как Swiss table).
+// У каждого слота есть управляющий байт с 7 битами хэша, и кандидаты в группе находятся
+// одним сравнением всех 16 байтов, а ключи сравниваются только у кандидатов.
+// Группы пробируются квадратично, поиск останавливается на группе с пустым слотом
+template <typename TKey, typename TValue>
+class SwissBucket
+{
+public:
+   typedef std::pair<TKey, TValue> TKeyValue;
+
+   typedef NoNodePool TPool;
+
+   // ячейка сама меняет свой размер, рехэш всей таблицы не нужен
+   static bool const cSelfResizing = true;
+
+   // простые типы можно читать без блокировки с проверкой версии
+   static bool const cOptimisticReads = std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value;
+
+   static bool const cLockFreeReads = false;
+
+   SwissBucket()
+      : mArray( nullptr )
+      , mSize( 0 )
+      , mDeleted( 0 )
+   {
+
+   }
+
+   SwissBucket( SwissBucket&& b ) noexcept
+      : mArray( b.mArray.exchange( nullptr ) )
+      , mRetired( std::move( b.mRetired ) )
+      , mSize( b.mSize )
+      , mDeleted( b.mDeleted )
+   {
+      b.mSize = 0;
+      b.mDeleted = 0;
+   }
+
+   ~SwissBucket()
+   {
+      delete mArray.load();
+   }
+
+   SwissBucket& operator=( SwissBucket&& b ) noexcept
+   {
+      if ( this == &b )
+         return *this;
+
+      delete mArray.exchange( b.mArray.exchange( nullptr ) );
+      mRetired = std::move( b.mRetired );
+      mSize = b.mSize;
+      mDeleted = b.mDeleted;
+      b.mSize = 0;
+      b.mDeleted = 0;
+      return *this;
+   }
+
+   // узлы не из пула, привязывать нечего
+   void Attach( TPool& /*pool*/ )
+   {
+
+   }
+
+   void Clear()
+   {
+      auto array = mArray.load( std::memory_order_relaxed );
+      if ( array == nullptr )
+         return;
+
+      if ( cOptimisticReads )
+      {
+         // массив может читать поток без блокировки, поэтому не освобождаем, а чистим
+         array->Reset();
+      }
+      else
+      {
+         mArray.store( nullptr, std::memory_order_relaxed );
+         delete array;
+      }
+
+      mSize = 0;
+      mDeleted = 0;
+   }
+
+   void Reserve( size_t const size )
+   {
+      auto const capacity = CapacityFor( size );
+      if ( capacity > Capacity() )
+         Rehash( capacity );
+   }
+
+   // значение создаётся из args, только если ключа ещё нет
+   template<typename K, typename... Args>
+   bool Emplace( size_t const hash, K&& key, Args&&... args )
+   {
+      if ( Locate( hash, key ) != npos )
+         return false;
+
+      Add( hash, TKeyValue( std::piecewise_construct, std::forward_as_tuple( std::forward<K>( key ) ), std::forward_as_tuple( std::forward<Args>( args )... ) ) );
+      return true;
+   }
+
+   // возвращает true, если ключ вставлен, и false, если присвоено значение
+   template<typename K, typename V>
+   bool InsertOrAssign( size_t const hash, K&& key, V&& value )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx != npos )
+      {
+         Slots()[idx].second = std::forward<V>( value );
+         return false;
+      }
+
+      Add( hash, TKeyValue( std::forward<K>( key ), std::forward<V>( value ) ) );
+      return true;
+   }
+
+   template<typename K, typename V>
+   bool Update( size_t const hash, K const& key, V&& value )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      Slots()[idx].second = std::forward<V>( value );
+      return true;
+   }
+
+   template<typename K>
+   bool Read( size_t const hash, K const& key, TValue& value ) const
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      value = Slots()[idx].second;
+      return true;
+   }
+
+   // вызывает f( значение ) без копирования значения
+   template<typename K, typename Function>
+   bool Visit( size_t const hash, K const& key, Function f ) const
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      TValue const& value = Slots()[idx].second;
+      f( value );
+      return true;
+   }
+
+   // вызывает f( значение ) с возможностью изменить значение на месте
+   template<typename K, typename Function>
+   bool Modify( size_t const hash, K const& key, Function& f )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      f( Slots()[idx].second );
+      return true;
+   }
+
+   // f( значение, есть ли ключ ) -> оставить ли ключ. present - есть ли ключ после вызова,
+   // возвращается изменение количества элементов
+   template<typename K, typename Function>
+   ptrdiff_t Compute( size_t const hash, K&& key, Function& f, bool& present )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx != npos )
+      {
+         present = f( Slots()[idx].second, true );
+         if ( present )
+            return 0;
+
+         EraseAt( idx );
+         return -1;
+      }
+
+      TValue value = TValue();
+      present = f( value, false );
+      if ( !present )
+         return 0;
+
+      Add( hash, TKeyValue( std::forward<K>( key ), std::move( value ) ) );
+      return 1;
+   }
+
+   // чтение без блокировки. Результат имеет смысл, только если за время чтения
+   // не менялась версия блокировки ячейки - это проверяет таблица
+   template<typename K>
+   bool OptimisticRead( size_t const hash, K const& key, TValue& value ) const
+   {
+      auto const array = mArray.load( std::memory_order_acquire );
+      if ( array == nullptr )
+         return false;
+
+      // копии управляющих байтов и слотов: их мог менять писатель посреди чтения
+      return Probe( *array, hash, [&]( size_t const idx ) -> bool
+      {
+         TKeyValue slot;
+         std::memcpy( static_cast<void*>( &slot ), &array->slots[idx], sizeof( TKeyValue ) );
+         if ( !( slot.first == key ) )
+            return false;
+
+         value = slot.second;
+         return true;
+      } ) != npos;
+   }
+
+   template<typename K>
+   bool LockFreeRead( size_t const /*hash*/, K const& /*key*/, TValue& /*value*/ ) const
+   {
+      return false;
+   }
+
+   // загрузка управляющих байтов первой группы ключа
+   void Prefetch( size_t const hash ) const
+   {
+      auto const array = mArray.load( std::memory_order_relaxed );
+      if ( array != nullptr )
+         kvs::Prefetch( &array->control[Split( hash ).h1 & array->groupMask] );
+   }
+
+   template<typename K>
+   bool Delete( size_t const hash, K const& key )
+   {
+      auto const idx = Locate( hash, key );
+      if ( idx == npos )
+         return false;
+
+      EraseAt( idx );
+      return true;
+   }
+
+   size_t Size() const
+   {
+      return mSize;
+   }
+
+   size_t Capacity() const
+   {
+      auto const array = mArray.load( std::memory_order_relaxed );
+      return array == nullptr ? 0 : array->slots.size();
+   }
+
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; ++idx )
+      {
+         if ( IsFull( idx ) )
+            f( Slots()[idx] );
+      }
+   }
+
+   template<typename Predicate>
+   bool FindFirstIf( Predicate p, TKeyValue& found )
+   {
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; ++idx )
+      {
+         if ( IsFull( idx ) && p( Slots()[idx] ) )
+         {
+            found = Slots()[idx];
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   template<typename Predicate>
+   bool EraseIf( Predicate p )
+   {
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; ++idx )
+      {
+         if ( IsFull( idx ) && p( Slots()[idx] ) )
+         {
+            EraseAt( idx );
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   // удаляет все подходящие элементы, возвращает их количество.
+   // Удаление не сдвигает другие слоты, поэтому обход просто идёт дальше
+   template<typename Predicate>
+   size_t EraseAllIf( Predicate p )
+   {
+      size_t erased = 0;
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; ++idx )
+      {
+         if ( IsFull( idx ) && p( Slots()[idx] ) )
+         {
+            EraseAt( idx );
+            ++erased;
+         }
+      }
+
+      return erased;
+   }
+
+   // переносит все элементы в ячейки destination( хэш ). В слотах хранится только
+   // часть перемешанного хэша, поэтому хэш таблицы считается заново
+   template<typename THashFunction, typename TDestination>
+   void MoveTo( THashFunction hashOf, TDestination destination )
+   {
+      for ( size_t idx = 0, capacity = Capacity(); idx < capacity; ++idx )
+      {
+         if ( IsFull( idx ) )
+         {
+            auto& slot = Slots()[idx];
+            auto const hash = hashOf( slot.first );
+            destination( hash ).Add( hash, std::move( slot ) );
+         }
+      }
+
+      Clear();
+   }
+
+private:
+   SwissBucket( SwissBucket const& );
+
+   SwissBucket& operator=( SwissBucket const& );
+
+   // части перемешанного хэша: h1 выбирает группу, h2 хранится в управляющем байте
+   struct SplitHash
+   {
+      uint32_t h1;
+      int8_t h2;
+   };
+
+   // управляющие байты, слоты и h1 занятых слотов для роста массива.
+   // Публикуется одним указателем, чтобы читатель без блокировки не увидел их несогласованными
+   struct SlotArray
+   {
+      explicit SlotArray( size_t const capacity )
+         : groupMask( capacity / cSwissGroupSize - 1 )
+         , control( capacity / cSwissGroupSize )
+         , slots( capacity )
+         , hashes( capacity )
+      {
+         ResetControl();
+      }
+
+      void ResetControl()
+      {
+         for ( auto group_it = control.begin(); group_it != control.end(); ++group_it )
+         {
+            std::memset( group_it->bytes, static_cast<unsigned char>( cSwissEmpty ), cSwissGroupSize );
+         }
+      }
+
+      void Reset()
+      {
+         ResetControl();
+         for ( auto slot_it = slots.begin(); slot_it != slots.end(); ++slot_it )
+         {
+            *slot_it = TKeyValue();
+         }
+      }
+
+      size_t const groupMask;
+      std::vector<SwissControl> control;
+      std::vector<TKeyValue> slots;
+      std::vector<uint32_t> hashes;
+   };
+
+   static size_t const npos = static_cast<size_t>( -1 );
+
+   // свой хэш перемешивается, чтобы позиция в ячейке не зависела от индекса блокировки
+   static SplitHash Split( size_t const hash )
+   {
+      auto const mixed = static_cast<uint64_t>( MixHash( hash ) );
+      SplitHash split;
+      split.h1 = static_cast<uint32_t>( mixed >> 7 );
+      split.h2 = static_cast<int8_t>( mixed & 0x7f );
+      return split;
+   }
+
+   // 7/8 слотов, удалённые тоже занимают место до перестройки массива
+   static bool FitsLoad( size_t const used, size_t const capacity )
+   {
+      return used * 8 <= capacity * 7;
+   }
+
+   static size_t CapacityFor( size_t const size )
+   {
+      auto capacity = cSwissGroupSize;
+      while ( !FitsLoad( size, capacity ) )
+      {
+         capacity *= 2;
+      }
+      return capacity;
+   }
+
+   // обходит кандидатов с тем же h2 по группам, пока match( слот ) не вернёт true.
+   // Группы идут с шагом 1, 2, 3... и при степени двойки обходят все
+   template<typename Match>
+   static size_t Probe( SlotArray const& array, size_t const hash, Match match )
+   {
+      auto const split = Split( hash );
+      auto group = split.h1 & array.groupMask;
+      for ( size_t step = 1; step <= array.groupMask + 1; ++step )
+      {
+         SwissGroup const g( array.control[group] );
+         for ( auto mask = g.Match( split.h2 ); mask != 0; mask &= mask - 1 )
+         {
+            auto const idx = group * cSwissGroupSize + SwissGroup::LowestBit( mask );
+            if ( match( idx ) )
+               return idx;
+         }
+
+         // в группу с пустым слотом ключ положили бы, дальше искать нечего
+         if ( g.MatchEmpty() != 0 )
+            return npos;
+
+         group = ( group + step ) & array.groupMask;
+      }
+
+      return npos;
+   }
+
+   TKeyValue* Slots() const
+   {
+      return mArray.load( std::memory_order_relaxed )->slots.data();
+   }
+
+   int8_t& Control( size_t const idx ) const
+   {
+      return mArray.load( std::memory_order_relaxed )->control[idx / cSwissGroupSize].bytes[idx % cSwissGroupSize];
+   }
+
+   bool IsFull( size_t const idx ) const
+   {
+      return Control( idx ) >= 0;
+   }
+
+   template<typename K>
+   size_t Locate( size_t const hash, K const& key ) const
+   {
+      if ( mSize == 0 )
+         return npos;
+
+      auto const slots = Slots();
+      return Probe( *mArray.load( std::memory_order_relaxed ), hash, [&]( size_t const idx ) -> bool
+      {
+         return slots[idx].first == key;
+      } );
+   }
+
+   // добавление ключа, которого точно нет в ячейке
+   void Add( size_t const hash, TKeyValue&& kv )
+   {
+      if ( !FitsLoad( mSize + mDeleted + 1, Capacity() ) )
+      {
+         // если место заняли удалённые, массив перестраивается того же размера
+         auto const capacity = Capacity();
+         if ( capacity == 0 )
+            Rehash( cSwissGroupSize );
+         else
+            Rehash( FitsLoad( ( mSize + 1 ) * 2, capacity ) ? capacity : capacity * 2 );
+      }
+
+      auto const split = Split( hash );
+      auto& array = *mArray.load( std::memory_order_relaxed );
+      auto const idx = FindFree( array, split.h1 );
+      if ( array.control[idx / cSwissGroupSize].bytes[idx % cSwissGroupSize] == cSwissDeleted )
+         --mDeleted;
+
+      Place( array, idx, split, std::move( kv ) );
+      ++mSize;
+   }
+
+   // первый пустой или удалённый слот на пути пробирования
+   static size_t FindFree( SlotArray const& array, uint32_t const h1 )
+   {
+      auto group = h1 & array.groupMask;
+      for ( size_t step = 1; ; ++step )
+      {
+         auto const mask = SwissGroup( array.control[group] ).MatchFree();
+         if ( mask != 0 )
+            return group * cSwissGroupSize + SwissGroup::LowestBit( mask );
+
+         group = ( group + step ) & array.groupMask;
+      }
+   }
+
+   // слот пишется раньше управляющего байта, чтобы читатель без блокировки
+   // не сравнил ключ в недописанном слоте. Ошибку всё равно отсечёт версия блокировки
+   static void Place( SlotArray& array, size_t const idx, SplitHash const split, TKeyValue&& kv )
+   {
+      array.slots[idx] = std::move( kv );
+      array.hashes[idx] = split.h1;
+      array.control[idx / cSwissGroupSize].bytes[idx % cSwissGroupSize] = split.h2;
+   }
+
+   // слот становится пустым, если в его группе уже есть пустой: тогда поиск никогда
+   // не проходил эту группу насквозь. Иначе остаётся метка удалённого
+   void EraseAt( size_t const idx )
+   {
+      auto& array = *mArray.load( std::memory_order_relaxed );
+      auto& group = array.control[idx / cSwissGroupSize];
+      auto const empty = SwissGroup( group ).MatchEmpty() != 0;
+
+      group.bytes[idx % cSwissGroupSize] = empty ? cSwissEmpty : cSwissDeleted;
+      array.slots[idx] = TKeyValue();
+      if ( !empty )
+         ++mDeleted;
+      --mSize;
+   }
+
+   void Rehash( size_t const capacity )
+   {
+      auto const oldArray = mArray.load( std::memory_order_relaxed );
+      std::unique_ptr<SlotArray> newArray( new SlotArray( capacity ) );
+
+      if ( oldArray != nullptr )
+      {
+         for ( size_t idx = 0; idx < oldArray->slots.size(); ++idx )
+         {
+            auto const h2 = oldArray->control[idx / cSwissGroupSize].bytes[idx % cSwissGroupSize];
+            if ( h2 < 0 )
+               continue;
+
+            SplitHash split;
+            split.h1 = oldArray->hashes[idx];
+            split.h2 = h2;
+            Place( *newArray, FindFree( *newArray, split.h1 ), split, std::move( oldArray->slots[idx] ) );
+         }
+      }
+
+      mDeleted = 0;
+
+      // перестройка того же размера переписывает старый массив на месте: его читатели
+      // без блокировки увидят смену версии, а отложенные массивы не копятся
+      if ( cOptimisticReads && oldArray != nullptr && oldArray->slots.size() == capacity )
+      {
+         std::copy( newArray->control.begin(), newArray->control.end(), oldArray->control.begin() );
+         std::move( newArray->slots.begin(), newArray->slots.end(), oldArray->slots.begin() );
+         std::copy( newArray->hashes.begin(), newArray->hashes.end(), oldArray->hashes.begin() );
+         return;
+      }
+
+      mArray.store( newArray.release(), std::memory_order_release );
+
+      // старый массив ещё могут читать без блокировки, он живёт до разрушения ячейки.
+      // Массивы растут вдвое, так что их суммарный размер не больше текущего
+      if ( cOptimisticReads )
+         mRetired.push_back( std::unique_ptr<SlotArray>( oldArray ) );
+      else
+         delete oldArray;
+   }
+
+   std::atomic<SlotArray*> mArray;
+
+   std::vector<std::unique_ptr<SlotArray>> mRetired;
+
+   size_t mSize;
+
+   size_t mDeleted;
+};
+
+// хранение в массивах с групповым пробированием, по одной таблице на блокировку
+struct SwissStorage
+{
+   template <typename TKey, typename TValue>
+   struct Rebind
+   {
+      typedef SwissBucket<TKey, TValue> TBucket;
+   };
+};
+
+// хранение, выбранное по типу ключа: для тривиально копируемых ключей (числа, POD) -
+// SwissStorage, для остальных - списки ListStorage
+struct AutoStorage
+{
+   template <typename TKey, typename TValue>
+   struct Rebind
+   {
+      typedef typename std::conditional<std::is_trivially_copyable<TKey>::value, SwissBucket<TKey, TValue>, ListBucket<TKey, TValue>>::type TBucket;
+   };
+};
+
+} // namespace kvs
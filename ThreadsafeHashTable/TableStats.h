@@ -0,0 +1,301 @@
+﻿#pragma once
+
+#include "precomp.h"
+
+namespace kvs
+{
+
+// счётчики одной блокировки в снимке статистики
+struct StripeStats
+{
+   StripeStats()
+      : exclusiveLocks( 0 )
+      , sharedLocks( 0 )
+      , exclusiveContended( 0 )
+      , sharedContended( 0 )
+      , waitNs( 0 )
+      , holdNs( 0 )
+      , maxHoldNs( 0 )
+   {
+
+   }
+
+   uint64_t exclusiveLocks;
+
+   uint64_t sharedLocks;
+
+   // захваты, которые не удались с первой попытки
+   uint64_t exclusiveContended;
+
+   uint64_t sharedContended;
+
+   // суммарное ожидание занятой блокировки
+   uint64_t waitNs;
+
+   // суммарное и наибольшее время удержания эксклюзивной блокировки
+   uint64_t holdNs;
+
+   uint64_t maxHoldNs;
+};
+
+// снимок статистики таблицы (GetStats)
+struct TableStats
+{
+   // ячейки длиннее этой считаются вместе
+   static size_t const cChainLengthLimit = 64;
+
+   TableStats()
+      : size( 0 )
+      , bucketCount( 0 )
+      , lockCount( 0 )
+      , loadFactor( 0 )
+      , maxChainLength( 0 )
+      , rehashCount( 0 )
+      , pauseCount( 0 )
+      , pauseNs( 0 )
+      , maxPauseNs( 0 )
+   {
+
+   }
+
+   size_t size;
+
+   size_t bucketCount;
+
+   size_t lockCount;
+
+   float loadFactor;
+
+   // по блокировкам текущего массива. Пустой, если статистика выключена
+   std::vector<StripeStats> stripes;
+
+   // chainLengths[n] - количество ячеек с n элементами,
+   // последний элемент - ячейки с cChainLengthLimit элементами и больше.
+   // Во время постепенного рехэша учитываются неперенесённые старые ячейки и все новые
+   std::vector<size_t> chainLengths;
+
+   size_t maxChainLength;
+
+   // рехэши: сразу под всеми блокировками, начатые постепенные, из Reserve и сжатия
+   uint64_t rehashCount;
+
+   // паузы, когда таблица держит все блокировки: рехэш, начало и конец переноса
+   uint64_t pauseCount;
+
+   uint64_t pauseNs;
+
+   uint64_t maxPauseNs;
+};
+
+// время для статистики в наносекундах
+inline uint64_t StatsNow()
+{
+   return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count() );
+}
+
+// параметр TStats таблицы: статистика выключена. Счётчиков нет, блокировки берутся
+// напрямую, снимок содержит только то, что таблица знает и так
+struct NoStats
+{
+   struct StripeCounters
+   {
+      template<typename TLock>
+      void Lock( TLock& lock )
+      {
+         lock.lock();
+      }
+
+      template<typename TLock>
+      void Unlock( TLock& lock )
+      {
+         lock.unlock();
+      }
+
+      template<typename TLock>
+      void LockShared( TLock& lock )
+      {
+         lock.lock_shared();
+      }
+
+      template<typename TLock>
+      void UnlockShared( TLock& lock )
+      {
+         lock.unlock_shared();
+      }
+
+      void Read( StripeStats& /*stats*/ ) const
+      {
+
+      }
+   };
+
+   struct TableCounters
+   {
+      void Rehash()
+      {
+
+      }
+
+      uint64_t PauseStart() const
+      {
+         return 0;
+      }
+
+      void PauseEnd( uint64_t const /*start*/ )
+      {
+
+      }
+
+      void Read( TableStats& /*stats*/ ) const
+      {
+
+      }
+   };
+
+   static bool const cEnabled = false;
+};
+
+// параметр TStats таблицы: счётчики захватов блокировок ключей, ожидания и удержания,
+// рехэшей и пауз под всеми блокировками. Захват сначала пробует try_lock, и только
+// при неудаче замеряет ожидание; время удержания меряется для эксклюзивных захватов
+struct CollectStats
+{
+   class StripeCounters
+   {
+   public:
+      StripeCounters()
+         : mExclusiveLocks( 0 )
+         , mSharedLocks( 0 )
+         , mExclusiveContended( 0 )
+         , mSharedContended( 0 )
+         , mWaitNs( 0 )
+         , mHoldNs( 0 )
+         , mMaxHoldNs( 0 )
+         , mHoldStart( 0 )
+      {
+
+      }
+
+      template<typename TLock>
+      void Lock( TLock& lock )
+      {
+         if ( !lock.try_lock() )
+         {
+            auto const start = StatsNow();
+            lock.lock();
+            mWaitNs.fetch_add( StatsNow() - start, std::memory_order_relaxed );
+            mExclusiveContended.fetch_add( 1, std::memory_order_relaxed );
+         }
+
+         mExclusiveLocks.fetch_add( 1, std::memory_order_relaxed );
+         mHoldStart = StatsNow();
+      }
+
+      template<typename TLock>
+      void Unlock( TLock& lock )
+      {
+         auto const hold = StatsNow() - mHoldStart;
+         mHoldNs.fetch_add( hold, std::memory_order_relaxed );
+         if ( hold > mMaxHoldNs.load( std::memory_order_relaxed ) )
+            mMaxHoldNs.store( hold, std::memory_order_relaxed );
+
+         lock.unlock();
+      }
+
+      template<typename TLock>
+      void LockShared( TLock& lock )
+      {
+         if ( !lock.try_lock_shared() )
+         {
+            auto const start = StatsNow();
+            lock.lock_shared();
+            mWaitNs.fetch_add( StatsNow() - start, std::memory_order_relaxed );
+            mSharedContended.fetch_add( 1, std::memory_order_relaxed );
+         }
+
+         mSharedLocks.fetch_add( 1, std::memory_order_relaxed );
+      }
+
+      template<typename TLock>
+      void UnlockShared( TLock& lock )
+      {
+         lock.unlock_shared();
+      }
+
+      void Read( StripeStats& stats ) const
+      {
+         stats.exclusiveLocks = mExclusiveLocks.load( std::memory_order_relaxed );
+         stats.sharedLocks = mSharedLocks.load( std::memory_order_relaxed );
+         stats.exclusiveContended = mExclusiveContended.load( std::memory_order_relaxed );
+         stats.sharedContended = mSharedContended.load( std::memory_order_relaxed );
+         stats.waitNs = mWaitNs.load( std::memory_order_relaxed );
+         stats.holdNs = mHoldNs.load( std::memory_order_relaxed );
+         stats.maxHoldNs = mMaxHoldNs.load( std::memory_order_relaxed );
+      }
+
+   private:
+      std::atomic<uint64_t> mExclusiveLocks;
+      std::atomic<uint64_t> mSharedLocks;
+      std::atomic<uint64_t> mExclusiveContended;
+      std::atomic<uint64_t> mSharedContended;
+      std::atomic<uint64_t> mWaitNs;
+      std::atomic<uint64_t> mHoldNs;
+
+      // меняется только под эксклюзивной блокировкой
+      std::atomic<uint64_t> mMaxHoldNs;
+
+      // начало удержания, только под эксклюзивной блокировкой
+      uint64_t mHoldStart;
+   };
+
+   class TableCounters
+   {
+   public:
+      TableCounters()
+         : mRehashCount( 0 )
+         , mPauseCount( 0 )
+         , mPauseNs( 0 )
+         , mMaxPauseNs( 0 )
+      {
+
+      }
+
+      void Rehash()
+      {
+         mRehashCount.fetch_add( 1, std::memory_order_relaxed );
+      }
+
+      uint64_t PauseStart() const
+      {
+         return StatsNow();
+      }
+
+      // вызывается под всеми блокировками, поэтому паузы не пересекаются
+      void PauseEnd( uint64_t const start )
+      {
+         auto const pause = StatsNow() - start;
+         mPauseCount.fetch_add( 1, std::memory_order_relaxed );
+         mPauseNs.fetch_add( pause, std::memory_order_relaxed );
+         if ( pause > mMaxPauseNs.load( std::memory_order_relaxed ) )
+            mMaxPauseNs.store( pause, std::memory_order_relaxed );
+      }
+
+      void Read( TableStats& stats ) const
+      {
+         stats.rehashCount = mRehashCount.load( std::memory_order_relaxed );
+         stats.pauseCount = mPauseCount.load( std::memory_order_relaxed );
+         stats.pauseNs = mPauseNs.load( std::memory_order_relaxed );
+         stats.maxPauseNs = mMaxPauseNs.load( std::memory_order_relaxed );
+      }
+
+   private:
+      std::atomic<uint64_t> mRehashCount;
+      std::atomic<uint64_t> mPauseCount;
+      std::atomic<uint64_t> mPauseNs;
+      std::atomic<uint64_t> mMaxPauseNs;
+   };
+
+   static bool const cEnabled = true;
+};
+
+} // namespace kvs
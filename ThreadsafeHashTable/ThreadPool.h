@@ -0,0 +1,174 @@
+﻿#pragma once
+
+#include "precomp.h"
+
+namespace kvs
+{
+
+// пул потоков для параллельных обходов таблицы. ParallelFor раздаёт номера задач
+// рабочим потокам и вызывающему потоку, пока задачи не кончатся, и ждёт окончания всех.
+// Одновременно пул выполняет один ParallelFor, остальные вызовы ждут своей очереди,
+// поэтому задача не должна запускать ParallelFor на том же пуле
+class ThreadPool
+{
+public:
+   // threadCount - количество рабочих потоков, вызывающий поток работает вместе с ними
+   explicit ThreadPool( size_t const threadCount = DefaultThreadCount() )
+      : mTaskCount( 0 )
+      , mNextTask( 0 )
+      , mActiveWorkers( 0 )
+      , mGeneration( 0 )
+      , mStop( false )
+   {
+      for ( size_t i = 0; i < threadCount; ++i )
+      {
+         mWorkers.push_back( std::thread( [this]()
+         {
+            WorkerLoop();
+         } ) );
+      }
+   }
+
+   ~ThreadPool()
+   {
+      {
+         std::lock_guard<std::mutex> lock( mMutex );
+         mStop = true;
+      }
+      mWakeUp.notify_all();
+
+      for ( auto worker_it = mWorkers.begin(); worker_it != mWorkers.end(); ++worker_it )
+      {
+         worker_it->join();
+      }
+   }
+
+   size_t ThreadCount() const
+   {
+      return mWorkers.size();
+   }
+
+   // вызывает f( idx ) для idx от 0 до taskCount. Первое исключение из задачи
+   // пробрасывается вызывающему после того, как все потоки закончат
+   template<typename Function>
+   void ParallelFor( size_t const taskCount, Function f )
+   {
+      std::lock_guard<std::mutex> run_lock( mRunMutex );
+
+      mTask = [&f]( size_t const idx )
+      {
+         f( idx );
+      };
+      mError = nullptr;
+
+      {
+         std::lock_guard<std::mutex> lock( mMutex );
+         mTaskCount = taskCount;
+         mNextTask = 0;
+         mActiveWorkers = mWorkers.size();
+         ++mGeneration;
+      }
+      mWakeUp.notify_all();
+
+      RunTasks();
+
+      {
+         std::unique_lock<std::mutex> lock( mMutex );
+         mDone.wait( lock, [this]()
+         {
+            return mActiveWorkers == 0;
+         } );
+      }
+
+      mTask = nullptr;
+      if ( mError )
+         std::rethrow_exception( mError );
+   }
+
+   static size_t DefaultThreadCount()
+   {
+      auto const count = std::thread::hardware_concurrency();
+      return count > 1 ? count - 1 : 1;
+   }
+
+private:
+   ThreadPool( ThreadPool const& );
+
+   ThreadPool& operator=( ThreadPool const& );
+
+   void WorkerLoop()
+   {
+      size_t generation = 0;
+      for ( ;; )
+      {
+         {
+            std::unique_lock<std::mutex> lock( mMutex );
+            mWakeUp.wait( lock, [this, generation]()
+            {
+               return mStop || mGeneration != generation;
+            } );
+
+            if ( mStop )
+               return;
+            generation = mGeneration;
+         }
+
+         RunTasks();
+
+         {
+            std::lock_guard<std::mutex> lock( mMutex );
+            --mActiveWorkers;
+         }
+         mDone.notify_one();
+      }
+   }
+
+   // после ошибки оставшиеся задачи не запускаются
+   void RunTasks()
+   {
+      for ( ;; )
+      {
+         auto const idx = mNextTask.fetch_add( 1 );
+         if ( idx >= mTaskCount )
+            return;
+
+         try
+         {
+            mTask( idx );
+         }
+         catch( ... )
+         {
+            std::lock_guard<std::mutex> lock( mMutex );
+            if ( !mError )
+               mError = std::current_exception();
+            mNextTask = mTaskCount;
+         }
+      }
+   }
+
+   std::vector<std::thread> mWorkers;
+
+   std::function<void( size_t )> mTask;
+
+   std::exception_ptr mError;
+
+   size_t mTaskCount;
+
+   std::atomic<size_t> mNextTask;
+
+   size_t mActiveWorkers;
+
+   size_t mGeneration;
+
+   bool mStop;
+
+   std::mutex mRunMutex;
+
+   std::mutex mMutex;
+
+   std::condition_variable mWakeUp;
+
+   std::condition_variable mDone;
+};
+
+} // namespace kvs
@@ -1,11 +1,94 @@
 ﻿#pragma once
 
 #include "precomp.h"
+#include "ListStorage.h"
+#include "FlatStorage.h"
+#include "PooledListStorage.h"
+#include "HashedListStorage.h"
+#include "SwissStorage.h"
+#include "EpochListStorage.h"
+#include "ShardedCounter.h"
+#include "CacheLine.h"
+#include "ThreadPool.h"
+#include "TableStats.h"
+#include "Indexing.h"
+#include "Snapshot.h"
 
 namespace kvs
 {
 
-template <typename TKey, typename TValue, size_t pLockCount = 11, typename TLock = boost::shared_mutex, typename THash = std::hash<TKey>>
+enum class RehashMode
+{
+   // все элементы переносятся сразу под всеми блокировками
+   StopTheWorld,
+   // старый и новый массивы ячеек живут вместе, ячейки переносятся понемногу
+   Incremental
+};
+
+enum class ReadMode
+{
+   // чтение под разделяемой блокировкой
+   Locked,
+   // чтение без блокировки с проверкой версии блокировки (seqlock),
+   // при гонке с писателем - повтор и затем чтение под блокировкой.
+   // Работает только для хранилищ, которые это поддерживают (FlatStorage с простыми типами)
+   Optimistic,
+   // чтение без блокировки внутри эпохи: узлы, которые читатель мог застать, освобождаются
+   // только после его выхода, а промах во время записи или рехэша отсекается проверкой версии
+   // блокировки. Работает только для EpochListStorage, для остальных - чтение под блокировкой
+   LockFree
+};
+
+// когда таблица меняет количество ячеек. Хранилища, которые растут сами (FlatStorage, SwissStorage),
+// следят за размером своих массивов сами, для них политика не действует
+struct GrowthPolicy
+{
+   GrowthPolicy()
+      : maxLoadFactor( 0.7f )
+      , minLoadFactor( 0.0f )
+      , growthFactor( 2 )
+      , hysteresis( 0.25f )
+   {
+
+   }
+
+   // загрузка (элементов на ячейку), выше которой таблица растёт
+   float maxLoadFactor;
+
+   // загрузка, ниже которой таблица сжимается после удалений. 0 - сама не сжимается
+   float minLoadFactor;
+
+   // во сколько раз растёт количество ячеек, степень двойки
+   size_t growthFactor;
+
+   // запас после сжатия: загрузка не выше maxLoadFactor * ( 1 - hysteresis ),
+   // чтобы вставки сразу после сжатия не вызывали рост обратно
+   float hysteresis;
+};
+
+// хэш строк, который принимает и std::string, и std::string_view, и строковые литералы.
+// Считает так же, как std::hash<std::string>, а is_transparent разрешает искать
+// в таблице со строковыми ключами без построения std::string
+struct StringHash
+{
+   typedef void is_transparent;
+
+   size_t operator()( std::string_view const s ) const
+   {
+      return std::hash<std::string_view>()( s );
+   }
+};
+
+enum class StripeLayout
+{
+   // блокировки лежат подряд, несколько блокировок в одной кэш-линии
+   Packed,
+   // блокировка вместе с версией и счётчиком занимает свою кэш-линию,
+   // самостоятельно растущие ячейки тоже выровнены по кэш-линии
+   Padded
+};
+
+template <typename TKey, typename TValue, size_t pLockCount = 11, typename TLock = boost::shared_mutex, typename THash = std::hash<TKey>, typename TStorage = ListStorage, StripeLayout pStripeLayout = StripeLayout::Padded, typename TStats = NoStats, typename TIndexing = ModuloIndexing>
 class ThreadsafeHashTable
 {
 public:
@@ -13,380 +96,1495 @@ public:
    typedef boost::shared_lock_guard<TLock> TSharedLockGuard;
    //typedef std::unique_lock<TLock> TSharedLockGuard;
    typedef std::unique_lock<TLock> TUniqueLockGuard;
-   typedef std::array<TLock, pLockCount> TLockContainer;
 
-   class Bucket;
-   typedef std::vector<Bucket> TBucketContainer;
-   typedef typename TBucketContainer::iterator TBucketIterator;
-   typedef std::list<TKeyValue> TCollisionContainer;
-   typedef typename TCollisionContainer::iterator TCollisionIterator;
-   typedef std::atomic<size_t> TAtomicSize;
+   typedef typename TStorage::template Rebind<TKey, TValue>::TBucket Bucket;
+   // самостоятельно растущая ячейка принадлежит одной блокировке, поэтому её кладём в свою кэш-линию
+   typedef typename std::conditional<pStripeLayout == StripeLayout::Padded && Bucket::cSelfResizing, CacheAligned<Bucket>, Bucket>::type TBucketSlot;
+   typedef std::vector<TBucketSlot> TBucketContainer;
+   typedef typename TBucketContainer::iterator TBucketIterator;
+   typedef std::atomic<size_t> TAtomicSize;
+   typedef std::atomic<uint32_t> TAtomicVersion;
+
+   // pLockCount - количество блокировок по умолчанию, его можно задать при создании.
+   // С PowerOfTwoIndexing оно округляется вверх до степени двойки
+   explicit ThreadsafeHashTable( size_t const lockCount = pLockCount )
+      : mBucketView( nullptr )
+      , mMigrating( false )
+      , mMigrateTotal( 0 )
+      , mMigrateCursor( 0 )
+      , mMigratedCount( 0 )
+      , mRehashMode( RehashMode::StopTheWorld )
+      , mMigrationStep( 4 )
+      , mMaxLockCount( lockCount )
+      , mReadMode( ReadMode::Locked )
+   {
+      auto const count = TIndexing::Count( lockCount );
+      mStripeArrays.push_back( std::unique_ptr<Stripes>( new Stripes( count ) ) );
+      mStripes = mStripeArrays.back().get();
+
+      if ( Bucket::cLockFreeReads )
+         mEpochs.reset( new EpochDomain() );
+      BindPools( *mStripes );
+
+      mBuckets.resize( count );
+      mBucketCount = count;
+      AttachBuckets( mBuckets, *mStripes );
+      PublishBuckets();
+   }
+
+   ~ThreadsafeHashTable()
+   {
+      // узлы ячеек возвращаются в пулы полос, поэтому ячейки разрушаются раньше полос
+      TBucketContainer().swap( mNewBuckets );
+      TBucketContainer().swap( mBuckets );
+      delete mBucketView.load( std::memory_order_relaxed );
+   }
+
+   bool Find( TKey const& key, TValue& value )
+   {
+      return Read( key, value );
+   }
+
+   // поиск по ключу другого типа (например std::string_view для std::string),
+   // доступен, если хэш помечен is_transparent
+   template<typename K, typename H = THash, typename = typename H::is_transparent>
+   bool Find( K const& key, TValue& value )
+   {
+      return Read( key, value );
+   }
+
+   // вызывает f( TValue const& ) под разделяемой блокировкой, не копируя значение.
+   // f не должна обращаться к таблице
+   template<typename Function>
+   bool Visit( TKey const& key, Function f )
+   {
+      return VisitImpl( key, f );
+   }
+
+   template<typename K, typename Function, typename H = THash, typename = typename H::is_transparent>
+   bool Visit( K const& key, Function f )
+   {
+      return VisitImpl( key, f );
+   }
+
+   // точный размер - сумма счётчиков всех блокировок
+   size_t Size() const
+   {
+      return mStripes.load( std::memory_order_acquire )->ExactSize();
+   }
+
+   // дешёвый размер с погрешностью до нескольких процентов от количества ячеек
+   size_t ApproximateSize() const
+   {
+      return mStripes.load( std::memory_order_acquire )->ApproximateSize();
+   }
+
+   // пользователю этого метода придется блокировать ячейку в таблице
+   //TValue& operator[]( TKey const& key );
+
+   TValue operator[]( TKey const& key )
+   {
+      TValue value;
+      if ( Read( key, value ) )
+         return value;
+      throw std::exception( "Key not found" );
+   }
+
+   bool Insert( TKeyValue const& kv )
+   {
+      auto const& key = kv.first;
+      auto const& value = kv.second;
+
+      return EmplaceImpl( key, value );
+   }
+
+   bool Insert( TKeyValue&& kv )
+   {
+      return EmplaceImpl( std::move( kv.first ), std::move( kv.second ) );
+   }
+
+   // пара строится из args до блокировки, затем перемещается в таблицу
+   template<typename... Args>
+   bool Emplace( Args&&... args )
+   {
+      TKeyValue kv( std::forward<Args>( args )... );
+      return EmplaceImpl( std::move( kv.first ), std::move( kv.second ) );
+   }
+
+   // значение строится из args под блокировкой и только если ключа ещё нет
+   template<typename... Args>
+   bool TryEmplace( TKey const& key, Args&&... args )
+   {
+      return EmplaceImpl( key, std::forward<Args>( args )... );
+   }
+
+   template<typename... Args>
+   bool TryEmplace( TKey&& key, Args&&... args )
+   {
+      return EmplaceImpl( std::move( key ), std::forward<Args>( args )... );
+   }
+
+   // возвращает true, если ключ вставлен, и false, если значение присвоено существующему
+   template<typename V>
+   bool InsertOrAssign( TKey const& key, V&& value )
+   {
+      return InsertOrAssignImpl( key, std::forward<V>( value ) );
+   }
+
+   template<typename V>
+   bool InsertOrAssign( TKey&& key, V&& value )
+   {
+      return InsertOrAssignImpl( std::move( key ), std::forward<V>( value ) );
+   }
+
+   // операции чтения-изменения-записи под одной эксклюзивной блокировкой ключа.
+   // Функции вызываются под блокировкой и не должны обращаться к таблице
+
+   // f( TValue& ) меняет значение на месте, false - ключа нет
+   template<typename Function>
+   bool Modify( TKey const& key, Function f )
+   {
+      auto const hash = HashOf( key );
+      bool res = false;
+      WriteKey( hash, [&]( Bucket& bucket ) -> ptrdiff_t
+      {
+         res = bucket.Modify( hash, key, f );
+         return 0;
+      } );
+      return res;
+   }
+
+   // если ключа нет - вставляет init, иначе вызывает f( TValue& ).
+   // Возвращает true, если ключ вставлен
+   template<typename Init, typename Function>
+   bool Upsert( TKey const& key, Init&& init, Function f )
+   {
+      return UpsertImpl( key, std::forward<Init>( init ), f );
+   }
+
+   template<typename Init, typename Function>
+   bool Upsert( TKey&& key, Init&& init, Function f )
+   {
+      return UpsertImpl( std::move( key ), std::forward<Init>( init ), f );
+   }
+
+   // f( TValue& value, bool exists ) -> bool. Если ключа нет, value создано по умолчанию.
+   // true - значение остаётся (или вставляется), false - ключ удаляется (или не вставляется).
+   // Возвращает, есть ли ключ после операции
+   template<typename Function>
+   bool Compute( TKey const& key, Function f )
+   {
+      return ComputeImpl( key, f );
+   }
+
+   template<typename Function>
+   bool Compute( TKey&& key, Function f )
+   {
+      return ComputeImpl( std::move( key ), f );
+   }
+
+   bool Update( TKeyValue const& kv )
+   {
+      auto const& key = kv.first;
+      auto const& value = kv.second;
+
+      return Update( key, value );
+   }
+
+   void Erase( TKey const& key )
+   {
+      Delete( key );
+   }
+
+   template<typename K, typename H = THash, typename = typename H::is_transparent>
+   void Erase( K const& key )
+   {
+      Delete( key );
+   }
+
+   void Clear()
+   {
+      auto& stripes = LockAll();
+
+      for ( auto buc_it = mBuckets.begin(); buc_it != mBuckets.end(); ++buc_it )
+      {
+         buc_it->Clear();
+      }
+
+      // недоделанный перенос больше не нужен: новый массив тоже пуст
+      if ( mMigrating )
+      {
+         for ( auto buc_it = mNewBuckets.begin(); buc_it != mNewBuckets.end(); ++buc_it )
+         {
+            buc_it->Clear();
+         }
+         mBuckets.swap( mNewBuckets );
+         mBucketCount = mBuckets.size();
+         CompleteMigration();
+      }
+
+      // живых узлов не осталось, память пулов отдаётся целиком
+      for ( size_t idx = 0; idx < stripes.count; ++idx )
+      {
+         stripes.items[idx].pool.ReleaseAll();
+      }
+
+      stripes.ResetSize();
+
+      UnlockAll( stripes );
+      TryShrink();
+   }
+
+   template<typename Function>
+   void ForEach( Function f )
+   {
+      auto& stripes = LockAllShared();
+
+      FindBucket( [&f]( Bucket& bucket ) -> bool
+      {
+         bucket.ForEach( f );
+         return false;
+      } );
+
+      UnlockAllShared( stripes );
+   }
+
+   template<typename Predicate>
+   bool FindFirstIf( Predicate p, TKeyValue& found )
+   {
+      auto& stripes = LockAllShared();
+
+      auto const res = FindBucket( [&]( Bucket& bucket ) -> bool
+      {
+         return bucket.FindFirstIf( p, found );
+      } );
+
+      UnlockAllShared( stripes );
+      return res;
+   }
+
+   template<typename Predicate>
+   bool EraseIf( Predicate p )
+   {
+      auto& stripes = LockAll();
+
+      auto const res = FindBucket( [&p]( Bucket& bucket ) -> bool
+      {
+         return bucket.EraseIf( p );
+      } );
+
+      // под всеми блокировками можно менять любой слот счётчика
+      if ( res )
+         stripes.AddSize( 0, -1, CounterThreshold( stripes ) );
+
+      UnlockAll( stripes );
+
+      if ( res )
+         TryShrink();
+      return res;
+   }
+
+   // параллельные обходы: массив ячеек делится на окна, окна раздаются потокам пула,
+   // и в каждый момент поток держит только одну блокировку, так что остальные блокировки
+   // доступны писателям. На время обхода рехэш откладывается. Обход не атомарен: элементы,
+   // которые меняются во время обхода в ещё не пройденных ячейках, могут как попасть,
+   // так и не попасть в него. f и p вызываются из разных потоков и не должны обращаться к таблице
+
+   // f( TKeyValue& ) под разделяемой блокировкой
+   template<typename Function>
+   void ParallelForEach( ThreadPool& pool, Function f )
+   {
+      ParallelScan( pool, false, []( size_t ){}, [&f]( Stripes&, size_t, size_t, Bucket& bucket )
+      {
+         bucket.ForEach( f );
+      } );
+   }
+
+   // в отличие от EraseIf удаляет все подходящие элементы, возвращает их количество
+   template<typename Predicate>
+   size_t ParallelEraseIf( ThreadPool& pool, Predicate p )
+   {
+      std::atomic<size_t> erased( 0 );
+      ParallelScan( pool, true, []( size_t ){}, [&]( Stripes& stripes, size_t const idx, size_t, Bucket& bucket )
+      {
+         auto const count = bucket.EraseAllIf( p );
+         if ( count == 0 )
+            return;
+
+         stripes.AddSize( idx, -static_cast<ptrdiff_t>( count ), CounterThreshold( stripes ) );
+         erased.fetch_add( count, std::memory_order_relaxed );
+      } );
+
+      // сжатие ждёт конца обхода: обход держит блокировку рехэша
+      if ( erased != 0 )
+         TryShrink();
+      return erased;
+   }
+
+   template<typename Predicate>
+   size_t ParallelCountIf( ThreadPool& pool, Predicate p )
+   {
+      return ParallelReduce( pool, size_t( 0 ), [&p]( size_t& count, TKeyValue const& kv )
+      {
+         if ( p( kv ) )
+            ++count;
+      }, []( size_t& count, size_t& part )
+      {
+         count += part;
+      } );
+   }
+
+   // свёртка: для каждого окна своё значение, начиная с init, в которое
+   // accumulate( T&, TKeyValue const& ) добавляет элементы, затем значения окон
+   // сливаются combine( T& итог, T& часть ) по порядку окон.
+   // Например, для сбора элементов T - вектор, а combine дописывает часть в конец итога
+   template<typename T, typename Accumulate, typename Combine>
+   T ParallelReduce( ThreadPool& pool, T const& init, Accumulate accumulate, Combine combine )
+   {
+      std::vector<T> parts;
+      ParallelScan( pool, false, [&]( size_t const windowCount )
+      {
+         parts.assign( windowCount, init );
+      }, [&]( Stripes&, size_t, size_t const window, Bucket& bucket )
+      {
+         auto& part = parts[window];
+         bucket.ForEach( [&]( TKeyValue const& kv )
+         {
+            accumulate( part, kv );
+         } );
+      } );
+
+      T result = init;
+      for ( auto part_it = parts.begin(); part_it != parts.end(); ++part_it )
+      {
+         combine( result, *part_it );
+      }
+      return result;
+   }
+
+   // позиция обхода Scan. Курсор не держит блокировок, обход можно прервать
+   // и продолжить позже тем же курсором
+   class ScanCursor
+   {
+   public:
+      ScanCursor()
+         : mBucketCount( 0 )
+         , mLockCount( 0 )
+         , mPosition( 0 )
+      {
+
+      }
+
+   private:
+      friend class ThreadsafeHashTable;
+
+      // размеры таблицы в начале обхода, порядок обхода задаётся ими
+      size_t mBucketCount;
+      size_t mLockCount;
+
+      // сколько начальных ячеек уже пройдено
+      size_t mPosition;
+   };
+
+   // шаг обхода без общей блокировки: вызывает f( TKeyValue const& ) для элементов
+   // не больше чем bucketCount начальных ячеек под разделяемой блокировкой одной полосы
+   // и возвращает false, когда обход закончен.
+   // Обход идёт по ячейкам таблицы на момент начала обхода. Когда таблица растёт,
+   // элементы начальной ячейки r расходятся по ячейкам r + j * (начальное количество ячеек),
+   // и все они проходятся вместе, а когда сжимается - попадают в ячейку r % (новое количество),
+   // из которой берутся только они, поэтому элементы, которые были в таблице весь обход,
+   // встречаются ровно один раз. Добавленные и удалённые во время обхода элементы могут
+   // встретиться или нет. f не должна обращаться к таблице
+   template<typename Function>
+   bool Scan( ScanCursor& cursor, Function f, size_t const bucketCount = cScanBucketsPerLock )
+   {
+      if ( cursor.mBucketCount == 0 )
+      {
+         // блокировки читаются первыми: ячеек всегда не меньше, и количество блокировок его делит
+         cursor.mLockCount = LockCount();
+         cursor.mBucketCount = mBucketCount;
+      }
+
+      if ( cursor.mPosition >= cursor.mBucketCount )
+         return false;
+
+      ScanLocks locks;
+      auto const& stripes = LockScanStripes( cursor, locks );
+
+      auto const visit = [&f]( TKeyValue& kv )
+      {
+         TKeyValue const& value = kv;
+         f( value );
+      };
+
+      // шаг не выходит за часть окна одной начальной блокировки, в ней ячейки идут через mLockCount
+      auto const perLock = ScanBucketsPerLock( cursor );
+      auto start = ScanBucketIndex( cursor );
+      for ( size_t visited = 0; visited < bucketCount; ++visited )
+      {
+         // во время переноса элементы ячейки лежат и в старом, и в новом массиве
+         ScanBuckets( mBuckets, mMigrating, start, cursor, visit );
+         if ( mMigrating )
+            ScanBuckets( mNewBuckets, false, start, cursor, visit );
+
+         ++cursor.mPosition;
+         if ( cursor.mPosition % perLock == 0 )
+            break;
+         start += cursor.mLockCount;
+      }
+
+      return cursor.mPosition < cursor.mBucketCount;
+   }
+
+   // режим рехэша можно менять на ходу, начатый перенос всё равно будет доделан
+   void SetRehashMode( RehashMode const mode, size_t const migrationStep = 4 )
+   {
+      mRehashMode = mode;
+      mMigrationStep = migrationStep;
+   }
+
+   // политику можно менять на ходу, она действует со следующей вставки или удаления.
+   // Бросает std::invalid_argument, если после роста загрузка сразу оказалась бы
+   // ниже minLoadFactor или после сжатия - выше maxLoadFactor * ( 1 - hysteresis )
+   void SetGrowthPolicy( GrowthPolicy const& policy )
+   {
+      auto const factor = policy.growthFactor;
+      if ( !( policy.maxLoadFactor > 0 ) || policy.minLoadFactor < 0 || policy.hysteresis < 0 || policy.hysteresis >= 1 )
+         throw std::invalid_argument( "load factors out of range" );
+      if ( factor < 2 || ( factor & ( factor - 1 ) ) != 0 )
+         throw std::invalid_argument( "growth factor must be a power of two" );
+      if ( policy.minLoadFactor * factor >= policy.maxLoadFactor || policy.minLoadFactor * 2 >= policy.maxLoadFactor * ( 1 - policy.hysteresis ) )
+         throw std::invalid_argument( "min load factor too close to max load factor" );
+
+      mGrowthPolicy = policy;
+   }
+
+   GrowthPolicy const& GetGrowthPolicy() const
+   {
+      return mGrowthPolicy;
+   }
+
+   // сжимает массив ячеек под текущее количество элементов с запасом hysteresis,
+   // не дожидаясь, пока загрузка упадёт ниже minLoadFactor. Ячеек остаётся не меньше,
+   // чем блокировок: массив блокировок никогда не уменьшается
+   void ShrinkToFit()
+   {
+      if ( Bucket::cSelfResizing )
+         return;
+
+      TUniqueLockGuard rehashLock( mRehashLock );
+      auto const bucketCount = ShrinkTarget( Size() );
+      if ( bucketCount < ( mMigrating ? mNewBuckets.size() : mBuckets.size() ) )
+         Rehash( bucketCount );
+   }
+
+   // при рехэше количество блокировок удваивается вместе с ячейками, пока на блокировку
+   // приходится больше cBucketsPerLock ячеек, но не больше maxLockCount.
+   // Хранилища, которые растут сами (FlatStorage), рехэша не делают, и блокировок у них
+   // всегда столько, сколько задано при создании
+   void SetMaxLockCount( size_t const maxLockCount )
+   {
+      mMaxLockCount = maxLockCount;
+   }
+
+   size_t LockCount() const
+   {
+      return mStripes.load( std::memory_order_acquire )->count;
+   }
+
+   void SetReadMode( ReadMode const mode )
+   {
+      mReadMode = mode;
+   }
+
+   // память, которую писатели отложили до выхода читателей без блокировки, и её максимум.
+   // Для хранилищ без ReadMode::LockFree всегда нули
+   RetiredMemory GetRetiredMemory() const
+   {
+      return mEpochs ? mEpochs->GetRetiredMemory() : RetiredMemory();
+   }
+
+   // снимок статистики. Длины цепочек собираются под разделяемой блокировкой каждой полосы
+   // по очереди: снимок не атомарен, но писатели ждут не дольше обхода ячеек одной полосы.
+   // Счётчики блокировок, рехэшей и пауз есть только с TStats = CollectStats
+   TableStats GetStats()
+   {
+      TableStats stats;
+      TSharedLockGuard rehashLock( mRehashLock );
+      auto& stripes = *mStripes.load( std::memory_order_acquire );
+
+      stats.lockCount = stripes.count;
+      if ( TStats::cEnabled )
+      {
+         stats.stripes.resize( stripes.count );
+         for ( size_t idx = 0; idx < stripes.count; ++idx )
+         {
+            stripes.items[idx].Read( stats.stripes[idx] );
+         }
+      }
+      mStats.Read( stats );
+
+      // сама статистика не должна попадать в счётчики захватов, поэтому блокировки берутся напрямую
+      for ( size_t idx = 0; idx < stripes.count; ++idx )
+      {
+         auto& lock = stripes.items[idx].lock;
+         lock.lock_shared();
+         for ( auto buc_idx = idx; buc_idx < mBuckets.size(); buc_idx += stripes.count )
+         {
+            if ( !mMigrating || !mMigrated[buc_idx] )
+               AddChainLength( stats, mBuckets[buc_idx].Size() );
+         }
+
+         if ( mMigrating )
+         {
+            for ( auto buc_idx = idx; buc_idx < mNewBuckets.size(); buc_idx += stripes.count )
+            {
+               AddChainLength( stats, mNewBuckets[buc_idx].Size() );
+            }
+         }
+         lock.unlock_shared();
+      }
+
+      stats.size = stripes.ExactSize();
+      stats.bucketCount = mBucketCount;
+      stats.loadFactor = static_cast<float>( stats.size ) / stats.bucketCount;
+      return stats;
+   }
+
+   bool Rehashing() const
+   {
+      return mMigrating;
+   }
+
+   // шаг переноса ячеек для вспомогательного потока,
+   // возвращает false, когда переносить больше нечего
+   bool RehashStep( size_t const bucketCount )
+   {
+      if ( !mMigrating )
+         return false;
+
+      MigrateBuckets( bucketCount );
+      return mMigrating;
+   }
+
+   void Reserve( size_t const size )
+   {
+      if ( Bucket::cSelfResizing )
+      {
+         // каждая ячейка принадлежит одной блокировке и растёт сама
+         for ( size_t idx = 0; idx < mBuckets.size(); ++idx )
+         {
+            WriteLockGuard lock( *this, idx );
+            mBuckets[idx].Reserve( size / mBuckets.size() + 1 );
+         }
+         return;
+      }
+
+      if ( size <= mBucketCount )
+         return;
+
+      TUniqueLockGuard rehashLock( mRehashLock );
+      auto bucketCount = mMigrating ? mNewBuckets.size() : mBuckets.size();
+      while ( bucketCount < size )
+      {
+         bucketCount *= 2;
+      }
 
-   class Bucket
+      Rehash( bucketCount );
+   }
+
+   // пакетные операции: хэши считаются один раз, ключи группируются по блокировкам,
+   // и каждая нужная блокировка берётся один раз. prefetch - загрузить ячейки группы
+   // в кэш до поиска в них. Результат по каждому ключу - в векторе флагов того же размера,
+   // возвращается количество успешных операций
+   size_t MultiFind( std::vector<TKey> const& keys, std::vector<TValue>& values, std::vector<char>& found, bool const prefetch = true )
    {
-   public:
-      Bucket()
+      values.resize( keys.size() );
+      found.assign( keys.size(), 0 );
+
+      std::vector<size_t> hashes( keys.size() );
+      for ( size_t pos = 0; pos < keys.size(); ++pos )
+      {
+         hashes[pos] = HashOf( keys[pos] );
+      }
+
+      size_t res = 0;
+      ForEachStripeGroup( hashes, false, prefetch, [&]( Stripes&, size_t, TPositionIterator first, TPositionIterator last )
+      {
+         for ( auto pos_it = first; pos_it != last; ++pos_it )
+         {
+            auto const pos = *pos_it;
+            if ( GetBucket( hashes[pos] ).Read( hashes[pos], keys[pos], values[pos] ) )
+            {
+               found[pos] = 1;
+               ++res;
+            }
+         }
+      } );
+
+      return res;
+   }
+
+   size_t MultiInsert( std::vector<TKeyValue> const& kvs, std::vector<char>& inserted, bool const prefetch = true )
+   {
+      inserted.assign( kvs.size(), 0 );
+
+      // большая пачка в маленькую таблицу растянула бы цепочки до рехэша после вставки
+      if ( !Bucket::cSelfResizing && mRehashMode == RehashMode::StopTheWorld )
+         Reserve( static_cast<size_t>( ( ApproximateSize() + kvs.size() ) / mGrowthPolicy.maxLoadFactor ) );
+
+      std::vector<size_t> hashes( kvs.size() );
+      for ( size_t pos = 0; pos < kvs.size(); ++pos )
+      {
+         hashes[pos] = HashOf( kvs[pos].first );
+      }
+
+      size_t res = 0;
+      ForEachStripeGroup( hashes, true, prefetch, [&]( Stripes& stripes, size_t const idx, TPositionIterator first, TPositionIterator last )
+      {
+         ptrdiff_t groupRes = 0;
+         for ( auto pos_it = first; pos_it != last; ++pos_it )
+         {
+            auto const pos = *pos_it;
+            if ( GetBucketForWrite( hashes[pos] ).Emplace( hashes[pos], kvs[pos].first, kvs[pos].second ) )
+            {
+               inserted[pos] = 1;
+               ++groupRes;
+            }
+         }
+
+         stripes.AddSize( idx, groupRes, CounterThreshold( stripes ) );
+         res += groupRes;
+      } );
+
+      if ( res != 0 )
+         TryRehash();
+
+      HelpMigration();
+      return res;
+   }
+
+   size_t MultiErase( std::vector<TKey> const& keys, std::vector<char>& erased, bool const prefetch = true )
+   {
+      erased.assign( keys.size(), 0 );
+
+      std::vector<size_t> hashes( keys.size() );
+      for ( size_t pos = 0; pos < keys.size(); ++pos )
+      {
+         hashes[pos] = HashOf( keys[pos] );
+      }
+
+      size_t res = 0;
+      ForEachStripeGroup( hashes, true, prefetch, [&]( Stripes& stripes, size_t const idx, TPositionIterator first, TPositionIterator last )
+      {
+         ptrdiff_t groupRes = 0;
+         for ( auto pos_it = first; pos_it != last; ++pos_it )
+         {
+            auto const pos = *pos_it;
+            if ( GetBucketForWrite( hashes[pos] ).Delete( hashes[pos], keys[pos] ) )
+            {
+               erased[pos] = 1;
+               ++groupRes;
+            }
+         }
+
+         stripes.AddSize( idx, -groupRes, CounterThreshold( stripes ) );
+         res += groupRes;
+      } );
+
+      if ( res != 0 )
+         TryShrink();
+
+      HelpMigration();
+      return res;
+   }
+
+   // снимки для быстрого перезапуска, только для тривиально копируемых ключей и значений
+   // (формат - Snapshot.h).
+
+   // пишет снимок, не останавливая писателей: разделяемые блокировки полос берутся по очереди
+   // на окна из cScanBucketsPerLock ячеек, как в ParallelForEach, а в файл записи уходят
+   // блоками без блокировок. Снимок не атомарен: элементы, которые менялись во время записи,
+   // могут попасть в него в старом или новом виде или не попасть. На время записи рехэш
+   // откладывается. Возвращает false при ошибке записи
+   bool SaveSnapshot( std::string const& path )
+   {
+      static_assert( std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value, "snapshots need trivially copyable keys and values" );
+
+      TSharedLockGuard rehashLock( mRehashLock );
+      auto& stripes = *mStripes.load( std::memory_order_acquire );
+      SnapshotWriter<TKey, TValue> writer( path, Size() );
+
+      auto const add = [&writer]( Stripes&, size_t, size_t, Bucket& bucket )
+      {
+         bucket.ForEach( [&writer]( TKeyValue const& kv )
+         {
+            writer.Add( kv );
+         } );
+      };
+
+      auto const windowSize = stripes.count * cScanBucketsPerLock;
+      auto const windowCount = ( mBucketCount + windowSize - 1 ) / windowSize;
+      for ( size_t window = 0; window < windowCount; ++window )
       {
+         for ( size_t idx = 0; idx < stripes.count; ++idx )
+         {
+            {
+               ReadLockGuard lock( *this, idx );
+               ForEachWindowBucket( stripes, idx, window, add );
+            }
 
+            if ( writer.BlockFull() && !writer.Flush() )
+               return false;
+         }
       }
 
-      Bucket( Bucket const& b )
+      return writer.Finish();
+   }
+
+   // добавляет элементы снимка, значения имеющихся ключей заменяются. Ячейки выделяются
+   // заранее по размеру из заголовка, затем каждый блок снимка вставляется под всеми
+   // блокировками, взятыми один раз на блок, а рост проверяется после блока, а не после элемента.
+   // Возвращает false, если файл не открылся, снимок для других типов или оборван, -
+   // тогда в таблице остаются элементы, прочитанные до ошибки
+   bool LoadSnapshot( std::string const& path )
+   {
+      static_assert( std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value, "snapshots need trivially copyable keys and values" );
+
+      SnapshotReader<TKey, TValue> reader( path );
+      if ( !reader.Good() )
+         return false;
+
+      auto const expected = Size() + static_cast<size_t>( reader.ExpectedCount() );
+      if ( Bucket::cSelfResizing )
+         Reserve( expected );
+      else
+         Reserve( static_cast<size_t>( expected / mGrowthPolicy.maxLoadFactor ) );
+
+      // записи блока и их хэши готовятся до блокировки
+      std::vector<TKeyValue> kvs;
+      std::vector<size_t> hashes;
+      while ( reader.NextBlock() )
       {
-         mValues = b.mValues;
+         auto const count = reader.BlockSize();
+         kvs.resize( count );
+         hashes.resize( count );
+         for ( size_t pos = 0; pos < count; ++pos )
+         {
+            reader.Record( pos, kvs[pos].first, kvs[pos].second );
+            hashes[pos] = HashOf( kvs[pos].first );
+         }
+
+         auto& stripes = LockAll();
+         ptrdiff_t inserted = 0;
+         for ( size_t pos = 0; pos < count; ++pos )
+         {
+            if ( GetBucketForWrite( hashes[pos] ).InsertOrAssign( hashes[pos], kvs[pos].first, kvs[pos].second ) )
+               ++inserted;
+         }
+
+         // под всеми блокировками можно менять любой слот счётчика
+         stripes.AddSize( 0, inserted, CounterThreshold( stripes ) );
+         UnlockAll( stripes );
+
+         // снимок мог вырасти после записи заголовка
+         if ( inserted != 0 )
+            TryRehash();
+         HelpMigration();
       }
 
-      ~Bucket()
+      return reader.Complete();
+   }
+
+private:
+   typedef std::vector<size_t>::const_iterator TPositionIterator;
+
+   ThreadsafeHashTable( ThreadsafeHashTable const& );
+
+   ThreadsafeHashTable& operator=( ThreadsafeHashTable const& );
+
+   static size_t const cBucketsPerLock = 16;
+
+   // версия блокировки нужна обоим видам чтения без блокировки
+   static bool const cVersionedWrites = Bucket::cOptimisticReads || Bucket::cLockFreeReads;
+
+   // ячеек каждой блокировки в окне параллельного обхода
+   static size_t const cScanBucketsPerLock = 32;
+
+   // блокировка вместе с версией и слотом счётчика элементов. Счётчики статистики -
+   // базовый класс, при NoStats он пуст и места не занимает
+   struct StripeData : TStats::StripeCounters
+   {
+      StripeData()
+         : version( 0 )
       {
 
       }
 
-      Bucket& operator=( Bucket const& b )
+      TLock lock;
+
+      // версия для чтения без блокировки, меняется только под эксклюзивной блокировкой
+      TAtomicVersion version;
+
+      CounterSlot size;
+
+      // память узлов ячеек этой блокировки, меняется только под эксклюзивной блокировкой
+      typename Bucket::TPool pool;
+   };
+
+   typedef typename std::conditional<pStripeLayout == StripeLayout::Padded, CacheAligned<StripeData>, StripeData>::type Stripe;
+
+   // массив блокировок. При росте таблицы создаётся новый массив, а старый
+   // живёт до разрушения таблицы: его блокировки ещё могут ждать другие потоки
+   struct Stripes
+   {
+      explicit Stripes( size_t const lockCount )
+         : count( lockCount )
+         , items( new Stripe[lockCount] )
+         , approximateSize( 0 )
       {
-         if ( this == &b )
-            return *this;
 
-         mValues = b.mValues;
-         return *this;
       }
 
-      TCollisionContainer const& Values()
+      // вызывается под блокировкой idx, возвращает true, если изменился приблизительный размер
+      bool AddSize( size_t const idx, ptrdiff_t const delta, ptrdiff_t const threshold )
+      {
+         return items[idx].size.Add( delta, threshold, approximateSize );
+      }
+
+      size_t ExactSize() const
       {
-         return mValues;
+         ptrdiff_t value = 0;
+         for ( size_t idx = 0; idx < count; ++idx )
+         {
+            value += items[idx].size.value.load( std::memory_order_relaxed );
+         }
+         return value < 0 ? 0 : static_cast<size_t>( value );
       }
 
-      void Clear()
+      size_t ApproximateSize() const
       {
-         mValues.clear();
+         auto const value = approximateSize.load( std::memory_order_relaxed );
+         return value < 0 ? 0 : static_cast<size_t>( value );
       }
 
-      bool Insert( TKey const& key, TValue const& value )
+      // вызывается под всеми блокировками
+      void ResetSize( size_t const value = 0 )
       {
-         auto insert_position = mValues.begin();
-         for ( ; insert_position != mValues.end(); ++insert_position )
+         for ( size_t idx = 0; idx < count; ++idx )
          {
-            auto const& cur_bval = *insert_position;
-            auto const& cur_key = cur_bval.first;
+            items[idx].size.Reset();
+         }
+         items[0].size.Reset( static_cast<ptrdiff_t>( value ) );
+         approximateSize = static_cast<ptrdiff_t>( value );
+      }
 
-            if ( cur_key < key )
-            {
-               continue;
-            }
-            else if ( cur_key == key )
-            {
-               return false;
-            }
-            else
-            {
+      size_t const count;
+
+      std::unique_ptr<Stripe[]> items;
+
+      alignas( cCacheLineSize ) std::atomic<ptrdiff_t> approximateSize;
+   };
+
+   // массив ячеек для чтения без блокировки. Публикуется заново при каждой смене массива,
+   // старый освобождается по эпохам
+   struct BucketView
+   {
+      BucketView( TBucketSlot* const viewData, size_t const viewCount )
+         : data( viewData )
+         , count( viewCount )
+      {
+
+      }
+
+      TBucketSlot* const data;
+
+      size_t const count;
+   };
+
+   // эксклюзивная блокировка ключа, которая отмечает запись в версии.
+   // Пока поток ждал, массив блокировок мог вырасти - тогда отпускаем
+   // блокировку старого массива и берём блокировку по новому
+   class WriteLockGuard
+   {
+   public:
+      WriteLockGuard( ThreadsafeHashTable& table, size_t const hash )
+         : mTable( table )
+      {
+         for ( ;; )
+         {
+            mStripes = mTable.mStripes.load( std::memory_order_acquire );
+            mIdx = TIndexing::Index( hash, mStripes->count );
+            mTable.LockStripe( *mStripes, mIdx );
+
+            if ( mStripes == mTable.mStripes.load( std::memory_order_relaxed ) )
                break;
-            }
+
+            mTable.UnlockStripe( *mStripes, mIdx );
          }
+      }
+
+      ~WriteLockGuard()
+      {
+         mTable.UnlockStripe( *mStripes, mIdx );
+      }
+
+      Stripes& GetStripes() const
+      {
+         return *mStripes;
+      }
 
-         mValues.insert( insert_position, TKeyValue( key, value ) );
-         return true;
+      size_t Index() const
+      {
+         return mIdx;
       }
 
-      bool Update( TKey const& key, TValue const& value )
+   private:
+      WriteLockGuard( WriteLockGuard const& );
+
+      WriteLockGuard& operator=( WriteLockGuard const& );
+
+      ThreadsafeHashTable& mTable;
+      Stripes* mStripes;
+      size_t mIdx;
+   };
+
+   // разделяемая блокировка ключа, с той же проверкой массива блокировок
+   class ReadLockGuard
+   {
+   public:
+      ReadLockGuard( ThreadsafeHashTable& table, size_t const hash )
       {
-         for ( auto bval_it = mValues.begin(); bval_it != mValues.end(); ++bval_it )
+         for ( ;; )
          {
-            auto& cur_bval = *bval_it;
-            auto const& cur_key = cur_bval.first;
+            auto const stripes = table.mStripes.load( std::memory_order_acquire );
+            mStripe = &stripes->items[TIndexing::Index( hash, stripes->count )];
+            mStripe->LockShared( mStripe->lock );
 
-            if ( cur_key == key )
-            {
-               cur_bval.second = value;
-               return true;
-            }
+            if ( stripes == table.mStripes.load( std::memory_order_relaxed ) )
+               break;
+
+            mStripe->UnlockShared( mStripe->lock );
          }
+      }
 
-         return false;
+      ~ReadLockGuard()
+      {
+         mStripe->UnlockShared( mStripe->lock );
+      }
+
+   private:
+      ReadLockGuard( ReadLockGuard const& );
+
+      ReadLockGuard& operator=( ReadLockGuard const& );
+
+      StripeData* mStripe;
+   };
+
+   void LockStripe( Stripes& stripes, size_t const idx )
+   {
+      auto& stripe = stripes.items[idx];
+      stripe.Lock( stripe.lock );
+
+      if ( cVersionedWrites )
+      {
+         // нечётная версия - идёт запись
+         auto& version = stripe.version;
+         version.store( version.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+         std::atomic_thread_fence( std::memory_order_release );
+      }
+   }
+
+   void UnlockStripe( Stripes& stripes, size_t const idx )
+   {
+      auto& stripe = stripes.items[idx];
+      if ( cVersionedWrites )
+      {
+         auto& version = stripe.version;
+         version.store( version.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
       }
 
-      bool Read( TKey const& key, TValue& value ) const
+      stripe.Unlock( stripe.lock );
+   }
+
+   // захватывает все блокировки текущего массива и возвращает его
+   Stripes& LockAll()
+   {
+      for ( ;; )
       {
-         for ( auto val_it = mValues.begin(); val_it != mValues.end(); ++val_it )
+         auto const stripes = mStripes.load( std::memory_order_acquire );
+         for ( size_t idx = 0; idx < stripes->count; ++idx )
          {
-            auto& cur_val = *val_it;
-            auto const& cur_key = cur_val.first;
+            LockStripe( *stripes, idx );
+         }
 
-            if ( cur_key > key )
-            {
-               return false;
-            }
-            else if ( cur_key == key )
-            {
-               value = cur_val.second;
-               return true;
-            }
+         if ( stripes == mStripes.load( std::memory_order_relaxed ) )
+            return *stripes;
+
+         UnlockAll( *stripes );
+      }
+   }
+
+   void UnlockAll( Stripes& stripes )
+   {
+      for ( size_t idx = stripes.count; idx > 0; --idx )
+      {
+         UnlockStripe( stripes, idx - 1 );
+      }
+   }
+
+   Stripes& LockAllShared()
+   {
+      for ( ;; )
+      {
+         auto const stripes = mStripes.load( std::memory_order_acquire );
+         for ( size_t idx = 0; idx < stripes->count; ++idx )
+         {
+            stripes->items[idx].lock.lock_shared();
          }
 
-         return false;
+         if ( stripes == mStripes.load( std::memory_order_relaxed ) )
+            return *stripes;
+
+         UnlockAllShared( *stripes );
+      }
+   }
+
+   void UnlockAllShared( Stripes& stripes )
+   {
+      for ( size_t idx = stripes.count; idx > 0; --idx )
+      {
+         stripes.items[idx - 1].lock.unlock_shared();
+      }
+   }
+
+   // вызывает f( stripes, idx, first, last ) для каждой группы позиций пачки с одной блокировкой,
+   // под этой блокировкой (эксклюзивной или разделяемой). Группы идут в порядке блокировок,
+   // внутри группы - в порядке пачки. Если массив блокировок вырос, оставшиеся
+   // позиции группируются заново
+   template<typename Function>
+   void ForEachStripeGroup( std::vector<size_t> const& hashes, bool const exclusive, bool const prefetch, Function f )
+   {
+      std::vector<size_t> order( hashes.size() );
+      for ( size_t pos = 0; pos < order.size(); ++pos )
+      {
+         order[pos] = pos;
       }
 
-      TCollisionIterator Find( TKey const& key )
+      size_t done = 0;
+      while ( done < order.size() )
       {
-         for ( auto val_it = mValues.begin(); val_it != mValues.end(); ++val_it )
+         auto const stripes = mStripes.load( std::memory_order_acquire );
+         auto const count = stripes->count;
+         std::stable_sort( order.begin() + done, order.end(), [&]( size_t const a, size_t const b )
          {
-            auto& cur_val = *val_it;
-            auto const& cur_key = cur_val.first;
+            return TIndexing::Index( hashes[a], count ) < TIndexing::Index( hashes[b], count );
+         } );
 
-            if ( cur_key > key )
+         while ( done < order.size() )
+         {
+            auto const idx = TIndexing::Index( hashes[order[done]], count );
+            auto end = done + 1;
+            while ( end < order.size() && TIndexing::Index( hashes[order[end]], count ) == idx )
             {
-               return mValues.end();
+               ++end;
             }
-            else if ( cur_key == key )
+
+            auto& stripe = stripes->items[idx];
+            if ( exclusive )
+               LockStripe( *stripes, idx );
+            else
+               stripe.LockShared( stripe.lock );
+
+            auto const valid = stripes == mStripes.load( std::memory_order_relaxed );
+            if ( valid )
             {
-               return val_it;
+               if ( prefetch )
+               {
+                  for ( auto pos = done; pos < end; ++pos )
+                  {
+                     GetBucket( hashes[order[pos]] ).Prefetch( hashes[order[pos]] );
+                  }
+               }
+
+               f( *stripes, idx, order.cbegin() + done, order.cbegin() + end );
             }
+
+            if ( exclusive )
+               UnlockStripe( *stripes, idx );
+            else
+               stripe.UnlockShared( stripe.lock );
+
+            if ( !valid )
+               break;
+
+            done = end;
          }
+      }
+   }
 
-         return mValues.end();
+   // вызывается под всеми блокировками и блокировкой рехэша после смены массива ячеек.
+   // Количество блокировок всегда делит количество ячеек, поэтому растёт тоже вдвое
+   void GrowStripes( Stripes& stripes )
+   {
+      auto count = stripes.count;
+      while ( count * 2 <= mMaxLockCount && mBuckets.size() / count > cBucketsPerLock && mBuckets.size() % ( count * 2 ) == 0 )
+      {
+         count *= 2;
       }
 
-      bool Delete( TKey const& key )
+      if ( count == stripes.count )
+         return;
+
+      std::unique_ptr<Stripes> grown( new Stripes( count ) );
+      grown->ResetSize( stripes.ExactSize() );
+      BindPools( *grown );
+
+      // узлы переезжают в пулы новых полос, старые пулы освобождаются целиком
+      AttachBuckets( mBuckets, *grown );
+      for ( size_t idx = 0; idx < stripes.count; ++idx )
       {
-         for ( auto bval_it = mValues.begin(); bval_it != mValues.end(); ++bval_it )
-         {
-            auto& cur_bval = *bval_it;
-            auto const& cur_key = cur_bval.first;
+         stripes.items[idx].pool.ReleaseAll();
+      }
+
+      mStripes.store( grown.get(), std::memory_order_release );
+      mStripeArrays.push_back( std::move( grown ) );
+   }
+
+   // prepare( количество окон ) вызывается один раз перед обходом, затем f( stripes, idx, окно, ячейка )
+   // для каждой живой ячейки под её блокировкой idx. Блокировка рехэша держится разделяемой,
+   // поэтому ни массив блокировок, ни (кроме Clear) массивы ячеек не меняются.
+   // Окно - cScanBucketsPerLock ячеек каждой блокировки подряд. Внутри окна блокировки
+   // берутся по очереди, и ячейки блокировки идут с шагом в количество блокировок, но окно
+   // целиком остаётся в кэше, а блокировка берётся один раз на cScanBucketsPerLock ячеек
+   template<typename Prepare, typename Function>
+   void ParallelScan( ThreadPool& pool, bool const exclusive, Prepare prepare, Function f )
+   {
+      TSharedLockGuard rehashLock( mRehashLock );
+      auto& stripes = *mStripes.load( std::memory_order_acquire );
+      auto const windowSize = stripes.count * cScanBucketsPerLock;
+      auto const windowCount = ( mBucketCount + windowSize - 1 ) / windowSize;
+      prepare( windowCount );
 
-            if ( cur_key > key )
+      pool.ParallelFor( windowCount, [&]( size_t const window )
+      {
+         for ( size_t idx = 0; idx < stripes.count; ++idx )
+         {
+            if ( exclusive )
             {
-               return false;
+               WriteLockGuard lock( *this, idx );
+               ForEachWindowBucket( stripes, idx, window, f );
             }
-            else if ( cur_key == key )
+            else
             {
-               mValues.erase( bval_it );
-               return true;
+               ReadLockGuard lock( *this, idx );
+               ForEachWindowBucket( stripes, idx, window, f );
             }
          }
+      } );
+   }
+
+   // ячейки блокировки idx в окне window. Новый массив при переносе в growthFactor раз больше,
+   // поэтому в нём окно во столько же раз шире
+   template<typename Function>
+   void ForEachWindowBucket( Stripes& stripes, size_t const idx, size_t const window, Function& f )
+   {
+      auto const windowSize = stripes.count * cScanBucketsPerLock;
+      auto const end = std::min( ( window + 1 ) * windowSize, mBuckets.size() );
+      for ( auto buc_idx = window * windowSize + idx; buc_idx < end; buc_idx += stripes.count )
+      {
+         if ( !mMigrating || !mMigrated[buc_idx] )
+            f( stripes, idx, window, mBuckets[buc_idx] );
+      }
+
+      if ( !mMigrating )
+         return;
+
+      auto const newWindowSize = windowSize * ( mNewBuckets.size() / mBuckets.size() );
+      auto const newEnd = std::min( ( window + 1 ) * newWindowSize, mNewBuckets.size() );
+      for ( auto buc_idx = window * newWindowSize + idx; buc_idx < newEnd; buc_idx += stripes.count )
+      {
+         f( stripes, idx, window, mNewBuckets[buc_idx] );
+      }
+   }
+
+   // разделяемые блокировки шага Scan, отпускаются в обратном порядке.
+   // Обычно блокировка одна, и вектор не нужен
+   class ScanLocks
+   {
+   public:
+      ScanLocks()
+         : mFirst( nullptr )
+      {
 
-         return false;
       }
 
-      size_t Size() const
+      ~ScanLocks()
       {
-         return mValues.size();
+         Release();
       }
 
-      template<typename Function>
-      void ForEach( Function f )
+      void Add( TLock& lock )
       {
-         for ( auto val_it = mValues.begin(), end_it = mValues.end(); val_it != end_it; ++val_it )
-         {
-            f( *val_it );
-         }
+         lock.lock_shared();
+         if ( mFirst == nullptr )
+            mFirst = &lock;
+         else
+            mRest.push_back( &lock );
       }
 
-      template<typename Predicate>
-      bool FindFirstIf( Predicate p, TKeyValue& found )
+      void Release()
       {
-         for ( auto val_it = mValues.begin(), end_it = mValues.end(); val_it != end_it; ++val_it )
+         for ( auto lock_it = mRest.rbegin(); lock_it != mRest.rend(); ++lock_it )
          {
-            auto const& val = *val_it;
-
-            if( p( val ) )
-            {
-               found = val;
-               return true;
-            }
+            ( *lock_it )->unlock_shared();
          }
+         mRest.clear();
 
-         return false;
+         if ( mFirst != nullptr )
+            mFirst->unlock_shared();
+         mFirst = nullptr;
       }
 
-      template<typename Predicate>
-      bool EraseIf( Predicate p )
-      {
-         for ( auto val_it = mValues.begin(), end_it = mValues.end(); val_it != end_it; ++val_it )
-         {
-            auto const& val = *val_it;
+   private:
+      ScanLocks( ScanLocks const& );
 
-            if( p( val ) )
-            {
-               mValues.erase( val_it );
-               return true;
-            }
-         }
+      ScanLocks& operator=( ScanLocks const& );
 
-         return false;
-      }
+      TLock* mFirst;
 
-   private:
-      TCollisionContainer mValues;
+      std::vector<TLock*> mRest;
    };
 
-   ThreadsafeHashTable()
-      : mMaxLoadFactor( 0.7f )
-   {
-      mBuckets.resize( pLockCount );
-   }
-
-   ~ThreadsafeHashTable()
+   size_t ScanBucketsPerLock( ScanCursor const& cursor ) const
    {
-
+      return std::min( cScanBucketsPerLock, cursor.mBucketCount / cursor.mLockCount );
    }
 
-   bool Find( TKey const& key, TValue& value )
+   // начальная ячейка курсора. Начальные ячейки обходятся окнами по cScanBucketsPerLock
+   // ячеек каждой начальной блокировки: внутри окна сначала все ячейки первой
+   // блокировки, затем второй и т.д., поэтому блокировка берётся один раз на шаг,
+   // а окно целиком остаётся в кэше
+   size_t ScanBucketIndex( ScanCursor const& cursor ) const
    {
-      return Read( key, value );
+      auto const perLock = ScanBucketsPerLock( cursor );
+      auto const windowSize = cursor.mLockCount * perLock;
+      auto const window = cursor.mPosition / windowSize;
+      auto const offset = cursor.mPosition % windowSize;
+      return window * windowSize + offset / perLock + ( offset % perLock ) * cursor.mLockCount;
    }
 
-   size_t Size() const
+   // элементы начальной ячейки start курсора в массиве buckets. Количества ячеек отличаются
+   // в степень двойки раз, поэтому одно делит другое. Если с начала обхода массив сжался,
+   // начальная ячейка - часть ячейки start % size, и её элементы отбираются по хэшу
+   template<typename Function>
+   void ScanBuckets( TBucketContainer& buckets, bool const skipMigrated, size_t const start, ScanCursor const& cursor, Function& visit )
    {
-      return mSize;
-   }
+      if ( buckets.size() < cursor.mBucketCount )
+      {
+         auto const idx = start % buckets.size();
+         if ( skipMigrated && mMigrated[idx] )
+            return;
 
-   // пользователю этого метода придется блокировать ячейку в таблице
-   //TValue& operator[]( TKey const& key );
+         buckets[idx].ForEach( [&]( TKeyValue& kv )
+         {
+            if ( TIndexing::Index( HashOf( kv.first ), cursor.mBucketCount ) == start )
+               visit( kv );
+         } );
+         return;
+      }
 
-   TValue operator[]( TKey const& key )
-   {
-      TValue value;
-      if ( Read( key, value ) )
-         return value;
-      throw std::exception( "Key not found" );
+      for ( auto idx = start; idx < buckets.size(); idx += cursor.mBucketCount )
+      {
+         if ( !skipMigrated || !mMigrated[idx] )
+            buckets[idx].ForEach( visit );
+      }
    }
 
-   bool Insert( TKeyValue const& kv )
+   // ячейки r + j * n0 (n0 - начальное количество ячеек) закрыты блокировками
+   // с номерами r по модулю g = min( n0, количество блокировок ), т.к. одно из этих чисел делит другое.
+   // Обычно блокировок не больше n0, и блокировка одна
+   size_t ScanStripe( ScanCursor const& cursor, Stripes const& stripes ) const
    {
-      auto const& key = kv.first;
-      auto const& value = kv.second;
-
-      return Insert( key, value );
+      return ScanBucketIndex( cursor ) % std::min( cursor.mBucketCount, stripes.count );
    }
 
-   bool Update( TKeyValue const& kv )
+   // берёт разделяемые блокировки ячеек курсора по возрастанию номера, как LockAll,
+   // и возвращает массив блокировок, который не меняется, пока они захвачены
+   Stripes const& LockScanStripes( ScanCursor const& cursor, ScanLocks& locks )
    {
-      auto const& key = kv.first;
-      auto const& value = kv.second;
+      for ( ;; )
+      {
+         auto const stripes = mStripes.load( std::memory_order_acquire );
+         auto const step = std::min( cursor.mBucketCount, stripes->count );
+         for ( auto idx = ScanStripe( cursor, *stripes ); idx < stripes->count; idx += step )
+         {
+            locks.Add( stripes->items[idx].lock );
+         }
 
-      return Update( key, value );
-   }
+         if ( stripes == mStripes.load( std::memory_order_relaxed ) )
+            return *stripes;
 
-   void Erase( TKey const& key )
-   {
-      Delete( key );
+         locks.Release();
+      }
    }
 
-   void Clear()
+   // ячейка берёт узлы из пула той блокировки, которой она закрыта
+   static void AttachBuckets( TBucketContainer& buckets, Stripes& stripes )
    {
-      for ( auto lock_it = mLocks.begin(); lock_it != mLocks.end(); ++lock_it )
+      for ( size_t idx = 0; idx < buckets.size(); ++idx )
       {
-         lock_it->lock();
-      }
-
-      for ( auto buc_it = mBuckets.begin(); buc_it != mBuckets.end(); ++buc_it )
-      {
-         buc_it->Clear();
+         buckets[idx].Attach( stripes.items[idx % stripes.count].pool );
       }
+   }
 
-      mSize = 0;
+   // пулы полос откладывают удалённые узлы в домен эпох таблицы
+   void BindPools( Stripes& stripes )
+   {
+      if ( !mEpochs )
+         return;
 
-      for ( auto lock_it = mLocks.rbegin(); lock_it != mLocks.rend(); ++lock_it )
+      for ( size_t idx = 0; idx < stripes.count; ++idx )
       {
-         lock_it->unlock();
+         stripes.items[idx].pool.Bind( *mEpochs );
       }
    }
 
-   template<typename Function>
-   void ForEach( Function f )
+   // публикует текущий массив ячеек для чтения без блокировки, во время переноса
+   // массива нет и читатели идут под блокировку. Вызывается под всеми блокировками
+   void PublishBuckets()
    {
-      for ( auto lock_it = mLocks.begin(); lock_it != mLocks.end(); ++lock_it )
-      {
-         lock_it->lock_shared();
-      }
+      if ( !mEpochs )
+         return;
 
-      for ( auto buc_it = mBuckets.begin(), end_it = mBuckets.end(); buc_it != end_it; ++buc_it )
-      {
-         auto const idx = std::distance( mBuckets.begin(), buc_it );
-         buc_it->ForEach( f );
-      }
+      BucketView* view = nullptr;
+      if ( !mMigrating )
+         view = new BucketView( mBuckets.data(), mBuckets.size() );
 
-      for ( auto lock_it = mLocks.rbegin(); lock_it != mLocks.rend(); ++lock_it )
-      {
-         lock_it->unlock_shared();
-      }
+      auto const old = mBucketView.exchange( view, std::memory_order_acq_rel );
+      if ( old != nullptr )
+         mEpochs->Retire( old );
    }
 
-   template<typename Predicate>
-   bool FindFirstIf( Predicate p, TKeyValue& found )
+   // заменённый массив ячеек ещё могут читать без блокировки, поэтому он освобождается по эпохам
+   void RetireBuckets( TBucketContainer& buckets )
    {
-      for ( auto lock_it = mLocks.begin(); lock_it != mLocks.end(); ++lock_it )
+      if ( !mEpochs )
       {
-         lock_it->lock_shared();
+         TBucketContainer().swap( buckets );
+         return;
       }
 
-      for ( auto buc_it = mBuckets.begin(), end_it = mBuckets.end(); buc_it != end_it; ++buc_it )
+      std::unique_ptr<TBucketContainer> retired( new TBucketContainer() );
+      retired->swap( buckets );
+      mEpochs->Retire( retired.release() );
+   }
+
+   // обходит все живые ячейки (во время переноса - ещё не перенесённые старые и новые),
+   // пока функция не вернёт true. Вызывается под всеми блокировками
+   template<typename Function>
+   bool FindBucket( Function f )
+   {
+      for ( size_t idx = 0; idx < mBuckets.size(); ++idx )
       {
-         auto const idx = std::distance( mBuckets.begin(), buc_it );
-         if ( buc_it->FindFirstIf( p, found ) )
-         {
+         if ( mMigrating && mMigrated[idx] )
+            continue;
+
+         if ( f( mBuckets[idx] ) )
             return true;
-         }
       }
 
-      for ( auto lock_it = mLocks.rbegin(); lock_it != mLocks.rend(); ++lock_it )
+      if ( !mMigrating )
+         return false;
+
+      for ( auto buc_it = mNewBuckets.begin(), end_it = mNewBuckets.end(); buc_it != end_it; ++buc_it )
       {
-         lock_it->unlock_shared();
+         if ( f( *buc_it ) )
+            return true;
       }
 
       return false;
    }
 
-   template<typename Predicate>
-   bool EraseIf( Predicate p )
+   static void AddChainLength( TableStats& stats, size_t const length )
    {
-      for ( auto lock_it = mLocks.begin(); lock_it != mLocks.end(); ++lock_it )
-      {
-         lock_it->lock_shared();
-      }
+      auto const slot = std::min( length, TableStats::cChainLengthLimit );
+      if ( stats.chainLengths.size() <= slot )
+         stats.chainLengths.resize( slot + 1, 0 );
 
-      for ( auto buc_it = mBuckets.begin(), end_it = mBuckets.end(); buc_it != end_it; ++buc_it )
-      {
-         auto const idx = std::distance( mBuckets.begin(), buc_it );
-         if ( buc_it->EraseIf( p ) )
-         {
-            return true;
-         }
-      }
+      ++stats.chainLengths[slot];
+      stats.maxChainLength = std::max( stats.maxChainLength, length );
+   }
 
-      for ( auto lock_it = mLocks.rbegin(); lock_it != mLocks.rend(); ++lock_it )
-      {
-         lock_it->unlock_shared();
-      }
+   bool NeedRehash()
+   {
+      if ( Bucket::cSelfResizing || mMigrating )
+         return false;
 
-      return false;
+      auto const loadFactor = static_cast<float>( ApproximateSize() ) / mBucketCount;
+      if ( loadFactor < mGrowthPolicy.maxLoadFactor )
+         return false;
+      return true;
    }
 
-   void Reserve( size_t const size )
+   // сжатие проверяется только после удалений: после Reserve пустая таблица
+   // не должна сжиматься от первой же вставки. Одиночные удаления проверяют его, только
+   // когда изменился приблизительный размер, т.е. раз в порог счётчика на блокировку.
+   // Приблизительный размер может быть больше точного на количество блокировок * порог,
+   // поэтому здесь отсекаются только таблицы, которые точно не надо сжимать
+   bool NeedShrink()
    {
-      if ( size <= mBuckets.size() )
-         return;
+      if ( Bucket::cSelfResizing || mMigrating || mGrowthPolicy.minLoadFactor <= 0 )
+         return false;
 
-      TUniqueLockGuard rehashLock( mRehashLock );
-      auto bucketCount = mBuckets.size();
-      while ( bucketCount < size )
-      {
-         bucketCount *= 2;
-      }
+      size_t const bucketCount = mBucketCount;
+      auto const lockCount = LockCount();
+      if ( bucketCount <= lockCount )
+         return false;
 
-      Rehash( bucketCount );
+      auto const error = std::max( bucketCount / 8, lockCount );
+      return ApproximateSize() < mGrowthPolicy.minLoadFactor * bucketCount + error;
    }
 
-private:
-   ThreadsafeHashTable( ThreadsafeHashTable const& );
+   bool TryShrink()
+   {
+      if ( !NeedShrink() )
+         return false;
 
-   ThreadsafeHashTable& operator=( ThreadsafeHashTable const& );
+      if ( !mRehashLock.try_lock() )
+         return false;
+      TUniqueLockGuard rehash_lock( mRehashLock, std::adopt_lock );
 
-   bool NeedRehash()
-   {
-      auto const loadFactor = static_cast<float>( mSize ) / mBuckets.size();
-      if ( loadFactor < mMaxLoadFactor )
+      if ( !NeedShrink() )
+         return false;
+
+      auto const size = Size();
+      if ( size >= mGrowthPolicy.minLoadFactor * mBuckets.size() )
+         return false;
+
+      auto const bucketCount = ShrinkTarget( size );
+      if ( bucketCount >= mBuckets.size() )
          return false;
+
+      Rehash( bucketCount );
       return true;
    }
 
+   // наименьшее количество ячеек, при котором загрузка не выше maxLoadFactor * ( 1 - hysteresis ).
+   // Ячейки делятся пополам, пока их больше, чем блокировок: количество блокировок
+   // должно делить количество ячеек. Вызывается под блокировкой рехэша
+   size_t ShrinkTarget( size_t const size ) const
+   {
+      auto const stripeCount = mStripes.load( std::memory_order_acquire )->count;
+      auto const limit = mGrowthPolicy.maxLoadFactor * ( 1 - mGrowthPolicy.hysteresis );
+      auto bucketCount = mMigrating ? mNewBuckets.size() : mBuckets.size();
+      while ( bucketCount / 2 >= stripeCount && bucketCount % 2 == 0 && size <= limit * ( bucketCount / 2 ) )
+      {
+         bucketCount /= 2;
+      }
+      return bucketCount;
+   }
+
    bool TryRehash()
    {
       if( !NeedRehash() )
@@ -400,108 +1598,436 @@ private:
       if( !NeedRehash() )
          return false;
 
-      Rehash();
+      if ( mRehashMode == RehashMode::Incremental )
+         StartMigration();
+      else
+         Rehash();
       return true;
    }
 
    void Rehash( size_t const size = 0 )
    {
-      for ( auto lock_it = mLocks.begin(); lock_it != mLocks.end(); ++lock_it )
-      {
-         lock_it->lock();
-      }
-      
+      auto& stripes = LockAll();
+      auto const pauseStart = mStats.PauseStart();
+      mStats.Rehash();
+
       size_t bucketCount;
       if ( size == 0 )
-         bucketCount = mBuckets.size() * 2;
+         bucketCount = ( mMigrating ? mNewBuckets.size() : mBuckets.size() ) * mGrowthPolicy.growthFactor;
       else
          bucketCount = size;
 
-      TBucketContainer oldBuckets = std::move( mBuckets );
-      mBuckets.resize( bucketCount );
-      for ( auto buc_it = oldBuckets.begin(); buc_it != oldBuckets.end(); ++buc_it )
+      // элементы не копируются: узлы перевешиваются или перемещаются
+      TBucketContainer newBuckets( bucketCount );
+      AttachBuckets( newBuckets, stripes );
+      auto const hashOf = [this]( TKey const& key )
+      {
+         return HashOf( key );
+      };
+      FindBucket( [&]( Bucket& bucket ) -> bool
+      {
+         bucket.MoveTo( hashOf, [&newBuckets]( size_t const hash ) -> Bucket&
+         {
+            return newBuckets[TIndexing::Index( hash, newBuckets.size() )];
+         } );
+         return false;
+      } );
+
+      mBuckets.swap( newBuckets );
+      mBucketCount = mBuckets.size();
+      if ( mMigrating )
+         CompleteMigration();
+
+      RetireBuckets( newBuckets );
+      PublishBuckets();
+      GrowStripes( stripes );
+
+      mStats.PauseEnd( pauseStart );
+      UnlockAll( stripes );
+   }
+
+   // начало постепенного рехэша: под всеми блокировками только публикуется новый массив
+   void StartMigration()
+   {
+      // пустые ячейки создаём до блокировки. Массив блокировок под блокировкой рехэша не меняется
+      TBucketContainer newBuckets( mBuckets.size() * mGrowthPolicy.growthFactor );
+      AttachBuckets( newBuckets, *mStripes.load( std::memory_order_acquire ) );
+
+      auto& stripes = LockAll();
+      auto const pauseStart = mStats.PauseStart();
+      mStats.Rehash();
+
+      mNewBuckets.swap( newBuckets );
+      mMigrated.assign( mBuckets.size(), 0 );
+      mMigrateTotal = mBuckets.size();
+      mMigrateCursor = 0;
+      mMigratedCount = 0;
+      mMigrating = true;
+      PublishBuckets();
+
+      mStats.PauseEnd( pauseStart );
+      UnlockAll( stripes );
+   }
+
+   // сбрасывает состояние переноса, вызывается под всеми блокировками
+   void CompleteMigration()
+   {
+      RetireBuckets( mNewBuckets );
+      std::vector<char>().swap( mMigrated );
+      mMigrating = false;
+      PublishBuckets();
+   }
+
+   // переносит старую ячейку в новый массив, вызывается под её блокировкой
+   void MigrateBucket( size_t const idx )
+   {
+      auto const hashOf = [this]( TKey const& key )
+      {
+         return HashOf( key );
+      };
+      mBuckets[idx].MoveTo( hashOf, [this]( size_t const hash ) -> Bucket&
+      {
+         return mNewBuckets[TIndexing::Index( hash, mNewBuckets.size() )];
+      } );
+
+      mMigrated[idx] = 1;
+      ++mMigratedCount;
+   }
+
+   void MigrateBuckets( size_t const count )
+   {
+      for ( size_t i = 0; i < count; ++i )
       {
-         auto const& values = buc_it->Values();
-         for ( auto val_it = values.begin(); val_it != values.end(); ++val_it )
+         auto const idx = mMigrateCursor++;
+         if ( idx >= mMigrateTotal )
+            break;
+
          {
-            auto const& key = val_it->first;
-            auto const& value = val_it->second;
+            // старая ячейка и все её новые ячейки закрыты одной блокировкой,
+            // т.к. количество ячеек всегда кратно количеству блокировок
+            WriteLockGuard lock( *this, idx );
+            if ( !mMigrating || idx >= mBuckets.size() )
+               break;
 
-            GetBucket( key ).Insert( key, value );
+            if ( !mMigrated[idx] )
+               MigrateBucket( idx );
          }
       }
 
-      for ( auto lock_it = mLocks.rbegin(); lock_it != mLocks.rend(); ++lock_it )
+      FinishMigration();
+   }
+
+   void FinishMigration()
+   {
+      if ( !mMigrating || mMigratedCount < mMigrateTotal )
+         return;
+
+      // писатель не ждёт блокировку рехэша: если её держит параллельный обход или
+      // другой поток, перенос завершит одна из следующих операций
+      if ( !mRehashLock.try_lock() )
+         return;
+      TUniqueLockGuard rehashLock( mRehashLock, std::adopt_lock );
+      auto& stripes = LockAll();
+      auto const pauseStart = mStats.PauseStart();
+
+      if ( mMigrating && mMigratedCount == mBuckets.size() )
       {
-         lock_it->unlock();
+         mBuckets.swap( mNewBuckets );
+         mBucketCount = mBuckets.size();
+         CompleteMigration();
+         GrowStripes( stripes );
       }
+
+      mStats.PauseEnd( pauseStart );
+      UnlockAll( stripes );
    }
 
-   TLock& GetLockForKey( TKey const& key )
+   // попутная помощь с переносом от пишущих операций
+   void HelpMigration()
    {
-      auto idx = mHasher( key ) % mLocks.size();
-      return mLocks[idx];
+      if ( mMigrating )
+         MigrateBuckets( mMigrationStep );
    }
 
-   size_t GetBucketIndex( TKey const& key )
+   // порог сброса слота счётчика в общий приблизительный размер: суммарная погрешность
+   // не больше 1/8 от количества ячеек, т.е. загрузка для рехэша ошибается не больше чем на 0.125.
+   // Вызывается под блокировкой, массив ячеек при этом не меняется
+   ptrdiff_t CounterThreshold( Stripes const& stripes ) const
    {
-      return mHasher( key ) % mBuckets.size();
+      auto const threshold = mBuckets.size() / ( stripes.count * 8 );
+      return threshold == 0 ? 1 : static_cast<ptrdiff_t>( threshold );
    }
 
-   Bucket& GetBucket( TKey const& key )
+   // хэш ключа считается один раз за операцию, по нему выбираются и блокировка, и ячейка
+   template<typename K>
+   size_t HashOf( K const& key )
    {
-      return mBuckets[GetBucketIndex( key )];
+      return TIndexing::Hash( mHasher( key ) );
    }
 
-   bool Insert( TKey const& key, TValue const& value )
+   size_t GetBucketIndex( size_t const hash )
    {
-      bool res = false;
+      return TIndexing::Index( hash, mBuckets.size() );
+   }
+
+   // вызывается под блокировкой ключа
+   Bucket& GetBucket( size_t const hash )
+   {
+      auto const idx = GetBucketIndex( hash );
+      if ( !mMigrating || !mMigrated[idx] )
+         return mBuckets[idx];
+
+      return mNewBuckets[TIndexing::Index( hash, mNewBuckets.size() )];
+   }
+
+   // вызывается под эксклюзивной блокировкой ключа,
+   // ячейку, в которую пишем, заодно переносим в новый массив
+   Bucket& GetBucketForWrite( size_t const hash )
+   {
+      if ( mMigrating )
       {
-         TUniqueLockGuard lock( GetLockForKey( key ) );
-         res = GetBucket( key ).Insert( key, value );
+         auto const idx = GetBucketIndex( hash );
+         if ( !mMigrated[idx] )
+            MigrateBucket( idx );
+
+         return mNewBuckets[TIndexing::Index( hash, mNewBuckets.size() )];
       }
 
-      if( res )
+      return mBuckets[GetBucketIndex( hash )];
+   }
+
+   // выполняет op( ячейка ) под эксклюзивной блокировкой ключа, блокировка берётся один раз.
+   // op возвращает изменение количества элементов: -1, 0 или 1
+   template<typename Function>
+   ptrdiff_t WriteKey( size_t const hash, Function op )
+   {
+      ptrdiff_t delta = 0;
+      bool resized = false;
       {
-         ++mSize;
-         TryRehash();
+         WriteLockGuard lock( *this, hash );
+         delta = op( GetBucketForWrite( hash ) );
+         if ( delta != 0 )
+            resized = lock.GetStripes().AddSize( lock.Index(), delta, CounterThreshold( lock.GetStripes() ) );
       }
 
-      return res;
+      if( delta > 0 )
+         TryRehash();
+      else if ( delta < 0 && resized )
+         TryShrink();
+
+      HelpMigration();
+      return delta;
+   }
+
+   template<typename K, typename... Args>
+   bool EmplaceImpl( K&& key, Args&&... args )
+   {
+      auto const hash = HashOf( key );
+      return WriteKey( hash, [&]( Bucket& bucket ) -> ptrdiff_t
+      {
+         return bucket.Emplace( hash, std::forward<K>( key ), std::forward<Args>( args )... ) ? 1 : 0;
+      } ) > 0;
+   }
+
+   template<typename K, typename V>
+   bool InsertOrAssignImpl( K&& key, V&& value )
+   {
+      auto const hash = HashOf( key );
+      return WriteKey( hash, [&]( Bucket& bucket ) -> ptrdiff_t
+      {
+         return bucket.InsertOrAssign( hash, std::forward<K>( key ), std::forward<V>( value ) ) ? 1 : 0;
+      } ) > 0;
+   }
+
+   template<typename K, typename Init, typename Function>
+   bool UpsertImpl( K&& key, Init&& init, Function& f )
+   {
+      auto const hash = HashOf( key );
+      return WriteKey( hash, [&]( Bucket& bucket ) -> ptrdiff_t
+      {
+         if ( bucket.Modify( hash, key, f ) )
+            return 0;
+
+         bucket.Emplace( hash, std::forward<K>( key ), std::forward<Init>( init ) );
+         return 1;
+      } ) > 0;
+   }
+
+   template<typename K, typename Function>
+   bool ComputeImpl( K&& key, Function& f )
+   {
+      auto const hash = HashOf( key );
+      bool present = false;
+      WriteKey( hash, [&]( Bucket& bucket ) -> ptrdiff_t
+      {
+         return bucket.Compute( hash, std::forward<K>( key ), f, present );
+      } );
+      return present;
    }
 
    bool Update( TKey const& key, TValue const& value )
    {
-      TUniqueLockGuard lock( GetLockForKey( key ) );
-      return GetBucket( key ).Update( key, value );
+      auto const hash = HashOf( key );
+      WriteLockGuard lock( *this, hash );
+      return GetBucketForWrite( hash ).Update( hash, key, value );
    }
 
-   bool Read( TKey const& key, TValue& value )
+   template<typename K, typename Function>
+   bool VisitImpl( K const& key, Function& f )
    {
-      TSharedLockGuard lock( GetLockForKey( key ) );
-      return GetBucket( key ).Read( key, value );
+      auto const hash = HashOf( key );
+      ReadLockGuard lock( *this, hash );
+      return GetBucket( hash ).Visit( hash, key, f );
    }
 
-   bool Delete( TKey const& key )
+   template<typename K>
+   bool Read( K const& key, TValue& value )
    {
-      TUniqueLockGuard lock( GetLockForKey( key ) );
-      auto res = GetBucket( key ).Delete( key );
-      if( res )
-         --mSize;
-      return res;
+      auto const hash = HashOf( key );
+
+      if ( Bucket::cOptimisticReads && mReadMode == ReadMode::Optimistic )
+      {
+         bool found = false;
+         if ( OptimisticRead( hash, key, value, found ) )
+            return found;
+      }
+
+      if ( Bucket::cLockFreeReads && mReadMode == ReadMode::LockFree )
+      {
+         bool found = false;
+         if ( LockFreeRead( hash, key, value, found ) )
+            return found;
+      }
+
+      ReadLockGuard lock( *this, hash );
+      return GetBucket( hash ).Read( hash, key, value );
+   }
+
+   // у самостоятельно растущих хранилищ массив ячеек не меняется,
+   // поэтому ячейку можно найти без блокировки
+   template<typename K>
+   bool OptimisticRead( size_t const hash, K const& key, TValue& value, bool& found )
+   {
+      static int const cAttempts = 4;
+
+      auto const stripes = mStripes.load( std::memory_order_acquire );
+      auto const& version = stripes->items[TIndexing::Index( hash, stripes->count )].version;
+      auto const& bucket = mBuckets[GetBucketIndex( hash )];
+      for ( int attempt = 0; attempt < cAttempts; ++attempt )
+      {
+         auto const before = version.load( std::memory_order_acquire );
+         if ( before & 1 )
+            continue;
+
+         TValue candidate;
+         auto const res = bucket.OptimisticRead( hash, key, candidate );
+
+         std::atomic_thread_fence( std::memory_order_acquire );
+         if ( version.load( std::memory_order_relaxed ) == before )
+         {
+            found = res;
+            if ( res )
+               value = candidate;
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   // массив ячеек может смениться во время чтения, но ни он, ни узлы не освобождаются,
+   // пока читатель внутри эпохи. Результат верен, если версия блокировки ключа не изменилась
+   template<typename K>
+   bool LockFreeRead( size_t const hash, K const& key, TValue& value, bool& found )
+   {
+      static int const cAttempts = 4;
+
+      EpochDomain::Guard guard( *mEpochs );
+      for ( int attempt = 0; attempt < cAttempts; ++attempt )
+      {
+         auto const stripes = mStripes.load( std::memory_order_acquire );
+         auto const& version = stripes->items[TIndexing::Index( hash, stripes->count )].version;
+         auto const before = version.load( std::memory_order_acquire );
+         if ( before & 1 )
+            continue;
+
+         auto const view = mBucketView.load( std::memory_order_acquire );
+         if ( view == nullptr )
+            return false;
+
+         TValue candidate;
+         Bucket const& bucket = view->data[TIndexing::Index( hash, view->count )];
+         auto const res = bucket.LockFreeRead( hash, key, candidate );
+
+         std::atomic_thread_fence( std::memory_order_acquire );
+         if ( version.load( std::memory_order_relaxed ) == before && stripes == mStripes.load( std::memory_order_relaxed ) )
+         {
+            found = res;
+            if ( res )
+               value = candidate;
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   template<typename K>
+   bool Delete( K const& key )
+   {
+      auto const hash = HashOf( key );
+      return WriteKey( hash, [&]( Bucket& bucket ) -> ptrdiff_t
+      {
+         return bucket.Delete( hash, key ) ? -1 : 0;
+      } ) < 0;
    }
 
    THash mHasher;
 
+   // домен эпох для ReadMode::LockFree. Разрушается последним: в него уходят
+   // узлы из ячеек и пулов полос
+   std::unique_ptr<EpochDomain> mEpochs;
+
    TBucketContainer mBuckets;
 
-   TAtomicSize mSize;
+   // mBuckets для чтения без блокировки, nullptr во время переноса
+   std::atomic<BucketView*> mBucketView;
+
+   // размер mBuckets для проверок без блокировки
+   TAtomicSize mBucketCount;
+
+   // состояние постепенного рехэша, меняется только под всеми блокировками
+   TBucketContainer mNewBuckets;
+
+   std::vector<char> mMigrated;
+
+   std::atomic<bool> mMigrating;
+
+   TAtomicSize mMigrateTotal;
 
-   mutable TLockContainer mLocks;
+   TAtomicSize mMigrateCursor;
+
+   TAtomicSize mMigratedCount;
+
+   RehashMode mRehashMode;
+
+   size_t mMigrationStep;
+
+   // текущий массив блокировок, меняется только под всеми его блокировками и блокировкой рехэша
+   std::atomic<Stripes*> mStripes;
+
+   // все массивы блокировок, последний - текущий
+   std::vector<std::unique_ptr<Stripes>> mStripeArrays;
+
+   size_t mMaxLockCount;
+
+   ReadMode mReadMode;
 
    mutable TLock mRehashLock;
 
-   float const mMaxLoadFactor;
+   GrowthPolicy mGrowthPolicy;
+
+   typename TStats::TableCounters mStats;
 };
 
 } // namespace kvs
\ No newline at end of file
@@ -1,5 +1,9 @@
 ﻿#include "precomp.h"
 #include "ThreadsafeHashTable.h"
+#include "SplitOrderedHashTable.h"
+#include "SharedMemoryHashTable.h"
+#include "CacheHashTable.h"
+#include "LockPolicies.h"
 
 BOOST_AUTO_TEST_CASE( TestInterface )
 {
@@ -125,4 +129,2108 @@ BOOST_AUTO_TEST_CASE( TestEraseIf )
    {
       BOOST_ERROR( "Ouch..." );
    }
-}
\ No newline at end of file
+}
+
+template <typename TStorage, kvs::StripeLayout pStripeLayout = kvs::StripeLayout::Padded>
+void CheckStorageSemantics()
+{
+   kvs::ThreadsafeHashTable<int, int, 11, boost::shared_mutex, std::hash<int>, TStorage, pStripeLayout> ht;
+
+   BOOST_CHECK_EQUAL( ht.Insert( std::make_pair( 1, 2 ) ), true );
+   BOOST_CHECK_EQUAL( ht.Insert( std::make_pair( 1, 3 ) ), false );
+   BOOST_CHECK_EQUAL( ht.Update( std::make_pair( 1, 4 ) ), true );
+   BOOST_CHECK_EQUAL( ht.Update( std::make_pair( 2, 4 ) ), false );
+   BOOST_CHECK_EQUAL( ht[1], 4 );
+
+   std::map<int, int> reference;
+   reference[1] = 4;
+   std::mt19937 generator( 42 );
+   std::uniform_int_distribution<int> distribution( 0, 2000 );
+   for ( int i = 0; i < 20000; ++i )
+   {
+      auto const key = distribution( generator );
+      switch ( i % 3 )
+      {
+      case 0:
+         BOOST_CHECK_EQUAL( ht.Insert( std::make_pair( key, i ) ), reference.insert( std::make_pair( key, i ) ).second );
+         break;
+      case 1:
+         ht.Erase( key );
+         reference.erase( key );
+         break;
+      default:
+         {
+            int val = -1;
+            auto const it = reference.find( key );
+            BOOST_CHECK_EQUAL( ht.Find( key, val ), it != reference.end() );
+            if ( it != reference.end() )
+               BOOST_CHECK_EQUAL( val, it->second );
+         }
+      }
+   }
+
+   BOOST_CHECK_EQUAL( ht.Size(), reference.size() );
+
+   size_t counter = 0;
+   ht.ForEach( [&]( std::pair<int, int> const& kv ){ BOOST_CHECK_EQUAL( reference[kv.first], kv.second ); ++counter; } );
+   BOOST_CHECK_EQUAL( counter, reference.size() );
+
+   ht.Reserve( 100000 );
+   for ( auto it = reference.begin(); it != reference.end(); ++it )
+   {
+      int val = -1;
+      BOOST_CHECK_EQUAL( ht.Find( it->first, val ), true );
+      BOOST_CHECK_EQUAL( val, it->second );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestFlatStorage )
+{
+   try
+   {
+      CheckStorageSemantics<kvs::ListStorage>();
+      CheckStorageSemantics<kvs::FlatStorage<kvs::Probing::Linear>>();
+      CheckStorageSemantics<kvs::FlatStorage<kvs::Probing::RobinHood>>();
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestIncrementalRehash )
+{
+   try
+   {
+      kvs::ThreadsafeHashTable<int, int> ht;
+      ht.SetRehashMode( kvs::RehashMode::Incremental, 1 );
+
+      int size = 10000;
+      bool rehashing = false;
+      for ( int i = 0; i < size; ++i )
+      {
+         ht.Insert( std::make_pair( i, i * 2 ) );
+         rehashing = rehashing || ht.Rehashing();
+
+         int val;
+         BOOST_REQUIRE( ht.Find( i / 2, val ) );
+         BOOST_CHECK_EQUAL( val, i / 2 * 2 );
+      }
+      BOOST_CHECK( rehashing );
+
+      // перенос, начатый последними вставками, доделывает вспомогательный поток
+      while ( ht.RehashStep( 16 ) )
+      {
+      }
+      BOOST_CHECK( !ht.Rehashing() );
+
+      int counter = 0;
+      ht.ForEach( [&counter]( std::pair<int, int> const& kv ){ BOOST_CHECK_EQUAL( kv.first * 2, kv.second ); ++counter; } );
+      BOOST_CHECK_EQUAL( counter, size );
+      BOOST_CHECK_EQUAL( ht.Size(), size );
+
+      ht.Reserve( size * 8 );
+      for ( int i = 0; i < size; ++i )
+      {
+         int val;
+         BOOST_REQUIRE( ht.Find( i, val ) );
+      }
+
+      ht.Clear();
+      BOOST_CHECK_EQUAL( ht.Size(), 0 );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestIncrementalRehashConcurrent )
+{
+   try
+   {
+      kvs::ThreadsafeHashTable<int, int> ht;
+      ht.SetRehashMode( kvs::RehashMode::Incremental );
+
+      int const thread_count = 4;
+      int const per_thread = 20000;
+      std::atomic<bool> done( false );
+
+      std::thread helper( [&]()
+      {
+         while ( !done )
+         {
+            if ( !ht.RehashStep( 8 ) )
+               std::this_thread::yield();
+         }
+      } );
+
+      std::vector<std::thread> threads;
+      for ( int t = 0; t < thread_count; ++t )
+      {
+         threads.push_back( std::thread( [&ht, t, per_thread]()
+         {
+            for ( int i = t * per_thread; i < ( t + 1 ) * per_thread; ++i )
+            {
+               ht.Insert( std::make_pair( i, i ) );
+               if ( i % 3 == 0 )
+                  ht.Erase( i );
+            }
+         } ) );
+      }
+
+      for ( auto it = threads.begin(); it != threads.end(); ++it )
+      {
+         it->join();
+      }
+      done = true;
+      helper.join();
+
+      int val;
+      for ( int i = 0; i < thread_count * per_thread; ++i )
+      {
+         BOOST_CHECK_EQUAL( ht.Find( i, val ), i % 3 != 0 );
+      }
+      BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( thread_count * per_thread - ( thread_count * per_thread + 2 ) / 3 ) );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+struct TestPair
+{
+   int first;
+   int second;
+};
+
+BOOST_AUTO_TEST_CASE( TestOptimisticRead )
+{
+   try
+   {
+      typedef kvs::ThreadsafeHashTable<int, TestPair, 11, boost::shared_mutex, std::hash<int>, kvs::FlatStorage<>> TTable;
+      TTable ht;
+      ht.SetReadMode( kvs::ReadMode::Optimistic );
+
+      int const size = 1000;
+      for ( int i = 0; i < size; ++i )
+      {
+         TestPair const val = { i, i };
+         ht.Insert( std::make_pair( i, val ) );
+      }
+
+      std::atomic<bool> done( false );
+      std::thread writer( [&]()
+      {
+         // обновления и рост ячеек вперемешку с чтением
+         for ( int gen = 1; gen < 50; ++gen )
+         {
+            for ( int i = 0; i < size; ++i )
+            {
+               TestPair const val = { i + gen, i + gen };
+               ht.Update( std::make_pair( i, val ) );
+            }
+            for ( int i = 0; i < size; ++i )
+            {
+               TestPair const val = { 0, 0 };
+               ht.Insert( std::make_pair( gen * size + i, val ) );
+            }
+         }
+         done = true;
+      } );
+
+      int failures = 0;
+      while ( !done )
+      {
+         for ( int i = 0; i < size; ++i )
+         {
+            TestPair val;
+            if ( !ht.Find( i, val ) || val.first != val.second )
+               ++failures;
+         }
+      }
+      writer.join();
+
+      BOOST_CHECK_EQUAL( failures, 0 );
+      BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( size * 50 ) );
+
+      TestPair val;
+      BOOST_CHECK( ht.Find( 49 * size + 1, val ) );
+      BOOST_CHECK( !ht.Find( -1, val ) );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestShardedSize )
+{
+   try
+   {
+      kvs::ThreadsafeHashTable<int, int, 16> ht;
+
+      int const thread_count = 4;
+      int const per_thread = 20000;
+
+      std::vector<std::thread> threads;
+      for ( int t = 0; t < thread_count; ++t )
+      {
+         threads.push_back( std::thread( [&ht, t, per_thread]()
+         {
+            for ( int i = t * per_thread; i < ( t + 1 ) * per_thread; ++i )
+            {
+               ht.Insert( std::make_pair( i, i ) );
+               if ( i % 4 == 0 )
+                  ht.Erase( i );
+            }
+         } ) );
+      }
+
+      for ( auto it = threads.begin(); it != threads.end(); ++it )
+      {
+         it->join();
+      }
+
+      size_t const expected = thread_count * per_thread * 3 / 4;
+      BOOST_CHECK_EQUAL( ht.Size(), expected );
+
+      // приблизительный размер отстаёт не больше чем на 1/8 от количества ячеек
+      auto const approximate = ht.ApproximateSize();
+      BOOST_CHECK( approximate <= expected );
+      BOOST_CHECK( approximate * 2 >= expected );
+
+      ht.EraseIf( []( std::pair<int, int> const& kv ) { return kv.first == 1; } );
+      BOOST_CHECK_EQUAL( ht.Size(), expected - 1 );
+
+      ht.Clear();
+      BOOST_CHECK_EQUAL( ht.Size(), 0 );
+      BOOST_CHECK_EQUAL( ht.ApproximateSize(), 0 );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestLockGrowth )
+{
+   try
+   {
+      kvs::ThreadsafeHashTable<int, int> fixed( 32 );
+      BOOST_CHECK_EQUAL( fixed.LockCount(), 32 );
+
+      kvs::RehashMode const modes[] = { kvs::RehashMode::StopTheWorld, kvs::RehashMode::Incremental };
+      for ( auto mode_it = std::begin( modes ); mode_it != std::end( modes ); ++mode_it )
+      {
+         kvs::ThreadsafeHashTable<int, int> ht( 4 );
+         ht.SetMaxLockCount( 64 );
+         ht.SetRehashMode( *mode_it );
+
+         int const thread_count = 4;
+         int const per_thread = 20000;
+
+         std::vector<std::thread> threads;
+         for ( int t = 0; t < thread_count; ++t )
+         {
+            threads.push_back( std::thread( [&ht, t, per_thread]()
+            {
+               int val;
+               for ( int i = t * per_thread; i < ( t + 1 ) * per_thread; ++i )
+               {
+                  ht.Insert( std::make_pair( i, i ) );
+                  ht.Find( i / 2, val );
+                  if ( i % 5 == 0 )
+                     ht.Erase( i );
+               }
+            } ) );
+         }
+
+         for ( auto it = threads.begin(); it != threads.end(); ++it )
+         {
+            it->join();
+         }
+
+         while ( ht.RehashStep( 64 ) )
+         {
+         }
+
+         BOOST_CHECK_EQUAL( ht.LockCount(), 64 );
+
+         int val;
+         for ( int i = 0; i < thread_count * per_thread; ++i )
+         {
+            BOOST_CHECK_EQUAL( ht.Find( i, val ), i % 5 != 0 );
+         }
+         BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( thread_count * per_thread * 4 / 5 ) );
+
+         ht.Clear();
+         BOOST_CHECK_EQUAL( ht.Size(), 0 );
+      }
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestStripeLayout )
+{
+   try
+   {
+      typedef kvs::ThreadsafeHashTable<int, int, 11, boost::shared_mutex, std::hash<int>, kvs::FlatStorage<>> TPaddedFlat;
+      typedef kvs::ThreadsafeHashTable<int, int, 11, boost::shared_mutex, std::hash<int>, kvs::FlatStorage<>, kvs::StripeLayout::Packed> TPackedFlat;
+      static_assert( alignof( TPaddedFlat::TBucketSlot ) == kvs::cCacheLineSize, "padded bucket must start a cache line" );
+      static_assert( sizeof( TPackedFlat::TBucketSlot ) == sizeof( TPackedFlat::Bucket ), "packed bucket must not be padded" );
+
+      CheckStorageSemantics<kvs::ListStorage, kvs::StripeLayout::Packed>();
+      CheckStorageSemantics<kvs::FlatStorage<>, kvs::StripeLayout::Packed>();
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+template <typename TStorage>
+void CheckMultiOperations()
+{
+   kvs::ThreadsafeHashTable<int, int, 11, boost::shared_mutex, std::hash<int>, TStorage> ht;
+
+   // ключи повторяются внутри пачки: выигрывает первый, как при вставке по одному
+   std::vector<std::pair<int, int>> kvs;
+   for ( int i = 0; i < 5000; ++i )
+   {
+      kvs.push_back( std::make_pair( i % 3000, i ) );
+   }
+
+   std::vector<char> inserted;
+   BOOST_CHECK_EQUAL( ht.MultiInsert( kvs, inserted ), 3000 );
+   for ( int i = 0; i < 5000; ++i )
+   {
+      BOOST_CHECK_EQUAL( inserted[i], i < 3000 ? 1 : 0 );
+   }
+   BOOST_CHECK_EQUAL( ht.Size(), 3000 );
+
+   std::vector<int> keys;
+   for ( int i = 0; i < 4000; ++i )
+   {
+      keys.push_back( i );
+   }
+
+   std::vector<int> values;
+   std::vector<char> found;
+   BOOST_CHECK_EQUAL( ht.MultiFind( keys, values, found, false ), 3000 );
+   for ( int i = 0; i < 4000; ++i )
+   {
+      BOOST_CHECK_EQUAL( found[i], i < 3000 ? 1 : 0 );
+      if ( i < 3000 )
+         BOOST_CHECK_EQUAL( values[i], i );
+   }
+
+   std::vector<char> erased;
+   BOOST_CHECK_EQUAL( ht.MultiErase( keys, erased ), 3000 );
+   BOOST_CHECK_EQUAL( ht.Size(), 0 );
+   BOOST_CHECK_EQUAL( ht.MultiFind( keys, values, found ), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( TestMultiOperations )
+{
+   try
+   {
+      CheckMultiOperations<kvs::ListStorage>();
+      CheckMultiOperations<kvs::FlatStorage<>>();
+
+      // пачки из разных потоков, пока растёт массив блокировок
+      kvs::ThreadsafeHashTable<int, int> ht( 4 );
+      ht.SetMaxLockCount( 64 );
+
+      int const thread_count = 4;
+      int const batch_count = 20;
+      int const batch_size = 1000;
+
+      std::vector<std::thread> threads;
+      for ( int t = 0; t < thread_count; ++t )
+      {
+         threads.push_back( std::thread( [&ht, t]()
+         {
+            for ( int b = 0; b < batch_count; ++b )
+            {
+               std::vector<std::pair<int, int>> kvs;
+               std::vector<int> keys;
+               for ( int i = 0; i < batch_size; ++i )
+               {
+                  auto const key = ( t * batch_count + b ) * batch_size + i;
+                  kvs.push_back( std::make_pair( key, key ) );
+                  if ( i % 2 == 0 )
+                     keys.push_back( key );
+               }
+
+               std::vector<char> flags;
+               ht.MultiInsert( kvs, flags );
+               ht.MultiErase( keys, flags );
+            }
+         } ) );
+      }
+
+      for ( auto it = threads.begin(); it != threads.end(); ++it )
+      {
+         it->join();
+      }
+
+      BOOST_CHECK_EQUAL( ht.LockCount(), 64 );
+      BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( thread_count * batch_count * batch_size / 2 ) );
+
+      int val;
+      for ( int key = 0; key < thread_count * batch_count * batch_size; ++key )
+      {
+         BOOST_CHECK_EQUAL( ht.Find( key, val ), key % 2 != 0 );
+      }
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+// значение, которое считает свои копирования
+struct CopyCounted
+{
+   CopyCounted()
+      : value( 0 )
+   {
+
+   }
+
+   explicit CopyCounted( int v )
+      : value( v )
+   {
+
+   }
+
+   CopyCounted( CopyCounted const& c )
+      : value( c.value )
+   {
+      ++copies;
+   }
+
+   CopyCounted( CopyCounted&& c )
+      : value( c.value )
+   {
+
+   }
+
+   CopyCounted& operator=( CopyCounted const& c )
+   {
+      value = c.value;
+      ++copies;
+      return *this;
+   }
+
+   CopyCounted& operator=( CopyCounted&& c )
+   {
+      value = c.value;
+      return *this;
+   }
+
+   int value;
+
+   static int copies;
+};
+
+int CopyCounted::copies = 0;
+
+template <typename TStorage>
+void CheckMoveSemantics()
+{
+   typedef std::unique_ptr<int> TPointer;
+   kvs::ThreadsafeHashTable<int, TPointer, 11, boost::shared_mutex, std::hash<int>, TStorage> ht;
+
+   BOOST_CHECK_EQUAL( ht.Emplace( 1, TPointer( new int( 10 ) ) ), true );
+   BOOST_CHECK_EQUAL( ht.TryEmplace( 2, new int( 20 ) ), true );
+
+   // ключ уже есть - аргумент не трогается
+   TPointer kept( new int( 21 ) );
+   BOOST_CHECK_EQUAL( ht.TryEmplace( 2, std::move( kept ) ), false );
+   BOOST_CHECK( kept );
+
+   BOOST_CHECK_EQUAL( ht.InsertOrAssign( 1, TPointer( new int( 11 ) ) ), false );
+   BOOST_CHECK_EQUAL( ht.InsertOrAssign( 3, TPointer( new int( 30 ) ) ), true );
+
+   int const* address = nullptr;
+   BOOST_CHECK_EQUAL( ht.Visit( 1, [&]( TPointer const& p ){ address = p.get(); } ), true );
+   BOOST_CHECK_EQUAL( *address, 11 );
+
+   for ( int i = 4; i < 2000; ++i )
+   {
+      ht.Insert( std::make_pair( i, TPointer( new int( i ) ) ) );
+   }
+   ht.Reserve( 10000 );
+
+   int const* moved = nullptr;
+   BOOST_CHECK_EQUAL( ht.Visit( 1, [&]( TPointer const& p ){ moved = p.get(); } ), true );
+   BOOST_CHECK_EQUAL( moved, address );
+   BOOST_CHECK_EQUAL( ht.Size(), 1999 );
+
+   CopyCounted::copies = 0;
+   kvs::ThreadsafeHashTable<int, CopyCounted, 11, boost::shared_mutex, std::hash<int>, TStorage> counted;
+   for ( int i = 0; i < 2000; ++i )
+   {
+      counted.Emplace( i, CopyCounted( i ) );
+      counted.InsertOrAssign( i, CopyCounted( i + 1 ) );
+   }
+   counted.Reserve( 10000 );
+   BOOST_CHECK_EQUAL( CopyCounted::copies, 0 );
+}
+
+BOOST_AUTO_TEST_CASE( TestMoveSemantics )
+{
+   try
+   {
+      CheckMoveSemantics<kvs::ListStorage>();
+      CheckMoveSemantics<kvs::FlatStorage<>>();
+
+      // перевешивание узлов списка при рехэше: адрес значения не меняется
+      kvs::ThreadsafeHashTable<int, int> ht;
+      ht.Insert( std::make_pair( 1, 1 ) );
+      int const* before = nullptr;
+      ht.Visit( 1, [&]( int const& v ){ before = &v; } );
+      ht.Reserve( 10000 );
+      int const* after = nullptr;
+      ht.Visit( 1, [&]( int const& v ){ after = &v; } );
+      BOOST_CHECK_EQUAL( before, after );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestHeterogeneousLookup )
+{
+   try
+   {
+      kvs::ThreadsafeHashTable<std::string, std::string, 11, boost::shared_mutex, kvs::StringHash> ht;
+      for ( int i = 0; i < 100; ++i )
+      {
+         ht.Emplace( "key" + std::to_string( i ), std::string( 100, 'a' + i % 26 ) );
+      }
+
+      std::string value;
+      BOOST_CHECK_EQUAL( ht.Find( std::string_view( "key1" ), value ), true );
+      BOOST_CHECK_EQUAL( value, std::string( 100, 'b' ) );
+      BOOST_CHECK_EQUAL( ht.Find( "key2", value ), true );
+      BOOST_CHECK_EQUAL( ht.Find( std::string( "key3" ), value ), true );
+      BOOST_CHECK_EQUAL( ht.Find( "missing", value ), false );
+
+      size_t length = 0;
+      BOOST_CHECK_EQUAL( ht.Visit( std::string_view( "key4" ), [&]( std::string const& v ){ length = v.size(); } ), true );
+      BOOST_CHECK_EQUAL( length, 100 );
+
+      ht.Erase( std::string_view( "key5" ) );
+      BOOST_CHECK_EQUAL( ht.Find( "key5", value ), false );
+      BOOST_CHECK_EQUAL( ht.Size(), 99 );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+template <typename TStorage>
+void CheckReadModifyWrite()
+{
+   kvs::ThreadsafeHashTable<int, int, 11, boost::shared_mutex, std::hash<int>, TStorage> ht;
+
+   BOOST_CHECK_EQUAL( ht.Modify( 1, []( int& v ){ ++v; } ), false );
+   BOOST_CHECK_EQUAL( ht.Upsert( 1, 10, []( int& v ){ ++v; } ), true );
+   BOOST_CHECK_EQUAL( ht.Upsert( 1, 10, []( int& v ){ ++v; } ), false );
+   BOOST_CHECK_EQUAL( ht[1], 11 );
+   BOOST_CHECK_EQUAL( ht.Modify( 1, []( int& v ){ v *= 2; } ), true );
+   BOOST_CHECK_EQUAL( ht[1], 22 );
+
+   // Compute: вставка, изменение, удаление и отказ от вставки
+   BOOST_CHECK_EQUAL( ht.Compute( 2, []( int& v, bool exists ){ BOOST_CHECK( !exists ); v = 5; return true; } ), true );
+   BOOST_CHECK_EQUAL( ht.Compute( 2, []( int& v, bool exists ){ BOOST_CHECK( exists ); ++v; return true; } ), true );
+   BOOST_CHECK_EQUAL( ht[2], 6 );
+   BOOST_CHECK_EQUAL( ht.Compute( 2, []( int&, bool ){ return false; } ), false );
+   BOOST_CHECK_EQUAL( ht.Compute( 3, []( int&, bool ){ return false; } ), false );
+   BOOST_CHECK_EQUAL( ht.Size(), 1 );
+
+   // счётчики из нескольких потоков не теряют приращений
+   int const thread_count = 4;
+   int const per_thread = 20000;
+   int const key_count = 100;
+
+   std::vector<std::thread> threads;
+   for ( int t = 0; t < thread_count; ++t )
+   {
+      threads.push_back( std::thread( [&ht, t]()
+      {
+         for ( int i = 0; i < per_thread; ++i )
+         {
+            auto const key = 100 + ( i * ( t + 1 ) ) % key_count;
+            if ( i % 2 == 0 )
+               ht.Upsert( key, 1, []( int& v ){ ++v; } );
+            else
+               ht.Compute( key, []( int& v, bool ){ ++v; return true; } );
+         }
+      } ) );
+   }
+
+   for ( auto it = threads.begin(); it != threads.end(); ++it )
+   {
+      it->join();
+   }
+
+   int total = 0;
+   ht.ForEach( [&]( std::pair<int, int> const& kv ){ if ( kv.first >= 100 ) total += kv.second; } );
+   BOOST_CHECK_EQUAL( total, thread_count * per_thread );
+   BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( key_count + 1 ) );
+}
+
+BOOST_AUTO_TEST_CASE( TestReadModifyWrite )
+{
+   try
+   {
+      CheckReadModifyWrite<kvs::ListStorage>();
+      CheckReadModifyWrite<kvs::FlatStorage<>>();
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestPooledStorage )
+{
+   try
+   {
+      CheckStorageSemantics<kvs::PooledListStorage>();
+      CheckStorageSemantics<kvs::PooledListStorage, kvs::StripeLayout::Packed>();
+      CheckMultiOperations<kvs::PooledListStorage>();
+      CheckMoveSemantics<kvs::PooledListStorage>();
+      CheckReadModifyWrite<kvs::PooledListStorage>();
+
+      // узлы переезжают между пулами при росте количества блокировок
+      kvs::RehashMode const modes[] = { kvs::RehashMode::StopTheWorld, kvs::RehashMode::Incremental };
+      for ( auto mode_it = std::begin( modes ); mode_it != std::end( modes ); ++mode_it )
+      {
+         kvs::ThreadsafeHashTable<int, std::string, 4, boost::shared_mutex, std::hash<int>, kvs::PooledListStorage> ht;
+         ht.SetMaxLockCount( 64 );
+         ht.SetRehashMode( *mode_it );
+
+         int const thread_count = 4;
+         int const per_thread = 10000;
+
+         std::vector<std::thread> threads;
+         for ( int t = 0; t < thread_count; ++t )
+         {
+            threads.push_back( std::thread( [&ht, t, per_thread]()
+            {
+               for ( int i = t * per_thread; i < ( t + 1 ) * per_thread; ++i )
+               {
+                  ht.Insert( std::make_pair( i, std::to_string( i ) ) );
+                  if ( i % 5 == 0 )
+                     ht.Erase( i );
+               }
+            } ) );
+         }
+
+         for ( auto it = threads.begin(); it != threads.end(); ++it )
+         {
+            it->join();
+         }
+
+         while ( ht.RehashStep( 64 ) )
+         {
+         }
+
+         BOOST_CHECK_EQUAL( ht.LockCount(), 64 );
+
+         std::string val;
+         for ( int i = 0; i < thread_count * per_thread; ++i )
+         {
+            BOOST_CHECK_EQUAL( ht.Find( i, val ), i % 5 != 0 );
+            if ( i % 5 != 0 )
+               BOOST_CHECK_EQUAL( val, std::to_string( i ) );
+         }
+         BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( thread_count * per_thread * 4 / 5 ) );
+
+         // освобождённые пулы снова выдают узлы
+         ht.Clear();
+         BOOST_CHECK_EQUAL( ht.Size(), 0 );
+         ht.Insert( std::make_pair( 1, std::string( "one" ) ) );
+         BOOST_CHECK( ht.Find( 1, val ) && val == "one" );
+      }
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+template <typename TStorage>
+void CheckParallelScan( kvs::ThreadPool& pool )
+{
+   typedef kvs::ThreadsafeHashTable<int, int, 11, boost::shared_mutex, std::hash<int>, TStorage> THashTable;
+   THashTable ht( 4 );
+   ht.SetMaxLockCount( 64 );
+
+   int const key_count = 20000;
+   for ( int i = 0; i < key_count; ++i )
+   {
+      ht.Insert( std::make_pair( i, i ) );
+   }
+
+   std::atomic<int> visited( 0 );
+   ht.ParallelForEach( pool, [&visited]( std::pair<int, int>& kv ){ kv.second += 1; ++visited; } );
+   BOOST_CHECK_EQUAL( visited, key_count );
+
+   BOOST_CHECK_EQUAL( ht.ParallelCountIf( pool, []( std::pair<int, int> const& kv ){ return kv.second == kv.first + 1; } ), static_cast<size_t>( key_count ) );
+
+   auto const sum = ht.ParallelReduce( pool, int64_t( 0 ), []( int64_t& acc, std::pair<int, int> const& kv ){ acc += kv.first; }, []( int64_t& acc, int64_t& part ){ acc += part; } );
+   BOOST_CHECK_EQUAL( sum, int64_t( key_count ) * ( key_count - 1 ) / 2 );
+
+   auto keys = ht.ParallelReduce( pool, std::vector<int>(), []( std::vector<int>& acc, std::pair<int, int> const& kv )
+   {
+      if ( kv.first % 100 == 0 )
+         acc.push_back( kv.first );
+   }, []( std::vector<int>& acc, std::vector<int>& part )
+   {
+      acc.insert( acc.end(), part.begin(), part.end() );
+   } );
+   std::sort( keys.begin(), keys.end() );
+   BOOST_CHECK_EQUAL( keys.size(), static_cast<size_t>( key_count / 100 ) );
+   BOOST_CHECK( keys.empty() || keys.back() == key_count - 100 );
+
+   BOOST_CHECK_EQUAL( ht.ParallelEraseIf( pool, []( std::pair<int, int> const& kv ){ return kv.first % 2 == 0; } ), static_cast<size_t>( key_count / 2 ) );
+   BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( key_count / 2 ) );
+   int val;
+   BOOST_CHECK( !ht.Find( 10, val ) );
+   BOOST_CHECK( ht.Find( 11, val ) );
+
+   // исключение из предиката доходит до вызывающего, блокировки отпущены
+   BOOST_CHECK_THROW( ht.ParallelCountIf( pool, []( std::pair<int, int> const& ) -> bool { throw std::runtime_error( "predicate" ); } ), std::runtime_error );
+   ht.Insert( std::make_pair( 10, 10 ) );
+
+   // обходы вместе с писателями, которые растят таблицу постепенным рехэшем
+   ht.SetRehashMode( kvs::RehashMode::Incremental );
+   std::atomic<bool> stop( false );
+   std::thread writer( [&]()
+   {
+      for ( int i = key_count; !stop; ++i )
+      {
+         ht.Insert( std::make_pair( i, i ) );
+         if ( i - 1000 >= key_count )
+            ht.Erase( i - 1000 );
+      }
+   } );
+
+   for ( int i = 0; i < 20; ++i )
+   {
+      BOOST_CHECK( ht.ParallelCountIf( pool, []( std::pair<int, int> const& kv ){ return kv.first < key_count && kv.first % 2 == 1; } ) == static_cast<size_t>( key_count / 2 ) );
+      ht.ParallelEraseIf( pool, []( std::pair<int, int> const& kv ){ return kv.first >= key_count && kv.first % 7 == 0; } );
+   }
+
+   stop = true;
+   writer.join();
+
+   size_t size = 0;
+   ht.ForEach( [&size]( std::pair<int, int> const& ){ ++size; } );
+   BOOST_CHECK_EQUAL( ht.Size(), size );
+}
+
+BOOST_AUTO_TEST_CASE( TestParallelScan )
+{
+   try
+   {
+      kvs::ThreadPool pool( 3 );
+      BOOST_CHECK_EQUAL( pool.ThreadCount(), 3 );
+
+      CheckParallelScan<kvs::ListStorage>( pool );
+      CheckParallelScan<kvs::FlatStorage<kvs::Probing::Linear>>( pool );
+      CheckParallelScan<kvs::FlatStorage<kvs::Probing::RobinHood>>( pool );
+      CheckParallelScan<kvs::PooledListStorage>( pool );
+      CheckParallelScan<kvs::HashedListStorage>( pool );
+      CheckParallelScan<kvs::SwissStorage>( pool );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+template <typename TStorage>
+void CheckScanCursor()
+{
+   typedef kvs::ThreadsafeHashTable<int, int, 11, boost::shared_mutex, std::hash<int>, TStorage> THashTable;
+
+   int const key_count = 5000;
+   kvs::RehashMode const modes[] = { kvs::RehashMode::StopTheWorld, kvs::RehashMode::Incremental };
+   for ( auto mode_it = std::begin( modes ); mode_it != std::end( modes ); ++mode_it )
+   {
+      THashTable ht( 3 );
+      ht.SetMaxLockCount( 96 );
+      ht.SetRehashMode( *mode_it );
+      for ( int i = 0; i < key_count; ++i )
+      {
+         ht.Insert( std::make_pair( i, i ) );
+      }
+
+      // между шагами таблица растёт в несколько раз, ключи, которые были
+      // в ней весь обход, встречаются ровно один раз
+      std::vector<int> seen( key_count * 9, 0 );
+      typename THashTable::ScanCursor cursor;
+      int next = key_count;
+      auto const visit = [&seen]( std::pair<int, int> const& kv ){ ++seen[kv.first]; };
+      while ( ht.Scan( cursor, visit, 3 ) )
+      {
+         for ( int i = 0; i < 20 && next < key_count * 9; ++i, ++next )
+         {
+            ht.Insert( std::make_pair( next, next ) );
+         }
+         ht.Erase( next - 1 );
+         ht.RehashStep( 2 );
+      }
+      BOOST_CHECK( !ht.Scan( cursor, visit ) );
+
+      for ( int i = 0; i < key_count * 9; ++i )
+      {
+         if ( i < key_count )
+            BOOST_CHECK_EQUAL( seen[i], 1 );
+         else
+            BOOST_CHECK( seen[i] <= 1 );
+      }
+      BOOST_CHECK( THashTable::Bucket::cSelfResizing || ht.LockCount() > 3 );
+   }
+
+   // обход вместе с писателем
+   THashTable ht;
+   ht.SetRehashMode( kvs::RehashMode::Incremental );
+   for ( int i = 0; i < key_count; ++i )
+   {
+      ht.Insert( std::make_pair( i, i ) );
+   }
+
+   std::atomic<bool> stop( false );
+   std::thread writer( [&]()
+   {
+      for ( int i = key_count; !stop; ++i )
+      {
+         ht.Insert( std::make_pair( i, i ) );
+         if ( i % 3 == 0 )
+            ht.Erase( i / 2 + key_count / 2 );
+      }
+   } );
+
+   std::vector<int> seen( key_count, 0 );
+   typename THashTable::ScanCursor cursor;
+   while ( ht.Scan( cursor, [&seen]( std::pair<int, int> const& kv ){ if ( kv.first < key_count ) ++seen[kv.first]; } ) )
+   {
+   }
+
+   stop = true;
+   writer.join();
+
+   for ( int i = 0; i < key_count / 2; ++i )
+   {
+      BOOST_CHECK_EQUAL( seen[i], 1 );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestScanCursor )
+{
+   try
+   {
+      CheckScanCursor<kvs::ListStorage>();
+      CheckScanCursor<kvs::FlatStorage<>>();
+      CheckScanCursor<kvs::PooledListStorage>();
+      CheckScanCursor<kvs::HashedListStorage>();
+      CheckScanCursor<kvs::SwissStorage>();
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestSplitOrderedHashTable )
+{
+   try
+   {
+      {
+         kvs::SplitOrderedHashTable<int, std::string> ht( 2 );
+         std::string val;
+         BOOST_CHECK( !ht.Find( 1, val ) );
+         BOOST_CHECK( ht.Insert( std::make_pair( 1, std::string( "1" ) ) ) );
+         BOOST_CHECK( !ht.Insert( std::make_pair( 1, std::string( "one" ) ) ) );
+         BOOST_CHECK( ht.Find( 1, val ) && val == "1" );
+         BOOST_CHECK( ht.Update( std::make_pair( 1, std::string( "one" ) ) ) );
+         BOOST_CHECK( !ht.Update( std::make_pair( 2, std::string( "two" ) ) ) );
+         BOOST_CHECK( ht[1] == "one" );
+
+         // ячейки удваиваются, а элементы находятся через новые фиктивные узлы
+         for ( int i = 0; i < 10000; ++i )
+         {
+            ht.Insert( std::make_pair( i, std::to_string( i ) ) );
+         }
+         BOOST_CHECK( ht.Size() == 10000 );
+         BOOST_CHECK( ht.BucketCount() >= 10000 / 2 );
+
+         for ( int i = 0; i < 10000; i += 2 )
+         {
+            ht.Erase( i );
+         }
+         ht.Erase( 10000 );
+         BOOST_CHECK( ht.Size() == 5000 );
+
+         size_t count = 0;
+         ht.ForEach( [&count]( std::pair<int, std::string> const& kv )
+         {
+            BOOST_CHECK( kv.first % 2 == 1 && kv.second == ( kv.first == 1 ? "one" : std::to_string( kv.first ) ) );
+            ++count;
+         } );
+         BOOST_CHECK( count == 5000 );
+
+         ht.Clear();
+         BOOST_CHECK( ht.Size() == 0 && !ht.Find( 1, val ) );
+      }
+
+      // одни потоки вставляют и удаляют свои ключи, другие читают и обновляют общие
+      kvs::SplitOrderedHashTable<int, int> ht;
+      int const shared_count = 1000;
+      for ( int i = 0; i < shared_count; ++i )
+      {
+         ht.Insert( std::make_pair( i, i ) );
+      }
+
+      int const thread_count = 4;
+      int const per_thread = 20000;
+      std::atomic<bool> failed( false );
+
+      std::vector<std::thread> threads;
+      for ( int t = 0; t < thread_count; ++t )
+      {
+         threads.push_back( std::thread( [&ht, &failed, t, per_thread, shared_count]()
+         {
+            int const first = shared_count + t * per_thread;
+            for ( int i = first; i < first + per_thread; ++i )
+            {
+               ht.Insert( std::make_pair( i, i ) );
+               if ( i % 3 == 0 )
+                  ht.Erase( i );
+            }
+         } ) );
+         threads.push_back( std::thread( [&ht, &failed, t, shared_count]()
+         {
+            for ( int n = 0; n < 50000; ++n )
+            {
+               int const key = ( n * 7 + t ) % shared_count;
+               int val;
+               if ( !ht.Find( key, val ) || val % shared_count != key )
+                  failed = true;
+               ht.Update( std::make_pair( key, key + shared_count * ( n % 5 ) ) );
+            }
+         } ) );
+      }
+
+      for ( auto thread_it = threads.begin(); thread_it != threads.end(); ++thread_it )
+      {
+         thread_it->join();
+      }
+
+      BOOST_CHECK( !failed );
+
+      size_t expected = shared_count;
+      for ( int i = shared_count; i < shared_count + thread_count * per_thread; ++i )
+      {
+         int val;
+         bool const present = ht.Find( i, val );
+         BOOST_CHECK( present == ( i % 3 != 0 ) );
+         if ( present )
+            ++expected;
+      }
+      BOOST_CHECK( ht.Size() == expected );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestLockFreeReads )
+{
+   try
+   {
+      CheckStorageSemantics<kvs::EpochListStorage>();
+      CheckMultiOperations<kvs::EpochListStorage>();
+      CheckMoveSemantics<kvs::EpochListStorage>();
+      CheckReadModifyWrite<kvs::EpochListStorage>();
+
+      // читатели без блокировки, пока писатели вставляют, удаляют, заменяют значения,
+      // а таблица растёт вместе с количеством блокировок
+      kvs::RehashMode const modes[] = { kvs::RehashMode::StopTheWorld, kvs::RehashMode::Incremental };
+      for ( auto mode_it = std::begin( modes ); mode_it != std::end( modes ); ++mode_it )
+      {
+         kvs::ThreadsafeHashTable<int, std::string, 4, boost::shared_mutex, std::hash<int>, kvs::EpochListStorage> ht;
+         ht.SetMaxLockCount( 64 );
+         ht.SetRehashMode( *mode_it );
+         ht.SetReadMode( kvs::ReadMode::LockFree );
+
+         int const shared_count = 500;
+         for ( int i = 0; i < shared_count; ++i )
+         {
+            ht.Insert( std::make_pair( i, std::to_string( i ) ) );
+         }
+
+         int const thread_count = 3;
+         int const per_thread = 10000;
+         std::atomic<bool> failed( false );
+
+         std::vector<std::thread> threads;
+         for ( int t = 0; t < thread_count; ++t )
+         {
+            threads.push_back( std::thread( [&ht, t, per_thread, shared_count]()
+            {
+               int const first = shared_count + t * per_thread;
+               for ( int i = first; i < first + per_thread; ++i )
+               {
+                  ht.Insert( std::make_pair( i, std::to_string( i ) ) );
+                  if ( i % 2 == 0 )
+                     ht.Erase( i );
+
+                  int const key = i % shared_count;
+                  ht.Update( std::make_pair( key, std::to_string( key ) + "+" ) );
+               }
+            } ) );
+            threads.push_back( std::thread( [&ht, &failed, t, shared_count]()
+            {
+               for ( int n = 0; n < 30000; ++n )
+               {
+                  int const key = ( n * 13 + t ) % shared_count;
+                  std::string val;
+                  if ( !ht.Find( key, val ) || val.compare( 0, std::to_string( key ).size(), std::to_string( key ) ) != 0 )
+                     failed = true;
+               }
+            } ) );
+         }
+
+         for ( auto thread_it = threads.begin(); thread_it != threads.end(); ++thread_it )
+         {
+            thread_it->join();
+         }
+
+         BOOST_CHECK( !failed );
+         BOOST_CHECK( ht.LockCount() > 4 );
+         BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( shared_count + thread_count * per_thread / 2 ) );
+         for ( int i = shared_count; i < shared_count + thread_count * per_thread; ++i )
+         {
+            std::string val;
+            BOOST_CHECK_EQUAL( ht.Find( i, val ), i % 2 != 0 );
+         }
+
+         // удалённые и заменённые узлы прошли через отложенное освобождение
+         auto const retired = ht.GetRetiredMemory();
+         BOOST_CHECK( retired.peakCount > 0 );
+         BOOST_CHECK( retired.peakBytes >= retired.bytes );
+      }
+
+      kvs::ThreadsafeHashTable<int, int> locked;
+      BOOST_CHECK_EQUAL( locked.GetRetiredMemory().peakCount, 0u );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+template <typename TLock>
+void CheckLockPolicy( bool const sharedReaders )
+{
+   TLock lock;
+   BOOST_CHECK( lock.try_lock() );
+   BOOST_CHECK( !lock.try_lock() );
+   BOOST_CHECK( !lock.try_lock_shared() );
+   lock.unlock();
+
+   lock.lock_shared();
+   BOOST_CHECK( !lock.try_lock() );
+   BOOST_CHECK_EQUAL( lock.try_lock_shared(), sharedReaders );
+   if ( sharedReaders )
+      lock.unlock_shared();
+   lock.unlock_shared();
+   BOOST_CHECK( lock.try_lock() );
+   lock.unlock();
+
+   // счётчик под исключительной блокировкой не теряет приращений
+   int const thread_count = 4;
+   int const per_thread = 20000;
+   int counter = 0;
+   std::vector<std::thread> threads;
+   for ( int t = 0; t < thread_count; ++t )
+   {
+      threads.push_back( std::thread( [&lock, &counter, t, per_thread]()
+      {
+         for ( int i = 0; i < per_thread; ++i )
+         {
+            if ( i % 2 == 0 )
+            {
+               std::lock_guard<TLock> guard( lock );
+               ++counter;
+            }
+            else
+            {
+               std::shared_lock<TLock> guard( lock );
+               volatile int value = counter;
+               ( void ) value;
+               guard.unlock();
+
+               while ( !lock.try_lock() )
+               {
+                  std::this_thread::yield();
+               }
+               ++counter;
+               lock.unlock();
+            }
+         }
+      } ) );
+   }
+
+   for ( auto thread_it = threads.begin(); thread_it != threads.end(); ++thread_it )
+   {
+      thread_it->join();
+   }
+   BOOST_CHECK_EQUAL( counter, thread_count * per_thread );
+
+   // таблица растёт под нагрузкой: рехэш берёт блокировки через try_lock
+   kvs::ThreadsafeHashTable<int, int, 4, TLock> ht;
+   ht.SetMaxLockCount( 32 );
+   ht.SetRehashMode( kvs::RehashMode::Incremental );
+
+   threads.clear();
+   for ( int t = 0; t < thread_count; ++t )
+   {
+      threads.push_back( std::thread( [&ht, t, per_thread]()
+      {
+         int val;
+         for ( int i = t * per_thread; i < ( t + 1 ) * per_thread; ++i )
+         {
+            ht.Insert( std::make_pair( i, i ) );
+            ht.Find( i / 2, val );
+            if ( i % 3 == 0 )
+               ht.Erase( i );
+         }
+      } ) );
+   }
+
+   for ( auto thread_it = threads.begin(); thread_it != threads.end(); ++thread_it )
+   {
+      thread_it->join();
+   }
+
+   BOOST_CHECK( ht.LockCount() > 4 );
+   BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( thread_count * per_thread - ( thread_count * per_thread + 2 ) / 3 ) );
+   int val;
+   for ( int i = 0; i < thread_count * per_thread; ++i )
+   {
+      BOOST_CHECK_EQUAL( ht.Find( i, val ), i % 3 != 0 );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestLockPolicies )
+{
+   try
+   {
+      CheckLockPolicy<std::shared_mutex>( true );
+      CheckLockPolicy<kvs::SpinSharedMutex>( true );
+      CheckLockPolicy<kvs::TicketMutex>( false );
+      CheckLockPolicy<kvs::BravoSharedMutex<>>( true );
+      CheckLockPolicy<kvs::BravoSharedMutex<kvs::SpinSharedMutex>>( true );
+#ifndef WIN32
+      CheckLockPolicy<kvs::PthreadSharedMutex>( true );
+#endif
+#if defined( __linux__ )
+      CheckLockPolicy<kvs::FutexSharedMutex>( true );
+#endif
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestBravoSharedMutex )
+{
+   try
+   {
+      // писатель ждёт читателя, который держит блокировку через индикатор
+      kvs::BravoSharedMutex<> lock;
+      lock.lock_shared();
+      std::atomic<bool> locked( false );
+      std::thread writer( [&lock, &locked]()
+      {
+         lock.lock();
+         locked = true;
+         lock.unlock();
+      } );
+
+      std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+      BOOST_CHECK( !locked );
+      lock.unlock_shared();
+      writer.join();
+      BOOST_CHECK( locked );
+
+      // поток держит больше разделяемых блокировок, чем помещается в его список
+      // быстрых, и несколько из них попадают в одну ячейку индикатора
+      kvs::BravoSharedMutex<> locks[16];
+      for ( auto lock_it = std::begin( locks ); lock_it != std::end( locks ); ++lock_it )
+      {
+         lock_it->lock_shared();
+      }
+
+      std::thread checker( [&locks]()
+      {
+         for ( auto lock_it = std::begin( locks ); lock_it != std::end( locks ); ++lock_it )
+         {
+            BOOST_CHECK( !lock_it->try_lock() );
+            BOOST_CHECK( lock_it->try_lock_shared() );
+            lock_it->unlock_shared();
+         }
+      } );
+      checker.join();
+
+      for ( auto lock_it = std::begin( locks ); lock_it != std::end( locks ); ++lock_it )
+      {
+         lock_it->unlock_shared();
+         BOOST_CHECK( lock_it->try_lock() );
+         lock_it->unlock();
+      }
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestStats )
+{
+   try
+   {
+      // без статистики снимок содержит размер и длины цепочек
+      kvs::ThreadsafeHashTable<int, int> plain;
+      for ( int i = 0; i < 1000; ++i )
+      {
+         plain.Insert( std::make_pair( i, i ) );
+      }
+
+      auto const plainStats = plain.GetStats();
+      BOOST_CHECK_EQUAL( plainStats.size, 1000u );
+      BOOST_CHECK( plainStats.stripes.empty() );
+      BOOST_CHECK_EQUAL( plainStats.rehashCount, 0u );
+      size_t plainBuckets = 0;
+      for ( auto length_it = plainStats.chainLengths.begin(); length_it != plainStats.chainLengths.end(); ++length_it )
+      {
+         plainBuckets += *length_it;
+      }
+      BOOST_CHECK_EQUAL( plainBuckets, plainStats.bucketCount );
+      BOOST_CHECK( plainStats.loadFactor > 0 && plainStats.loadFactor < 1 );
+
+      kvs::RehashMode const modes[] = { kvs::RehashMode::StopTheWorld, kvs::RehashMode::Incremental };
+      for ( auto mode_it = std::begin( modes ); mode_it != std::end( modes ); ++mode_it )
+      {
+         kvs::ThreadsafeHashTable<int, int, 4, boost::shared_mutex, std::hash<int>, kvs::ListStorage, kvs::StripeLayout::Padded, kvs::CollectStats> ht;
+         ht.SetRehashMode( *mode_it );
+         ht.SetMaxLockCount( 16 );
+
+         int const thread_count = 4;
+         int const per_thread = 5000;
+         std::vector<std::thread> threads;
+         for ( int t = 0; t < thread_count; ++t )
+         {
+            threads.push_back( std::thread( [&ht, t, per_thread]()
+            {
+               int val;
+               for ( int i = t * per_thread; i < ( t + 1 ) * per_thread; ++i )
+               {
+                  ht.Insert( std::make_pair( i, i ) );
+                  ht.Find( i, val );
+               }
+            } ) );
+         }
+
+         for ( auto thread_it = threads.begin(); thread_it != threads.end(); ++thread_it )
+         {
+            thread_it->join();
+         }
+
+         while ( ht.RehashStep( 64 ) )
+         {
+         }
+
+         auto const stats = ht.GetStats();
+         BOOST_CHECK_EQUAL( stats.size, static_cast<size_t>( thread_count * per_thread ) );
+         BOOST_CHECK_EQUAL( stats.lockCount, ht.LockCount() );
+         BOOST_CHECK_EQUAL( stats.stripes.size(), stats.lockCount );
+         BOOST_CHECK( stats.rehashCount > 0 );
+         BOOST_CHECK( stats.pauseCount >= stats.rehashCount );
+         BOOST_CHECK( stats.maxPauseNs > 0 && stats.maxPauseNs <= stats.pauseNs );
+
+         // по цепочкам сходятся и количество ячеек, и количество элементов
+         size_t buckets = 0;
+         size_t elements = 0;
+         for ( size_t length = 0; length < stats.chainLengths.size(); ++length )
+         {
+            buckets += stats.chainLengths[length];
+            elements += length * stats.chainLengths[length];
+         }
+         BOOST_CHECK_EQUAL( buckets, stats.bucketCount );
+         BOOST_CHECK_EQUAL( elements, stats.size );
+         BOOST_CHECK( stats.maxChainLength < stats.chainLengths.size() );
+
+         // захваты после последнего роста массива блокировок: каждая Find и Insert берёт
+         // одну блокировку, лишние - рехэш и перенос
+         uint64_t shared = 0;
+         uint64_t exclusive = 0;
+         for ( auto stripe_it = stats.stripes.begin(); stripe_it != stats.stripes.end(); ++stripe_it )
+         {
+            shared += stripe_it->sharedLocks;
+            exclusive += stripe_it->exclusiveLocks;
+            BOOST_CHECK( stripe_it->maxHoldNs <= stripe_it->holdNs );
+            BOOST_CHECK( stripe_it->exclusiveContended <= stripe_it->exclusiveLocks );
+         }
+         BOOST_CHECK( shared > 0 && shared <= static_cast<uint64_t>( thread_count * per_thread ) );
+         BOOST_CHECK( exclusive > 0 );
+      }
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestPowerOfTwoIndexing )
+{
+   try
+   {
+      BOOST_CHECK_EQUAL( kvs::PowerOfTwoIndexing::Count( 1 ), 1u );
+      BOOST_CHECK_EQUAL( kvs::PowerOfTwoIndexing::Count( 11 ), 16u );
+      BOOST_CHECK_EQUAL( kvs::PowerOfTwoIndexing::Count( 256 ), 256u );
+      BOOST_CHECK_EQUAL( kvs::PowerOfTwoIndexing::Index( 35, 16 ), 3u );
+
+      typedef kvs::ThreadsafeHashTable<int, int, 11, boost::shared_mutex, std::hash<int>, kvs::ListStorage, kvs::StripeLayout::Padded, kvs::NoStats, kvs::PowerOfTwoIndexing> TListTable;
+      typedef kvs::ThreadsafeHashTable<int, int, 11, boost::shared_mutex, std::hash<int>, kvs::FlatStorage<kvs::Probing::RobinHood>, kvs::StripeLayout::Padded, kvs::NoStats, kvs::PowerOfTwoIndexing> TFlatTable;
+
+      // у ключей с шагом 1024 совпадают младшие биты, без перемешивания они попали бы в одни ячейки
+      int const count = 20000;
+      int const stride = 1024;
+
+      kvs::RehashMode const modes[] = { kvs::RehashMode::StopTheWorld, kvs::RehashMode::Incremental };
+      for ( auto mode_it = std::begin( modes ); mode_it != std::end( modes ); ++mode_it )
+      {
+         TListTable ht;
+         ht.SetRehashMode( *mode_it );
+         ht.SetMaxLockCount( 64 );
+         BOOST_CHECK_EQUAL( ht.LockCount(), 16u );
+
+         for ( int i = 0; i < count; ++i )
+         {
+            BOOST_CHECK( ht.Insert( std::make_pair( i * stride, i ) ) );
+         }
+
+         while ( ht.RehashStep( 64 ) )
+         {
+         }
+
+         BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( count ) );
+         BOOST_CHECK_EQUAL( ht.LockCount(), 64u );
+
+         auto const stats = ht.GetStats();
+         BOOST_CHECK_EQUAL( stats.bucketCount & ( stats.bucketCount - 1 ), 0u );
+         BOOST_CHECK( stats.maxChainLength < 16 );
+
+         for ( int i = 0; i < count; ++i )
+         {
+            int val = -1;
+            BOOST_CHECK( ht.Find( i * stride, val ) );
+            BOOST_CHECK_EQUAL( val, i );
+            BOOST_CHECK( !ht.Find( i * stride + 1, val ) );
+         }
+
+         std::vector<int> keys;
+         for ( int i = 0; i < count; i += 2 )
+         {
+            keys.push_back( i * stride );
+         }
+
+         std::vector<char> erased;
+         BOOST_CHECK_EQUAL( ht.MultiErase( keys, erased ), keys.size() );
+         BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( count / 2 ) );
+
+         std::vector<int> values;
+         std::vector<char> found;
+         BOOST_CHECK_EQUAL( ht.MultiFind( keys, values, found ), 0u );
+      }
+
+      TFlatTable flat;
+      flat.SetReadMode( kvs::ReadMode::Optimistic );
+      for ( int i = 0; i < count; ++i )
+      {
+         flat.Insert( std::make_pair( i * stride, i ) );
+      }
+
+      BOOST_CHECK_EQUAL( flat.Size(), static_cast<size_t>( count ) );
+      for ( int i = 0; i < count; ++i )
+      {
+         int val = -1;
+         BOOST_CHECK( flat.Find( i * stride, val ) );
+         BOOST_CHECK_EQUAL( val, i );
+      }
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+// считает вызовы, чтобы проверить, что рехэш не пересчитывает хэши
+struct CountingStringHash
+{
+   typedef void is_transparent;
+
+   size_t operator()( std::string_view const s ) const
+   {
+      ++calls;
+      return std::hash<std::string_view>()( s );
+   }
+
+   static std::atomic<size_t> calls;
+};
+
+std::atomic<size_t> CountingStringHash::calls( 0 );
+
+// много ключей с одним хэшем: внутри хэша элементы упорядочены по ключу
+struct CollidingHash
+{
+   size_t operator()( int const key ) const
+   {
+      return static_cast<size_t>( key % 7 );
+   }
+};
+
+BOOST_AUTO_TEST_CASE( TestHashedStorage )
+{
+   try
+   {
+      CheckStorageSemantics<kvs::HashedListStorage>();
+      CheckStorageSemantics<kvs::HashedListStorage, kvs::StripeLayout::Packed>();
+      CheckMultiOperations<kvs::HashedListStorage>();
+      CheckMoveSemantics<kvs::HashedListStorage>();
+      CheckReadModifyWrite<kvs::HashedListStorage>();
+
+      kvs::RehashMode const modes[] = { kvs::RehashMode::StopTheWorld, kvs::RehashMode::Incremental };
+      for ( auto mode_it = std::begin( modes ); mode_it != std::end( modes ); ++mode_it )
+      {
+         kvs::ThreadsafeHashTable<std::string, int, 4, boost::shared_mutex, CountingStringHash, kvs::HashedListStorage> ht;
+         ht.SetRehashMode( *mode_it );
+         ht.SetMaxLockCount( 32 );
+
+         // по одному вызову хэша на вставку, хотя таблица много раз удваивается
+         int const count = 5000;
+         CountingStringHash::calls = 0;
+         for ( int i = 0; i < count; ++i )
+         {
+            ht.Emplace( "long-key-prefix-" + std::string( 64, 'k' ) + std::to_string( i ), i );
+         }
+
+         while ( ht.RehashStep( 64 ) )
+         {
+         }
+
+         BOOST_CHECK_EQUAL( CountingStringHash::calls, static_cast<size_t>( count ) );
+         BOOST_CHECK( ht.GetStats().bucketCount > 4 );
+
+         int val = -1;
+         for ( int i = 0; i < count; ++i )
+         {
+            BOOST_CHECK( ht.Find( "long-key-prefix-" + std::string( 64, 'k' ) + std::to_string( i ), val ) );
+            BOOST_CHECK_EQUAL( val, i );
+         }
+         BOOST_CHECK( ht.Find( std::string_view( "long-key-prefix-" + std::string( 64, 'k' ) + "7" ), val ) && val == 7 );
+         BOOST_CHECK( !ht.Find( "missing", val ) );
+      }
+
+      kvs::ThreadsafeHashTable<int, int, 4, boost::shared_mutex, CollidingHash, kvs::HashedListStorage> colliding;
+      for ( int i = 1000; i > 0; --i )
+      {
+         BOOST_CHECK( colliding.Insert( std::make_pair( i, i ) ) );
+      }
+      BOOST_CHECK( !colliding.Insert( std::make_pair( 500, 0 ) ) );
+
+      for ( int i = 1; i <= 1000; i += 3 )
+      {
+         colliding.Erase( i );
+      }
+
+      int val = -1;
+      for ( int i = 1; i <= 1000; ++i )
+      {
+         BOOST_CHECK_EQUAL( colliding.Find( i, val ), ( i - 1 ) % 3 != 0 );
+      }
+      BOOST_CHECK_EQUAL( colliding.Size(), 666u );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestSwissStorage )
+{
+   try
+   {
+      CheckStorageSemantics<kvs::SwissStorage>();
+      CheckStorageSemantics<kvs::SwissStorage, kvs::StripeLayout::Packed>();
+      CheckMultiOperations<kvs::SwissStorage>();
+      CheckMoveSemantics<kvs::SwissStorage>();
+      CheckReadModifyWrite<kvs::SwissStorage>();
+
+      // AutoStorage выбирает Swiss-ячейки только для тривиально копируемых ключей
+      static_assert( std::is_same<kvs::AutoStorage::Rebind<int, std::string>::TBucket, kvs::SwissBucket<int, std::string>>::value, "Swiss buckets for int keys" );
+      static_assert( std::is_same<kvs::AutoStorage::Rebind<std::string, int>::TBucket, kvs::ListBucket<std::string, int>>::value, "lists for string keys" );
+
+      // вставки и удаления по кругу оставляют метки удалённых, массив перестраивается
+      // того же размера, а чтения без блокировки идут вперемешку
+      typedef kvs::ThreadsafeHashTable<int, TestPair, 4, boost::shared_mutex, std::hash<int>, kvs::AutoStorage> TTable;
+      TTable ht;
+      ht.SetReadMode( kvs::ReadMode::Optimistic );
+
+      int const size = 1000;
+      for ( int i = 0; i < size; ++i )
+      {
+         TestPair const val = { i, i };
+         ht.Insert( std::make_pair( i, val ) );
+      }
+
+      std::atomic<bool> done( false );
+      std::thread writer( [&]()
+      {
+         for ( int gen = 1; gen < 100; ++gen )
+         {
+            for ( int i = 0; i < size; ++i )
+            {
+               TestPair const val = { i + gen, i + gen };
+               ht.Update( std::make_pair( i, val ) );
+               ht.Insert( std::make_pair( gen * size + i, val ) );
+            }
+            for ( int i = 0; i < size; ++i )
+            {
+               ht.Erase( gen * size + i );
+            }
+         }
+         done = true;
+      } );
+
+      int failures = 0;
+      while ( !done )
+      {
+         for ( int i = 0; i < size; ++i )
+         {
+            TestPair val;
+            if ( !ht.Find( i, val ) || val.first != val.second )
+               ++failures;
+         }
+      }
+      writer.join();
+
+      BOOST_CHECK_EQUAL( failures, 0 );
+      BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( size ) );
+
+      TestPair val;
+      BOOST_CHECK( ht.Find( size - 1, val ) && val.first == size - 1 + 99 );
+      BOOST_CHECK( !ht.Find( size, val ) );
+      BOOST_CHECK( !ht.Find( -1, val ) );
+
+      size_t counter = 0;
+      ht.ForEach( [&counter]( std::pair<int, TestPair> const& ){ ++counter; } );
+      BOOST_CHECK_EQUAL( counter, static_cast<size_t>( size ) );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+template <typename TIndexing>
+void CheckGrowthPolicy()
+{
+   typedef kvs::ThreadsafeHashTable<int, int, 4, boost::shared_mutex, std::hash<int>, kvs::ListStorage, kvs::StripeLayout::Padded, kvs::NoStats, TIndexing> THashTable;
+
+   int const key_count = 20000;
+   kvs::RehashMode const modes[] = { kvs::RehashMode::StopTheWorld, kvs::RehashMode::Incremental };
+   for ( auto mode_it = std::begin( modes ); mode_it != std::end( modes ); ++mode_it )
+   {
+      THashTable ht;
+      ht.SetRehashMode( *mode_it );
+
+      kvs::GrowthPolicy policy;
+      policy.minLoadFactor = 0.1f;
+      policy.growthFactor = 4;
+      ht.SetGrowthPolicy( policy );
+
+      for ( int i = 0; i < key_count; ++i )
+      {
+         ht.Insert( std::make_pair( i, i ) );
+      }
+      while ( ht.RehashStep( 64 ) )
+      {
+      }
+
+      // рост в 4 раза: количество ячеек - начальное, умноженное на степень четвёрки
+      auto const grown = ht.GetStats().bucketCount;
+      BOOST_CHECK( grown >= key_count / policy.maxLoadFactor );
+      auto count = grown / THashTable( 4 ).GetStats().bucketCount;
+      while ( count % 4 == 0 )
+      {
+         count /= 4;
+      }
+      BOOST_CHECK_EQUAL( count, 1u );
+
+      // обход начинается до сжатия и заканчивается после: оставшиеся ключи встречаются один раз
+      std::vector<int> seen( key_count, 0 );
+      typename THashTable::ScanCursor cursor;
+      ht.Scan( cursor, [&seen]( std::pair<int, int> const& kv ){ ++seen[kv.first]; }, 5 );
+
+      for ( int i = 0; i < key_count; ++i )
+      {
+         if ( i % 50 != 0 )
+            ht.Erase( i );
+      }
+
+      auto const stats = ht.GetStats();
+      BOOST_CHECK_EQUAL( stats.size, static_cast<size_t>( key_count / 50 ) );
+      // одиночные удаления проверяют загрузку раз в порог счётчика, поэтому
+      // она может отстать от минимальной на ту же 1/8, что и приблизительный размер
+      BOOST_CHECK( stats.bucketCount <= grown / 4 );
+      BOOST_CHECK( stats.loadFactor <= policy.maxLoadFactor );
+
+      while ( ht.Scan( cursor, [&seen]( std::pair<int, int> const& kv ){ ++seen[kv.first]; } ) )
+      {
+      }
+      for ( int i = 0; i < key_count; i += 50 )
+      {
+         BOOST_CHECK_EQUAL( seen[i], 1 );
+         int val = -1;
+         BOOST_CHECK( ht.Find( i, val ) && val == i );
+      }
+
+      // после сжатия таблица снова растёт вставками
+      for ( int i = 0; i < key_count; ++i )
+      {
+         ht.Insert( std::make_pair( i, i ) );
+      }
+      BOOST_CHECK_EQUAL( ht.Size(), static_cast<size_t>( key_count ) );
+
+      // массовое удаление и Clear сжимают таблицу до количества блокировок
+      kvs::ThreadPool pool( 2 );
+      BOOST_CHECK_EQUAL( ht.ParallelEraseIf( pool, []( std::pair<int, int> const& kv ){ return kv.first % 100 != 0; } ), static_cast<size_t>( key_count - key_count / 100 ) );
+      BOOST_CHECK( ht.GetStats().bucketCount < grown / 8 );
+      ht.Clear();
+      BOOST_CHECK_EQUAL( ht.GetStats().bucketCount, ht.LockCount() );
+   }
+
+   // без минимальной загрузки таблица сама не сжимается, но ShrinkToFit сжимает
+   THashTable ht;
+   for ( int i = 0; i < key_count; ++i )
+   {
+      ht.Insert( std::make_pair( i, i ) );
+   }
+   auto const grown = ht.GetStats().bucketCount;
+   for ( int i = 100; i < key_count; ++i )
+   {
+      ht.Erase( i );
+   }
+   BOOST_CHECK_EQUAL( ht.GetStats().bucketCount, grown );
+
+   ht.ShrinkToFit();
+   auto const stats = ht.GetStats();
+   BOOST_CHECK( stats.bucketCount < grown );
+   BOOST_CHECK( stats.loadFactor <= ht.GetGrowthPolicy().maxLoadFactor * ( 1 - ht.GetGrowthPolicy().hysteresis ) );
+   BOOST_CHECK( stats.loadFactor * 2 > ht.GetGrowthPolicy().maxLoadFactor * ( 1 - ht.GetGrowthPolicy().hysteresis ) );
+   for ( int i = 0; i < 100; ++i )
+   {
+      int val = -1;
+      BOOST_CHECK( ht.Find( i, val ) && val == i );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestGrowthPolicy )
+{
+   try
+   {
+      CheckGrowthPolicy<kvs::ModuloIndexing>();
+      CheckGrowthPolicy<kvs::PowerOfTwoIndexing>();
+
+      // политики, при которых таблица сжималась бы сразу после роста или росла сразу после сжатия
+      kvs::ThreadsafeHashTable<int, int> ht;
+      kvs::GrowthPolicy policy;
+      policy.growthFactor = 3;
+      BOOST_CHECK_THROW( ht.SetGrowthPolicy( policy ), std::invalid_argument );
+      policy.growthFactor = 2;
+      policy.minLoadFactor = 0.4f;
+      BOOST_CHECK_THROW( ht.SetGrowthPolicy( policy ), std::invalid_argument );
+      policy.minLoadFactor = 0.2f;
+      ht.SetGrowthPolicy( policy );
+      BOOST_CHECK_EQUAL( ht.GetGrowthPolicy().minLoadFactor, 0.2f );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+template <typename TStorage>
+void CheckSnapshot()
+{
+   typedef kvs::ThreadsafeHashTable<int, TestPair, 11, boost::shared_mutex, std::hash<int>, TStorage> THashTable;
+
+   char const* const path = "snapshot_test.bin";
+   int const key_count = 200000;
+
+   THashTable source;
+   for ( int i = 0; i < key_count; ++i )
+   {
+      TestPair const val = { i, -i };
+      source.Insert( std::make_pair( i, val ) );
+   }
+
+   // запись вместе с писателем: ключи, которые он не трогает, попадают в снимок ровно один раз
+   std::atomic<bool> stop( false );
+   std::thread writer( [&]()
+   {
+      for ( int i = key_count; !stop; ++i )
+      {
+         TestPair const val = { i, -i };
+         source.Insert( std::make_pair( i, val ) );
+         if ( i >= key_count + 1000 )
+            source.Erase( i - 1000 );
+      }
+   } );
+   while ( source.Size() < static_cast<size_t>( key_count ) + 500 )
+   {
+      std::this_thread::yield();
+   }
+   BOOST_CHECK( source.SaveSnapshot( path ) );
+   stop = true;
+   writer.join();
+
+   // значение, которое уже было в таблице, заменяется значением из снимка
+   THashTable loaded( 3 );
+   TestPair const stale = { 0, 0 };
+   loaded.Insert( std::make_pair( 1000, stale ) );
+   BOOST_CHECK( loaded.LoadSnapshot( path ) );
+
+   std::vector<int> seen( key_count, 0 );
+   loaded.ForEach( [&]( std::pair<int, TestPair> const& kv )
+   {
+      BOOST_CHECK_EQUAL( kv.first, kv.second.first );
+      BOOST_CHECK_EQUAL( kv.first, -kv.second.second );
+      if ( kv.first < key_count )
+         ++seen[kv.first];
+   } );
+   for ( int i = 0; i < key_count; ++i )
+   {
+      BOOST_CHECK_EQUAL( seen[i], 1 );
+   }
+
+   size_t counter = 0;
+   loaded.ForEach( [&counter]( std::pair<int, TestPair> const& ){ ++counter; } );
+   BOOST_CHECK_EQUAL( loaded.Size(), counter );
+
+   // снимок пустой таблицы загружается как пустой
+   THashTable empty;
+   BOOST_CHECK( empty.SaveSnapshot( path ) );
+   THashTable fromEmpty;
+   BOOST_CHECK( fromEmpty.LoadSnapshot( path ) );
+   BOOST_CHECK_EQUAL( fromEmpty.Size(), 0u );
+
+   std::remove( path );
+}
+
+BOOST_AUTO_TEST_CASE( TestSnapshot )
+{
+   try
+   {
+      CheckSnapshot<kvs::ListStorage>();
+      CheckSnapshot<kvs::FlatStorage<>>();
+      CheckSnapshot<kvs::EpochListStorage>();
+      CheckSnapshot<kvs::SwissStorage>();
+
+      // снимок других типов, оборванный и несуществующий файлы не загружаются
+      char const* const path = "snapshot_test.bin";
+      kvs::ThreadsafeHashTable<int, int> ht;
+      for ( int i = 0; i < 100000; ++i )
+      {
+         ht.Insert( std::make_pair( i, i ) );
+      }
+      BOOST_CHECK( ht.SaveSnapshot( path ) );
+
+      kvs::ThreadsafeHashTable<int, int64_t> wide;
+      BOOST_CHECK( !wide.LoadSnapshot( path ) );
+      BOOST_CHECK_EQUAL( wide.Size(), 0u );
+
+      std::string bytes;
+      {
+         std::ifstream file( path, std::ios::binary );
+         bytes.assign( std::istreambuf_iterator<char>( file ), std::istreambuf_iterator<char>() );
+      }
+      {
+         std::ofstream file( path, std::ios::binary | std::ios::trunc );
+         file.write( bytes.data(), bytes.size() - 100 );
+      }
+      kvs::ThreadsafeHashTable<int, int> truncated;
+      BOOST_CHECK( !truncated.LoadSnapshot( path ) );
+      BOOST_CHECK( truncated.Size() < 100000u );
+
+      std::remove( path );
+      kvs::ThreadsafeHashTable<int, int> missing;
+      BOOST_CHECK( !missing.LoadSnapshot( path ) );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestSharedMemoryTable )
+{
+   try
+   {
+      typedef kvs::SharedMemoryHashTable<int, int64_t, 16> TSharedTable;
+      char const* const name = "ThreadsafeHashTableTest";
+      int const capacity = 100000;
+
+      TSharedTable owner( kvs::SharedMode::Create, name, capacity );
+      BOOST_CHECK_EQUAL( owner.Capacity(), static_cast<size_t>( capacity ) );
+
+      // второе отображение того же региона лежит по другому адресу, как в другом процессе
+      TSharedTable reader( kvs::SharedMode::Open, name );
+      BOOST_CHECK_EQUAL( reader.Capacity(), static_cast<size_t>( capacity ) );
+
+      std::atomic<bool> done( false );
+      std::atomic<int> wrong( 0 );
+      std::thread readerThread( [&]()
+      {
+         while ( !done.load() )
+         {
+            for ( int i = 0; i < capacity; i += 97 )
+            {
+               int64_t value = 0;
+               if ( reader.Find( i, value ) && value != i && value != -i )
+                  ++wrong;
+            }
+         }
+      } );
+
+      for ( int i = 0; i < capacity; ++i )
+      {
+         BOOST_CHECK( owner.Insert( std::make_pair( i, static_cast<int64_t>( i ) ) ) );
+      }
+      for ( int i = 0; i < capacity; i += 2 )
+      {
+         BOOST_CHECK( owner.Update( std::make_pair( i, static_cast<int64_t>( -i ) ) ) );
+      }
+      done.store( true );
+      readerThread.join();
+      BOOST_CHECK_EQUAL( wrong.load(), 0 );
+
+      BOOST_CHECK_EQUAL( reader.Size(), static_cast<size_t>( capacity ) );
+      BOOST_CHECK( !owner.Insert( std::make_pair( 0, int64_t( 1 ) ) ) );
+
+      // свободных узлов нет, пока что-нибудь не удалено
+      BOOST_CHECK( !owner.Insert( std::make_pair( capacity, int64_t( 1 ) ) ) );
+      for ( int i = 0; i < capacity; i += 3 )
+      {
+         reader.Erase( i );
+      }
+      int erased = 0;
+      for ( int i = 0; i < capacity; ++i )
+      {
+         int64_t value = 0;
+         if ( i % 3 == 0 )
+         {
+            BOOST_CHECK( !owner.Find( i, value ) );
+            ++erased;
+         }
+         else
+         {
+            BOOST_CHECK( owner.Find( i, value ) );
+            BOOST_CHECK_EQUAL( value, i % 2 == 0 ? -i : i );
+         }
+      }
+      BOOST_CHECK_EQUAL( owner.Size(), static_cast<size_t>( capacity - erased ) );
+
+      size_t counter = 0;
+      reader.ForEach( [&counter]( std::pair<int, int64_t> const& kv )
+      {
+         BOOST_CHECK( kv.first % 3 != 0 );
+         ++counter;
+      } );
+      BOOST_CHECK_EQUAL( counter, static_cast<size_t>( capacity - erased ) );
+
+      // узлы удалённых элементов переиспользуются
+      int reinserted = 0;
+      for ( int i = capacity; i < 2 * capacity; ++i )
+      {
+         if ( owner.Insert( std::make_pair( i, static_cast<int64_t>( i ) ) ) )
+            ++reinserted;
+      }
+      BOOST_CHECK( reinserted > 0 );
+      BOOST_CHECK( reinserted <= erased );
+      BOOST_CHECK_EQUAL( reader.Size(), static_cast<size_t>( capacity - erased + reinserted ) );
+
+      reader.Clear();
+      BOOST_CHECK_EQUAL( owner.Size(), 0u );
+      BOOST_CHECK( owner.Insert( std::make_pair( 1, int64_t( 1 ) ) ) );
+
+      // регион другого типа таблицы не открывается
+      BOOST_CHECK_THROW( ( kvs::SharedMemoryHashTable<int, int, 16>( kvs::SharedMode::Open, name ) ), std::runtime_error );
+
+      BOOST_CHECK( TSharedTable::Remove( name ) );
+      BOOST_CHECK_THROW( ( TSharedTable( kvs::SharedMode::Open, name ) ), boost::interprocess::interprocess_exception );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
+
+BOOST_AUTO_TEST_CASE( TestCacheTable )
+{
+   try
+   {
+      typedef kvs::CacheHashTable<int, std::string, 4> TCache;
+
+      // размер не превышает предела, а отмеченные Find элементы переживают вытеснение
+      TCache cache( 400 );
+      BOOST_CHECK_EQUAL( cache.Capacity(), 400u );
+      for ( int i = 0; i < 400; ++i )
+      {
+         BOOST_CHECK( cache.Insert( std::make_pair( i, std::to_string( i ) ) ) );
+      }
+      BOOST_CHECK_EQUAL( cache.Size(), 400u );
+      BOOST_CHECK( !cache.Insert( std::make_pair( 0, std::string( "0" ) ) ) );
+
+      std::string value;
+      for ( int i = 0; i < 400; i += 5 )
+      {
+         BOOST_CHECK( cache.Find( i, value ) );
+      }
+      for ( int i = 400; i < 600; ++i )
+      {
+         BOOST_CHECK( cache.Insert( std::make_pair( i, std::to_string( i ) ) ) );
+         BOOST_CHECK( cache.Size() <= cache.Capacity() );
+      }
+      BOOST_CHECK_EQUAL( cache.Size(), 400u );
+      BOOST_CHECK_EQUAL( cache.GetCacheStats().evictions, 200u );
+      for ( int i = 0; i < 400; i += 5 )
+      {
+         BOOST_CHECK( cache.Find( i, value ) );
+         BOOST_CHECK_EQUAL( value, std::to_string( i ) );
+      }
+      for ( int i = 400; i < 600; ++i )
+      {
+         BOOST_CHECK( cache.Find( i, value ) );
+      }
+
+      BOOST_CHECK( cache.Update( std::make_pair( 5, std::string( "five" ) ) ) );
+      BOOST_CHECK( cache.Find( 5, value ) );
+      BOOST_CHECK_EQUAL( value, "five" );
+      BOOST_CHECK( !cache.InsertOrAssign( 5, "5" ) );
+      BOOST_CHECK( cache.Find( 5, value ) );
+      BOOST_CHECK_EQUAL( value, "5" );
+
+      cache.Erase( 5 );
+      BOOST_CHECK( !cache.Find( 5, value ) );
+      BOOST_CHECK_EQUAL( cache.Size(), 399u );
+      BOOST_CHECK_EQUAL( cache.EraseAllIf( []( std::pair<int, std::string> const& kv ){ return kv.first >= 500; } ), 100u );
+      BOOST_CHECK_EQUAL( cache.Size(), 299u );
+
+      size_t counter = 0;
+      cache.ForEach( [&counter]( std::pair<int, std::string> const& kv ){ BOOST_CHECK( kv.first < 500 ); ++counter; } );
+      BOOST_CHECK_EQUAL( counter, 299u );
+
+      cache.Clear();
+      BOOST_CHECK_EQUAL( cache.Size(), 0u );
+      BOOST_CHECK( !cache.Find( 0, value ) );
+      BOOST_CHECK( cache.Insert( std::make_pair( 0, std::string( "0" ) ) ) );
+
+      // просроченные элементы не находятся и удаляются при встрече, элементы без срока живут
+      TCache ttl( 100 );
+      for ( int i = 0; i < 50; ++i )
+      {
+         ttl.Insert( std::make_pair( i, std::to_string( i ) ), std::chrono::milliseconds( 20 ) );
+         ttl.Insert( std::make_pair( i + 50, std::to_string( i ) ) );
+      }
+      BOOST_CHECK( ttl.Find( 0, value ) );
+      std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+      BOOST_CHECK( !ttl.Find( 0, value ) );
+      BOOST_CHECK( ttl.Find( 50, value ) );
+      BOOST_CHECK_EQUAL( ttl.Size(), 99u );
+      BOOST_CHECK_EQUAL( ttl.GetCacheStats().expirations, 1u );
+
+      // вставка поверх просроченного элемента - новая вставка
+      BOOST_CHECK( ttl.Insert( std::make_pair( 1, std::string( "new" ) ) ) );
+      BOOST_CHECK( ttl.Find( 1, value ) );
+      BOOST_CHECK_EQUAL( value, "new" );
+
+      // стрелка вытесняет просроченные элементы и пропускает отмеченные
+      for ( int i = 50; i < 100; ++i )
+      {
+         BOOST_CHECK( ttl.Find( i, value ) );
+      }
+      for ( int i = 100; i < 140; ++i )
+      {
+         ttl.Insert( std::make_pair( i, std::to_string( i ) ) );
+      }
+      for ( int i = 50; i < 140; ++i )
+      {
+         BOOST_CHECK( ttl.Find( i, value ) );
+      }
+      BOOST_CHECK_EQUAL( ttl.GetCacheStats().evictions, 0u );
+
+      // конкурентные вставки и чтения не выходят за предел
+      kvs::CacheHashTable<int, int, 16> shared( 1000 );
+      std::vector<std::thread> threads;
+      for ( int t = 0; t < 4; ++t )
+      {
+         threads.emplace_back( [&shared, t]()
+         {
+            std::default_random_engine generator( t );
+            std::uniform_int_distribution<int> distribution( 0, 10000 );
+            for ( int i = 0; i < 100000; ++i )
+            {
+               auto const key = distribution( generator );
+               int found = 0;
+               if ( shared.Find( key, found ) )
+                  BOOST_CHECK_EQUAL( found, key );
+               else
+                  shared.Insert( std::make_pair( key, key ), std::chrono::milliseconds( i % 3 ) );
+            }
+         } );
+      }
+      for ( auto it = threads.begin(); it != threads.end(); ++it )
+      {
+         it->join();
+      }
+      BOOST_CHECK( shared.Size() <= shared.Capacity() );
+      counter = 0;
+      shared.ForEach( [&counter]( std::pair<int, int> const& ){ ++counter; } );
+      BOOST_CHECK( counter <= shared.Size() );
+   }
+   catch( ... )
+   {
+      BOOST_ERROR( "Ouch..." );
+   }
+}
@@ -1,11 +1,30 @@
 ﻿#pragma once
 
 #include <array>
+#include <cstdint>
+#include <limits>
 #include <vector>
 #include <list>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#include <map>
+#include <random>
 #include <functional>
 #include <mutex>
+#include <shared_mutex>
 #include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <string>
+#include <string_view>
+#include <fstream>
 
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/shared_lock_guard.hpp>